@@ -0,0 +1,74 @@
+-- Helpers shared by the benchmark scripts.
+--
+-- The scripts write their results as one JSON object per line (to stderr by
+-- default, since the binding still prints debug traces on stdout).
+
+local bench_common = {}
+
+function bench_common.load_dbus()
+	local ok, dbus = pcall( require, "dbus")
+	if ok then
+		return dbus
+	end
+	-- fall back on what the Code::Blocks project builds
+	local path = os.getenv( "LUA_DBUS_LIB") or "./libLua D-Bus Binding.so"
+	local open, err = package.loadlib( path, "luaopen_dbus")
+	if not open then
+		error( "can't load the dbus binding (" .. tostring( err) .. "), set LUA_DBUS_LIB")
+	end
+	return open()
+end
+
+-- fill settings from the command line: "--name value" sets settings[name], which must have a
+-- default unless it is listed in optional; a bare argument goes to settings[positional]
+function bench_common.parse_options( settings, optional, positional)
+	local allowed = {}
+	for _, name in ipairs( optional or {}) do
+		allowed[name] = true
+	end
+	local i = 1
+	while arg and arg[i] do
+		local name = arg[i]:match( "^%-%-(%w+)$")
+		if not name then
+			if not positional then
+				error( "unknown option " .. arg[i])
+			end
+			settings[positional] = arg[i]
+			i = i + 1
+		else
+			if settings[name] == nil and not allowed[name] then
+				error( "unknown option " .. arg[i])
+			end
+			local value = arg[i + 1]
+			settings[name] = tonumber( value) or value
+			i = i + 2
+		end
+	end
+	return settings
+end
+
+-- returns report( record), which writes one JSON line to the file (stderr if nil), and a function that closes it
+function bench_common.open_report( path)
+	local out = path and assert( io.open( path, "w")) or io.stderr
+	local function report( record)
+		local fields = {}
+		for key, value in pairs( record) do
+			if type( value) == "string" then
+				fields[#fields + 1] = string.format( "%q:%q", key, value)
+			else
+				fields[#fields + 1] = string.format( "%q:%.9g", key, value)
+			end
+		end
+		table.sort( fields)
+		out:write( "{", table.concat( fields, ","), "}\n")
+		out:flush()
+	end
+	local function close()
+		if out ~= io.stderr then
+			out:close()
+		end
+	end
+	return report, close
+end
+
+return bench_common
@@ -0,0 +1,437 @@
+/************************************************************************
+*
+* Lua bindings for libdbus.
+* Copyright (c) 2009 - BenoitGermain <bnt.germain@gmail.com>
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+************************************************************************/
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../utils.h"
+
+//################################################################################
+// microbenchmarks of the per-message helpers in utils.c
+// usage: bench_utils [output file]
+// each measurement is a JSON object on its own line, written to stderr by default
+// "warm" runs cycle over a small corpus that stays in cache,
+// "cold" runs walk a large corpus spread one entry per page, and trash the caches before each pass
+//################################################################################
+
+extern int luaopen_dbus( lua_State * const _L);
+
+#define NB_WARM_ENTRIES 64
+#define NB_COLD_ENTRIES 4096
+#define COLD_STRIDE 4096
+#define NB_WARM_PASSES 2000
+#define NB_COLD_PASSES 20
+#define EVICTION_SIZE (64 * 1024 * 1024)
+
+static FILE * gOutput = 0x0;
+static char * gEvictionBuffer = 0x0;
+static char const gBenchMetatableKey[] = "lua-dbus bench";
+static volatile int gSink = 0;
+
+//################################################################################
+// corpora
+//################################################################################
+
+static char const * gDomains[] = { "org.freedesktop", "org.gnome", "org.kde", "com.example", "net.connman", "org.bluez" };
+static char const * gComponents[] = { "NetworkManager", "PolicyKit1", "UPower", "Notifications", "login1", "systemd1", "ScreenSaver", "Telepathy", "Avahi", "ModemManager1" };
+static char const * gMembers[] = { "PropertiesChanged", "GetAll", "Introspect", "StateChanged", "NameOwnerChanged", "Activate", "GetManagedObjects", "Notify" };
+
+#define NB_ELEMENTS(_array) ((int) (sizeof( _array) / sizeof( _array[0])))
+
+enum ECorpus
+{
+	EC_BusName,
+	EC_ObjectPath,
+};
+typedef enum ECorpus ECorpus;
+
+static void private_make_name( ECorpus _corpus, int _n, char * const _buffer)
+{
+	char const * const domain = gDomains[_n % NB_ELEMENTS( gDomains)];
+	char const * const component = gComponents[(_n / NB_ELEMENTS( gDomains)) % NB_ELEMENTS( gComponents)];
+	if ( _corpus == EC_BusName )
+	{
+		// mostly short well-known names, some with an instance suffix
+		if ( _n % 3 == 0 )
+			sprintf( _buffer, "%s.%s", domain, component);
+		else
+			sprintf( _buffer, "%s.%s.Instance%d", domain, component, _n);
+	}
+	else
+	{
+		// the path mirrors the name, with a few levels of objects below it
+		char * p = _buffer + sprintf( _buffer, "/%s/%s", domain, component);
+		char * q;
+		for ( q = _buffer + 1; q < p; ++ q)
+			if ( *q == '.' )
+				*q = '/';
+		if ( _n % 2 == 0 )
+			sprintf( p, "/Devices/%d", _n);
+		else
+			sprintf( p, "/Devices/%d/Ports/port_%d/Settings", _n % 17, _n);
+	}
+}
+
+//################################################################################
+
+// warm corpora are packed together, cold ones get a page each
+static char const ** private_make_corpus( ECorpus _corpus, int _nbEntries, int _stride)
+{
+	char const ** const names = (char const **) malloc( _nbEntries * sizeof( char const *));
+	char * const storage = (char *) malloc( _nbEntries * _stride);
+	int i;
+	for ( i = 0; i < _nbEntries; ++ i)
+	{
+		char * const name = storage + i * _stride;
+		private_make_name( _corpus, i, name);
+		names[i] = name;
+	}
+	return names;
+}
+
+//################################################################################
+
+static void private_free_corpus( char const ** const _names)
+{
+	// the first name is at the beginning of the storage block
+	free( (void *) _names[0]);
+	free( _names);
+}
+
+//################################################################################
+// measurement
+//################################################################################
+
+static void private_evict_caches( void)
+{
+	size_t i;
+	for ( i = 0; i < EVICTION_SIZE; i += 64)
+		gEvictionBuffer[i] += 1;
+}
+
+//################################################################################
+
+static void private_report( char const * const _benchmark, char const * const _variant, int const _warm, int const _nbEntries, long const _nbCalls, dbus_uint64_t const _elapsed)
+{
+	fprintf( gOutput, "{\"benchmark\":\"%s\",\"variant\":\"%s\",\"cache\":\"%s\",\"entries\":%d,\"calls\":%ld,\"elapsed_ns\":%llu,\"ns_per_call\":%.2f}\n",
+		_benchmark, _variant, _warm ? "warm" : "cold", _nbEntries, _nbCalls, (unsigned long long) _elapsed, (double) _elapsed / (double) _nbCalls);
+	fflush( gOutput);
+}
+
+//################################################################################
+
+// a benchmark body processes entry _n of its corpus
+typedef void (* BenchBody)( lua_State * const _L, void * const _context, int const _n);
+
+static void private_run( lua_State * const _L, char const * const _benchmark, char const * const _variant, BenchBody _body, void * const _context, int const _warm)
+{
+	int const nbEntries = _warm ? NB_WARM_ENTRIES : NB_COLD_ENTRIES;
+	int const nbPasses = _warm ? NB_WARM_PASSES : NB_COLD_PASSES;
+	int n;
+	// one untimed pass so that nothing is measured on its first touch
+	for ( n = 0; n < nbEntries; ++ n)
+		_body( _L, _context, n);
+	dbus_uint64_t elapsed = 0;
+	int pass;
+	for ( pass = 0; pass < nbPasses; ++ pass)
+	{
+		if ( !_warm )
+			private_evict_caches();
+		dbus_uint64_t const start = utils_get_monotonic_time_ns();
+		for ( n = 0; n < nbEntries; ++ n)
+			_body( _L, _context, n);
+		elapsed += utils_get_monotonic_time_ns() - start;
+	}
+	private_report( _benchmark, _variant, _warm, nbEntries, (long) nbPasses * nbEntries, elapsed);
+}
+
+//################################################################################
+// benchmark bodies
+//################################################################################
+
+typedef int (* ValidationFunction)( lua_State * const _L, char const * const _name);
+
+struct ValidationContext
+{
+	ValidationFunction validate;
+	char const ** names;
+};
+typedef struct ValidationContext ValidationContext;
+
+static void private_validation_body( lua_State * const _L, void * const _context, int const _n)
+{
+	ValidationContext * const context = (ValidationContext *) _context;
+	gSink += context->validate( _L, context->names[_n]);
+}
+
+//################################################################################
+
+// the table at the given stack index holds one rules table per entry
+static void private_rules_body( lua_State * const _L, void * const _context, int const _n)
+{
+	char rules_buffer[DBUS_MAXIMUM_MATCH_RULE_LENGTH];
+	lua_rawgeti( _L, *(int *) _context, _n + 1);             // ... {rules}
+	utils_fill_rule_buffer_from_table( _L, -1, rules_buffer);
+	lua_pop( _L, 1);                                         // ...
+	gSink += rules_buffer[0];
+}
+
+//################################################################################
+
+struct MappingContext
+{
+	char * pointers;
+	int offset;
+};
+typedef struct MappingContext MappingContext;
+
+static void private_mapping_body( lua_State * const _L, void * const _context, int const _n)
+{
+	MappingContext * const context = (MappingContext *) _context;
+	void * const block = utils_push_mapped_userdata( _L, context->pointers + context->offset + _n, gBenchMetatableKey, sizeof( void *));
+	lua_pop( _L, 1);
+	gSink += (block != 0x0);
+}
+
+//################################################################################
+
+// the stack holds the converted strings starting at the given index
+struct ConversionContext
+{
+	int firstNdx;
+	int nbStrings;
+	int which;
+};
+typedef struct ConversionContext ConversionContext;
+
+static void private_conversion_body( lua_State * const _L, void * const _context, int const _n)
+{
+	ConversionContext * const context = (ConversionContext *) _context;
+	int const ndx = context->firstNdx + _n % context->nbStrings;
+	switch( context->which)
+	{
+		case 0: gSink += (int) utils_convert_to_bus_type( _L, ndx); break;
+		case 1: gSink += (int) utils_convert_to_handler_result( _L, ndx); break;
+		default: gSink += utils_convert_to_message_type( _L, ndx); break;
+	}
+}
+
+//################################################################################
+// suites
+//################################################################################
+
+static void private_bench_validation( lua_State * const _L)
+{
+	struct
+	{
+		char const * name;
+		ValidationFunction validate;
+		ECorpus corpus;
+	} const suites[] =
+	{
+		{ "utils_bus_name_is_valid", utils_bus_name_is_valid, EC_BusName },
+		{ "utils_object_path_name_is_valid", utils_object_path_name_is_valid, EC_ObjectPath },
+	};
+	int i;
+	for ( i = 0; i < NB_ELEMENTS( suites); ++ i)
+	{
+		ValidationContext context;
+		context.validate = suites[i].validate;
+		context.names = private_make_corpus( suites[i].corpus, NB_WARM_ENTRIES, 256);
+		private_run( _L, suites[i].name, "realistic", private_validation_body, &context, 1);
+		private_free_corpus( context.names);
+		context.names = private_make_corpus( suites[i].corpus, NB_COLD_ENTRIES, COLD_STRIDE);
+		private_run( _L, suites[i].name, "realistic", private_validation_body, &context, 0);
+		private_free_corpus( context.names);
+	}
+}
+
+//################################################################################
+
+static void private_bench_rules( lua_State * const _L)
+{
+	// build one rules table per entry, with the usual signal subscription fields
+	lua_createtable( _L, NB_COLD_ENTRIES, 0);                                  // {all}
+	int const allNdx = lua_gettop( _L);
+	char name[256];
+	int n;
+	for ( n = 0; n < NB_COLD_ENTRIES; ++ n)
+	{
+		lua_createtable( _L, 0, 5);                                             // {all} {rules}
+		lua_pushliteral( _L, "signal");
+		lua_setfield( _L, -2, "type");
+		private_make_name( EC_BusName, n, name);
+		lua_pushstring( _L, name);
+		lua_setfield( _L, -2, "sender");
+		lua_pushstring( _L, name);
+		lua_setfield( _L, -2, "interface");
+		lua_pushstring( _L, gMembers[n % NB_ELEMENTS( gMembers)]);
+		lua_setfield( _L, -2, "member");
+		private_make_name( EC_ObjectPath, n, name);
+		lua_pushstring( _L, name);
+		lua_setfield( _L, -2, "path");
+		lua_rawseti( _L, allNdx, n + 1);                                        // {all}
+	}
+	private_run( _L, "utils_fill_rule_buffer_from_table", "signal_subscription", private_rules_body, (void *) &allNdx, 1);
+	private_run( _L, "utils_fill_rule_buffer_from_table", "signal_subscription", private_rules_body, (void *) &allNdx, 0);
+	lua_pop( _L, 1);                                                           //
+}
+
+//################################################################################
+
+static void private_bench_mapping( lua_State * const _L)
+{
+	// fake object pointers, we never dereference them
+	static int const nbPointers = NB_COLD_ENTRIES * (NB_WARM_PASSES + 2);
+	MappingContext context;
+	context.pointers = (char *) malloc( nbPointers);
+	context.offset = 0;
+	// existing mappings: keep the userdata alive so that every push finds them
+	lua_createtable( _L, NB_COLD_ENTRIES, 0);                                  // {anchor}
+	int n;
+	for ( n = 0; n < NB_COLD_ENTRIES; ++ n)
+	{
+		utils_push_mapped_userdata( _L, context.pointers + n, gBenchMetatableKey, sizeof( void *));
+		lua_rawseti( _L, -2, n + 1);
+	}
+	private_run( _L, "utils_push_mapped_userdata", "existing", private_mapping_body, &context, 1);
+	private_run( _L, "utils_push_mapped_userdata", "existing", private_mapping_body, &context, 0);
+	lua_pop( _L, 1);                                                           //
+	lua_gc( _L, LUA_GCCOLLECT, 0);
+	// new mappings: a fresh pointer for each call, the garbage collector does its job as it would in real life
+	context.offset = NB_COLD_ENTRIES;
+	int const warm[] = { 1, 0 };
+	int i;
+	for ( i = 0; i < 2; ++ i)
+	{
+		int const nbEntries = warm[i] ? NB_WARM_ENTRIES : NB_COLD_ENTRIES;
+		int const nbPasses = warm[i] ? NB_WARM_PASSES : NB_COLD_PASSES;
+		dbus_uint64_t elapsed = 0;
+		int pass;
+		for ( pass = 0; pass < nbPasses; ++ pass)
+		{
+			if ( !warm[i] )
+				private_evict_caches();
+			dbus_uint64_t const start = utils_get_monotonic_time_ns();
+			for ( n = 0; n < nbEntries; ++ n)
+				private_mapping_body( _L, &context, n);
+			elapsed += utils_get_monotonic_time_ns() - start;
+			// never reuse a pointer
+			context.offset += nbEntries;
+		}
+		private_report( "utils_push_mapped_userdata", "new", warm[i], nbEntries, (long) nbPasses * nbEntries, elapsed);
+	}
+	lua_gc( _L, LUA_GCCOLLECT, 0);
+	free( context.pointers);
+}
+
+//################################################################################
+
+static void private_bench_conversions( lua_State * const _L)
+{
+	static char const * const busTypes[] = { "DBUS_BUS_SESSION", "DBUS_BUS_SYSTEM", "DBUS_BUS_STARTER" };
+	static char const * const handlerResults[] = { "DBUS_HANDLER_RESULT_HANDLED", "DBUS_HANDLER_RESULT_NOT_YET_HANDLED", "DBUS_HANDLER_RESULT_NEED_MEMORY" };
+	static char const * const messageTypes[] = { "DBUS_MESSAGE_TYPE_INVALID", "DBUS_MESSAGE_TYPE_METHOD_CALL", "DBUS_MESSAGE_TYPE_METHOD_RETURN", "DBUS_MESSAGE_TYPE_ERROR", "DBUS_MESSAGE_TYPE_SIGNAL" };
+	struct
+	{
+		char const * name;
+		char const * const * strings;
+		int nbStrings;
+	} const suites[] =
+	{
+		{ "utils_convert_to_bus_type", busTypes, NB_ELEMENTS( busTypes) },
+		{ "utils_convert_to_handler_result", handlerResults, NB_ELEMENTS( handlerResults) },
+		{ "utils_convert_to_message_type", messageTypes, NB_ELEMENTS( messageTypes) },
+	};
+	int i;
+	for ( i = 0; i < NB_ELEMENTS( suites); ++ i)
+	{
+		ConversionContext context;
+		context.firstNdx = lua_gettop( _L) + 1;
+		context.nbStrings = suites[i].nbStrings;
+		context.which = i;
+		int s;
+		for ( s = 0; s < suites[i].nbStrings; ++ s)
+			lua_pushstring( _L, suites[i].strings[s]);
+		private_run( _L, suites[i].name, "all_values", private_conversion_body, &context, 1);
+		private_run( _L, suites[i].name, "all_values", private_conversion_body, &context, 0);
+		lua_pop( _L, suites[i].nbStrings);
+	}
+}
+
+//################################################################################
+//################################################################################
+
+static int private_main( lua_State * const _L)
+{
+	// the module sets up the userdata map and utils_init()
+	lua_pushcfunction( _L, luaopen_dbus);
+	lua_call( _L, 0, 0);
+	// a metatable without finalizer for the fake mapped objects
+	utils_prepare_metatable( _L, gBenchMetatableKey);
+	lua_pop( _L, 1);
+
+	private_bench_validation( _L);
+	private_bench_rules( _L);
+	private_bench_mapping( _L);
+	private_bench_conversions( _L);
+	return 0;
+}
+
+//################################################################################
+
+int main( int _argc, char ** _argv)
+{
+	gOutput = (_argc > 1) ? fopen( _argv[1], "w") : stderr;
+	if ( gOutput == 0x0 )
+	{
+		fprintf( stderr, "can't open %s\n", _argv[1]);
+		return 1;
+	}
+	// the binding traces a lot of things on stdout, keep them out of the measurements
+	if ( freopen( "/dev/null", "w", stdout) == 0x0 )
+		fprintf( stderr, "warning: debug traces will go to stdout\n");
+	gEvictionBuffer = (char *) calloc( EVICTION_SIZE, 1);
+	lua_State * const L = luaL_newstate();
+	if ( L == 0x0 || gEvictionBuffer == 0x0 )
+	{
+		fprintf( stderr, "not enough memory\n");
+		return 1;
+	}
+	luaL_openlibs( L);
+	int const status = lua_cpcall( L, private_main, 0x0);
+	if ( status != 0 )
+		fprintf( stderr, "error: %s\n", lua_tostring( L, -1));
+	lua_close( L);
+	free( gEvictionBuffer);
+	if ( gOutput != stderr )
+		fclose( gOutput);
+	return (status == 0) ? 0 : 1;
+}
@@ -0,0 +1,199 @@
+-- Loopback benchmark for the Lua D-Bus binding.
+--
+-- Starts a dbus server in-process, connects N peers to it and measures
+-- round-trip latency of method calls and one-way throughput of signals,
+-- with small and large payloads. No bus daemon is needed.
+--
+-- usage: lua loopback.lua [--peers N] [--iterations N] [--large BYTES] [--output FILE]
+--
+-- Results are written as JSON lines, see bench_common.lua.
+
+-- the shared helpers live next to this script
+package.path = ( arg and arg[0] and arg[0]:match( "^(.*[/\\])") or "" ) .. "?.lua;" .. package.path
+local bench_common = require( "bench_common")
+
+local dbus = bench_common.load_dbus()
+
+--------------------------------------------------------------------------------
+-- settings
+
+local settings = { peers = 4, iterations = 2000, large = 64 * 1024, output = nil }
+bench_common.parse_options( settings, { "output" })
+
+local report, close_report = bench_common.open_report( settings.output)
+
+--------------------------------------------------------------------------------
+-- helpers
+
+local now = dbus.monotonic_time
+
+local function pump( connections, timeout)
+	for _, connection in ipairs( connections) do
+		connection:read_write( timeout)
+	end
+end
+
+-- wait for the next message on any of the given connections
+local function wait_message( connections)
+	while true do
+		for _, connection in ipairs( connections) do
+			connection:read_write( 0)
+			local message = connection:pop_message()
+			if message then
+				return message, connection
+			end
+		end
+	end
+end
+
+local function percentile( sorted, p)
+	if #sorted == 0 then
+		return 0
+	end
+	local rank = math.ceil( p * #sorted)
+	return sorted[math.max( rank, 1)]
+end
+
+local function report_latencies( name, payload, samples, elapsed)
+	table.sort( samples)
+	local total = 0
+	for _, sample in ipairs( samples) do
+		total = total + sample
+	end
+	report
+	{
+		benchmark = name,
+		payload_bytes = payload,
+		peers = settings.peers,
+		count = #samples,
+		mean_us = total / #samples * 1e6,
+		p50_us = percentile( samples, 0.50) * 1e6,
+		p90_us = percentile( samples, 0.90) * 1e6,
+		p99_us = percentile( samples, 0.99) * 1e6,
+		p999_us = percentile( samples, 0.999) * 1e6,
+		max_us = samples[#samples] * 1e6,
+		rate_per_s = #samples / elapsed,
+	}
+end
+
+--------------------------------------------------------------------------------
+-- setup
+
+local server = assert( dbus.server_listen( "unix:tmpdir=/tmp"))
+local address = server:get_address()
+local accepted = {}
+server:set_new_connection_function( function( _, connection)
+	accepted[#accepted + 1] = connection
+end)
+
+local clients = {}
+for i = 1, settings.peers do
+	clients[i] = assert( dbus.connection_open( address))
+end
+
+-- accept everybody and let the authentication handshakes complete
+local deadline = now() + 10
+local function ready()
+	if #accepted < settings.peers then
+		return false
+	end
+	for _, connection in ipairs( clients) do
+		if not connection:get_is_authenticated() then
+			return false
+		end
+	end
+	return true
+end
+while not ready() do
+	assert( now() < deadline, "peers did not connect in time")
+	server:handle_watches( 1)
+	pump( clients, 0)
+	pump( accepted, 0)
+end
+
+report { benchmark = "setup", address = address, peers = settings.peers }
+
+--------------------------------------------------------------------------------
+-- method call round trips: the client sends a call, the server side echoes the payload back
+
+local function bench_method_calls( payload)
+	local samples = {}
+	local start = now()
+	for i = 1, settings.iterations do
+		local client = clients[(i - 1) % #clients + 1]
+		local call = dbus.message_new_method_call{ path = "/org/luadbus/Bench", interface = "org.luadbus.Bench", method = "Echo" }
+		call:append_args( "ay", payload)
+		local t0 = now()
+		client:send( call)
+		client:flush()
+		local request, peer = wait_message( accepted)
+		local reply = dbus.message_new_method_return( request)
+		reply:append_args( "ay", (request:get_args()))
+		peer:send( reply)
+		peer:flush()
+		local answer = wait_message{ client }
+		samples[i] = now() - t0
+		assert( answer:get_reply_serial() == call:get_serial(), "reply mismatch")
+	end
+	report_latencies( "method_call_roundtrip", #payload, samples, now() - start)
+end
+
+--------------------------------------------------------------------------------
+-- signal throughput: every client fires signals, the server side drains them
+
+local function bench_signals( payload)
+	local count = settings.iterations
+	local start = now()
+	local received = 0
+	for i = 1, count do
+		local client = clients[(i - 1) % #clients + 1]
+		local signal = dbus.message_new_signal( "/org/luadbus/Bench", "org.luadbus.Bench", "Tick")
+		signal:append_args( "ay", payload)
+		client:send( signal)
+		-- drain as we go so that the socket buffers don't fill up
+		if i % 64 == 0 then
+			pump( clients, 0)
+			for _, peer in ipairs( accepted) do
+				peer:read_write( 0)
+				while peer:pop_message() do
+					received = received + 1
+				end
+			end
+		end
+	end
+	for _, client in ipairs( clients) do
+		client:flush()
+	end
+	while received < count do
+		for _, peer in ipairs( accepted) do
+			peer:read_write( 1)
+			while peer:pop_message() do
+				received = received + 1
+			end
+		end
+	end
+	local elapsed = now() - start
+	report
+	{
+		benchmark = "signal_throughput",
+		payload_bytes = #payload,
+		peers = settings.peers,
+		count = count,
+		elapsed_s = elapsed,
+		rate_per_s = count / elapsed,
+		bytes_per_s = count * #payload / elapsed,
+	}
+end
+
+--------------------------------------------------------------------------------
+
+local small = string.rep( "x", 16)
+local large = string.rep( "x", settings.large)
+
+bench_method_calls( small)
+bench_method_calls( large)
+bench_signals( small)
+bench_signals( large)
+
+server:disconnect()
+close_report()
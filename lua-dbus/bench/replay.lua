@@ -0,0 +1,198 @@
+-- Replay driver for capture files (see conn:capture_start).
+--
+-- Starts a dbus server in-process, connects a client to it, and sends the
+-- captured messages through the client at their original timing, at a
+-- scaled timing, or as fast as possible. The server side runs a Lua handler,
+-- so production traffic can be reproduced against the same handler code
+-- without a live bus.
+--
+-- usage: lua replay.lua CAPTURE [--handler MODULE] [--speed X] [--direction in|out|all]
+--                               [--timeout SECONDS] [--output FILE]
+--
+--   --speed 1 replays at the original timing (default), 2 twice as fast, 0 as fast as possible
+--   --direction selects which captured messages are replayed: the ones the captured
+--     connection received (in, default), sent (out) or both
+--   --handler names a module returning function( connection, message) that returns
+--     the reply message or nil, like the worker pool handlers; by default calls get an
+--     empty method return
+--
+-- Results are written as JSON lines, see bench_common.lua.
+
+-- the shared helpers live next to this script
+package.path = ( arg and arg[0] and arg[0]:match( "^(.*[/\\])") or "" ) .. "?.lua;" .. package.path
+local bench_common = require( "bench_common")
+
+local dbus = bench_common.load_dbus()
+
+--------------------------------------------------------------------------------
+-- settings
+
+local settings = { capture = nil, handler = nil, speed = 1, direction = "in", timeout = 5, output = nil }
+bench_common.parse_options( settings, { "handler", "output" }, "capture")
+assert( settings.capture, "usage: lua replay.lua CAPTURE [options]")
+assert( settings.direction == "in" or settings.direction == "out" or settings.direction == "all", "bad --direction")
+assert( type( settings.speed) == "number" and settings.speed >= 0, "bad --speed")
+
+local report, close_report = bench_common.open_report( settings.output)
+
+local METHOD_CALL = "DBUS_MESSAGE_TYPE_METHOD_CALL"
+local ERROR = "DBUS_MESSAGE_TYPE_ERROR"
+
+--------------------------------------------------------------------------------
+-- helpers
+
+local now = dbus.monotonic_time
+
+local handler
+if settings.handler then
+	handler = require( settings.handler)
+	assert( type( handler) == "function", "the handler module must return a function")
+else
+	handler = function( _, message)
+		if message:get_type() == METHOD_CALL then
+			return dbus.message_new_method_return( message)
+		end
+	end
+end
+
+--------------------------------------------------------------------------------
+-- setup
+
+local server = assert( dbus.server_listen( "unix:tmpdir=/tmp"))
+local peer
+server:set_new_connection_function( function( _, connection)
+	peer = connection
+end)
+local client = assert( dbus.connection_open( server:get_address()))
+
+local deadline = now() + 10
+while not ( peer and client:get_is_authenticated()) do
+	assert( now() < deadline, "the client did not connect in time")
+	server:handle_watches( 1)
+	client:read_write( 0)
+	if peer then
+		peer:read_write( 0)
+	end
+end
+
+--------------------------------------------------------------------------------
+-- replay
+
+local counters = { sent = 0, calls = 0, answered = 0, error_replies = 0, send_failures = 0, handler_errors = 0, unexpected_replies = 0 }
+local pending = {}   -- serial -> send time
+local nb_pending = 0
+local latency = dbus.histogram_new()
+local max_lag = 0
+
+-- run the handler on whatever reached the server, and collect the replies on the client
+local function service()
+	peer:read_write( 0)
+	while true do
+		local message = peer:pop_message()
+		if not message then
+			break
+		end
+		local ok, reply = pcall( handler, peer, message)
+		if not ok then
+			counters.handler_errors = counters.handler_errors + 1
+		elseif reply then
+			peer:send( reply)
+		end
+	end
+	client:read_write( 0)
+	while true do
+		local message = client:pop_message()
+		if not message then
+			break
+		end
+		local sent_at = pending[message:get_reply_serial()]
+		if sent_at then
+			latency:record( now() - sent_at)
+			pending[message:get_reply_serial()] = nil
+			nb_pending = nb_pending - 1
+			counters.answered = counters.answered + 1
+			if message:get_type() == ERROR then
+				counters.error_replies = counters.error_replies + 1
+			end
+		else
+			counters.unexpected_replies = counters.unexpected_replies + 1
+		end
+	end
+end
+
+local reader = assert( dbus.capture_open( settings.capture))
+local first, start, damaged
+while true do
+	local message, direction, timestamp = reader:next()
+	if not message then
+		-- nil at the end of the file, nil + error on a damaged record: stop there in both cases
+		damaged = direction
+		break
+	end
+	if settings.direction == "all" or settings.direction == direction then
+		if not first then
+			first, start = timestamp, now()
+		end
+		if settings.speed > 0 then
+			local due = start + ( timestamp - first) / settings.speed
+			while now() < due do
+				service()
+			end
+			max_lag = math.max( max_lag, now() - due)
+		end
+		-- a copy gets a fresh serial on send, the captured one belongs to the original connection
+		local copy = message:copy()
+		local expects_reply = copy:get_type() == METHOD_CALL and not copy:get_no_reply()
+		if client:send( copy) then
+			counters.sent = counters.sent + 1
+			if expects_reply then
+				counters.calls = counters.calls + 1
+				pending[copy:get_serial()] = now()
+				nb_pending = nb_pending + 1
+			end
+		else
+			counters.send_failures = counters.send_failures + 1
+		end
+		service()
+	end
+end
+reader:close()
+
+local sent_until = now()
+deadline = sent_until + settings.timeout
+client:flush()
+while nb_pending > 0 and now() < deadline do
+	service()
+end
+local elapsed = start and ( sent_until - start) or 0
+
+local summary = latency:summary()
+report
+{
+	benchmark = "replay",
+	capture = settings.capture,
+	direction = settings.direction,
+	speed = settings.speed,
+	sent = counters.sent,
+	calls = counters.calls,
+	answered = counters.answered,
+	error_replies = counters.error_replies,
+	dropped = counters.send_failures + nb_pending,
+	send_failures = counters.send_failures,
+	unanswered = nb_pending,
+	unexpected_replies = counters.unexpected_replies,
+	handler_errors = counters.handler_errors,
+	elapsed_s = elapsed,
+	rate_per_s = elapsed > 0 and counters.sent / elapsed or 0,
+	max_lag_us = max_lag * 1e6,
+	mean_us = summary.mean * 1e6,
+	p50_us = summary.p50 * 1e6,
+	p90_us = summary.p90 * 1e6,
+	p99_us = summary.p99 * 1e6,
+	p999_us = summary.p999 * 1e6,
+	max_us = summary.max * 1e6,
+	capture_error = damaged,
+}
+
+server:disconnect()
+close_report()
@@ -30,11 +30,14 @@
 
 #include "utils.h"
 #include "dbus_connection_shared.h"
+#include "dbus_name_owner.h"
+#include "dbus_property_cache.h"
+#include "dbus_proxy.h"
 
 //################################################################################
 //################################################################################
 
-int gBusMetatableRef = LUA_NOREF;
+char const gBusMetatableKey[] = "lua-dbus bus";
 
 //################################################################################
 //################################################################################
@@ -46,14 +49,35 @@ int push_dbus_bus( lua_State * const _L, DBusConnection * const _connection)
 	else
 	{
 		// create (or find an existing) fully functional userdata for our connection
-		ConnectionUserdata * const block = (ConnectionUserdata *) utils_push_mapped_userdata( _L, _connection, gBusMetatableRef, sizeof(ConnectionUserdata));
+		int const existing = utils_is_mapped_userdata( _L, _connection);
+		ConnectionUserdata * const block = (ConnectionUserdata *) utils_push_mapped_userdata( _L, _connection, gBusMetatableKey, sizeof(ConnectionUserdata));
 		// not necessary because our finalizer implementation doesn't care...
 		block->closeOnFinalize = 0;
-		// create a news table and set it as the userdata's environment (it will be used to store filters)
-		lua_newtable( _L);
-		lua_setfenv( _L, -2);
-		block->filterCallSequence = 0x0;
-		block->nbRegisteredFilters = 0;
+		// an existing userdata keeps its filters and counters
+		if ( !existing )
+		{
+			// create a news table and set it as the userdata's environment (it will be used to store filters)
+			lua_newtable( _L);
+			lua_setfenv( _L, -2);
+			block->filterCallSequence = 0x0;
+			block->filterPredicates = 0x0;
+			block->nbRegisteredFilters = 0;
+			block->filterState = 0x0;
+			block->filterChainLatency = 0x0;
+			block->filterLatencies = 0x0;
+			block->capture = 0x0;
+			block->replyCache = 0x0;
+			block->nameOwners = 0x0;
+			block->priorityStage = 0x0;
+			block->rateLimiter = 0x0;
+			block->replyTable = 0x0;
+			block->replyLatency = 0x0;
+			memset( &block->stats, 0, sizeof( block->stats));
+			// counting in a filter of our own, added first, sees all that dispatch goes through
+			block->accountingFilterAdded = 0;
+			if ( !install_accounting_filter( block) )
+				return luaL_error( _L, "not enough memory to watch the connection");
+		}
 		// connection address is already stored at the beginning of the userdata block, just fill the rest
 		printf( "push_dbus_bus: new connection contents: %p(%p)\n", _connection, block->connection);
 		return 1;
@@ -64,7 +88,7 @@ int push_dbus_bus( lua_State * const _L, DBusConnection * const _connection)
 
 static ConnectionUserdata * cast_to_dbus_bus_userdata( lua_State * const _L, int const _ndx)
 {
-	return (ConnectionUserdata *) utils_cast_userdata( _L, _ndx, gBusMetatableRef);
+	return (ConnectionUserdata *) utils_cast_userdata( _L, _ndx, gBusMetatableKey);
 }
 //################################################################################
 //################################################################################
@@ -93,7 +117,7 @@ int bind_dbus_bus_get( lua_State * const _L)
 int bind_dbus_bus_add_match( lua_State * const _L)
 {
 	// first argument should be a bus (which is just a special connection)
-	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, gBusMetatableRef);
+	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, gBusMetatableKey);
 
 	char rules_buffer[DBUS_MAXIMUM_MATCH_RULE_LENGTH];
 	utils_fill_rule_buffer_from_table( _L, 2, rules_buffer);
@@ -118,7 +142,7 @@ int bind_dbus_bus_add_match( lua_State * const _L)
 int bind_dbus_bus_remove_match( lua_State * const _L)
 {
 	// first argument should be a bus (which is just a special connection)
-	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, gBusMetatableRef);
+	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, gBusMetatableKey);
 
 	char rules_buffer[DBUS_MAXIMUM_MATCH_RULE_LENGTH];
 	utils_fill_rule_buffer_from_table( _L, 2, rules_buffer);
@@ -147,7 +171,14 @@ int finalize_dbus_bus( lua_State * const _L)
 	ConnectionUserdata * const connectionUD = cast_to_dbus_bus_userdata( _L, 1);
 	printf( "finalize_dbus_bus: connection=%p\n", connectionUD->connection);
 
+	finalize_accounting_data( connectionUD);
 	finalize_filter_data( _L, connectionUD);
+	finalize_capture_data( connectionUD);
+	finalize_reply_cache_data( connectionUD);
+	finalize_priority_data( connectionUD);
+	finalize_rate_limit_data( connectionUD);
+	finalize_reply_table_data( connectionUD);
+	finalize_name_owner_data( connectionUD);
 	puts( "finalize_dbus_bus: unrefing connection");
 	dbus_connection_unref( connectionUD->connection);
 	puts( "finalize_dbus_bus; unref-ed");
@@ -160,6 +191,10 @@ int finalize_dbus_bus( lua_State * const _L)
 static luaL_Reg gBusMeta[] =
 {
 	{ "add_match", bind_dbus_bus_add_match },
+	{ "name_owner", bind_dbus_bus_name_owner },
+	{ "on_name_owner_changed", bind_dbus_bus_on_name_owner_changed },
+	{ "property_cache", bind_dbus_bus_property_cache },
+	{ "proxy", bind_dbus_bus_proxy },
 	{ "remove_match", bind_dbus_bus_remove_match },
 	{ "__gc", finalize_dbus_bus },
 	{ 0x0, 0x0 },
@@ -168,15 +203,15 @@ static luaL_Reg gBusMeta[] =
 //################################################################################
 //################################################################################
 
-extern void register_shared_connection_stuff( lua_State * const _L, int const _mtRef);
+extern void register_shared_connection_stuff( lua_State * const _L, char const * const _metaKey);
 
 // should be called with the "dbus" library table on the top of the stack
 void register_bus_stuff( lua_State * const _L)
 {
 	// register the connection object metatable in the registry
-	utils_prepare_metatable( _L, &gBusMetatableRef);              // {meta}
-	utils_register_upvalued_functions( _L, gSharedConnectionMeta, gBusMetatableRef);
+	utils_prepare_metatable( _L, gBusMetatableKey);               // {meta}
+	utils_register_upvalued_functions( _L, gSharedConnectionMeta, gBusMetatableKey);
 	// replace/add whatever is specific to a bus connection
-	utils_register_upvalued_functions( _L, gBusMeta, gBusMetatableRef);
+	utils_register_upvalued_functions( _L, gBusMeta, gBusMetatableKey);
 	lua_pop( _L, 1);                                                     //
 }
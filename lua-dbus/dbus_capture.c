@@ -0,0 +1,339 @@
+/************************************************************************
+*
+* Lua bindings for libdbus.
+* Copyright (c) 2009 - BenoitGermain <bnt.germain@gmail.com>
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+************************************************************************/
+
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "dbus_capture.h"
+
+//################################################################################
+// capture files: connections append the messages they see, readers map the file
+// and rebuild the messages one at a time, so a capture never has to fit in the heap
+//################################################################################
+
+extern int push_dbus_message( lua_State * const _L, DBusMessage * const _message);
+
+//################################################################################
+//################################################################################
+
+char const gCaptureReaderMetatableKey[] = "lua-dbus capture reader";
+
+struct CaptureReader
+{
+	// the mapping, always first by convention, NULL once closed
+	char *base;
+	size_t size;
+	size_t offset;
+};
+typedef struct CaptureReader CaptureReader;
+
+static char const gPadding[8] = { 0 };
+
+//################################################################################
+//################################################################################
+
+Capture * capture_open( char const * const _path, char const ** const _error)
+{
+	FILE * const file = fopen( _path, "a+b");
+	if ( file == 0x0 )
+	{
+		*_error = strerror( errno);
+		return 0x0;
+	}
+	// appending to an existing capture is fine, as long as it is one
+	char header[CAPTURE_HEADER_SIZE];
+	dbus_uint32_t const version = CAPTURE_VERSION;
+	fseek( file, 0, SEEK_END);
+	if ( ftell( file) == 0 )
+	{
+		memcpy( header, CAPTURE_MAGIC, 4);
+		memcpy( header + 4, &version, 4);
+		if ( fwrite( header, CAPTURE_HEADER_SIZE, 1, file) != 1 )
+		{
+			*_error = strerror( errno);
+			fclose( file);
+			return 0x0;
+		}
+	}
+	else
+	{
+		rewind( file);
+		if ( fread( header, CAPTURE_HEADER_SIZE, 1, file) != 1 || memcmp( header, CAPTURE_MAGIC, 4) != 0 || memcmp( header + 4, &version, 4) != 0 )
+		{
+			*_error = "not a capture file, or an incompatible one";
+			fclose( file);
+			return 0x0;
+		}
+	}
+	Capture * const capture = (Capture *) malloc( sizeof( Capture));
+	if ( capture == 0x0 )
+	{
+		*_error = "not enough memory";
+		fclose( file);
+		return 0x0;
+	}
+	// appends go to the end anyway, but we track where the last complete record stops
+	fseek( file, 0, SEEK_END);
+	capture->file = file;
+	capture->end = ftell( file);
+	capture->stopped = 0;
+	capture->nbRecords = 0;
+	capture->nbErrors = 0;
+	capture->nbBytes = 0;
+	return capture;
+}
+
+//################################################################################
+
+// failures are only counted: capturing must never get in the way of the traffic itself
+// a record that could only be partially written is cut off, so that readers never see it;
+// if even that fails, the capture stops growing and every further message counts as an error
+void capture_write( Capture * const _capture, DBusMessage * const _message, int const _direction)
+{
+	if ( _capture->stopped )
+	{
+		++ _capture->nbErrors;
+		return;
+	}
+	char *buffer;
+	int length;
+	if ( !dbus_message_marshal( _message, &buffer, &length) )
+	{
+		++ _capture->nbErrors;
+		return;
+	}
+	dbus_uint32_t record[2] = { (dbus_uint32_t) length, (dbus_uint32_t) _direction };
+	dbus_uint64_t const timestamp = utils_get_monotonic_time_ns();
+	size_t const padding = (8 - (length & 7)) & 7;
+	if ( fwrite( record, sizeof( record), 1, _capture->file) == 1
+		&& fwrite( &timestamp, sizeof( timestamp), 1, _capture->file) == 1
+		&& fwrite( buffer, length, 1, _capture->file) == 1
+		&& ( padding == 0 || fwrite( gPadding, padding, 1, _capture->file) == 1) )
+	{
+		++ _capture->nbRecords;
+		_capture->nbBytes += CAPTURE_RECORD_HEADER_SIZE + length + padding;
+		_capture->end += CAPTURE_RECORD_HEADER_SIZE + length + (long) padding;
+	}
+	else
+	{
+		++ _capture->nbErrors;
+		// drop whatever part of the record reached the stdio buffer or the file
+		clearerr( _capture->file);
+		if ( fflush( _capture->file) != 0 || ftruncate( fileno( _capture->file), (off_t) _capture->end) != 0 || fseek( _capture->file, 0, SEEK_END) != 0 )
+		{
+			_capture->stopped = 1;
+		}
+	}
+	dbus_free( buffer);
+}
+
+//################################################################################
+
+void capture_close( Capture * const _capture)
+{
+	fclose( _capture->file);
+	free( _capture);
+}
+
+//################################################################################
+//################################################################################
+
+static CaptureReader * cast_to_capture_reader( lua_State * const _L, int const _ndx)
+{
+	return (CaptureReader *) utils_cast_userdata( _L, _ndx, gCaptureReaderMetatableKey);
+}
+
+//################################################################################
+
+// dbus.capture_open( path) -> reader, or nil, error
+int bind_dbus_capture_open( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	char const * const path = luaL_checkstring( _L, 1);
+	int const fd = open( path, O_RDONLY);
+	struct stat info;
+	if ( fd < 0 || fstat( fd, &info) != 0 )
+	{
+		int const error = errno;
+		if ( fd >= 0 )
+			close( fd);
+		lua_pushnil( _L);
+		lua_pushstring( _L, strerror( error));
+		return 2;
+	}
+	if ( info.st_size < CAPTURE_HEADER_SIZE )
+	{
+		close( fd);
+		lua_pushnil( _L);
+		lua_pushliteral( _L, "not a capture file");
+		return 2;
+	}
+	void * const base = mmap( 0x0, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	int const error = errno;
+	// the mapping stays valid once the descriptor is closed
+	close( fd);
+	if ( base == MAP_FAILED )
+	{
+		lua_pushnil( _L);
+		lua_pushstring( _L, strerror( error));
+		return 2;
+	}
+	dbus_uint32_t const version = CAPTURE_VERSION;
+	if ( memcmp( base, CAPTURE_MAGIC, 4) != 0 || memcmp( (char *) base + 4, &version, 4) != 0 )
+	{
+		munmap( base, (size_t) info.st_size);
+		lua_pushnil( _L);
+		lua_pushliteral( _L, "not a capture file, or an incompatible one");
+		return 2;
+	}
+	// we read the file front to back, once
+	madvise( base, (size_t) info.st_size, MADV_SEQUENTIAL);
+	CaptureReader * const reader = (CaptureReader *) lua_newuserdata( _L, sizeof( CaptureReader));   // R
+	reader->base = (char *) base;
+	reader->size = (size_t) info.st_size;
+	reader->offset = CAPTURE_HEADER_SIZE;
+	utils_push_metatable( _L, gCaptureReaderMetatableKey);                                          // R meta
+	lua_setmetatable( _L, -2);                                                                       // R
+	return 1;
+}
+
+//################################################################################
+
+int bind_dbus_capture_reader_close( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	CaptureReader * const reader = cast_to_capture_reader( _L, 1);
+	munmap( reader->base, reader->size);
+	reader->base = 0x0;
+	return 0;
+}
+
+//################################################################################
+
+// reader:next() -> message, "in"/"out", timestamp in seconds; nil at the end; nil, error on a damaged record
+// it also works as a generic for iterator: for msg, direction, t in reader.next, reader do ... end
+int bind_dbus_capture_reader_next( lua_State * const _L)
+{
+	if ( lua_gettop( _L) != 2 )
+		utils_check_nargs( _L, 1);
+	CaptureReader * const reader = cast_to_capture_reader( _L, 1);
+	if ( reader->offset == reader->size )
+	{
+		lua_pushnil( _L);
+		return 1;
+	}
+	if ( reader->size - reader->offset < CAPTURE_RECORD_HEADER_SIZE )
+	{
+		lua_pushnil( _L);
+		lua_pushliteral( _L, "truncated record header");
+		return 2;
+	}
+	char const * const record = reader->base + reader->offset;
+	dbus_uint32_t length, direction;
+	dbus_uint64_t timestamp;
+	memcpy( &length, record, 4);
+	memcpy( &direction, record + 4, 4);
+	memcpy( &timestamp, record + 8, 8);
+	size_t const padding = (8 - (length & 7)) & 7;
+	if ( reader->size - reader->offset - CAPTURE_RECORD_HEADER_SIZE < (size_t) length + padding )
+	{
+		lua_pushnil( _L);
+		lua_pushliteral( _L, "truncated record");
+		return 2;
+	}
+	DBusError error;
+	dbus_error_init( &error);
+	DBusMessage * const message = dbus_message_demarshal( record + CAPTURE_RECORD_HEADER_SIZE, (int) length, &error);
+	if ( message == 0x0 )
+	{
+		lua_pushnil( _L);
+		lua_pushstring( _L, error.message);
+		dbus_error_free( &error);
+		return 2;
+	}
+	reader->offset += CAPTURE_RECORD_HEADER_SIZE + length + padding;
+	push_dbus_message( _L, message);
+	lua_pushstring( _L, direction == CAPTURE_DIRECTION_OUT ? "out" : "in");
+	lua_pushnumber( _L, (lua_Number) timestamp / 1e9);
+	return 3;
+}
+
+//################################################################################
+
+int bind_dbus_capture_reader_rewind( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	CaptureReader * const reader = cast_to_capture_reader( _L, 1);
+	reader->offset = CAPTURE_HEADER_SIZE;
+	return 0;
+}
+
+//################################################################################
+
+int finalize_dbus_capture_reader( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	CaptureReader * const reader = (CaptureReader *) lua_touserdata( _L, 1);
+	if ( reader->base != 0x0 )
+	{
+		munmap( reader->base, reader->size);
+		reader->base = 0x0;
+	}
+	return 0;
+}
+
+//################################################################################
+//################################################################################
+
+static luaL_Reg gCaptureReaderMeta[] =
+{
+	{ "close", bind_dbus_capture_reader_close },
+	{ "next", bind_dbus_capture_reader_next },
+	{ "rewind", bind_dbus_capture_reader_rewind },
+	{ "__gc", finalize_dbus_capture_reader },
+	{ 0x0, 0x0 },
+};
+
+//################################################################################
+//################################################################################
+
+void register_capture_stuff( lua_State * const _L)
+{
+	// register the capture reader metatable in the registry
+	utils_prepare_metatable( _L, gCaptureReaderMetatableKey);                                 // {meta}
+	utils_register_upvalued_functions( _L, gCaptureReaderMeta, gCaptureReaderMetatableKey);   // {meta}
+	lua_pop( _L, 1);                                                                          //
+}
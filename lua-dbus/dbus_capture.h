@@ -0,0 +1,41 @@
+#if ! defined ( __dbus_capture_h__ )
+#define __dbus_capture_h__ 1
+
+#include <stdio.h>
+
+//################################################################################
+
+// capture file layout, all integers in host byte order:
+// header: "LDBC" magic, uint32 version
+// then, for each message: uint32 length, uint32 direction, uint64 timestamp (ns, monotonic clock),
+// followed by the message as produced by dbus_message_marshal(), padded to 8 bytes
+#define CAPTURE_MAGIC "LDBC"
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_SIZE 8
+#define CAPTURE_RECORD_HEADER_SIZE 16
+#define CAPTURE_DIRECTION_IN 0
+#define CAPTURE_DIRECTION_OUT 1
+
+struct Capture
+{
+	FILE *file;
+	// offset just past the last complete record, a partial one is cut back to it
+	long end;
+	// set when a partial record could not be cut off: nothing more is appended then
+	int stopped;
+	unsigned long nbRecords;
+	unsigned long nbErrors;
+	dbus_uint64_t nbBytes;
+};
+typedef struct Capture Capture;
+
+extern Capture * capture_open( char const * const _path, char const ** const _error);
+extern void capture_write( Capture * const _capture, DBusMessage * const _message, int const _direction);
+extern void capture_close( Capture * const _capture);
+
+extern int bind_dbus_capture_open( lua_State * const _L);
+extern void register_capture_stuff( lua_State * const _L);
+
+//################################################################################
+
+#endif // __dbus_capture_h__
@@ -26,6 +26,7 @@
 
 #include <lua.h>
 #include <lauxlib.h>
+#include <string.h>
 
 #include "utils.h"
 #include "dbus_connection_shared.h"
@@ -33,7 +34,7 @@
 //################################################################################
 //################################################################################
 
-int gConnectionMetatableRef = LUA_NOREF;
+char const gConnectionMetatableKey[] = "lua-dbus connection";
 
 //################################################################################
 //################################################################################
@@ -45,12 +46,33 @@ int push_dbus_connection( lua_State * const _L, DBusConnection * const _connecti
 	else
 	{
 		// create (or find an existing) fully functional userdata for our connection
-		ConnectionUserdata * const block = (ConnectionUserdata *) utils_push_mapped_userdata( _L, _connection, gConnectionMetatableRef, sizeof(ConnectionUserdata));
-		// create a news table and set it as the userdata's environment (it will be used to store filters)
-		lua_newtable( _L);
-		lua_setfenv( _L, -2);
-		block->filterCallSequence = 0x0;
-		block->nbRegisteredFilters = 0;
+		int const existing = utils_is_mapped_userdata( _L, _connection);
+		ConnectionUserdata * const block = (ConnectionUserdata *) utils_push_mapped_userdata( _L, _connection, gConnectionMetatableKey, sizeof(ConnectionUserdata));
+		// an existing userdata keeps its filters and counters
+		if ( !existing )
+		{
+			// create a news table and set it as the userdata's environment (it will be used to store filters)
+			lua_newtable( _L);
+			lua_setfenv( _L, -2);
+			block->filterCallSequence = 0x0;
+			block->filterPredicates = 0x0;
+			block->nbRegisteredFilters = 0;
+			block->filterState = 0x0;
+			block->filterChainLatency = 0x0;
+			block->filterLatencies = 0x0;
+			block->capture = 0x0;
+			block->replyCache = 0x0;
+			block->nameOwners = 0x0;
+			block->priorityStage = 0x0;
+			block->rateLimiter = 0x0;
+			block->replyTable = 0x0;
+			block->replyLatency = 0x0;
+			memset( &block->stats, 0, sizeof( block->stats));
+			// counting in a filter of our own, added first, sees all that dispatch goes through
+			block->accountingFilterAdded = 0;
+			if ( !install_accounting_filter( block) )
+				return luaL_error( _L, "not enough memory to watch the connection");
+		}
 		// connection address is already stored at the beginning of the userdata block, just fill the rest
 		printf( "new connection contents: %p(%p),%d\n", _connection, block->connection, _closeOnFinalize);
 		if ( _closeOnFinalize >= 0 )
@@ -63,9 +85,40 @@ int push_dbus_connection( lua_State * const _L, DBusConnection * const _connecti
 
 //################################################################################
 
+int bind_dbus_connection_open( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	luaL_argcheck( _L, lua_isstring( _L, 1), 1, "must provide connection address");
+	char const * const address = lua_tostring( _L, 1);
+	DBusError error;
+	dbus_error_init( &error);
+	DBusConnection * const connection = dbus_connection_open_private( address, &error);
+	// in case of error, return NIL instead of the connection userdata, plus error messages
+	if ( connection == 0x0 )
+	{
+		lua_pushnil( _L);
+		if ( dbus_error_is_set( &error) )
+		{
+			lua_pushstring( _L, error.name);
+			lua_pushstring( _L, error.message);
+			dbus_error_free( &error);
+		}
+		else
+		{
+			lua_pushliteral( _L, "unknown error");
+			lua_pushliteral( _L, "NULL connection, but no error was reported");
+		}
+		return 3;
+	}
+	// a private connection must be closed before it is released
+	return push_dbus_connection( _L, connection, 1);
+}
+
+//################################################################################
+
 static ConnectionUserdata * cast_to_dbus_connection_userdata( lua_State * const _L, int const _ndx)
 {
-	return (ConnectionUserdata *) utils_cast_userdata( _L, _ndx, gConnectionMetatableRef);
+	return (ConnectionUserdata *) utils_cast_userdata( _L, _ndx, gConnectionMetatableKey);
 }
 
 //################################################################################
@@ -79,7 +132,13 @@ int finalize_dbus_connection( lua_State * const _L)
 
 	printf( "finalize_dbus_connection: connection=%p\n", connectionUD->connection);
 
+	finalize_accounting_data( connectionUD);
 	finalize_filter_data( _L, connectionUD);
+	finalize_capture_data( connectionUD);
+	finalize_reply_cache_data( connectionUD);
+	finalize_priority_data( connectionUD);
+	finalize_rate_limit_data( connectionUD);
+	finalize_reply_table_data( connectionUD);
 	if ( connectionUD->closeOnFinalize != 0 )
 	{
 		printf( "closing connection: %d\n", connectionUD->closeOnFinalize);
@@ -107,9 +166,9 @@ static luaL_Reg gConnectionMeta[] =
 void register_connection_stuff( lua_State * const _L)
 {
 	// register the connection object metatable in the registry
-	utils_prepare_metatable( _L, &gConnectionMetatableRef);              // {meta}
-	utils_register_upvalued_functions( _L, gSharedConnectionMeta, gConnectionMetatableRef);
+	utils_prepare_metatable( _L, gConnectionMetatableKey);               // {meta}
+	utils_register_upvalued_functions( _L, gSharedConnectionMeta, gConnectionMetatableKey);
 	// replace/add whatever is specific to a non-bus connection
-	utils_register_upvalued_functions( _L, gConnectionMeta, gConnectionMetatableRef);
+	utils_register_upvalued_functions( _L, gConnectionMeta, gConnectionMetatableKey);
 	lua_pop( _L, 1);                                                     //
 }
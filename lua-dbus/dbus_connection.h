@@ -3,6 +3,7 @@
 
 //################################################################################
 
+extern int bind_dbus_connection_open( lua_State * const _L);
 extern void register_connection_stuff( lua_State * const _L);
 
 //################################################################################
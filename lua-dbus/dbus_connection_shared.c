@@ -27,52 +27,68 @@
 #include <lua.h>
 #include <lauxlib.h>
 #include <memory.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "utils.h"
 #include "dbus_connection_shared.h"
+#include "dbus_capture.h"
+#include "dbus_histogram.h"
+#include "dbus_name_owner.h"
+#include "dbus_pool.h"
+#include "dbus_priority.h"
+#include "dbus_rate_limit.h"
+#include "dbus_reply_cache.h"
+#include "dbus_reply_table.h"
 
 //################################################################################
 // contains bindings that are shared by the 'bus' and 'connection' types
 // since a bus is just a connection with a few constraints and specific APIs
 //################################################################################
 
-extern int gBusMetatableRef;
-extern int gConnectionMetatableRef;
+extern char const gBusMetatableKey[];
+extern char const gConnectionMetatableKey[];
+extern char const gMessageMetatableKey[];
 extern DBusMessage * cast_to_dbus_message( lua_State * const _L,  int const _ndx);
 extern int push_dbus_message( lua_State * const _L, DBusMessage * const _message);
+extern int push_referenced_dbus_message( lua_State * const _L, DBusMessage * const _message);
+
+// the daemon tells us when a unique name goes away, so that its rate limiting buckets can too
+#define SENDER_GONE_MATCH_RULE "type='signal',sender='" DBUS_SERVICE_DBUS "',path='" DBUS_PATH_DBUS "',interface='" DBUS_INTERFACE_DBUS "',member='NameOwnerChanged',arg2=''"
 
 //################################################################################
 //################################################################################
 
-DBusConnection * extract_dbus_connection_pointer( lua_State * const _L, int const _ndx, int const _whichMeta)
+DBusConnection * extract_dbus_connection_pointer( lua_State * const _L, int const _ndx, char const * const _whichMeta)
 {
 	// note that all this could be replaced by the following single line, but I like to check for errors...
 	// in that case, I wouldn't even need to register an upvalue with the bound functions
 	// FASTER VERSION: return *(DBusConnection **) lua_touserdata( _L, _ndx);
 	lua_pushvalue( _L, lua_upvalueindex(1));
 	luaL_checktype( _L, -1, LUA_TLIGHTUSERDATA);
-	int const metaRef = (int) lua_touserdata( _L, -1);
+	char const * const metaKey = (char const *) lua_touserdata( _L, -1);
 	lua_pop( _L, 1);
 	// raise an error if necessary
-	if ( (_whichMeta < 0) ? (metaRef != gBusMetatableRef && metaRef != gConnectionMetatableRef) : (metaRef != _whichMeta) )
+	if ( (_whichMeta == 0x0) ? (metaKey != gBusMetatableKey && metaKey != gConnectionMetatableKey) : (metaKey != _whichMeta) )
 		return luaL_error( _L, "internal error, wrong metatable reference in upvalue"), (DBusConnection *) 0x0;
 	// by convention, the C-side object pointer is always at the beginning of the userdata block
-	return *(DBusConnection **) utils_cast_userdata( _L, _ndx, metaRef);
+	return *(DBusConnection **) utils_cast_userdata( _L, _ndx, metaKey);
 }
 
 //################################################################################
 
-static ConnectionUserdata * extract_dbus_connection_userdata( lua_State * const _L, int const _ndx, int const _whichMeta)
+static ConnectionUserdata * extract_dbus_connection_userdata( lua_State * const _L, int const _ndx, char const * const _whichMeta)
 {
 	// note that all this could be replaced by the following single line, but I like to check for errors...
 	// in that case, I wouldn't even need to register an upvalue with the bound functions
 	// FASTER VERSION: return (ConnectionUserdata *) lua_touserdata( _L, _ndx);
 	lua_pushvalue( _L, lua_upvalueindex(1));
 	luaL_checktype( _L, -1, LUA_TLIGHTUSERDATA);
-	int const metaRef = (int) lua_touserdata( _L, -1);
+	char const * const metaKey = (char const *) lua_touserdata( _L, -1);
 	lua_pop( _L, 1);
 	// raise an error if necessary
-	if ( (_whichMeta < 0) ? (metaRef != gBusMetatableRef && metaRef != gConnectionMetatableRef) : (metaRef != _whichMeta) )
+	if ( (_whichMeta == 0x0) ? (metaKey != gBusMetatableKey && metaKey != gConnectionMetatableKey) : (metaKey != _whichMeta) )
 		return luaL_error( _L, "internal error, wrong metatable reference in upvalue"), (ConnectionUserdata *) 0x0;
 	// by convention, the C-side object pointer is always at the beginning of the userdata block
 	return (ConnectionUserdata *) lua_touserdata( _L, _ndx);
@@ -81,53 +97,466 @@ static ConnectionUserdata * extract_dbus_connection_userdata( lua_State * const
 //################################################################################
 //################################################################################
 
-// filters can be added to a connection
-// of course, la lua binding will want to add lua filters, and we need a C filter
-// that will be in charge of invoking them
-DBusHandlerResult private_call_lua_filters( DBusConnection *_connection, DBusMessage *_message, void *_user_data)
+// everything that goes in or out through the binding is accounted for here
+// called from the filter below, and for the messages that never go through the filters: popped, stolen, or the reply of a pending call
+static void private_message_received( ConnectionUserdata * const _ud, DBusMessage * const _message)
+{
+	int const type = dbus_message_get_type( _message);
+	++ _ud->stats.nbMessagesReceived;
+	if ( type < DBUS_NUM_MESSAGE_TYPES )
+		++ _ud->stats.nbReceivedByType[type];
+	if ( _ud->capture != 0x0 )
+		capture_write( _ud->capture, _message, CAPTURE_DIRECTION_IN);
+}
+
+//################################################################################
+
+// added when the userdata is created, before any other filter, so it sees every dispatched message,
+// even those a later filter turns away
+static DBusHandlerResult private_account_received( DBusConnection *_connection, DBusMessage *_message, void *_user_data)
+{
+	private_message_received( (ConnectionUserdata *) _user_data, _message);
+	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+//################################################################################
+
+static void private_message_sent( ConnectionUserdata * const _ud, DBusMessage * const _message)
+{
+	int const type = dbus_message_get_type( _message);
+	++ _ud->stats.nbMessagesSent;
+	if ( type < DBUS_NUM_MESSAGE_TYPES )
+		++ _ud->stats.nbSentByType[type];
+	if ( _ud->capture != 0x0 )
+		capture_write( _ud->capture, _message, CAPTURE_DIRECTION_OUT);
+}
+
+//################################################################################
+
+// answer a method call from the reply cache if possible, returns 1 if it was
+static int private_answer_from_cache( ConnectionUserdata * const _ud, DBusMessage * const _call)
+{
+	if ( _ud->replyCache == 0x0 )
+		return 0;
+	DBusMessage * const reply = reply_cache_answer( _ud->replyCache, _call);
+	if ( reply == 0x0 )
+		return 0;
+	if ( dbus_connection_send( _ud->connection, reply, 0x0) )
+		private_message_sent( _ud, reply);
+	dbus_message_unref( reply);
+	return 1;
+}
+
+//################################################################################
+
+// a popped message skips the C filters, so it is given what they would have done with it:
+// replies to conn:call_async() calls go to the reply table (their callbacks run on the next
+// dispatch or conn:deliver_replies()), memoized calls are answered from the cache
+// returns 1 if the message was consumed that way
+static int private_consume_popped( ConnectionUserdata * const _ud, DBusMessage * const _message)
+{
+	if ( _ud->replyTable != 0x0 && reply_table_answer( _ud->replyTable, _message, utils_get_monotonic_time_ns()) != 0x0 )
+		return 1;
+	return private_answer_from_cache( _ud, _message);
+}
+
+//################################################################################
+
+// returns 1 if the message may reach the lua filters, else refuses it: calls get an error reply, signals are dropped
+// disconnections reported by the daemon are checked on the way, to expire the buckets of the senders that left
+static int private_admit( ConnectionUserdata * const _ud, DBusMessage * const _message)
+{
+	RateLimiter * const limiter = _ud->rateLimiter;
+	if ( limiter->watchesSenders && dbus_message_is_signal( _message, DBUS_INTERFACE_DBUS, "NameOwnerChanged") && dbus_message_has_sender( _message, DBUS_SERVICE_DBUS) )
+	{
+		char const *name, *oldOwner, *newOwner;
+		if ( dbus_message_get_args( _message, 0x0, DBUS_TYPE_STRING, &name, DBUS_TYPE_STRING, &oldOwner, DBUS_TYPE_STRING, &newOwner, DBUS_TYPE_INVALID) && name[0] == ':' && newOwner[0] == '\0' )
+			rate_limiter_forget( limiter, name);
+	}
+	if ( rate_limiter_admit( limiter, _message, utils_get_monotonic_time_ns()) )
+		return 1;
+	if ( dbus_message_get_type( _message) == DBUS_MESSAGE_TYPE_METHOD_CALL && !dbus_message_get_no_reply( _message) )
+	{
+		DBusMessage * const reply = dbus_message_new_error( _message, DBUS_ERROR_LIMITS_EXCEEDED, "Too many requests, slow down");
+		if ( reply != 0x0 && dbus_connection_send( _ud->connection, reply, 0x0) )
+			private_message_sent( _ud, reply);
+		if ( reply != 0x0 )
+			dbus_message_unref( reply);
+	}
+	return 0;
+}
+
+//################################################################################
+
+// installed along with the rate limiter: the lua filter chain runs the limiter before any lua filter,
+// but without lua filters nothing else would, and libdbus would dispatch the flood as usual
+static DBusHandlerResult private_limit_rates( DBusConnection *_connection, DBusMessage *_message, void *_user_data)
+{
+	ConnectionUserdata * const ud = (ConnectionUserdata *) _user_data;
+	return private_admit( ud, _message) ? DBUS_HANDLER_RESULT_NOT_YET_HANDLED : DBUS_HANDLER_RESULT_HANDLED;
+}
+
+//################################################################################
+//################################################################################
+
+// what a filter added with a rules table wants to see
+// checked in C, so that filters don't have to enter lua just to ignore a message
+struct FilterPredicate
+{
+	int type;
+	// the strings live in the same block, right after the predicate; 0x0 matches anything
+	char *sender;
+	char *path;
+	char *interface;
+	char *member;
+	char *destination;
+};
+typedef struct FilterPredicate FilterPredicate;
+
+//################################################################################
+
+// build a predicate from the rules table at _ndx, same fields as bus:add_match()
+// on a bus, the owner of a well-known sender is resolved now, so that matching never asks the daemon
+// the predicate is a userdata left on the stack: whatever raises an error later on, nothing leaks
+static FilterPredicate * private_compile_predicate( lua_State * const _L, int const _ndx, ConnectionUserdata * const _ud)
+{
+	static char const * const fields[] = { "sender", "path", "interface", "member", "destination" };
+	static dbus_bool_t (* const validators[])( char const *, DBusError *) = { dbus_validate_bus_name, dbus_validate_path, dbus_validate_interface, dbus_validate_member, dbus_validate_bus_name };
+	char const *values[5];
+	size_t sizes[5];
+	size_t blockSize = sizeof( FilterPredicate);
+	int type = DBUS_MESSAGE_TYPE_INVALID;
+	luaL_checktype( _L, _ndx, LUA_TTABLE);
+	lua_getfield( _L, _ndx, "type");                                                // ... type?
+	if ( !lua_isnil( _L, -1) )
+	{
+		// 'signal', 'method_call', 'method_return' or 'error'
+		type = dbus_message_type_from_string( luaL_checkstring( _L, -1));
+		if ( type == DBUS_MESSAGE_TYPE_INVALID )
+			return luaL_error( _L, "'%s' is not a valid type", lua_tostring( _L, -1)), (FilterPredicate *) 0x0;
+	}
+	lua_pop( _L, 1);                                                                // ...
+	int i;
+	for ( i = 0; i < 5; ++ i)
+	{
+		// the strings stay on the stack until they are copied
+		lua_getfield( _L, _ndx, fields[i]);                                          // ... value?
+		values[i] = 0x0;
+		if ( lua_isnil( _L, -1) )
+			continue;
+		if ( lua_type( _L, -1) != LUA_TSTRING )
+			return luaL_error( _L, "'%s' is not a string", fields[i]), (FilterPredicate *) 0x0;
+		values[i] = lua_tolstring( _L, -1, &sizes[i]);
+		if ( !validators[i]( values[i], 0x0) )
+			return luaL_error( _L, "'%s' is not a valid %s", values[i], fields[i]), (FilterPredicate *) 0x0;
+		blockSize += sizes[i] + 1;
+	}
+	FilterPredicate * const predicate = (FilterPredicate *) lua_newuserdata( _L, blockSize);        // ... v1..v5 P
+	predicate->type = type;
+	char *caret = (char *) (predicate + 1);
+	char ** const strings[] = { &predicate->sender, &predicate->path, &predicate->interface, &predicate->member, &predicate->destination };
+	for ( i = 0; i < 5; ++ i)
+	{
+		*strings[i] = 0x0;
+		if ( values[i] == 0x0 )
+			continue;
+		memcpy( caret, values[i], sizes[i] + 1);
+		*strings[i] = caret;
+		caret += sizes[i] + 1;
+	}
+	lua_insert( _L, -6);                                                            // ... P v1..v5
+	lua_pop( _L, 5);                                                                // ... P
+	if ( predicate->sender != 0x0 && dbus_bus_get_unique_name( _ud->connection) != 0x0 )
+	{
+		DBusError error;
+		char const *owner;
+		dbus_error_init( &error);
+		if ( !name_owner_resolve( _L, 1, _ud, predicate->sender, &owner, &error) )
+		{
+			lua_pushfstring( _L, "failed to resolve %s: %s %s", predicate->sender, error.name, error.message);
+			dbus_error_free( &error);
+			return lua_error( _L), (FilterPredicate *) 0x0;
+		}
+	}
+	return predicate;
+}
+
+//################################################################################
+
+static int private_predicate_matches( ConnectionUserdata * const _ud, FilterPredicate const * const _predicate, DBusMessage * const _message)
 {
-	lua_State * const L = (lua_State *) _user_data;
+	if ( _predicate->type != DBUS_MESSAGE_TYPE_INVALID && dbus_message_get_type( _message) != _predicate->type )
+		return 0;
+	if ( _predicate->path != 0x0 && !dbus_message_has_path( _message, _predicate->path) )
+		return 0;
+	if ( _predicate->interface != 0x0 && !dbus_message_has_interface( _message, _predicate->interface) )
+		return 0;
+	if ( _predicate->member != 0x0 && !dbus_message_has_member( _message, _predicate->member) )
+		return 0;
+	if ( _predicate->destination != 0x0 && !dbus_message_has_destination( _message, _predicate->destination) )
+		return 0;
+	if ( _predicate->sender != 0x0 )
+	{
+		char const * const sender = dbus_message_get_sender( _message);
+		char const *owner;
+		if ( sender == 0x0 )
+			return 0;
+		if ( strcmp( sender, _predicate->sender) == 0 )
+			return 1;
+		// messages carry the unique name of their sender: well-known names go through the owner cache
+		return _predicate->sender[0] != ':'
+			&& _ud->nameOwners != 0x0
+			&& name_owner_cache_lookup( _ud->nameOwners, _predicate->sender, &owner)
+			&& owner != 0x0
+			&& strcmp( owner, sender) == 0;
+	}
+	return 1;
+}
+
+//################################################################################
+
+// run the lua filters on a message, in the order they were added
+static DBusHandlerResult private_run_lua_filters( ConnectionUserdata * const ud, DBusMessage * const _message)
+{
+	lua_State * const L = ud->filterState;
 	// fetch the userdata object associated with this connection
-	utils_fetch_userdata( L, _connection);                          // U
-	// grab a pointer
-	ConnectionUserdata * const ud = extract_dbus_connection_userdata( L, -1, -1);
+	utils_fetch_userdata( L, ud->connection);                       // U
 	// create a userdata for the message object we got
-	push_dbus_message( L, _message);                                // U msg
+	// libdbus keeps its own reference on the message, the userdata needs another one
+	dbus_message_ref( _message);
+	push_referenced_dbus_message( L, _message);                     // U msg
 	// fetch the userdata's environment
 	lua_getfenv( L, -2);                                            // U msg {env}
 	// fetch the filters table
 	lua_getfield( L, -1, "filters");                                // U msg {env} {filters}
+	dbus_uint64_t const chainStart = utils_get_monotonic_time_ns();
+	dbus_uint64_t filterStart = chainStart;
 	int index;
 	for( index = 0; index < ud->nbRegisteredFilters; ++ index)
 	{
-		lua_rawgeti( L, -1, ud->filterCallSequence[index]);          // U msg {env} {filters} filter
+		FilterPredicate const * const predicate = ud->filterPredicates[index];
+		if ( predicate != 0x0 && !private_predicate_matches( ud, predicate, _message) )
+		{
+			++ ud->stats.nbFilterSkipped;
+			continue;
+		}
+		int const ref = ud->filterCallSequence[index];
+		lua_rawgeti( L, -1, ref);                                    // U msg {env} {filters} filter
 		lua_pushvalue( L, -5);                                       // U msg {env} {filters} filter U
 		lua_pushvalue( L, -5);                                       // U msg {env} {filters} filter U msg
+		++ ud->stats.nbFilterInvocations;
 		// call the filter with two arguments (the connection and the message), expect 1 return value, no error handler
 		int const success = lua_pcall( L, 2, 1, 0);                  // U msg {env} {filters} retval
+		dbus_uint64_t const filterEnd = utils_get_monotonic_time_ns();
+		// the filter may have added or removed filters, itself included: the sample goes to wherever it is now, if anywhere
+		int slot = ( index < ud->nbRegisteredFilters && ud->filterCallSequence[index] == ref ) ? index : 0;
+		if ( slot != index )
+		{
+			while ( slot < ud->nbRegisteredFilters && ud->filterCallSequence[slot] != ref )
+				++ slot;
+		}
+		if ( slot < ud->nbRegisteredFilters )
+			histogram_record( &ud->filterLatencies[slot], filterEnd - filterStart);
+		filterStart = filterEnd;
 		if ( success == 0 )
 		{
 			DBusHandlerResult hresult = utils_convert_to_handler_result( L, -1);
 			if ( hresult == DBUS_HANDLER_RESULT_NEED_MEMORY || hresult == DBUS_HANDLER_RESULT_HANDLED)
 			{
+				if ( hresult == DBUS_HANDLER_RESULT_HANDLED )
+					++ ud->stats.nbFilterHandled;
+				histogram_record( ud->filterChainLatency, filterStart - chainStart);
 				lua_pop( L, 5);                                        //
 				return hresult;
 			}
 		}
 		else
 		{
-			// some internal error occured with the pcall processing
-			// tell the filter engine to stop filtering stuff
-			lua_pop( L, 5);                                           //
-			return luaL_error( L, "internal error will calling handlers!"), DBUS_HANDLER_RESULT_HANDLED;
+			// some error occured with the pcall processing
+			// we can't raise it from here since libdbus is in the middle of dispatching,
+			// so keep it until dispatch returns, and tell the filter engine to stop filtering stuff
+			++ ud->stats.nbFilterErrors;
+			histogram_record( ud->filterChainLatency, filterStart - chainStart);
+			lua_setfield( L, -3, "filter_error");                     // U msg {env} {filters}
+			lua_pop( L, 4);                                           //
+			return DBUS_HANDLER_RESULT_HANDLED;
 		}
 		lua_pop( L, 1);                                              // U msg {env} {filters}
 	}
 	// if we get here, this means that no filter handled the message so far
+	histogram_record( ud->filterChainLatency, filterStart - chainStart);
 	lua_pop( L, 4);                                                 //
 	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
 
+//################################################################################
+
+// filters can be added to a connection
+// of course, la lua binding will want to add lua filters, and we need a C filter
+// that will be in charge of invoking them
+static DBusHandlerResult private_call_lua_filters( DBusConnection *_connection, DBusMessage *_message, void *_user_data)
+{
+	ConnectionUserdata * const ud = (ConnectionUserdata *) _user_data;
+	// a lua filter may swallow NameOwnerChanged before the cache's own filter sees it
+	if ( ud->nameOwners != 0x0 )
+		name_owner_observe( ud->nameOwners, _message);
+	// replies to conn:call_async() calls wait in the reply table for their callback
+	if ( ud->replyTable != 0x0 && reply_table_answer( ud->replyTable, _message, utils_get_monotonic_time_ns()) != 0x0 )
+		return DBUS_HANDLER_RESULT_HANDLED;
+	// flooding senders are turned away before anything else is done for them
+	if ( ud->rateLimiter != 0x0 && !private_admit( ud, _message) )
+		return DBUS_HANDLER_RESULT_HANDLED;
+	// memoized replies don't need to bother the lua side
+	if ( private_answer_from_cache( ud, _message) )
+		return DBUS_HANDLER_RESULT_HANDLED;
+	// low priority and coalesced messages are parked, and filtered once libdbus has nothing else queued
+	PriorityStage * const stage = ud->priorityStage;
+	if ( stage != 0x0 && priority_stage_should_park( stage, _message) && priority_stage_push( stage, _message) )
+	{
+		// the other C filters still see signals now, but a call must not get libdbus' default error reply
+		return ( dbus_message_get_type( _message) == DBUS_MESSAGE_TYPE_SIGNAL ) ? DBUS_HANDLER_RESULT_NOT_YET_HANDLED : DBUS_HANDLER_RESULT_HANDLED;
+	}
+	return private_run_lua_filters( ud, _message);
+}
+
+//################################################################################
+
+// filter the oldest message parked by the priority stage, returns 0 if there was none
+static int private_dispatch_parked( ConnectionUserdata * const _ud)
+{
+	DBusMessage * const message = ( _ud->priorityStage != 0x0 ) ? priority_stage_pop( _ud->priorityStage) : 0x0;
+	if ( message == 0x0 )
+		return 0;
+	// the filters may all be gone since the message was parked
+	DBusHandlerResult const result = ( _ud->nbRegisteredFilters > 0 ) ? private_run_lua_filters( _ud, message) : DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	// answer unhandled calls like libdbus would have done
+	if ( result == DBUS_HANDLER_RESULT_NOT_YET_HANDLED && dbus_message_get_type( message) == DBUS_MESSAGE_TYPE_METHOD_CALL && !dbus_message_get_no_reply( message) )
+	{
+		DBusMessage * const reply = dbus_message_new_error_printf( message, DBUS_ERROR_UNKNOWN_METHOD, "No filter handled method %s", dbus_message_get_member( message));
+		if ( reply != 0x0 && dbus_connection_send( _ud->connection, reply, 0x0) )
+			private_message_sent( _ud, reply);
+		if ( reply != 0x0 )
+			dbus_message_unref( reply);
+	}
+	dbus_message_unref( message);
+	return 1;
+}
+
+//################################################################################
+
+// what libdbus says, except that parked messages still have to be dispatched
+static DBusDispatchStatus private_get_dispatch_status( ConnectionUserdata * const _ud)
+{
+	DBusDispatchStatus const status = dbus_connection_get_dispatch_status( _ud->connection);
+	if ( status == DBUS_DISPATCH_COMPLETE && _ud->priorityStage != 0x0 && _ud->priorityStage->count > 0 )
+		return DBUS_DISPATCH_DATA_REMAINS;
+	return status;
+}
+
+//################################################################################
+
+// dispatch one message: whatever libdbus has queued first, then what the priority stage parked
+static DBusDispatchStatus private_dispatch_one( ConnectionUserdata * const _ud)
+{
+	if ( dbus_connection_get_dispatch_status( _ud->connection) == DBUS_DISPATCH_DATA_REMAINS )
+		dbus_connection_dispatch( _ud->connection);
+	else
+		private_dispatch_parked( _ud);
+	return private_get_dispatch_status( _ud);
+}
+
+//################################################################################
+
+// raise the error a filter may have stored while the connection at _ndx was dispatching
+static int private_raise_filter_error( lua_State * const _L, int const _ndx)
+{
+	lua_getfenv( _L, _ndx);                                         // {env}
+	lua_getfield( _L, -1, "filter_error");                          // {env} error?
+	if ( lua_isnil( _L, -1) )
+	{
+		lua_pop( _L, 2);                                             //
+		return 0;
+	}
+	lua_pushnil( _L);                                               // {env} error nil
+	lua_setfield( _L, -3, "filter_error");                          // {env} error
+	return luaL_error( _L, "error while calling filters: %s", lua_tostring( _L, -1));
+}
+
+//################################################################################
+
+// catches the replies to conn:call_async() calls, and fails them all when the connection goes away
+// the lua filters check the table too, so a reply is taken by whichever of the two runs first
+static DBusHandlerResult private_collect_replies( DBusConnection *_connection, DBusMessage *_message, void *_user_data)
+{
+	ConnectionUserdata * const ud = (ConnectionUserdata *) _user_data;
+	if ( dbus_message_is_signal( _message, DBUS_INTERFACE_LOCAL, "Disconnected") )
+	{
+		reply_table_fail_all( ud->replyTable);
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	}
+	return ( reply_table_answer( ud->replyTable, _message, utils_get_monotonic_time_ns()) != 0x0 ) ? DBUS_HANDLER_RESULT_HANDLED : DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+//################################################################################
+
+// the error a call gets when it leaves the reply table without a reply, like libdbus would make it
+static DBusMessage * private_new_reply_failure( PendingReply const * const _pending)
+{
+	int const timedOut = ( _pending->status == PENDING_REPLY_TIMED_OUT );
+	char const * const text = timedOut ? "Did not receive a reply before the timeout expired" : "Connection was closed before a reply was received";
+	DBusMessage * const error = dbus_message_new( DBUS_MESSAGE_TYPE_ERROR);
+	if ( error == 0x0 )
+		return 0x0;
+	if (
+		!dbus_message_set_error_name( error, timedOut ? DBUS_ERROR_NO_REPLY : DBUS_ERROR_DISCONNECTED)
+		|| !dbus_message_set_reply_serial( error, _pending->serial)
+		|| !dbus_message_append_args( error, DBUS_TYPE_STRING, &text, DBUS_TYPE_INVALID)
+	)
+	{
+		dbus_message_unref( error);
+		return 0x0;
+	}
+	dbus_message_set_no_reply( error, TRUE);
+	return error;
+}
+
+//################################################################################
+
+// expire the calls whose timeout is over, then call the callbacks of all the calls that are done,
+// in the order they completed, with ( conn, reply or error); returns the number of callbacks called
+// runs outside of libdbus' dispatching, so errors raised by the callbacks simply propagate
+static int private_deliver_replies( lua_State * const _L, int const _ndx, ConnectionUserdata * const _ud)
+{
+	ReplyTable * const table = _ud->replyTable;
+	if ( table == 0x0 )
+		return 0;
+	reply_table_advance( table, utils_get_monotonic_time_ns() / 1000000);
+	if ( table->readyHead == 0x0 )
+		return 0;
+	lua_getfenv( _L, _ndx);                                         // {env}
+	lua_getfield( _L, -1, "pending_calls");                         // {env} {pending_calls}
+	int count = 0;
+	PendingReply *pending;
+	while ( (pending = reply_table_pop_ready( table)) != 0x0 )
+	{
+		lua_Number const serial = pending->serial;
+		lua_rawgeti( _L, -1, pending->callbackRef);                  // {env} {pending_calls} f
+		luaL_unref( _L, -2, pending->callbackRef);
+		// the table's reference on the reply goes to the message userdata
+		DBusMessage * const message = ( pending->reply != 0x0 ) ? pending->reply : private_new_reply_failure( pending);
+		pending->reply = 0x0;
+		reply_table_release( pending);
+		if ( message == 0x0 )
+			return luaL_error( _L, "not enough memory to fail call %f", serial);
+		lua_pushvalue( _L, _ndx);                                    // {env} {pending_calls} f U
+		push_referenced_dbus_message( _L, message);                  // {env} {pending_calls} f U msg
+		++ count;
+		lua_call( _L, 2, 0);                                         // {env} {pending_calls}
+	}
+	lua_pop( _L, 2);                                                //
+	return count;
+}
+
 //################################################################################
 //################################################################################
 
@@ -137,29 +566,72 @@ int bind_dbus_connection_add_filter( lua_State * const _L)
 	void *allocUserData;
 	lua_Alloc allocFunction = lua_getallocf( _L, &allocUserData);
 
-	// should have two arguments: the connection, and the filter function
-	utils_check_nargs( _L, 2);                                                      // U f
+	// should have two or three arguments: the connection, the filter function, and an optional rules table
+	if ( lua_gettop( _L) != 3 )
+		utils_check_nargs( _L, 2);                                                   // U f [rules]
 	// this will raise an error if argument #1 is not a connection or a bus
-	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, -1);
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
+	luaL_checktype( _L, 2, LUA_TFUNCTION);
+	// the filter is only called for messages matching the rules, if any
+	lua_settop( _L, 3);                                                             // U f rules?
+	FilterPredicate * const predicate = lua_isnil( _L, 3) ? 0x0 : private_compile_predicate( _L, 3, ud);
+	lua_settop( _L, predicate != 0x0 ? 4 : 3);                                      // U f rules? P?
+	lua_replace( _L, 3);                                                            // U f P?
 	// filters are functions that we call in sequence
 	// we store them in a table inside the userdata's environment table
 	// first, create this infrastructure if it doesn't exist yet
-	lua_getfenv( _L, -2);                                                           // U f {env}
-	lua_getfield( _L, -1, "filters");                                               // U f {env} {nil/filters?}
+	lua_getfenv( _L, 1);                                                            // U f P? {env}
+	lua_getfield( _L, -1, "filters");                                               // U f P? {env} {nil/filters?}
 	if ( lua_isnil( _L, -1) )
 	{
-		lua_pop( _L, 1);                                                             // U f {env}
-		lua_newtable( _L);                                                           // U f {env} {filters}
-		lua_pushvalue( _L, -1);                                                      // U f {env} {filters} {filters}
-		lua_setfield( _L, -3, "filters");                                            // U f {env} {filters}
+		lua_pop( _L, 1);                                                             // U f P? {env}
+		lua_newtable( _L);                                                           // U f P? {env} {filters}
+		lua_pushvalue( _L, -1);                                                      // U f P? {env} {filters} {filters}
+		lua_setfield( _L, -3, "filters");                                            // U f P? {env} {filters}
 	}
 	// here we are sure we have an environment, with a table named "filters"
+	// the predicate lives as long as the filter, in a table of its own keyed by its address
+	if ( predicate != 0x0 )
+	{
+		lua_getfield( _L, -2, "filter_predicates");                                  // U f P {env} {filters} {predicates}?
+		if ( lua_isnil( _L, -1) )
+		{
+			lua_pop( _L, 1);                                                          // U f P {env} {filters}
+			lua_newtable( _L);                                                        // U f P {env} {filters} {predicates}
+			lua_pushvalue( _L, -1);                                                   // U f P {env} {filters} {predicates} {predicates}
+			lua_setfield( _L, -4, "filter_predicates");                               // U f P {env} {filters} {predicates}
+		}
+		lua_pushlightuserdata( _L, predicate);                                       // U f P {env} {filters} {predicates} p
+		lua_pushvalue( _L, 3);                                                       // U f P {env} {filters} {predicates} p P
+		lua_rawset( _L, -3);                                                         // U f P {env} {filters} {predicates}
+		lua_pop( _L, 1);                                                             // U f P {env} {filters}
+	}
+	// the first lua filter installs the C filter that runs them all
+	if ( ud->nbRegisteredFilters == 0 )
+	{
+		if ( !dbus_connection_add_filter( ud->connection, private_call_lua_filters, ud, 0x0) )
+			return luaL_error( _L, "not enough memory to add a filter");
+		ud->filterState = _L;
+		// make sure the state we run the filters in stays alive as long as they are installed
+		lua_pushthread( _L);                                                         // U f P? {env} {filters} thread
+		lua_setfield( _L, -3, "filter_state");                                       // U f P? {env} {filters}
+		// the chain histogram survives the filters, it is only released with the connection
+		if ( ud->filterChainLatency == 0x0 )
+		{
+			ud->filterChainLatency = allocFunction( allocUserData, 0x0, 0, sizeof(Histogram));
+			histogram_reset( ud->filterChainLatency);
+		}
+	}
 	// grow our array of call sequence by one slot
 	ud->filterCallSequence = allocFunction( allocUserData, ud->filterCallSequence, ud->nbRegisteredFilters * sizeof(int), (ud->nbRegisteredFilters + 1) * sizeof(int));
-	lua_pushvalue( _L, 2);                                                          // U f {env} {filters} f
-	ud->filterCallSequence[ud->nbRegisteredFilters] = luaL_ref( _L, -2);            // U f {env} {filters}
+	ud->filterLatencies = allocFunction( allocUserData, ud->filterLatencies, ud->nbRegisteredFilters * sizeof(Histogram), (ud->nbRegisteredFilters + 1) * sizeof(Histogram));
+	ud->filterPredicates = allocFunction( allocUserData, ud->filterPredicates, ud->nbRegisteredFilters * sizeof(FilterPredicate *), (ud->nbRegisteredFilters + 1) * sizeof(FilterPredicate *));
+	ud->filterPredicates[ud->nbRegisteredFilters] = predicate;
+	histogram_reset( &ud->filterLatencies[ud->nbRegisteredFilters]);
+	lua_pushvalue( _L, 2);                                                          // U f P? {env} {filters} f
+	ud->filterCallSequence[ud->nbRegisteredFilters] = luaL_ref( _L, -2);            // U f P? {env} {filters}
 	++ ud->nbRegisteredFilters;
-	lua_pop( _L, 4);                                                                //
+	lua_settop( _L, 0);                                                             //
 	return 0;
 }
 
@@ -168,7 +640,7 @@ int bind_dbus_connection_add_filter( lua_State * const _L)
 int bind_dbus_connection_borrow_message( lua_State * const _L)
 {
 	utils_check_nargs( _L, 1);
-	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, -1);
+	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, 0x0);
 	DBusMessage * const message = dbus_connection_borrow_message( connection);
 	if( message == 0x0)
 	{
@@ -183,12 +655,367 @@ int bind_dbus_connection_borrow_message( lua_State * const _L)
 
 //################################################################################
 
+// the send-to-reply times of conn:call_async() and conn:call_many() calls, created on first use
+// without memory for it, the latencies just aren't recorded
+static Histogram * private_get_reply_latency( ConnectionUserdata * const _ud)
+{
+	if ( _ud->replyLatency == 0x0 )
+	{
+		_ud->replyLatency = (Histogram *) malloc( sizeof( Histogram));
+		if ( _ud->replyLatency != 0x0 )
+			histogram_reset( _ud->replyLatency);
+	}
+	return _ud->replyLatency;
+}
+
+//################################################################################
+
+// conn:call_async( msg, f [, timeout_ms]) -> serial
+// sends a method call without waiting, f( conn, reply) is called from dispatch(), dispatch_budget(),
+// read_write_dispatch() or deliver_replies() once the reply arrived, or with a NoReply error once the timeout
+// is over (25 s by default, 0x7fffffff never expires), or a Disconnected error if the connection goes away first
+int bind_dbus_connection_call_async( lua_State * const _L)
+{
+	if ( lua_gettop( _L) != 4 )
+		utils_check_nargs( _L, 3);                                                   // U msg f [timeout]
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
+	DBusMessage * const message = cast_to_dbus_message( _L,  2);
+	luaL_checktype( _L, 3, LUA_TFUNCTION);
+	int const timeout = luaL_optint( _L, 4, -1);
+	luaL_argcheck( _L, dbus_message_get_type( message) == DBUS_MESSAGE_TYPE_METHOD_CALL && !dbus_message_get_no_reply( message), 2, "expects a method call that wants a reply");
+	dbus_uint64_t const nowNs = utils_get_monotonic_time_ns();
+	if ( ud->replyTable == 0x0 )
+	{
+		ud->replyTable = reply_table_new( nowNs / 1000000);
+		if ( ud->replyTable == 0x0 )
+			return luaL_error( _L, "not enough memory to track calls");
+		if ( !dbus_connection_add_filter( ud->connection, private_collect_replies, ud, 0x0) )
+		{
+			reply_table_delete( ud->replyTable);
+			ud->replyTable = 0x0;
+			return luaL_error( _L, "not enough memory to track calls");
+		}
+		ud->replyTable->filterAdded = 1;
+		ud->replyTable->latency = private_get_reply_latency( ud);
+	}
+	lua_getfenv( _L, 1);                                                           // U msg f [timeout] {env}
+	lua_getfield( _L, -1, "pending_calls");                                        // U msg f [timeout] {env} {pending_calls}?
+	if ( lua_isnil( _L, -1) )
+	{
+		lua_pop( _L, 1);                                                             // U msg f [timeout] {env}
+		lua_newtable( _L);                                                           // U msg f [timeout] {env} {pending_calls}
+		lua_pushvalue( _L, -1);                                                      // U msg f [timeout] {env} {pending_calls} {pending_calls}
+		lua_setfield( _L, -3, "pending_calls");                                      // U msg f [timeout] {env} {pending_calls}
+	}
+	// everything that can fail is done before sending: a call on the wire is always tracked
+	lua_pushvalue( _L, 3);                                                         // U msg f [timeout] {env} {pending_calls} f
+	int const callbackRef = luaL_ref( _L, -2);                                     // U msg f [timeout] {env} {pending_calls}
+	PendingReply * const pending = reply_table_alloc();
+	if ( pending == 0x0 )
+	{
+		luaL_unref( _L, -1, callbackRef);
+		return luaL_error( _L, "not enough memory to track the call");
+	}
+	pending->callbackRef = callbackRef;
+	dbus_uint32_t serial;
+	if ( !dbus_connection_send( ud->connection, message, &serial) )
+	{
+		reply_table_release( pending);
+		luaL_unref( _L, -1, callbackRef);
+		return luaL_error( _L, "not enough memory to send the call");
+	}
+	private_message_sent( ud, message);
+	reply_table_add( ud->replyTable, pending, serial, nowNs, timeout);
+	lua_pushnumber( _L, serial);                                                   // U msg f [timeout] {env} {pending_calls} serial
+	return 1;
+}
+
+//################################################################################
+
+static void private_cancel_pending_calls( DBusPendingCall ** const _pendings, int const _count)
+{
+	int i;
+	for ( i = 0; i < _count; ++ i)
+	{
+		if ( _pendings[i] != 0x0 )
+		{
+			dbus_pending_call_cancel( _pendings[i]);
+			dbus_pending_call_unref( _pendings[i]);
+			_pendings[i] = 0x0;
+		}
+	}
+}
+
+//################################################################################
+
+// conn:call_many( { call1, call2, ...} [, timeout_ms]) -> { reply1, reply2, ...}
+// all the calls are queued back to back before waiting for the first reply, so the whole batch costs about
+// as much as its slowest call instead of the sum of all of them. replies come back indexed like the calls,
+// whatever order they arrived in: a method return, or an error message, NoReply for a call that timed out
+// other incoming messages stay queued for the next dispatch, no filter runs while we wait
+int bind_dbus_connection_call_many( lua_State * const _L)
+{
+	if ( lua_gettop( _L) != 3 )
+		utils_check_nargs( _L, 2);                                                   // U {calls} [timeout]
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
+	luaL_checktype( _L, 2, LUA_TTABLE);
+	int const timeout = luaL_optint( _L, 3, -1);
+	int const nbCalls = lua_objlen( _L, 2);
+	int i;
+	// a bad entry must not leave half the batch sent
+	for ( i = 1; i <= nbCalls; ++ i)
+	{
+		lua_rawgeti( _L, 2, i);                                                      // U {calls} [timeout] msg
+		DBusMessage * const call = cast_to_dbus_message( _L, -1);
+		if ( dbus_message_get_type( call) != DBUS_MESSAGE_TYPE_METHOD_CALL || dbus_message_get_no_reply( call) )
+			return luaL_error( _L, "call #%d is not a method call that wants a reply", i);
+		lua_pop( _L, 1);                                                             // U {calls} [timeout]
+	}
+	lua_settop( _L, 2);                                                            // U {calls}
+	lua_createtable( _L, nbCalls, 0);                                              // U {calls} {replies}
+	DBusPendingCall ** const pendings = (DBusPendingCall **) lua_newuserdata( _L, (nbCalls + 1) * sizeof( DBusPendingCall *)); // U {calls} {replies} pendings
+	dbus_uint64_t const batchStart = utils_get_monotonic_time_ns();
+	for ( i = 0; i < nbCalls; ++ i)
+	{
+		lua_rawgeti( _L, 2, i + 1);                                                  // U {calls} {replies} pendings msg
+		DBusMessage * const call = cast_to_dbus_message( _L, -1);
+		lua_pop( _L, 1);                                                             // U {calls} {replies} pendings
+		if ( !dbus_connection_send_with_reply( ud->connection, call, &pendings[i], timeout) )
+		{
+			private_cancel_pending_calls( pendings, i);
+			return luaL_error( _L, "not enough memory to send call #%d", i + 1);
+		}
+		// libdbus gives no pending call when the connection is already closed
+		if ( pendings[i] != 0x0 )
+			private_message_sent( ud, call);
+	}
+	dbus_connection_flush( ud->connection);
+	// the calls left back to back, their latency is measured from the start of the batch to when we get their reply
+	Histogram * const latency = private_get_reply_latency( ud);
+	// blocking on each in turn is fine: replies that arrive early are already there when we get to them
+	for ( i = 0; i < nbCalls; ++ i)
+	{
+		DBusMessage *reply = 0x0;
+		if ( pendings[i] != 0x0 )
+		{
+			dbus_pending_call_block( pendings[i]);
+			reply = dbus_pending_call_steal_reply( pendings[i]);
+			dbus_pending_call_unref( pendings[i]);
+			pendings[i] = 0x0;
+		}
+		if ( reply != 0x0 )
+		{
+			private_message_received( ud, reply);
+			if ( latency != 0x0 )
+				histogram_record( latency, utils_get_monotonic_time_ns() - batchStart);
+		}
+		else
+		{
+			lua_rawgeti( _L, 2, i + 1);                                                // U {calls} {replies} pendings msg
+			reply = dbus_message_new_error( cast_to_dbus_message( _L, -1), DBUS_ERROR_DISCONNECTED, "Connection was closed before a reply was received");
+			lua_pop( _L, 1);                                                           // U {calls} {replies} pendings
+			if ( reply == 0x0 )
+			{
+				private_cancel_pending_calls( pendings + i, nbCalls - i);
+				return luaL_error( _L, "not enough memory to fail call #%d", i + 1);
+			}
+		}
+		push_referenced_dbus_message( _L, reply);                                    // U {calls} {replies} pendings reply
+		lua_rawseti( _L, -3, i + 1);                                                 // U {calls} {replies} pendings
+	}
+	lua_pop( _L, 1);                                                               // U {calls} {replies}
+	return 1;
+}
+
+//################################################################################
+
+// conn:can_send_type( "h") tells if the peer accepts unix fds; other basic types are always accepted
+int bind_dbus_connection_can_send_type( lua_State * const _L)
+{
+	utils_check_nargs( _L, 2);
+	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, 0x0);
+	size_t length;
+	char const * const type = luaL_checklstring( _L, 2, &length);
+	luaL_argcheck( _L, length == 1 && dbus_type_is_valid( type[0]), 2, "expects a single type code");
+	lua_pushboolean( _L, dbus_connection_can_send_type( connection, type[0]) != 0);
+	return 1;
+}
+
+//################################################################################
+
+// conn:cancel_call( serial) -> true if the call was still waiting for its reply, its callback won't be called
+int bind_dbus_connection_cancel_call( lua_State * const _L)
+{
+	utils_check_nargs( _L, 2);
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
+	lua_Number const serial = luaL_checknumber( _L, 2);
+	PendingReply * const pending = ( ud->replyTable != 0x0 ) ? reply_table_cancel( ud->replyTable, (dbus_uint32_t) serial) : 0x0;
+	if ( pending != 0x0 )
+	{
+		lua_getfenv( _L, 1);                                                         // U serial {env}
+		lua_getfield( _L, -1, "pending_calls");                                      // U serial {env} {pending_calls}
+		luaL_unref( _L, -1, pending->callbackRef);
+		lua_pop( _L, 2);                                                             // U serial
+		reply_table_release( pending);
+	}
+	lua_pushboolean( _L, pending != 0x0);
+	return 1;
+}
+
+//################################################################################
+
+// conn:capture_start( path) -> true, or nil, error
+// appends every message sent or received from now on to the capture file at path
+int bind_dbus_connection_capture_start( lua_State * const _L)
+{
+	utils_check_nargs( _L, 2);
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
+	char const * const path = luaL_checkstring( _L, 2);
+	if ( ud->capture != 0x0 )
+		return luaL_error( _L, "this connection is already capturing");
+	char const * error = 0x0;
+	ud->capture = capture_open( path, &error);
+	if ( ud->capture == 0x0 )
+	{
+		lua_pushnil( _L);
+		lua_pushstring( _L, error);
+		return 2;
+	}
+	lua_pushboolean( _L, 1);
+	return 1;
+}
+
+//################################################################################
+
+// conn:capture_stop() -> number of captured messages, number of messages that could not be captured
+int bind_dbus_connection_capture_stop( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
+	if ( ud->capture == 0x0 )
+		return 0;
+	lua_pushnumber( _L, ud->capture->nbRecords);
+	lua_pushnumber( _L, ud->capture->nbErrors);
+	finalize_capture_data( ud);
+	return 2;
+}
+
+//################################################################################
+
+// conn:deliver_replies() -> number of conn:call_async() callbacks called
+// for the loops that don't dispatch the connection, or to get timeouts while nothing comes in
+int bind_dbus_connection_deliver_replies( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
+	lua_pushinteger( _L, private_deliver_replies( _L, 1, ud));
+	return 1;
+}
+
+//################################################################################
+
 int bind_dbus_connection_dispatch( lua_State * const _L)
 {
 	utils_check_nargs( _L, 1);
-	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, -1);
-	dbus_connection_dispatch( connection);
-	return 0;
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
+	++ ud->stats.nbDispatchCalls;
+	private_dispatch_one( ud);
+	private_deliver_replies( _L, 1, ud);
+	return private_raise_filter_error( _L, 1);
+}
+
+//################################################################################
+
+static char const * private_dispatch_status_string( DBusDispatchStatus const _status)
+{
+	switch( _status)
+	{
+		case DBUS_DISPATCH_DATA_REMAINS: return "DBUS_DISPATCH_DATA_REMAINS";
+		case DBUS_DISPATCH_COMPLETE: return "DBUS_DISPATCH_COMPLETE";
+		case DBUS_DISPATCH_NEED_MEMORY: return "DBUS_DISPATCH_NEED_MEMORY";
+	}
+	return 0x0;
+}
+
+//################################################################################
+
+// conn:dispatch_budget{ max_messages = N, max_us = T} -> number of messages dispatched, dispatch status
+// dispatches until the queue is empty or either budget is spent (both are optional), so that a loop
+// serving several connections can give each its share; a filter error stops the batch and is raised
+int bind_dbus_connection_dispatch_budget( lua_State * const _L)
+{
+	utils_check_nargs( _L, 2);
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
+	luaL_checktype( _L, 2, LUA_TTABLE);
+	lua_getfield( _L, 2, "max_messages");                                           // U {budget} max_messages?
+	lua_getfield( _L, 2, "max_us");                                                 // U {budget} max_messages? max_us?
+	lua_Number const maxMessages = lua_isnil( _L, -2) ? -1 : luaL_checknumber( _L, -2);
+	lua_Number const maxUs = lua_isnil( _L, -1) ? -1 : luaL_checknumber( _L, -1);
+	lua_pop( _L, 2);                                                                // U {budget}
+	// the clock is only read when there is a time budget
+	dbus_uint64_t const deadline = ( maxUs >= 0 ) ? utils_get_monotonic_time_ns() + (dbus_uint64_t) (maxUs * 1e3) : 0;
+	unsigned long const nbFilterErrors = ud->stats.nbFilterErrors;
+	int count = 0;
+	DBusDispatchStatus status = private_get_dispatch_status( ud);
+	while ( status == DBUS_DISPATCH_DATA_REMAINS && ( maxMessages < 0 || count < maxMessages ) )
+	{
+		status = private_dispatch_one( ud);
+		++ count;
+		if ( ud->stats.nbFilterErrors != nbFilterErrors )
+			break;
+		if ( maxUs >= 0 && utils_get_monotonic_time_ns() >= deadline )
+			break;
+	}
+	ud->stats.nbDispatchCalls += count;
+	private_deliver_replies( _L, 1, ud);
+	private_raise_filter_error( _L, 1);
+	lua_pushinteger( _L, count);
+	lua_pushstring( _L, private_dispatch_status_string( status));
+	return 2;
+}
+
+//################################################################################
+
+// conn:filter_histograms( [reset]) -> histogram of the whole filter chain, { [filter] = histogram }
+// a filter added several times gets the merge of all its histograms
+int bind_dbus_connection_filter_histograms( lua_State * const _L)
+{
+	if ( lua_gettop( _L) != 2 )
+		utils_check_nargs( _L, 1);
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
+	int const reset = lua_toboolean( _L, 2);
+	lua_settop( _L, 1);                                                             // U
+	push_dbus_histogram( _L, ud->filterChainLatency);                               // U H
+	lua_createtable( _L, 0, ud->nbRegisteredFilters);                              // U H {byfilter}
+	if ( ud->nbRegisteredFilters > 0 )
+	{
+		lua_getfenv( _L, 1);                                                         // U H {byfilter} {env}
+		lua_getfield( _L, -1, "filters");                                            // U H {byfilter} {env} {filters}
+		int i;
+		for ( i = 0; i < ud->nbRegisteredFilters; ++ i)
+		{
+			lua_rawgeti( _L, -1, ud->filterCallSequence[i]);                          // U H {byfilter} {env} {filters} f
+			lua_pushvalue( _L, -1);                                                   // U H {byfilter} {env} {filters} f f
+			lua_rawget( _L, -5);                                                      // U H {byfilter} {env} {filters} f H?
+			if ( lua_isnil( _L, -1) )
+			{
+				lua_pop( _L, 1);                                                       // U H {byfilter} {env} {filters} f
+				push_dbus_histogram( _L, &ud->filterLatencies[i]);                     // U H {byfilter} {env} {filters} f H
+				lua_rawset( _L, -5);                                                   // U H {byfilter} {env} {filters}
+			}
+			else
+			{
+				histogram_merge( *(Histogram **) lua_touserdata( _L, -1), &ud->filterLatencies[i]);
+				lua_pop( _L, 2);                                                       // U H {byfilter} {env} {filters}
+			}
+			if ( reset )
+				histogram_reset( &ud->filterLatencies[i]);
+		}
+		lua_pop( _L, 2);                                                             // U H {byfilter}
+	}
+	if ( reset && ud->filterChainLatency != 0x0 )
+		histogram_reset( ud->filterChainLatency);
+	return 2;
 }
 
 //################################################################################
@@ -196,7 +1023,7 @@ int bind_dbus_connection_dispatch( lua_State * const _L)
 int bind_dbus_connection_flush( lua_State * const _L)
 {
 	utils_check_nargs( _L, 1);
-	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, -1);
+	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, 0x0);
 	dbus_connection_flush( connection);
 	return 0;
 }
@@ -206,16 +1033,8 @@ int bind_dbus_connection_flush( lua_State * const _L)
 int bind_dbus_connection_get_dispatch_status( lua_State * const _L)
 {
 	utils_check_nargs( _L, 1);
-	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, -1);
-	DBusDispatchStatus const status = dbus_connection_get_dispatch_status( connection);
-	char const * string = 0x0;
-	switch( status)
-	{
-		case DBUS_DISPATCH_DATA_REMAINS: string = "DBUS_DISPATCH_DATA_REMAINS"; break;
-		case DBUS_DISPATCH_COMPLETE: string = "DBUS_DISPATCH_COMPLETE"; break;
-		case DBUS_DISPATCH_NEED_MEMORY: string = "DBUS_DISPATCH_NEED_MEMORY"; break;
-	}
-	lua_pushstring( _L, string);
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
+	lua_pushstring( _L, private_dispatch_status_string( private_get_dispatch_status( ud)));
 	return 1;
 }
 
@@ -224,7 +1043,7 @@ int bind_dbus_connection_get_dispatch_status( lua_State * const _L)
 int bind_dbus_connection_get_is_connected( lua_State * const _L)
 {
 	utils_check_nargs( _L, 1);
-	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, -1);
+	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, 0x0);
 	lua_pushboolean( _L, dbus_connection_get_is_connected( connection) != 0);
 	return 1;
 }
@@ -234,7 +1053,7 @@ int bind_dbus_connection_get_is_connected( lua_State * const _L)
 int bind_dbus_connection_get_is_authenticated( lua_State * const _L)
 {
 	utils_check_nargs( _L, 1);
-	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, -1);
+	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, 0x0);
 	lua_pushboolean( _L, dbus_connection_get_is_authenticated( connection) != 0);
 	return 1;
 }
@@ -244,7 +1063,7 @@ int bind_dbus_connection_get_is_authenticated( lua_State * const _L)
 int bind_dbus_connection_get_is_anonymous( lua_State * const _L)
 {
 	utils_check_nargs( _L, 1);
-	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, -1);
+	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, 0x0);
 	lua_pushboolean( _L, dbus_connection_get_is_anonymous( connection) != 0);
 	return 1;
 }
@@ -254,7 +1073,7 @@ int bind_dbus_connection_get_is_anonymous( lua_State * const _L)
 int bind_dbus_connection_get_server_id( lua_State * const _L)
 {
 	utils_check_nargs( _L, 1);
-	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, -1);
+	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, 0x0);
 	char const * id = dbus_connection_get_server_id( connection);
 	if ( id == 0x0 )
 		return 0 ;
@@ -267,17 +1086,89 @@ int bind_dbus_connection_get_server_id( lua_State * const _L)
 int bind_dbus_connection_pop_message( lua_State * const _L)
 {
 	utils_check_nargs( _L, 1);
-	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, -1);
-	DBusMessage * const message = dbus_connection_pop_message( connection);
-	if( message == 0x0)
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
+	for ( ;;)
 	{
-		lua_pushnil( _L);
-		return 1;
+		DBusMessage * const message = dbus_connection_pop_message( ud->connection);
+		if( message == 0x0)
+		{
+			lua_pushnil( _L);
+			return 1;
+		}
+		private_message_received( ud, message);
+		// awaited replies and calls answered from the reply cache are consumed here, go on with the next message
+		if ( private_consume_popped( ud, message) )
+		{
+			dbus_message_unref( message);
+			continue;
+		}
+		return push_dbus_message( _L, message);
 	}
-	else
+}
+
+//################################################################################
+
+// conn:pop_messages( max, tbl) -> count, more
+// pops up to max messages into tbl[1..count], and clears what a previous call left after them,
+// so the same table can be reused from one poll to the next; more tells if messages remain queued
+int bind_dbus_connection_pop_messages( lua_State * const _L)
+{
+	utils_check_nargs( _L, 3);
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
+	int const max = luaL_checkint( _L, 2);
+	luaL_checktype( _L, 3, LUA_TTABLE);
+	luaL_argcheck( _L, max >= 0, 2, "expects a positive count");
+	// fetch the userdata map and the message metatable once for the whole batch
+	lua_getfield( _L, LUA_REGISTRYINDEX, "dbus_userdata_map");                      // U max tbl {udm}
+	utils_push_metatable( _L, gMessageMetatableKey);                                // U max tbl {udm} meta
+	int count = 0;
+	while ( count < max )
 	{
-		return push_dbus_message( _L, message);
+		DBusMessage * const message = dbus_connection_pop_message( ud->connection);
+		if ( message == 0x0 )
+			break;
+		private_message_received( ud, message);
+		if ( private_consume_popped( ud, message) )
+		{
+			dbus_message_unref( message);
+			continue;
+		}
+		lua_pushlightuserdata( _L, message);                                         // U max tbl {udm} meta _lud
+		lua_rawget( _L, 4);                                                          // U max tbl {udm} meta msg?
+		if ( lua_isnil( _L, -1) )
+		{
+			// the usual case: a message we have never seen, the userdata takes over our reference
+			lua_pop( _L, 1);                                                          // U max tbl {udm} meta
+			DBusMessage ** const block = (DBusMessage **) lua_newuserdata( _L, sizeof( DBusMessage *));   // U max tbl {udm} meta msg
+			*block = message;
+			lua_pushvalue( _L, 5);                                                    // U max tbl {udm} meta msg meta
+			lua_setmetatable( _L, -2);                                                // U max tbl {udm} meta msg
+			lua_pushlightuserdata( _L, message);                                      // U max tbl {udm} meta msg _lud
+			lua_pushvalue( _L, -2);                                                   // U max tbl {udm} meta msg _lud msg
+			lua_rawset( _L, 4);                                                       // U max tbl {udm} meta msg
+		}
+		else
+		{
+			// borrowed earlier: the existing userdata has its own reference
+			dbus_message_unref( message);
+		}
+		lua_rawseti( _L, 3, ++ count);                                               // U max tbl {udm} meta
+	}
+	// clear the slots of a previous, bigger batch
+	int index;
+	for ( index = count + 1; ; ++ index)
+	{
+		lua_rawgeti( _L, 3, index);                                                  // U max tbl {udm} meta v?
+		int const empty = lua_isnil( _L, -1);
+		lua_pop( _L, 1);                                                             // U max tbl {udm} meta
+		if ( empty )
+			break;
+		lua_pushnil( _L);                                                            // U max tbl {udm} meta nil
+		lua_rawseti( _L, 3, index);                                                  // U max tbl {udm} meta
 	}
+	lua_pushinteger( _L, count);                                                    // U max tbl {udm} meta count
+	lua_pushboolean( _L, dbus_connection_get_dispatch_status( ud->connection) == DBUS_DISPATCH_DATA_REMAINS);   // U max tbl {udm} meta count more
+	return 2;
 }
 
 //################################################################################
@@ -285,7 +1176,7 @@ int bind_dbus_connection_pop_message( lua_State * const _L)
 int bind_dbus_connection_read_write( lua_State * const _L)
 {
 	utils_check_nargs( _L, 2);
-	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, -1);
+	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, 0x0);
 	int timeout = lua_tonumber( _L, 2);
 	DBusDispatchStatus status = dbus_connection_read_write( connection, timeout);
 	char const *string = 0x0;
@@ -304,9 +1195,22 @@ int bind_dbus_connection_read_write( lua_State * const _L)
 int bind_dbus_connection_read_write_dispatch( lua_State * const _L)
 {
 	utils_check_nargs( _L, 2);
-	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, -1);
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
 	int timeout = lua_tonumber( _L, 2);
-	dbus_bool_t status = dbus_connection_read_write_dispatch( connection, timeout);
+	++ ud->stats.nbDispatchCalls;
+	dbus_bool_t status;
+	if ( ud->priorityStage != 0x0 && ud->priorityStage->count > 0 )
+	{
+		// parked messages are pending work: don't block, and dispatch one of them if libdbus has nothing
+		status = dbus_connection_read_write( ud->connection, 0);
+		private_dispatch_one( ud);
+	}
+	else
+	{
+		status = dbus_connection_read_write_dispatch( ud->connection, timeout);
+	}
+	private_deliver_replies( _L, 1, ud);
+	private_raise_filter_error( _L, 1);
 	lua_pushboolean( _L, status);
 	return 1;
 }
@@ -322,7 +1226,7 @@ int bind_dbus_connection_remove_filter( lua_State * const _L)
 	// should have two arguments: the connection, and the filter function
 	utils_check_nargs( _L, 2);                                                      // U f
 	// this will raise an error if argument #1 is not a connection or a bus
-	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, -1);
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
 	// search backwards in our call sequence for the specified function
 	lua_getfenv( _L, -2);                                                           // U f {env}
 	lua_getfield( _L, -1, "filters");                                               // U f {env} {nil/filters?}
@@ -346,11 +1250,32 @@ int bind_dbus_connection_remove_filter( lua_State * const _L)
 			// found an occurence of the filter
 			// remove it from the filter table
 			luaL_unref( _L, -1, filterRef);
+			// its predicate, if any, goes with it
+			if ( ud->filterPredicates[i] != 0x0 )
+			{
+				lua_getfield( _L, -2, "filter_predicates");                             // U f {env} {filters} {predicates}
+				lua_pushlightuserdata( _L, ud->filterPredicates[i]);                   // U f {env} {filters} {predicates} p
+				lua_pushnil( _L);                                                       // U f {env} {filters} {predicates} p nil
+				lua_rawset( _L, -3);                                                    // U f {env} {filters} {predicates}
+				lua_pop( _L, 1);                                                        // U f {env} {filters}
+			}
 			// move the filter sequence contents to fill the hole
 			memmove( ud->filterCallSequence+i, ud->filterCallSequence+i+1, (ud->nbRegisteredFilters-i-1)*sizeof(int));
-			// shrink the memory block
+			memmove( ud->filterLatencies+i, ud->filterLatencies+i+1, (ud->nbRegisteredFilters-i-1)*sizeof(Histogram));
+			memmove( ud->filterPredicates+i, ud->filterPredicates+i+1, (ud->nbRegisteredFilters-i-1)*sizeof(FilterPredicate *));
+			// shrink the memory blocks
 			ud->filterCallSequence = allocFunction( allocUserData, ud->filterCallSequence, ud->nbRegisteredFilters * sizeof(int), (ud->nbRegisteredFilters-1) * sizeof(int));
+			ud->filterLatencies = allocFunction( allocUserData, ud->filterLatencies, ud->nbRegisteredFilters * sizeof(Histogram), (ud->nbRegisteredFilters-1) * sizeof(Histogram));
+			ud->filterPredicates = allocFunction( allocUserData, ud->filterPredicates, ud->nbRegisteredFilters * sizeof(FilterPredicate *), (ud->nbRegisteredFilters-1) * sizeof(FilterPredicate *));
 			-- ud->nbRegisteredFilters;
+			// the last lua filter is gone, no need to go through the C filter anymore
+			if ( ud->nbRegisteredFilters == 0 )
+			{
+				dbus_connection_remove_filter( ud->connection, private_call_lua_filters, ud);
+				ud->filterState = 0x0;
+				lua_pushnil( _L);                                                      // U f {env} {filters} nil
+				lua_setfield( _L, -3, "filter_state");                                 // U f {env} {filters}
+			}
 			break;
 		}
 	}
@@ -360,10 +1285,65 @@ int bind_dbus_connection_remove_filter( lua_State * const _L)
 
 //################################################################################
 
+// conn:reply_cache_invalidate( [path [, interface [, member]]]) -> number of dropped replies
+// nil matches anything, so conn:reply_cache_invalidate() empties the cache
+int bind_dbus_connection_reply_cache_invalidate( lua_State * const _L)
+{
+	int const nargs = lua_gettop( _L);
+	if ( nargs < 1 || nargs > 4 )
+		utils_check_nargs( _L, 1);
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
+	char const * const path = luaL_optstring( _L, 2, 0x0);
+	char const * const interface = luaL_optstring( _L, 3, 0x0);
+	char const * const member = luaL_optstring( _L, 4, 0x0);
+	lua_pushinteger( _L, ud->replyCache ? reply_cache_invalidate( ud->replyCache, path, interface, member) : 0);
+	return 1;
+}
+
+//################################################################################
+
+// conn:reply_cache_put( call, reply): answer the next calls identical to call (same path, interface,
+// member and arguments) with a copy of reply, without going through lua
+// returns false if the call can't be cached (not a method call, or file descriptors involved)
+int bind_dbus_connection_reply_cache_put( lua_State * const _L)
+{
+	utils_check_nargs( _L, 3);
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
+	DBusMessage * const call = cast_to_dbus_message( _L, 2);
+	DBusMessage * const reply = cast_to_dbus_message( _L, 3);
+	int const replyType = dbus_message_get_type( reply);
+	luaL_argcheck( _L, replyType == DBUS_MESSAGE_TYPE_METHOD_RETURN || replyType == DBUS_MESSAGE_TYPE_ERROR, 3, "not a reply");
+	if ( ud->replyCache == 0x0 )
+	{
+		ud->replyCache = reply_cache_new();
+		if ( ud->replyCache == 0x0 )
+			return luaL_error( _L, "not enough memory to create the reply cache");
+	}
+	lua_pushboolean( _L, reply_cache_put( ud->replyCache, call, reply));
+	return 1;
+}
+
+//################################################################################
+
+// conn:reply_histogram( [reset]) -> histogram of the time between sending a call and getting its reply,
+// for the calls made with conn:call_async() and conn:call_many(); timed out and failed calls are not in it
+int bind_dbus_connection_reply_histogram( lua_State * const _L)
+{
+	if ( lua_gettop( _L) != 2 )
+		utils_check_nargs( _L, 1);
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
+	push_dbus_histogram( _L, ud->replyLatency);
+	if ( lua_toboolean( _L, 2) && ud->replyLatency != 0x0 )
+		histogram_reset( ud->replyLatency);
+	return 1;
+}
+
+//################################################################################
+
 int bind_dbus_connection_return_message( lua_State * const _L)
 {
 	utils_check_nargs( _L, 2);
-	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, -1);
+	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, 0x0);
 	DBusMessage * const message = cast_to_dbus_message( _L, 2);
 	dbus_connection_return_message( connection, message);
 	return 0;
@@ -374,9 +1354,375 @@ int bind_dbus_connection_return_message( lua_State * const _L)
 int bind_dbus_connection_send( lua_State * const _L)
 {
 	utils_check_nargs( _L, 2);
-	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, -1);
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
 	DBusMessage * const message = cast_to_dbus_message( _L,  2);
-	lua_pushboolean( _L, dbus_connection_send( connection, message, 0x0) != 0);
+	dbus_bool_t const sent = dbus_connection_send( ud->connection, message, 0x0);
+	if ( sent )
+		private_message_sent( ud, message);
+	lua_pushboolean( _L, sent != 0);
+	return 1;
+}
+
+//################################################################################
+
+static void private_push_counts_by_type( lua_State * const _L, unsigned long const * const _counts)
+{
+	lua_createtable( _L, 0, 4);                                                     // {counts}
+	lua_pushnumber( _L, _counts[DBUS_MESSAGE_TYPE_METHOD_CALL]);
+	lua_setfield( _L, -2, "method_call");
+	lua_pushnumber( _L, _counts[DBUS_MESSAGE_TYPE_METHOD_RETURN]);
+	lua_setfield( _L, -2, "method_return");
+	lua_pushnumber( _L, _counts[DBUS_MESSAGE_TYPE_ERROR]);
+	lua_setfield( _L, -2, "error");
+	lua_pushnumber( _L, _counts[DBUS_MESSAGE_TYPE_SIGNAL]);
+	lua_setfield( _L, -2, "signal");
+}
+
+//################################################################################
+
+// conn:stats( [reset]) returns a snapshot of the connection's counters, then clears them if reset is true
+// counters are only ever touched as plain integers, the table is built here and nowhere else
+int bind_dbus_connection_stats( lua_State * const _L)
+{
+	if ( lua_gettop( _L) != 2 )
+		utils_check_nargs( _L, 1);
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
+	int const reset = lua_toboolean( _L, 2);
+	ConnectionStats const * const stats = &ud->stats;
+	lua_createtable( _L, 0, 11);                                                    // {stats}
+	lua_pushnumber( _L, stats->nbMessagesSent);
+	lua_setfield( _L, -2, "messages_sent");
+	lua_pushnumber( _L, stats->nbMessagesReceived);
+	lua_setfield( _L, -2, "messages_received");
+	private_push_counts_by_type( _L, stats->nbSentByType);                        // {stats} {sent}
+	lua_setfield( _L, -2, "sent");                                                 // {stats}
+	private_push_counts_by_type( _L, stats->nbReceivedByType);                    // {stats} {received}
+	lua_setfield( _L, -2, "received");                                             // {stats}
+	lua_pushnumber( _L, stats->nbFilterInvocations);
+	lua_setfield( _L, -2, "filter_invocations");
+	lua_pushnumber( _L, stats->nbFilterHandled);
+	lua_setfield( _L, -2, "filter_handled");
+	lua_pushnumber( _L, stats->nbFilterErrors);
+	lua_setfield( _L, -2, "filter_errors");
+	lua_pushnumber( _L, stats->nbFilterSkipped);
+	lua_setfield( _L, -2, "filter_skipped");
+	lua_pushnumber( _L, stats->nbDispatchCalls);
+	lua_setfield( _L, -2, "dispatch_calls");
+	lua_pushinteger( _L, ud->nbRegisteredFilters);
+	lua_setfield( _L, -2, "filters");
+	// the outgoing queue isn't a counter, libdbus tells us its current state
+	lua_pushnumber( _L, dbus_connection_get_outgoing_size( ud->connection));
+	lua_setfield( _L, -2, "outgoing_bytes");
+	lua_pushboolean( _L, dbus_connection_has_messages_to_send( ud->connection));
+	lua_setfield( _L, -2, "outgoing_pending");
+	if ( ud->replyCache != 0x0 )
+	{
+		lua_pushnumber( _L, ud->replyCache->nbHits);
+		lua_setfield( _L, -2, "reply_cache_hits");
+		lua_pushnumber( _L, ud->replyCache->nbMisses);
+		lua_setfield( _L, -2, "reply_cache_misses");
+		lua_pushinteger( _L, ud->replyCache->entries.nbEntries);
+		lua_setfield( _L, -2, "reply_cache_entries");
+	}
+	if ( ud->priorityStage != 0x0 )
+	{
+		lua_pushnumber( _L, ud->priorityStage->nbDeferred);
+		lua_setfield( _L, -2, "priority_deferred");
+		lua_pushinteger( _L, ud->priorityStage->count);
+		lua_setfield( _L, -2, "priority_parked");
+		// signals dropped because a newer one superseded them, in total and per coalescing rule
+		lua_pushnumber( _L, ud->priorityStage->nbCoalesced);
+		lua_setfield( _L, -2, "coalesced");
+		int i;
+		lua_createtable( _L, ud->priorityStage->nbCoalesceRules, 0);                // {stats} {coalesced_by_rule}
+		for ( i = 0; i < ud->priorityStage->nbCoalesceRules; ++ i)
+		{
+			lua_pushnumber( _L, ud->priorityStage->coalesceRules[i]->nbDropped);
+			lua_rawseti( _L, -2, i + 1);
+		}
+		lua_setfield( _L, -2, "coalesced_by_rule");                                // {stats}
+	}
+	if ( ud->replyTable != 0x0 )
+	{
+		lua_pushinteger( _L, ud->replyTable->pending.nbEntries);
+		lua_setfield( _L, -2, "calls_pending");
+		lua_pushnumber( _L, ud->replyTable->nbAnswered);
+		lua_setfield( _L, -2, "calls_answered");
+		lua_pushnumber( _L, ud->replyTable->nbTimedOut);
+		lua_setfield( _L, -2, "calls_timed_out");
+		lua_pushnumber( _L, ud->replyTable->nbFailed);
+		lua_setfield( _L, -2, "calls_failed");
+	}
+	if ( ud->rateLimiter != 0x0 )
+	{
+		lua_pushnumber( _L, ud->rateLimiter->nbRejectedCalls);
+		lua_setfield( _L, -2, "rate_limited_calls");
+		lua_pushnumber( _L, ud->rateLimiter->nbDroppedSignals);
+		lua_setfield( _L, -2, "rate_limited_signals");
+		lua_pushnumber( _L, ud->rateLimiter->nbExpired);
+		lua_setfield( _L, -2, "rate_limit_expired");
+		lua_pushinteger( _L, ud->rateLimiter->buckets.nbEntries);
+		lua_setfield( _L, -2, "rate_limit_buckets");
+		int i;
+		lua_createtable( _L, ud->rateLimiter->nbRules, 0);                          // {stats} {rate_limited_by_rule}
+		for ( i = 0; i < ud->rateLimiter->nbRules; ++ i)
+		{
+			lua_pushnumber( _L, ud->rateLimiter->rules[i]->nbRejected);
+			lua_rawseti( _L, -2, i + 1);
+		}
+		lua_setfield( _L, -2, "rate_limited_by_rule");                             // {stats}
+	}
+	if ( ud->nameOwners != 0x0 )
+	{
+		lua_pushnumber( _L, ud->nameOwners->nbHits);
+		lua_setfield( _L, -2, "name_owner_hits");
+		lua_pushnumber( _L, ud->nameOwners->nbMisses);
+		lua_setfield( _L, -2, "name_owner_misses");
+		lua_pushnumber( _L, ud->nameOwners->nbChanges);
+		lua_setfield( _L, -2, "name_owner_changes");
+		lua_pushinteger( _L, ud->nameOwners->entries.nbEntries);
+		lua_setfield( _L, -2, "name_owner_entries");
+	}
+	if ( reset )
+	{
+		memset( &ud->stats, 0, sizeof( ud->stats));
+		if ( ud->replyCache != 0x0 )
+			ud->replyCache->nbHits = ud->replyCache->nbMisses = 0;
+		if ( ud->priorityStage != 0x0 )
+		{
+			ud->priorityStage->nbDeferred = ud->priorityStage->nbCoalesced = 0;
+			int i;
+			for ( i = 0; i < ud->priorityStage->nbCoalesceRules; ++ i)
+				ud->priorityStage->coalesceRules[i]->nbDropped = 0;
+		}
+		if ( ud->replyTable != 0x0 )
+			ud->replyTable->nbAnswered = ud->replyTable->nbTimedOut = ud->replyTable->nbFailed = 0;
+		if ( ud->rateLimiter != 0x0 )
+		{
+			ud->rateLimiter->nbRejectedCalls = ud->rateLimiter->nbDroppedSignals = ud->rateLimiter->nbExpired = 0;
+			int i;
+			for ( i = 0; i < ud->rateLimiter->nbRules; ++ i)
+				ud->rateLimiter->rules[i]->nbRejected = 0;
+		}
+		if ( ud->nameOwners != 0x0 )
+			ud->nameOwners->nbHits = ud->nameOwners->nbMisses = ud->nameOwners->nbChanges = 0;
+	}
+	return 1;
+}
+
+//################################################################################
+
+static int private_check_priority( lua_State * const _L, int const _ndx)
+{
+	char const * const priority = luaL_checkstring( _L, _ndx);
+	if ( strcmp( priority, "high") == 0 )
+		return PRIORITY_HIGH;
+	if ( strcmp( priority, "low") == 0 )
+		return PRIORITY_LOW;
+	return luaL_error( _L, "'%s' is not a priority, expects 'high' or 'low'", priority);
+}
+
+//################################################################################
+
+// conn:set_coalescing{ { interface = i, member = m, path = p, arg0 = true}, ...}
+// signals matching one of the rules (missing fields match anything) are parked before reaching the lua filters,
+// and a parked one is dropped if a newer one with the same sender, path, interface, member
+// (and first argument, when arg0 is true) arrives before it was filtered
+// conn:set_coalescing( nil) stops coalescing new signals
+int bind_dbus_connection_set_coalescing( lua_State * const _L)
+{
+	utils_check_nargs( _L, 2);
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
+	if ( lua_isnil( _L, 2) )
+	{
+		if ( ud->priorityStage != 0x0 )
+			priority_stage_reset_coalescing( ud->priorityStage);
+		return 0;
+	}
+	luaL_checktype( _L, 2, LUA_TTABLE);
+	// the checked rules stay on the stack, four slots each, until they are copied
+	int const nbRules = lua_objlen( _L, 2);
+	luaL_checkstack( _L, 4 * nbRules + 5, "too many rules");
+	int i;
+	for ( i = 1; i <= nbRules; ++ i)
+	{
+		utils_push_interface_member_rule( _L, 2, i);                                 // U {rules} ... {rule} interface? member?
+		lua_getfield( _L, -3, "path");                                               // U {rules} ... {rule} interface? member? path?
+		char const * const path = lua_isnil( _L, -1) ? 0x0 : luaL_checkstring( _L, -1);
+		if ( path != 0x0 && !dbus_validate_path( path, 0x0) )
+			return luaL_error( _L, "'%s' is not a valid object path", path);
+		lua_getfield( _L, -4, "arg0");                                               // U {rules} ... {rule} interface? member? path? arg0?
+		lua_pushboolean( _L, lua_toboolean( _L, -1));                               // U {rules} ... {rule} interface? member? path? arg0? arg0
+		lua_replace( _L, -2);                                                        // U {rules} ... {rule} interface? member? path? arg0
+		lua_remove( _L, -5);                                                         // U {rules} ... interface? member? path? arg0
+	}
+	// from here on, only running out of memory can fail
+	if ( ud->priorityStage == 0x0 )
+	{
+		ud->priorityStage = priority_stage_new();
+		if ( ud->priorityStage == 0x0 )
+			return luaL_error( _L, "not enough memory to set coalescing rules");
+	}
+	PriorityStage * const stage = ud->priorityStage;
+	priority_stage_reset_coalescing( stage);
+	for ( i = 0; i < nbRules; ++ i)
+	{
+		int const ndx = 3 + 4 * i;
+		if ( !priority_stage_add_coalesce_rule( stage, lua_tostring( _L, ndx), lua_tostring( _L, ndx + 1), lua_tostring( _L, ndx + 2), lua_toboolean( _L, ndx + 3)) )
+		{
+			// better no coalescing than half of it
+			priority_stage_reset_coalescing( stage);
+			return luaL_error( _L, "not enough memory to set coalescing rules");
+		}
+	}
+	return 0;
+}
+
+//################################################################################
+
+// conn:set_priority_policy( policy) where policy is
+// { signal = "low", method_call = "high", method_return = "high", error = "high", { interface = i, member = m, priority = p }, ...}
+// missing types keep the defaults shown, the rules are checked first, in order, missing fields match anything
+// low priority messages are only given to the lua filters when libdbus has nothing else to dispatch
+// conn:set_priority_policy( nil) stops the classification, parked messages are still dispatched
+int bind_dbus_connection_set_priority_policy( lua_State * const _L)
+{
+	static char const * const types[] = { "method_call", "method_return", "error", "signal" };
+	utils_check_nargs( _L, 2);
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
+	if ( lua_isnil( _L, 2) )
+	{
+		if ( ud->priorityStage != 0x0 )
+			ud->priorityStage->enabled = 0;
+		return 0;
+	}
+	luaL_checktype( _L, 2, LUA_TTABLE);
+	// check everything before anything is allocated: a policy that fails to parse leaves the current one in place
+	PriorityPolicy policy;
+	priority_policy_init( &policy);
+	int i;
+	for ( i = 0; i < 4; ++ i)
+	{
+		lua_getfield( _L, 2, types[i]);                                              // U {policy} priority?
+		if ( !lua_isnil( _L, -1) )
+			policy.byType[dbus_message_type_from_string( types[i])] = private_check_priority( _L, -1);
+		lua_pop( _L, 1);                                                             // U {policy}
+	}
+	// the checked rules stay on the stack, three slots each, until they are copied
+	int const nbRules = lua_objlen( _L, 2);
+	luaL_checkstack( _L, 3 * nbRules + 3, "too many rules");
+	for ( i = 1; i <= nbRules; ++ i)
+	{
+		utils_push_interface_member_rule( _L, 2, i);                                 // U {policy} ... {rule} interface? member?
+		lua_getfield( _L, -3, "priority");                                           // U {policy} ... {rule} interface? member? priority
+		lua_pushinteger( _L, private_check_priority( _L, -1));                      // U {policy} ... {rule} interface? member? priority p
+		lua_replace( _L, -2);                                                        // U {policy} ... {rule} interface? member? p
+		lua_remove( _L, -4);                                                         // U {policy} ... interface? member? p
+	}
+	// from here on, only running out of memory can fail
+	if ( ud->priorityStage == 0x0 )
+	{
+		ud->priorityStage = priority_stage_new();
+		if ( ud->priorityStage == 0x0 )
+			return luaL_error( _L, "not enough memory to set a priority policy");
+	}
+	PriorityStage * const stage = ud->priorityStage;
+	for ( i = 0; i < nbRules; ++ i)
+	{
+		int const ndx = 3 + 3 * i;
+		if ( !priority_policy_add_rule( &policy, lua_tostring( _L, ndx), lua_tostring( _L, ndx + 1), (int) lua_tointeger( _L, ndx + 2)) )
+		{
+			priority_policy_clear( &policy);
+			return luaL_error( _L, "not enough memory to set a priority policy");
+		}
+	}
+	priority_stage_set_policy( stage, &policy);
+	stage->enabled = 1;
+	return 0;
+}
+
+//################################################################################
+
+// conn:set_rate_limits{ { interface = i, member = m, rate = r, burst = b }, ...}
+// each sender gets a bucket of b tokens (defaults to r, at least 1) per rule, refilled at r tokens per second
+// a call or signal takes a token from the bucket of the first rule that matches it (missing fields match anything),
+// and is refused before the lua filters when there is none left: calls get a LimitsExceeded error, signals are dropped
+// conn:set_rate_limits( nil) removes all limits
+// returns true, or nil, error name, error message if the bus could not be asked to report disconnections
+int bind_dbus_connection_set_rate_limits( lua_State * const _L)
+{
+	utils_check_nargs( _L, 2);
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
+	if ( lua_isnil( _L, 2) )
+	{
+		finalize_rate_limit_data( ud);
+		lua_pushboolean( _L, 1);
+		return 1;
+	}
+	luaL_checktype( _L, 2, LUA_TTABLE);
+	// the checked rules stay on the stack, four slots each, until they are copied
+	int const nbRules = lua_objlen( _L, 2);
+	luaL_checkstack( _L, 4 * nbRules + 5, "too many rules");
+	int i;
+	for ( i = 1; i <= nbRules; ++ i)
+	{
+		utils_push_interface_member_rule( _L, 2, i);                                 // U {limits} ... {rule} interface? member?
+		lua_getfield( _L, -3, "rate");                                               // U {limits} ... {rule} interface? member? rate
+		lua_getfield( _L, -4, "burst");                                              // U {limits} ... {rule} interface? member? rate burst?
+		double const rate = luaL_checknumber( _L, -2);
+		double burst = lua_isnil( _L, -1) ? rate : luaL_checknumber( _L, -1);
+		if ( rate < 0 )
+			return luaL_error( _L, "rate limits can't be negative");
+		if ( burst < 1 )
+			burst = 1;
+		lua_pop( _L, 2);                                                             // U {limits} ... {rule} interface? member?
+		lua_pushnumber( _L, rate);                                                   // U {limits} ... {rule} interface? member? rate
+		lua_pushnumber( _L, burst);                                                  // U {limits} ... {rule} interface? member? rate burst
+		lua_remove( _L, -5);                                                         // U {limits} ... interface? member? rate burst
+	}
+	// from here on, only running out of memory can fail
+	if ( ud->rateLimiter == 0x0 )
+	{
+		ud->rateLimiter = rate_limiter_new();
+		if ( ud->rateLimiter == 0x0 )
+			return luaL_error( _L, "not enough memory to set rate limits");
+		if ( !dbus_connection_add_filter( ud->connection, private_limit_rates, ud, 0x0) )
+		{
+			rate_limiter_delete( ud->rateLimiter);
+			ud->rateLimiter = 0x0;
+			return luaL_error( _L, "not enough memory to set rate limits");
+		}
+	}
+	RateLimiter * const limiter = ud->rateLimiter;
+	// buckets are per rule, new rules start everyone afresh
+	rate_limiter_reset( limiter);
+	for ( i = 0; i < nbRules; ++ i)
+	{
+		int const ndx = 3 + 4 * i;
+		if ( !rate_limiter_add_rule( limiter, lua_tostring( _L, ndx), lua_tostring( _L, ndx + 1), lua_tonumber( _L, ndx + 2), lua_tonumber( _L, ndx + 3)) )
+		{
+			// better no limits than half of them
+			rate_limiter_reset( limiter);
+			return luaL_error( _L, "not enough memory to set rate limits");
+		}
+	}
+	// on a bus, senders are unique names and the daemon tells us when they disconnect
+	if ( !limiter->watchesSenders && dbus_bus_get_unique_name( ud->connection) != 0x0 )
+	{
+		DBusError error;
+		dbus_error_init( &error);
+		dbus_bus_add_match( ud->connection, SENDER_GONE_MATCH_RULE, &error);
+		if ( dbus_error_is_set( &error) )
+		{
+			lua_pushnil( _L);
+			lua_pushstring( _L, error.name);
+			lua_pushstring( _L, error.message);
+			dbus_error_free( &error);
+			return 3;
+		}
+		limiter->watchesSenders = 1;
+	}
+	lua_pushboolean( _L, 1);
 	return 1;
 }
 
@@ -385,9 +1731,10 @@ int bind_dbus_connection_send( lua_State * const _L)
 int bind_dbus_connection_steal_borrowed_message( lua_State * const _L)
 {
 	utils_check_nargs( _L, 2);
-	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, -1);
+	ConnectionUserdata * const ud = extract_dbus_connection_userdata( _L, 1, 0x0);
 	DBusMessage * const message = cast_to_dbus_message( _L,  2);
-	dbus_connection_steal_borrowed_message( connection, message);
+	dbus_connection_steal_borrowed_message( ud->connection, message);
+	private_message_received( ud, message);
 	return 0;
 }
 
@@ -398,19 +1745,37 @@ luaL_Reg gSharedConnectionMeta[] =
 {
 	{ "add_filter", bind_dbus_connection_add_filter },
 	{ "borrow_message", bind_dbus_connection_borrow_message },
+	{ "call_async", bind_dbus_connection_call_async },
+	{ "call_many", bind_dbus_connection_call_many },
+	{ "can_send_type", bind_dbus_connection_can_send_type },
+	{ "cancel_call", bind_dbus_connection_cancel_call },
+	{ "capture_start", bind_dbus_connection_capture_start },
+	{ "capture_stop", bind_dbus_connection_capture_stop },
+	{ "deliver_replies", bind_dbus_connection_deliver_replies },
 	{ "dispatch", bind_dbus_connection_dispatch },
+	{ "dispatch_budget", bind_dbus_connection_dispatch_budget },
+	{ "filter_histograms", bind_dbus_connection_filter_histograms },
 	{ "flush", bind_dbus_connection_flush },
 	{ "get_dispatch_status", bind_dbus_connection_get_dispatch_status },
 	{ "get_is_connected", bind_dbus_connection_get_is_connected },
 	{ "get_is_authenticated", bind_dbus_connection_get_is_authenticated },
 	{ "get_is_anonymous", bind_dbus_connection_get_is_anonymous },
 	{ "get_server_id", bind_dbus_connection_get_server_id },
+	{ "new_worker_pool", bind_dbus_connection_new_worker_pool },
 	{ "pop_message", bind_dbus_connection_pop_message },
+	{ "pop_messages", bind_dbus_connection_pop_messages },
 	{ "read_write", bind_dbus_connection_read_write },
 	{ "read_write_dispatch", bind_dbus_connection_read_write_dispatch },
 	{ "remove_filter", bind_dbus_connection_remove_filter },
+	{ "reply_cache_invalidate", bind_dbus_connection_reply_cache_invalidate },
+	{ "reply_cache_put", bind_dbus_connection_reply_cache_put },
+	{ "reply_histogram", bind_dbus_connection_reply_histogram },
 	{ "return_message", bind_dbus_connection_return_message },
 	{ "send", bind_dbus_connection_send },
+	{ "set_coalescing", bind_dbus_connection_set_coalescing },
+	{ "set_priority_policy", bind_dbus_connection_set_priority_policy },
+	{ "set_rate_limits", bind_dbus_connection_set_rate_limits },
+	{ "stats", bind_dbus_connection_stats },
 	{ "steal_borrowed_message", bind_dbus_connection_steal_borrowed_message },
 	{ 0x0, 0x0 },
 };
@@ -419,6 +1784,27 @@ luaL_Reg gSharedConnectionMeta[] =
 // some additional stuff
 //################################################################################
 
+// called when the userdata is created, returns 0 if libdbus is out of memory
+int install_accounting_filter( ConnectionUserdata * const _ud)
+{
+	_ud->accountingFilterAdded = dbus_connection_add_filter( _ud->connection, private_account_received, _ud, 0x0);
+	return _ud->accountingFilterAdded;
+}
+
+//################################################################################
+
+// called by the bus and connection __gc finalizers
+void finalize_accounting_data( ConnectionUserdata * const _ud)
+{
+	if ( _ud->accountingFilterAdded )
+	{
+		dbus_connection_remove_filter( _ud->connection, private_account_received, _ud);
+		_ud->accountingFilterAdded = 0;
+	}
+}
+
+//################################################################################
+
 // called by the bus and connection __gc finalizers
 void finalize_filter_data( lua_State * const _L, ConnectionUserdata * const _ud)
 {
@@ -426,6 +1812,81 @@ void finalize_filter_data( lua_State * const _L, ConnectionUserdata * const _ud)
 	void *allocUserData;
 	lua_Alloc allocFunction = lua_getallocf( _L, &allocUserData);
 
+	if ( _ud->nbRegisteredFilters > 0 )
+		dbus_connection_remove_filter( _ud->connection, private_call_lua_filters, _ud);
+	_ud->filterState = 0x0;
+	// the predicates themselves are userdata, collected along with the environment
+	_ud->filterPredicates = allocFunction( allocUserData, _ud->filterPredicates, _ud->nbRegisteredFilters * sizeof(FilterPredicate *), 0);
 	_ud->filterCallSequence = allocFunction( allocUserData, _ud->filterCallSequence, _ud->nbRegisteredFilters * sizeof(int), 0);
+	_ud->filterLatencies = allocFunction( allocUserData, _ud->filterLatencies, _ud->nbRegisteredFilters * sizeof(Histogram), 0);
+	_ud->filterChainLatency = allocFunction( allocUserData, _ud->filterChainLatency, _ud->filterChainLatency ? sizeof(Histogram) : 0, 0);
 	_ud->nbRegisteredFilters = 0;
 }
+
+//################################################################################
+
+// called by the bus and connection __gc finalizers, and when a capture is stopped
+void finalize_capture_data( ConnectionUserdata * const _ud)
+{
+	if ( _ud->capture != 0x0 )
+	{
+		capture_close( _ud->capture);
+		_ud->capture = 0x0;
+	}
+}
+
+//################################################################################
+
+// called by the bus and connection __gc finalizers
+void finalize_reply_cache_data( ConnectionUserdata * const _ud)
+{
+	if ( _ud->replyCache != 0x0 )
+	{
+		reply_cache_delete( _ud->replyCache);
+		_ud->replyCache = 0x0;
+	}
+}
+
+//################################################################################
+
+// called by the bus and connection __gc finalizers, parked messages are dropped
+void finalize_priority_data( ConnectionUserdata * const _ud)
+{
+	if ( _ud->priorityStage != 0x0 )
+	{
+		priority_stage_delete( _ud->priorityStage);
+		_ud->priorityStage = 0x0;
+	}
+}
+
+//################################################################################
+
+// called by the bus and connection __gc finalizers, and when the limits are removed
+void finalize_rate_limit_data( ConnectionUserdata * const _ud)
+{
+	if ( _ud->rateLimiter != 0x0 )
+	{
+		dbus_connection_remove_filter( _ud->connection, private_limit_rates, _ud);
+		if ( _ud->rateLimiter->watchesSenders )
+			dbus_bus_remove_match( _ud->connection, SENDER_GONE_MATCH_RULE, 0x0);
+		rate_limiter_delete( _ud->rateLimiter);
+		_ud->rateLimiter = 0x0;
+	}
+}
+
+//################################################################################
+
+// called by the bus and connection __gc finalizers: the pending calls are released without calling
+// their callbacks, the connection they would get is being collected
+void finalize_reply_table_data( ConnectionUserdata * const _ud)
+{
+	if ( _ud->replyTable != 0x0 )
+	{
+		if ( _ud->replyTable->filterAdded )
+			dbus_connection_remove_filter( _ud->connection, private_collect_replies, _ud);
+		reply_table_delete( _ud->replyTable);
+		_ud->replyTable = 0x0;
+	}
+	free( _ud->replyLatency);
+	_ud->replyLatency = 0x0;
+}
@@ -3,17 +3,64 @@
 
 //################################################################################
 
+// plain counters, cheap enough to be always on
+struct ConnectionStats
+{
+	unsigned long nbMessagesSent;
+	unsigned long nbMessagesReceived;
+	unsigned long nbSentByType[DBUS_NUM_MESSAGE_TYPES];
+	unsigned long nbReceivedByType[DBUS_NUM_MESSAGE_TYPES];
+	unsigned long nbFilterInvocations;
+	unsigned long nbFilterHandled;
+	unsigned long nbFilterErrors;
+	// lua filters not called because their rules table didn't match
+	unsigned long nbFilterSkipped;
+	unsigned long nbDispatchCalls;
+};
+typedef struct ConnectionStats ConnectionStats;
+
 struct ConnectionUserdata
 {
 	DBusConnection *connection;
 	int closeOnFinalize;
+	// set once the filter that counts (and captures) the incoming messages is in place
+	int accountingFilterAdded;
 	int nbRegisteredFilters;
 	int *filterCallSequence;
+	// rules checked before calling each filter, 0x0 for filters that see everything (parallel to filterCallSequence)
+	struct FilterPredicate **filterPredicates;
+	// the state in which the lua filters are run, set when the first one is added
+	lua_State *filterState;
+	// time spent in the whole filter chain for one message, and in each filter (parallel to filterCallSequence)
+	struct Histogram *filterChainLatency;
+	struct Histogram *filterLatencies;
+	// when set, every message sent or received is appended to a capture file
+	struct Capture *capture;
+	// memoized replies, created by the first conn:reply_cache_put()
+	struct ReplyCache *replyCache;
+	// owners of the well-known names resolved so far, buses only
+	struct NameOwnerCache *nameOwners;
+	// when set, low priority messages wait until libdbus has nothing else to dispatch
+	struct PriorityStage *priorityStage;
+	// when set, calls and signals over their sender's rate are refused before the lua filters
+	struct RateLimiter *rateLimiter;
+	// calls sent with conn:call_async() that wait for their reply, created by the first one
+	struct ReplyTable *replyTable;
+	// send-to-reply time of the calls made with conn:call_async() and conn:call_many(), created by the first one
+	struct Histogram *replyLatency;
+	ConnectionStats stats;
 };
 typedef struct ConnectionUserdata ConnectionUserdata;
 
-extern DBusConnection * extract_dbus_connection_pointer( lua_State * const _L, int const _ndx, int const _whichMeta);
+extern DBusConnection * extract_dbus_connection_pointer( lua_State * const _L, int const _ndx, char const * const _whichMeta);
+extern int install_accounting_filter( ConnectionUserdata * const _ud);
+extern void finalize_accounting_data( ConnectionUserdata * const _ud);
 extern void finalize_filter_data( lua_State * const _L, ConnectionUserdata * const _ud);
+extern void finalize_capture_data( ConnectionUserdata * const _ud);
+extern void finalize_reply_cache_data( ConnectionUserdata * const _ud);
+extern void finalize_priority_data( ConnectionUserdata * const _ud);
+extern void finalize_rate_limit_data( ConnectionUserdata * const _ud);
+extern void finalize_reply_table_data( ConnectionUserdata * const _ud);
 extern luaL_Reg gSharedConnectionMeta[];
 
 //################################################################################
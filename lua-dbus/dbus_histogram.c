@@ -0,0 +1,323 @@
+/************************************************************************
+*
+* Lua bindings for libdbus.
+* Copyright (c) 2009 - BenoitGermain <bnt.germain@gmail.com>
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+************************************************************************/
+
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "dbus_histogram.h"
+
+//################################################################################
+// latency histograms: recording is a couple of integer operations, so they can stay on in production
+// the lua side only ever sees copies, so that it can keep, merge or reset them freely
+//################################################################################
+
+char const gHistogramMetatableKey[] = "lua-dbus histogram";
+
+// histograms don't wrap a libdbus object, but we still follow the convention of starting the block with the object pointer
+struct HistogramUserdata
+{
+	Histogram *histogram;
+	Histogram storage;
+};
+typedef struct HistogramUserdata HistogramUserdata;
+
+//################################################################################
+//################################################################################
+
+static int private_bucket_index( dbus_uint64_t const _value)
+{
+	if ( _value < HISTOGRAM_SUB_BUCKETS )
+		return (int) _value;
+	int const magnitude = 63 - __builtin_clzll( _value);
+	if ( magnitude > HISTOGRAM_MAX_MAGNITUDE )
+		return HISTOGRAM_NB_BUCKETS - 1;
+	int const shift = magnitude - HISTOGRAM_SUB_BUCKET_BITS;
+	return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (int) ((_value >> shift) - HISTOGRAM_SUB_BUCKETS);
+}
+
+//################################################################################
+
+// the highest value that falls in a bucket
+static dbus_uint64_t private_bucket_value( int const _index)
+{
+	if ( _index < HISTOGRAM_SUB_BUCKETS )
+		return (dbus_uint64_t) _index;
+	int const shift = _index / HISTOGRAM_SUB_BUCKETS - 1;
+	dbus_uint64_t const subBucket = (dbus_uint64_t) (_index % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS);
+	return ((subBucket + 1) << shift) - 1;
+}
+
+//################################################################################
+
+void histogram_reset( Histogram * const _h)
+{
+	memset( _h, 0, sizeof( Histogram));
+}
+
+//################################################################################
+
+void histogram_record( Histogram * const _h, dbus_uint64_t const _value)
+{
+	if ( _h->count == 0 || _value < _h->min )
+		_h->min = _value;
+	if ( _value > _h->max )
+		_h->max = _value;
+	++ _h->count;
+	_h->sum += _value;
+	++ _h->buckets[private_bucket_index( _value)];
+}
+
+//################################################################################
+
+void histogram_merge( Histogram * const _h, Histogram const * const _other)
+{
+	if ( _other->count == 0 )
+		return;
+	if ( _h->count == 0 || _other->min < _h->min )
+		_h->min = _other->min;
+	if ( _other->max > _h->max )
+		_h->max = _other->max;
+	_h->count += _other->count;
+	_h->sum += _other->sum;
+	int i;
+	for ( i = 0; i < HISTOGRAM_NB_BUCKETS; ++ i)
+		_h->buckets[i] += _other->buckets[i];
+}
+
+//################################################################################
+
+// _percentile is in [0,100]
+dbus_uint64_t histogram_value_at_percentile( Histogram const * const _h, double const _percentile)
+{
+	if ( _h->count == 0 )
+		return 0;
+	if ( _percentile >= 100.0 )
+		return _h->max;
+	// rank of the sample we are looking for, counting from 1
+	dbus_uint64_t rank = (dbus_uint64_t) (_percentile / 100.0 * (double) _h->count + 0.5);
+	if ( rank < 1 )
+		rank = 1;
+	dbus_uint64_t seen = 0;
+	int i;
+	for ( i = 0; i < HISTOGRAM_NB_BUCKETS; ++ i)
+	{
+		seen += _h->buckets[i];
+		if ( seen >= rank )
+		{
+			dbus_uint64_t const value = private_bucket_value( i);
+			return value > _h->max ? _h->max : (value < _h->min ? _h->min : value);
+		}
+	}
+	return _h->max;
+}
+
+//################################################################################
+//################################################################################
+
+// push a new histogram userdata, either empty or a copy of _source
+Histogram * push_dbus_histogram( lua_State * const _L, Histogram const * const _source)
+{
+	HistogramUserdata * const block = (HistogramUserdata *) lua_newuserdata( _L, sizeof( HistogramUserdata));   // H
+	block->histogram = &block->storage;
+	if ( _source != 0x0 )
+		memcpy( &block->storage, _source, sizeof( Histogram));
+	else
+		histogram_reset( &block->storage);
+	utils_push_metatable( _L, gHistogramMetatableKey);                                                      // H meta
+	lua_setmetatable( _L, -2);                                                                               // H
+	return block->histogram;
+}
+
+//################################################################################
+
+static Histogram * cast_to_dbus_histogram( lua_State * const _L, int const _ndx)
+{
+	return *(Histogram **) utils_cast_userdata( _L, _ndx, gHistogramMetatableKey);
+}
+
+//################################################################################
+
+// times are nanoseconds on the C side, seconds on the lua side, like dbus.monotonic_time()
+static void private_push_time( lua_State * const _L, dbus_uint64_t const _ns)
+{
+	lua_pushnumber( _L, (lua_Number) _ns / 1e9);
+}
+
+//################################################################################
+//################################################################################
+
+int bind_dbus_histogram_new( lua_State * const _L)
+{
+	utils_check_nargs( _L, 0);
+	push_dbus_histogram( _L, 0x0);
+	return 1;
+}
+
+//################################################################################
+
+int bind_dbus_histogram_count( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	Histogram * const h = cast_to_dbus_histogram( _L, 1);
+	lua_pushnumber( _L, (lua_Number) h->count);
+	return 1;
+}
+
+//################################################################################
+
+int bind_dbus_histogram_max( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	Histogram * const h = cast_to_dbus_histogram( _L, 1);
+	private_push_time( _L, h->max);
+	return 1;
+}
+
+//################################################################################
+
+int bind_dbus_histogram_mean( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	Histogram * const h = cast_to_dbus_histogram( _L, 1);
+	lua_pushnumber( _L, h->count == 0 ? 0 : (lua_Number) h->sum / (lua_Number) h->count / 1e9);
+	return 1;
+}
+
+//################################################################################
+
+// h:merge( other): add the samples of other into h
+int bind_dbus_histogram_merge( lua_State * const _L)
+{
+	utils_check_nargs( _L, 2);
+	Histogram * const h = cast_to_dbus_histogram( _L, 1);
+	Histogram * const other = cast_to_dbus_histogram( _L, 2);
+	histogram_merge( h, other);
+	lua_settop( _L, 1);
+	return 1;
+}
+
+//################################################################################
+
+int bind_dbus_histogram_min( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	Histogram * const h = cast_to_dbus_histogram( _L, 1);
+	private_push_time( _L, h->min);
+	return 1;
+}
+
+//################################################################################
+
+// h:percentile( p), p between 0 and 100
+int bind_dbus_histogram_percentile( lua_State * const _L)
+{
+	utils_check_nargs( _L, 2);
+	Histogram * const h = cast_to_dbus_histogram( _L, 1);
+	lua_Number const percentile = luaL_checknumber( _L, 2);
+	luaL_argcheck( _L, percentile >= 0 && percentile <= 100, 2, "percentile must be between 0 and 100");
+	private_push_time( _L, histogram_value_at_percentile( h, percentile));
+	return 1;
+}
+
+//################################################################################
+
+// h:record( seconds), for latencies measured on the lua side
+int bind_dbus_histogram_record( lua_State * const _L)
+{
+	utils_check_nargs( _L, 2);
+	Histogram * const h = cast_to_dbus_histogram( _L, 1);
+	lua_Number const value = luaL_checknumber( _L, 2);
+	histogram_record( h, value > 0 ? (dbus_uint64_t) (value * 1e9 + 0.5) : 0);
+	return 0;
+}
+
+//################################################################################
+
+int bind_dbus_histogram_reset( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	Histogram * const h = cast_to_dbus_histogram( _L, 1);
+	histogram_reset( h);
+	return 0;
+}
+
+//################################################################################
+
+// h:summary() -> { count, min, max, mean, p50, p90, p99, p999 }
+int bind_dbus_histogram_summary( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	Histogram * const h = cast_to_dbus_histogram( _L, 1);
+	lua_createtable( _L, 0, 8);                                            // {summary}
+	lua_pushnumber( _L, (lua_Number) h->count);
+	lua_setfield( _L, -2, "count");
+	private_push_time( _L, h->min);
+	lua_setfield( _L, -2, "min");
+	private_push_time( _L, h->max);
+	lua_setfield( _L, -2, "max");
+	lua_pushnumber( _L, h->count == 0 ? 0 : (lua_Number) h->sum / (lua_Number) h->count / 1e9);
+	lua_setfield( _L, -2, "mean");
+	private_push_time( _L, histogram_value_at_percentile( h, 50.0));
+	lua_setfield( _L, -2, "p50");
+	private_push_time( _L, histogram_value_at_percentile( h, 90.0));
+	lua_setfield( _L, -2, "p90");
+	private_push_time( _L, histogram_value_at_percentile( h, 99.0));
+	lua_setfield( _L, -2, "p99");
+	private_push_time( _L, histogram_value_at_percentile( h, 99.9));
+	lua_setfield( _L, -2, "p999");
+	return 1;
+}
+
+//################################################################################
+//################################################################################
+
+static luaL_Reg gHistogramMeta[] =
+{
+	{ "count", bind_dbus_histogram_count },
+	{ "max", bind_dbus_histogram_max },
+	{ "mean", bind_dbus_histogram_mean },
+	{ "merge", bind_dbus_histogram_merge },
+	{ "min", bind_dbus_histogram_min },
+	{ "percentile", bind_dbus_histogram_percentile },
+	{ "record", bind_dbus_histogram_record },
+	{ "reset", bind_dbus_histogram_reset },
+	{ "summary", bind_dbus_histogram_summary },
+	{ 0x0, 0x0 },
+};
+
+//################################################################################
+//################################################################################
+
+void register_histogram_stuff( lua_State * const _L)
+{
+	// register the histogram object metatable in the registry
+	utils_prepare_metatable( _L, gHistogramMetatableKey);                             // {meta}
+	utils_register_upvalued_functions( _L, gHistogramMeta, gHistogramMetatableKey);   // {meta}
+	lua_pop( _L, 1);                                                                  //
+}
@@ -0,0 +1,35 @@
+#if ! defined ( __dbus_histogram_h__ )
+#define __dbus_histogram_h__ 1
+
+//################################################################################
+
+// log-bucketed latency histogram, in the spirit of HdrHistogram:
+// every power of two is split into HISTOGRAM_SUB_BUCKETS linear buckets, which bounds the relative error to ~3%
+// values are nanoseconds, anything above 2^(HISTOGRAM_MAX_MAGNITUDE+1) lands in the last bucket (max stays exact)
+#define HISTOGRAM_SUB_BUCKET_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_MAX_MAGNITUDE 40
+#define HISTOGRAM_NB_BUCKETS ((HISTOGRAM_MAX_MAGNITUDE - HISTOGRAM_SUB_BUCKET_BITS + 2) * HISTOGRAM_SUB_BUCKETS)
+
+struct Histogram
+{
+	dbus_uint64_t count;
+	dbus_uint64_t min;
+	dbus_uint64_t max;
+	dbus_uint64_t sum;
+	dbus_uint64_t buckets[HISTOGRAM_NB_BUCKETS];
+};
+typedef struct Histogram Histogram;
+
+extern void histogram_reset( Histogram * const _h);
+extern void histogram_record( Histogram * const _h, dbus_uint64_t const _value);
+extern void histogram_merge( Histogram * const _h, Histogram const * const _other);
+extern dbus_uint64_t histogram_value_at_percentile( Histogram const * const _h, double const _percentile);
+
+extern Histogram * push_dbus_histogram( lua_State * const _L, Histogram const * const _source);
+extern int bind_dbus_histogram_new( lua_State * const _L);
+extern void register_histogram_stuff( lua_State * const _L);
+
+//################################################################################
+
+#endif // __dbus_histogram_h__
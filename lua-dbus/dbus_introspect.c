@@ -0,0 +1,500 @@
+/************************************************************************
+*
+* Lua bindings for libdbus.
+* Copyright (c) 2009 - BenoitGermain <bnt.germain@gmail.com>
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+************************************************************************/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <dbus/dbus.h>
+
+#include "dbus_introspect.h"
+
+//################################################################################
+// a small streaming parser for Introspect documents: one pass over the text, no tree,
+// only the elements and attributes of the introspection format are looked at
+//################################################################################
+
+#define MEMBER_NONE 0
+#define MEMBER_METHOD 1
+#define MEMBER_SIGNAL 2
+
+struct IntrospectParser
+{
+	char const *cursor;
+	char const *error;
+	IntrospectionData *data;
+	int nodeDepth;
+	int interfaceIndex;
+	int memberKind;
+	int memberIndex;
+	// the attributes of the current element we care about, 0x0 when absent
+	char *name;
+	char *type;
+	char *direction;
+	char *access;
+};
+typedef struct IntrospectParser IntrospectParser;
+
+//################################################################################
+//################################################################################
+
+static char * private_strdup( char const * const _string)
+{
+	size_t const size = strlen( _string) + 1;
+	char * const copy = (char *) malloc( size);
+	if ( copy != 0x0 )
+		memcpy( copy, _string, size);
+	return copy;
+}
+
+//################################################################################
+
+// append a complete type to a signature, reallocating it
+static int private_append_type( char ** const _signature, char const * const _type)
+{
+	size_t const length = *_signature ? strlen( *_signature) : 0;
+	size_t const typeLength = strlen( _type);
+	char * const signature = (char *) realloc( *_signature, length + typeLength + 1);
+	if ( signature == 0x0 )
+		return 0;
+	memcpy( signature + length, _type, typeLength + 1);
+	*_signature = signature;
+	return 1;
+}
+
+//################################################################################
+
+// grow an array by one zeroed slot, returns the new slot or 0x0
+static void * private_grow_array( void ** const _array, int * const _count, size_t const _itemSize)
+{
+	char * const array = (char *) realloc( *_array, (*_count + 1) * _itemSize);
+	if ( array == 0x0 )
+		return 0x0;
+	*_array = array;
+	memset( array + *_count * _itemSize, 0, _itemSize);
+	return array + (*_count) ++ * _itemSize;
+}
+
+//################################################################################
+
+static void private_clear_attributes( IntrospectParser * const _parser)
+{
+	free( _parser->name);
+	free( _parser->type);
+	free( _parser->direction);
+	free( _parser->access);
+	_parser->name = _parser->type = _parser->direction = _parser->access = 0x0;
+}
+
+//################################################################################
+
+static int private_is_name_char( char const _c)
+{
+	return ( _c >= 'a' && _c <= 'z' ) || ( _c >= 'A' && _c <= 'Z' ) || ( _c >= '0' && _c <= '9' ) || _c == '_' || _c == '-' || _c == ':' || _c == '.';
+}
+
+//################################################################################
+
+static void private_skip_spaces( IntrospectParser * const _parser)
+{
+	while ( *_parser->cursor == ' ' || *_parser->cursor == '\t' || *_parser->cursor == '\n' || *_parser->cursor == '\r' )
+		++ _parser->cursor;
+}
+
+//################################################################################
+
+// decode an attribute value between quotes, expanding the predefined entities
+static char * private_decode_value( char const * _begin, char const * const _end)
+{
+	char * const value = (char *) malloc( _end - _begin + 1);
+	if ( value == 0x0 )
+		return 0x0;
+	char *out = value;
+	while ( _begin < _end )
+	{
+		if ( *_begin != '&' )
+		{
+			*out ++ = *_begin ++;
+			continue;
+		}
+		static struct { char const *entity; char c; } const entities[] = { { "&lt;", '<' }, { "&gt;", '>' }, { "&amp;", '&' }, { "&quot;", '"' }, { "&apos;", '\'' } };
+		size_t i;
+		for ( i = 0; i < sizeof( entities) / sizeof( entities[0]); ++ i)
+		{
+			size_t const length = strlen( entities[i].entity);
+			if ( (size_t) (_end - _begin) >= length && strncmp( _begin, entities[i].entity, length) == 0 )
+			{
+				*out ++ = entities[i].c;
+				_begin += length;
+				break;
+			}
+		}
+		if ( i == sizeof( entities) / sizeof( entities[0]) )
+		{
+			// numeric references only appear in documentation strings, which we don't keep: leave them as they are
+			*out ++ = *_begin ++;
+		}
+	}
+	*out = '\0';
+	return value;
+}
+
+//################################################################################
+
+// parse the attributes of the current start tag, stops on '>' or "/>", returns 1 if the element is empty
+static int private_parse_attributes( IntrospectParser * const _parser)
+{
+	for ( ;;)
+	{
+		private_skip_spaces( _parser);
+		char const c = *_parser->cursor;
+		if ( c == '>' )
+		{
+			++ _parser->cursor;
+			return 0;
+		}
+		if ( c == '/' && _parser->cursor[1] == '>' )
+		{
+			_parser->cursor += 2;
+			return 1;
+		}
+		char const * const name = _parser->cursor;
+		while ( private_is_name_char( *_parser->cursor) )
+			++ _parser->cursor;
+		size_t const nameLength = _parser->cursor - name;
+		private_skip_spaces( _parser);
+		if ( nameLength == 0 || *_parser->cursor != '=' )
+			return _parser->error = "malformed attribute", 0;
+		++ _parser->cursor;
+		private_skip_spaces( _parser);
+		char const quote = *_parser->cursor;
+		if ( quote != '"' && quote != '\'' )
+			return _parser->error = "unquoted attribute value", 0;
+		char const * const begin = ++ _parser->cursor;
+		char const * const end = strchr( begin, quote);
+		if ( end == 0x0 )
+			return _parser->error = "unterminated attribute value", 0;
+		_parser->cursor = end + 1;
+		char **slot = 0x0;
+		if ( nameLength == 4 && strncmp( name, "name", 4) == 0 )
+			slot = &_parser->name;
+		else if ( nameLength == 4 && strncmp( name, "type", 4) == 0 )
+			slot = &_parser->type;
+		else if ( nameLength == 9 && strncmp( name, "direction", 9) == 0 )
+			slot = &_parser->direction;
+		else if ( nameLength == 6 && strncmp( name, "access", 6) == 0 )
+			slot = &_parser->access;
+		if ( slot != 0x0 )
+		{
+			free( *slot);
+			*slot = private_decode_value( begin, end);
+			if ( *slot == 0x0 )
+				return _parser->error = "not enough memory", 0;
+		}
+	}
+}
+
+//################################################################################
+
+static int private_element_is( char const * const _name, size_t const _length, char const * const _expected)
+{
+	return strlen( _expected) == _length && strncmp( _name, _expected, _length) == 0;
+}
+
+//################################################################################
+
+static void private_start_element( IntrospectParser * const _parser, char const * const _element, size_t const _length)
+{
+	IntrospectionData * const data = _parser->data;
+	if ( private_element_is( _element, _length, "node") )
+	{
+		++ _parser->nodeDepth;
+		// we only describe the node we introspected, its children are just listed
+		if ( _parser->nodeDepth == 2 && _parser->name != 0x0 )
+		{
+			char ** const child = (char **) private_grow_array( (void **) &data->children, &data->nbChildren, sizeof( char *));
+			if ( child == 0x0 || (*child = private_strdup( _parser->name)) == 0x0 )
+				_parser->error = "not enough memory";
+		}
+		return;
+	}
+	if ( _parser->nodeDepth != 1 )
+		return;
+	if ( private_element_is( _element, _length, "interface") )
+	{
+		if ( _parser->name == 0x0 || !dbus_validate_interface( _parser->name, 0x0) )
+		{
+			_parser->error = "interface without a valid name";
+			return;
+		}
+		IntrospectionInterface * const interface = (IntrospectionInterface *) private_grow_array( (void **) &data->interfaces, &data->nbInterfaces, sizeof( IntrospectionInterface));
+		if ( interface == 0x0 )
+		{
+			_parser->error = "not enough memory";
+			return;
+		}
+		interface->name = _parser->name;
+		_parser->name = 0x0;
+		_parser->interfaceIndex = data->nbInterfaces - 1;
+		return;
+	}
+	if ( _parser->interfaceIndex < 0 )
+		return;
+	IntrospectionInterface * const interface = &data->interfaces[_parser->interfaceIndex];
+	if ( private_element_is( _element, _length, "method") || private_element_is( _element, _length, "signal") )
+	{
+		if ( _parser->name == 0x0 || !dbus_validate_member( _parser->name, 0x0) )
+		{
+			_parser->error = "member without a valid name";
+			return;
+		}
+		int const isMethod = _element[0] == 'm';
+		char **name;
+		if ( isMethod )
+		{
+			IntrospectionMethod * const method = (IntrospectionMethod *) private_grow_array( (void **) &interface->methods, &interface->nbMethods, sizeof( IntrospectionMethod));
+			name = method ? &method->name : 0x0;
+			// a method without arguments has empty signatures, not missing ones
+			if ( method && ( !private_append_type( &method->inSignature, "") || !private_append_type( &method->outSignature, "") ) )
+				name = 0x0;
+		}
+		else
+		{
+			IntrospectionSignal * const signal = (IntrospectionSignal *) private_grow_array( (void **) &interface->signals, &interface->nbSignals, sizeof( IntrospectionSignal));
+			name = signal ? &signal->name : 0x0;
+			if ( signal && !private_append_type( &signal->signature, "") )
+				name = 0x0;
+		}
+		if ( name == 0x0 )
+		{
+			_parser->error = "not enough memory";
+			return;
+		}
+		*name = _parser->name;
+		_parser->name = 0x0;
+		_parser->memberKind = isMethod ? MEMBER_METHOD : MEMBER_SIGNAL;
+		_parser->memberIndex = ( isMethod ? interface->nbMethods : interface->nbSignals ) - 1;
+		return;
+	}
+	if ( private_element_is( _element, _length, "arg") )
+	{
+		if ( _parser->memberKind == MEMBER_NONE )
+			return;
+		if ( _parser->type == 0x0 || !dbus_signature_validate_single( _parser->type, 0x0) )
+		{
+			_parser->error = "argument without a valid type";
+			return;
+		}
+		char **signature;
+		if ( _parser->memberKind == MEMBER_METHOD )
+		{
+			IntrospectionMethod * const method = &interface->methods[_parser->memberIndex];
+			// arguments of methods are inputs unless told otherwise
+			signature = ( _parser->direction && strcmp( _parser->direction, "out") == 0 ) ? &method->outSignature : &method->inSignature;
+		}
+		else
+		{
+			signature = &interface->signals[_parser->memberIndex].signature;
+		}
+		if ( !private_append_type( signature, _parser->type) )
+			_parser->error = "not enough memory";
+		return;
+	}
+	if ( private_element_is( _element, _length, "property") )
+	{
+		if ( _parser->name == 0x0 || _parser->type == 0x0 || !dbus_signature_validate_single( _parser->type, 0x0) )
+		{
+			_parser->error = "property without a valid name or type";
+			return;
+		}
+		IntrospectionProperty * const property = (IntrospectionProperty *) private_grow_array( (void **) &interface->properties, &interface->nbProperties, sizeof( IntrospectionProperty));
+		if ( property == 0x0 )
+		{
+			_parser->error = "not enough memory";
+			return;
+		}
+		property->name = _parser->name;
+		property->type = _parser->type;
+		_parser->name = _parser->type = 0x0;
+		char const * const access = _parser->access ? _parser->access : "";
+		property->access = ( strstr( access, "read") ? INTROSPECTION_ACCESS_READ : 0 ) | ( strstr( access, "write") ? INTROSPECTION_ACCESS_WRITE : 0 );
+		return;
+	}
+	// annotations and anything else are of no use to us
+}
+
+//################################################################################
+
+static void private_end_element( IntrospectParser * const _parser, char const * const _element, size_t const _length)
+{
+	if ( private_element_is( _element, _length, "node") )
+		-- _parser->nodeDepth;
+	else if ( _parser->nodeDepth != 1 )
+		return;
+	else if ( private_element_is( _element, _length, "interface") )
+		_parser->interfaceIndex = -1;
+	else if ( private_element_is( _element, _length, "method") || private_element_is( _element, _length, "signal") )
+		_parser->memberKind = MEMBER_NONE;
+}
+
+//################################################################################
+
+// skip to the end of a construct we ignore, returns 0 if it is unterminated
+static int private_skip_past( IntrospectParser * const _parser, char const * const _terminator)
+{
+	char const * const end = strstr( _parser->cursor, _terminator);
+	if ( end == 0x0 )
+		return 0;
+	_parser->cursor = end + strlen( _terminator);
+	return 1;
+}
+
+//################################################################################
+//################################################################################
+
+IntrospectionData * introspection_parse( char const * const _xml, char const ** const _error)
+{
+	IntrospectParser parser;
+	memset( &parser, 0, sizeof( parser));
+	parser.cursor = _xml;
+	parser.interfaceIndex = -1;
+	parser.data = (IntrospectionData *) calloc( 1, sizeof( IntrospectionData));
+	if ( parser.data == 0x0 )
+	{
+		*_error = "not enough memory";
+		return 0x0;
+	}
+	while ( parser.error == 0x0 && *parser.cursor != '\0' )
+	{
+		if ( *parser.cursor != '<' )
+		{
+			// text between elements carries nothing for us
+			++ parser.cursor;
+			continue;
+		}
+		if ( strncmp( parser.cursor, "<!--", 4) == 0 )
+		{
+			if ( !private_skip_past( &parser, "-->") )
+				parser.error = "unterminated comment";
+			continue;
+		}
+		if ( strncmp( parser.cursor, "<?", 2) == 0 )
+		{
+			if ( !private_skip_past( &parser, "?>") )
+				parser.error = "unterminated processing instruction";
+			continue;
+		}
+		if ( strncmp( parser.cursor, "<!", 2) == 0 )
+		{
+			if ( !private_skip_past( &parser, ">") )
+				parser.error = "unterminated declaration";
+			continue;
+		}
+		int const closing = parser.cursor[1] == '/';
+		parser.cursor += closing ? 2 : 1;
+		char const * const element = parser.cursor;
+		while ( private_is_name_char( *parser.cursor) )
+			++ parser.cursor;
+		size_t const length = parser.cursor - element;
+		if ( length == 0 )
+		{
+			parser.error = "malformed tag";
+			break;
+		}
+		if ( closing )
+		{
+			if ( !private_skip_past( &parser, ">") )
+				parser.error = "unterminated tag";
+			else
+				private_end_element( &parser, element, length);
+			continue;
+		}
+		int const empty = private_parse_attributes( &parser);
+		if ( parser.error == 0x0 )
+			private_start_element( &parser, element, length);
+		if ( parser.error == 0x0 && empty )
+			private_end_element( &parser, element, length);
+		private_clear_attributes( &parser);
+	}
+	private_clear_attributes( &parser);
+	if ( parser.error == 0x0 && parser.nodeDepth != 0 )
+		parser.error = "unbalanced node elements";
+	if ( parser.error != 0x0 )
+	{
+		*_error = parser.error;
+		introspection_delete( parser.data);
+		return 0x0;
+	}
+	return parser.data;
+}
+
+//################################################################################
+
+void introspection_delete( IntrospectionData * const _data)
+{
+	int i, j;
+	for ( i = 0; i < _data->nbInterfaces; ++ i)
+	{
+		IntrospectionInterface * const interface = &_data->interfaces[i];
+		for ( j = 0; j < interface->nbMethods; ++ j)
+		{
+			free( interface->methods[j].name);
+			free( interface->methods[j].inSignature);
+			free( interface->methods[j].outSignature);
+			if ( interface->methods[j].template != 0x0 )
+				dbus_message_unref( interface->methods[j].template);
+		}
+		for ( j = 0; j < interface->nbSignals; ++ j)
+		{
+			free( interface->signals[j].name);
+			free( interface->signals[j].signature);
+		}
+		for ( j = 0; j < interface->nbProperties; ++ j)
+		{
+			free( interface->properties[j].name);
+			free( interface->properties[j].type);
+		}
+		free( interface->name);
+		free( interface->methods);
+		free( interface->signals);
+		free( interface->properties);
+	}
+	for ( i = 0; i < _data->nbChildren; ++ i)
+		free( _data->children[i]);
+	free( _data->interfaces);
+	free( _data->children);
+	free( _data);
+}
+
+//################################################################################
+
+IntrospectionInterface * introspection_find_interface( IntrospectionData * const _data, char const * const _name)
+{
+	int i;
+	for ( i = 0; i < _data->nbInterfaces; ++ i)
+		if ( strcmp( _data->interfaces[i].name, _name) == 0 )
+			return &_data->interfaces[i];
+	return 0x0;
+}
@@ -0,0 +1,64 @@
+#if ! defined ( __dbus_introspect_h__ )
+#define __dbus_introspect_h__ 1
+
+//################################################################################
+
+// what we keep of an Introspect document: interfaces with their members and signatures, and child node names
+// everything is allocated once by introspection_parse() and never moves afterwards
+
+#define INTROSPECTION_ACCESS_READ 1
+#define INTROSPECTION_ACCESS_WRITE 2
+
+struct IntrospectionMethod
+{
+	char *name;
+	char *inSignature;
+	char *outSignature;
+	// a ready to copy method call, filled by the proxy code
+	DBusMessage *template;
+};
+typedef struct IntrospectionMethod IntrospectionMethod;
+
+struct IntrospectionSignal
+{
+	char *name;
+	char *signature;
+};
+typedef struct IntrospectionSignal IntrospectionSignal;
+
+struct IntrospectionProperty
+{
+	char *name;
+	char *type;
+	int access;
+};
+typedef struct IntrospectionProperty IntrospectionProperty;
+
+struct IntrospectionInterface
+{
+	char *name;
+	int nbMethods;
+	IntrospectionMethod *methods;
+	int nbSignals;
+	IntrospectionSignal *signals;
+	int nbProperties;
+	IntrospectionProperty *properties;
+};
+typedef struct IntrospectionInterface IntrospectionInterface;
+
+struct IntrospectionData
+{
+	int nbInterfaces;
+	IntrospectionInterface *interfaces;
+	int nbChildren;
+	char **children;
+};
+typedef struct IntrospectionData IntrospectionData;
+
+extern IntrospectionData * introspection_parse( char const * const _xml, char const ** const _error);
+extern void introspection_delete( IntrospectionData * const _data);
+extern IntrospectionInterface * introspection_find_interface( IntrospectionData * const _data, char const * const _name);
+
+//################################################################################
+
+#endif // __dbus_introspect_h__
@@ -29,11 +29,13 @@
 #include <string.h>
 
 #include "utils.h"
+#include "dbus_message_args.h"
+#include "dbus_message_iter.h"
 
 //################################################################################
 //################################################################################
 
-int gMessageMetatableRef = LUA_NOREF;
+char const gMessageMetatableKey[] = "lua-dbus message";
 
 //################################################################################
 //################################################################################
@@ -45,7 +47,7 @@ int push_dbus_message( lua_State * const _L, DBusMessage * const _message)
 	else
 	{
 		// create (or find an existing) fully functional userdata for our connection
-		DBusMessage ** const block = (DBusMessage **) utils_push_mapped_userdata( _L, _message, gMessageMetatableRef, sizeof( void *));
+		DBusMessage ** const block = (DBusMessage **) utils_push_mapped_userdata( _L, _message, gMessageMetatableKey, sizeof( void *));
 		// connection address is already stored at the beginning of the userdata block, just fill the rest
 		printf( "push_dbus_message: new message contents: %p(%p)\n", _message, *block);
 		return 1;
@@ -54,9 +56,20 @@ int push_dbus_message( lua_State * const _L, DBusMessage * const _message)
 
 //################################################################################
 
+// push a message for which we hold a reference that the userdata must take over
+// if the message is already mapped in this state, the existing userdata has its own reference, so drop ours
+int push_referenced_dbus_message( lua_State * const _L, DBusMessage * const _message)
+{
+	if ( utils_is_mapped_userdata( _L, _message) )
+		dbus_message_unref( _message);
+	return push_dbus_message( _L, _message);
+}
+
+//################################################################################
+
 DBusMessage * cast_to_dbus_message( lua_State * const _L,  int const _ndx)
 {
-	return *(DBusMessage **) utils_cast_userdata( _L, _ndx, gMessageMetatableRef);
+	return *(DBusMessage **) utils_cast_userdata( _L, _ndx, gMessageMetatableKey);
 }
 
 //################################################################################
@@ -80,6 +93,88 @@ int bind_dbus_message_copy( lua_State * const _L)
 
 //################################################################################
 
+// dbus.message_demarshal( str) -> message, or nil, error
+int bind_dbus_message_demarshal( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	size_t length;
+	char const * const buffer = luaL_checklstring( _L, 1, &length);
+	DBusError error;
+	dbus_error_init( &error);
+	DBusMessage * const message = dbus_message_demarshal( buffer, (int) length, &error);
+	if ( message == 0x0 )
+	{
+		lua_pushnil( _L);
+		lua_pushstring( _L, error.message);
+		dbus_error_free( &error);
+		return 2;
+	}
+	return push_dbus_message( _L, message);
+}
+
+//################################################################################
+
+// dbus.message_bytes_needed( str) -> size of the whole message whose beginning is in str, or 0 if str is too short to tell
+// handy to split a stream of marshalled messages
+int bind_dbus_message_bytes_needed( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	size_t length;
+	char const * const buffer = luaL_checklstring( _L, 1, &length);
+	int const needed = dbus_message_demarshal_bytes_needed( buffer, (int) length);
+	if ( needed < 0 )
+		return luaL_argerror( _L, 1, "not the beginning of a marshalled message");
+	lua_pushinteger( _L, needed);
+	return 1;
+}
+
+//################################################################################
+
+// return an opaque handle that another state can turn back into a message with dbus.message_import
+// the handle holds a reference of its own, so it must be imported exactly once
+int bind_dbus_message_export( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	DBusMessage * const message = cast_to_dbus_message( _L, 1);
+	// once shared, the message must not be modified anymore
+	dbus_message_lock( message);
+	dbus_message_ref( message);
+	lua_pushlightuserdata( _L, message);
+	return 1;
+}
+
+//################################################################################
+
+int bind_dbus_message_get_no_reply( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	DBusMessage * const message = cast_to_dbus_message( _L, 1);
+	lua_pushboolean( _L, dbus_message_get_no_reply( message));
+	return 1;
+}
+
+//################################################################################
+
+int bind_dbus_message_get_reply_serial( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	DBusMessage * const message = cast_to_dbus_message( _L, 1);
+	lua_pushnumber( _L, (lua_Number) dbus_message_get_reply_serial( message));
+	return 1;
+}
+
+//################################################################################
+
+int bind_dbus_message_get_serial( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	DBusMessage * const message = cast_to_dbus_message( _L, 1);
+	lua_pushnumber( _L, (lua_Number) dbus_message_get_serial( message));
+	return 1;
+}
+
+//################################################################################
+
 int bind_dbus_message_get_type( lua_State * const _L)
 {
 	utils_check_nargs( _L, 1);
@@ -101,6 +196,36 @@ int bind_dbus_message_get_type( lua_State * const _L)
 
 //################################################################################
 
+int bind_dbus_message_import( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	luaL_checktype( _L, 1, LUA_TLIGHTUSERDATA);
+	DBusMessage * const message = (DBusMessage *) lua_touserdata( _L, 1);
+	if ( message == 0x0 )
+		return luaL_argerror( _L, 1, "NULL message handle");
+	// no copy: the new userdata takes over the reference held by the handle
+	return push_referenced_dbus_message( _L, message);
+}
+
+//################################################################################
+
+// msg:marshal() -> the message in wire format, as a string
+// locks the message, like sending it would
+int bind_dbus_message_marshal( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	DBusMessage * const message = cast_to_dbus_message( _L, 1);
+	char *buffer;
+	int length;
+	if ( !dbus_message_marshal( message, &buffer, &length) )
+		return luaL_error( _L, "not enough memory to marshal the message");
+	lua_pushlstring( _L, buffer, length);
+	dbus_free( buffer);
+	return 1;
+}
+
+//################################################################################
+
 int bind_dbus_message_new( lua_State * const _L)
 {
 	utils_check_nargs( _L, 1);
@@ -358,8 +483,20 @@ int finalize_dbus_message( lua_State * const _L)
 static luaL_Reg gMessageMeta[] =
 {
 	{ "__gc", finalize_dbus_message },
+	{ "append_args", bind_dbus_message_append_args } ,
+	{ "append_array", bind_dbus_message_append_array } ,
+	{ "args_into", bind_dbus_message_args_into } ,
 	{ "copy", bind_dbus_message_copy } ,
+	{ "decode_struct", bind_dbus_message_decode_struct } ,
+	{ "export", bind_dbus_message_export } ,
+	{ "get_args", bind_dbus_message_get_args } ,
+	{ "get_no_reply", bind_dbus_message_get_no_reply } ,
+	{ "get_reply_serial", bind_dbus_message_get_reply_serial } ,
+	{ "get_serial", bind_dbus_message_get_serial } ,
+	{ "get_signature", bind_dbus_message_get_signature } ,
 	{ "get_type", bind_dbus_message_get_type } ,
+	{ "iter_array", bind_dbus_message_iter_array } ,
+	{ "marshal", bind_dbus_message_marshal } ,
 	{ "set_auto_start", bind_dbus_message_set_auto_start } ,
 	{ "set_no_reply", bind_dbus_message_set_no_reply } ,
 	{ 0x0, 0x0 },
@@ -372,7 +509,7 @@ static luaL_Reg gMessageMeta[] =
 void register_message_stuff( lua_State * const _L)
 {
 	// register the connection object metatable in the registry
-	utils_prepare_metatable( _L, &gMessageMetatableRef);                      // {meta}
-	utils_register_upvalued_functions( _L, gMessageMeta, gMessageMetatableRef);
+	utils_prepare_metatable( _L, gMessageMetatableKey);                       // {meta}
+	utils_register_upvalued_functions( _L, gMessageMeta, gMessageMetatableKey);
 	lua_pop( _L, 1);                                                         //
 }
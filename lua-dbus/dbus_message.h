@@ -3,6 +3,9 @@
 
 //################################################################################
 
+extern int bind_dbus_message_bytes_needed( lua_State * const _L);
+extern int bind_dbus_message_demarshal( lua_State * const _L);
+extern int bind_dbus_message_import( lua_State * const _L);
 extern int bind_dbus_message_new( lua_State * const _L);
 extern int bind_dbus_message_new_error( lua_State * const _L);
 extern int bind_dbus_message_new_method_call( lua_State * const _L);
@@ -0,0 +1,935 @@
+/************************************************************************
+*
+* Lua bindings for libdbus.
+* Copyright (c) 2009 - BenoitGermain <bnt.germain@gmail.com>
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+************************************************************************/
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "utils.h"
+#include "dbus_message_args.h"
+#include "dbus_unix_fd.h"
+
+//################################################################################
+// conversion of message arguments from and to lua values
+// * integer and floating point types <-> number
+// * boolean <-> boolean
+// * string, object path, signature <-> string
+// * array of bytes <-> string
+// * other arrays and structs <-> array tables
+// * dictionaries <-> tables
+// * variants are transparent, the contained value is used
+// * unix fd <-> fd object (or a descriptor number when appending)
+//################################################################################
+
+extern DBusMessage * cast_to_dbus_message( lua_State * const _L,  int const _ndx);
+
+//################################################################################
+//################################################################################
+
+int message_args_push_iter_value( lua_State * const _L, DBusMessageIter * const _iter)
+{
+	luaL_checkstack( _L, 3, "message is too deeply nested");
+	int const type = dbus_message_iter_get_arg_type( _iter);
+	switch( type)
+	{
+		case DBUS_TYPE_BYTE:
+		{
+			unsigned char value;
+			dbus_message_iter_get_basic( _iter, &value);
+			lua_pushnumber( _L, (lua_Number) value);
+		}
+		break;
+
+		case DBUS_TYPE_BOOLEAN:
+		{
+			dbus_bool_t value;
+			dbus_message_iter_get_basic( _iter, &value);
+			lua_pushboolean( _L, value != 0);
+		}
+		break;
+
+		case DBUS_TYPE_INT16:
+		{
+			dbus_int16_t value;
+			dbus_message_iter_get_basic( _iter, &value);
+			lua_pushnumber( _L, (lua_Number) value);
+		}
+		break;
+
+		case DBUS_TYPE_UINT16:
+		{
+			dbus_uint16_t value;
+			dbus_message_iter_get_basic( _iter, &value);
+			lua_pushnumber( _L, (lua_Number) value);
+		}
+		break;
+
+		case DBUS_TYPE_INT32:
+		{
+			dbus_int32_t value;
+			dbus_message_iter_get_basic( _iter, &value);
+			lua_pushnumber( _L, (lua_Number) value);
+		}
+		break;
+
+		case DBUS_TYPE_UINT32:
+		{
+			dbus_uint32_t value;
+			dbus_message_iter_get_basic( _iter, &value);
+			lua_pushnumber( _L, (lua_Number) value);
+		}
+		break;
+
+		case DBUS_TYPE_INT64:
+		{
+			dbus_int64_t value;
+			dbus_message_iter_get_basic( _iter, &value);
+			lua_pushnumber( _L, (lua_Number) value);
+		}
+		break;
+
+		case DBUS_TYPE_UINT64:
+		{
+			dbus_uint64_t value;
+			dbus_message_iter_get_basic( _iter, &value);
+			lua_pushnumber( _L, (lua_Number) value);
+		}
+		break;
+
+		case DBUS_TYPE_DOUBLE:
+		{
+			double value;
+			dbus_message_iter_get_basic( _iter, &value);
+			lua_pushnumber( _L, (lua_Number) value);
+		}
+		break;
+
+		case DBUS_TYPE_STRING:
+		case DBUS_TYPE_OBJECT_PATH:
+		case DBUS_TYPE_SIGNATURE:
+		{
+			char const * value;
+			dbus_message_iter_get_basic( _iter, &value);
+			lua_pushstring( _L, value);
+		}
+		break;
+
+		case DBUS_TYPE_UNIX_FD:
+		{
+			// libdbus gives us a duplicate each time, the fd object will close it
+			int value;
+			dbus_message_iter_get_basic( _iter, &value);
+			if ( value < 0 )
+				return luaL_error( _L, "failed to duplicate a received fd");
+			push_dbus_unix_fd( _L, value);
+		}
+		break;
+
+		case DBUS_TYPE_VARIANT:
+		{
+			DBusMessageIter sub;
+			dbus_message_iter_recurse( _iter, &sub);
+			message_args_push_iter_value( _L, &sub);
+		}
+		break;
+
+		case DBUS_TYPE_STRUCT:
+		{
+			DBusMessageIter sub;
+			dbus_message_iter_recurse( _iter, &sub);
+			lua_newtable( _L);                                           // {struct}
+			int field = 0;
+			while ( dbus_message_iter_get_arg_type( &sub) != DBUS_TYPE_INVALID )
+			{
+				message_args_push_iter_value( _L, &sub);                  // {struct} value
+				lua_rawseti( _L, -2, ++ field);                           // {struct}
+				dbus_message_iter_next( &sub);
+			}
+		}
+		break;
+
+		case DBUS_TYPE_ARRAY:
+		{
+			int const elementType = dbus_message_iter_get_element_type( _iter);
+			DBusMessageIter sub;
+			dbus_message_iter_recurse( _iter, &sub);
+			if ( elementType == DBUS_TYPE_BYTE )
+			{
+				// byte arrays are blobs, a string is much cheaper than a table of numbers
+				char const * bytes;
+				int nbBytes;
+				dbus_message_iter_get_fixed_array( &sub, &bytes, &nbBytes);
+				lua_pushlstring( _L, bytes, nbBytes);
+			}
+			else if ( elementType == DBUS_TYPE_DICT_ENTRY )
+			{
+				lua_newtable( _L);                                        // {dict}
+				while ( dbus_message_iter_get_arg_type( &sub) != DBUS_TYPE_INVALID )
+				{
+					DBusMessageIter entry;
+					dbus_message_iter_recurse( &sub, &entry);
+					message_args_push_iter_value( _L, &entry);             // {dict} key
+					dbus_message_iter_next( &entry);
+					message_args_push_iter_value( _L, &entry);             // {dict} key value
+					lua_rawset( _L, -3);                                   // {dict}
+					dbus_message_iter_next( &sub);
+				}
+			}
+			else
+			{
+				lua_newtable( _L);                                        // {array}
+				int index = 0;
+				while ( dbus_message_iter_get_arg_type( &sub) != DBUS_TYPE_INVALID )
+				{
+					message_args_push_iter_value( _L, &sub);               // {array} value
+					lua_rawseti( _L, -2, ++ index);                        // {array}
+					dbus_message_iter_next( &sub);
+				}
+			}
+		}
+		break;
+
+		default:
+		return luaL_error( _L, "unsupported argument type '%c'", (char) type);
+	}
+	return 1;
+}
+
+//################################################################################
+// decoding into existing tables: a container that decodes as a table reuses the table already
+// at its place, so a handler decoding the same shape on every message allocates nothing once warm
+//################################################################################
+
+static void private_decode_container_into( lua_State * const _L, DBusMessageIter * const _iter, int const _ndx);
+
+// structs and arrays other than byte arrays, those end up as tables
+static int private_decodes_to_table( DBusMessageIter * const _iter)
+{
+	int const type = dbus_message_iter_get_arg_type( _iter);
+	return type == DBUS_TYPE_STRUCT || (type == DBUS_TYPE_ARRAY && dbus_message_iter_get_element_type( _iter) != DBUS_TYPE_BYTE);
+}
+
+//################################################################################
+
+// _table[key] = value, where key is on the top of the stack (and popped)
+static void private_set_value_into( lua_State * const _L, DBusMessageIter * const _value, int const _ndx)
+{
+	// variants are transparent
+	DBusMessageIter content = *_value;
+	while ( dbus_message_iter_get_arg_type( &content) == DBUS_TYPE_VARIANT )
+	{
+		DBusMessageIter sub;
+		dbus_message_iter_recurse( &content, &sub);
+		content = sub;
+	}
+	if ( private_decodes_to_table( &content) )
+	{
+		lua_pushvalue( _L, -1);                                         // ... key key
+		lua_rawget( _L, _ndx);                                          // ... key old
+		if ( lua_istable( _L, -1) )
+		{
+			private_decode_container_into( _L, &content, lua_gettop( _L));
+			lua_pop( _L, 2);                                             // ...
+			return;
+		}
+		lua_pop( _L, 1);                                                // ... key
+	}
+	message_args_push_iter_value( _L, &content);                      // ... key value
+	lua_rawset( _L, _ndx);                                            // ...
+}
+
+//################################################################################
+
+// _table[1..n] = the values from _iter on, and the integer keys after n are cleared
+static void private_decode_sequence_into( lua_State * const _L, DBusMessageIter * const _iter, int const _ndx)
+{
+	int index = 0;
+	while ( dbus_message_iter_get_arg_type( _iter) != DBUS_TYPE_INVALID )
+	{
+		lua_pushinteger( _L, ++ index);                                 // ... index
+		private_set_value_into( _L, _iter, _ndx);                       // ...
+		dbus_message_iter_next( _iter);
+	}
+	// whatever follows belongs to a longer, previous, message
+	for ( ;; )
+	{
+		lua_rawgeti( _L, _ndx, ++ index);                               // ... old
+		int const stale = !lua_isnil( _L, -1);
+		lua_pop( _L, 1);                                                // ...
+		if ( !stale )
+			break;
+		lua_pushnil( _L);                                               // ... nil
+		lua_rawseti( _L, _ndx, index);                                  // ...
+	}
+}
+
+//################################################################################
+
+// tells if the dictionary entries from _entries on have the key at _keyNdx
+static int private_dict_has_key( lua_State * const _L, DBusMessageIter const * const _entries, int const _keyNdx)
+{
+	DBusMessageIter entries = *_entries;
+	while ( dbus_message_iter_get_arg_type( &entries) != DBUS_TYPE_INVALID )
+	{
+		DBusMessageIter entry;
+		dbus_message_iter_recurse( &entries, &entry);
+		message_args_push_iter_value( _L, &entry);                      // ... key
+		int const found = lua_rawequal( _L, -1, _keyNdx);
+		lua_pop( _L, 1);                                                // ...
+		if ( found )
+			return 1;
+		dbus_message_iter_next( &entries);
+	}
+	return 0;
+}
+
+//################################################################################
+
+static void private_decode_container_into( lua_State * const _L, DBusMessageIter * const _iter, int const _ndx)
+{
+	luaL_checkstack( _L, 4, "message is too deeply nested");
+	DBusMessageIter sub;
+	dbus_message_iter_recurse( _iter, &sub);
+	if ( dbus_message_iter_get_arg_type( _iter) != DBUS_TYPE_ARRAY || dbus_message_iter_get_element_type( _iter) != DBUS_TYPE_DICT_ENTRY )
+	{
+		private_decode_sequence_into( _L, &sub, _ndx);
+		return;
+	}
+	DBusMessageIter entries = sub;
+	int nbKeys = 0;
+	while ( dbus_message_iter_get_arg_type( &entries) != DBUS_TYPE_INVALID )
+	{
+		DBusMessageIter entry;
+		dbus_message_iter_recurse( &entries, &entry);
+		message_args_push_iter_value( _L, &entry);                      // ... key
+		dbus_message_iter_next( &entry);
+		private_set_value_into( _L, &entry, _ndx);                      // ...
+		++ nbKeys;
+		dbus_message_iter_next( &entries);
+	}
+	// same shape as last time is the usual case: the table has no more keys than we just wrote
+	int nbTableKeys = 0;
+	lua_pushnil( _L);                                                 // ... nil
+	while ( lua_next( _L, _ndx) != 0 )                                // ... key value
+	{
+		++ nbTableKeys;
+		lua_pop( _L, 1);                                               // ... key
+	}                                                                 // ...
+	if ( nbTableKeys <= nbKeys )
+		return;
+	// else look up each key in the message, clearing an existing field while traversing is allowed
+	lua_pushnil( _L);                                                 // ... nil
+	while ( lua_next( _L, _ndx) != 0 )                                // ... key value
+	{
+		lua_pop( _L, 1);                                               // ... key
+		if ( !private_dict_has_key( _L, &sub, lua_gettop( _L)) )
+		{
+			lua_pushvalue( _L, -1);                                     // ... key key
+			lua_pushnil( _L);                                           // ... key key nil
+			lua_rawset( _L, _ndx);                                      // ... key
+		}
+	}                                                                 // ...
+}
+
+//################################################################################
+//################################################################################
+
+char const * message_args_infer_signature( lua_State * const _L, int _ndx)
+{
+	switch( lua_type( _L, _ndx))
+	{
+		case LUA_TBOOLEAN:
+		return DBUS_TYPE_BOOLEAN_AS_STRING;
+
+		case LUA_TNUMBER:
+		{
+			lua_Number const number = lua_tonumber( _L, _ndx);
+			// out of range values and NaN fail the first test, non integer values the second one
+			if ( !(number >= -9.2e18 && number <= 9.2e18) || number != (lua_Number) (dbus_int64_t) number )
+				return DBUS_TYPE_DOUBLE_AS_STRING;
+			if ( number < -2147483648.0 || number > 2147483647.0 )
+				return DBUS_TYPE_INT64_AS_STRING;
+			return DBUS_TYPE_INT32_AS_STRING;
+		}
+
+		case LUA_TSTRING:
+		return DBUS_TYPE_STRING_AS_STRING;
+
+		case LUA_TUSERDATA:
+		if ( is_dbus_unix_fd( _L, _ndx) )
+			return DBUS_TYPE_UNIX_FD_AS_STRING;
+		return luaL_error( _L, "can't find a D-Bus type for a %s", luaL_typename( _L, _ndx)), (char const *) 0x0;
+
+		case LUA_TTABLE:
+		// sequences become arrays of variants, anything else a string-keyed dictionary of variants
+		if ( lua_objlen( _L, _ndx) > 0 )
+			return DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_VARIANT_AS_STRING;
+		return DBUS_TYPE_ARRAY_AS_STRING DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING DBUS_DICT_ENTRY_END_CHAR_AS_STRING;
+
+		default:
+		return luaL_error( _L, "can't find a D-Bus type for a %s", luaL_typename( _L, _ndx)), (char const *) 0x0;
+	}
+}
+
+//################################################################################
+
+static lua_Number private_check_number( lua_State * const _L, int _ndx, int const _type)
+{
+	if ( lua_type( _L, _ndx) != LUA_TNUMBER )
+		return luaL_error( _L, "'%c' argument expects a number, got a %s", (char) _type, luaL_typename( _L, _ndx)), 0;
+	return lua_tonumber( _L, _ndx);
+}
+
+//################################################################################
+
+static char const * private_check_string( lua_State * const _L, int _ndx, int const _type)
+{
+	if ( lua_type( _L, _ndx) != LUA_TSTRING )
+		return luaL_error( _L, "'%c' argument expects a string, got a %s", (char) _type, luaL_typename( _L, _ndx)), (char const *) 0x0;
+	return lua_tostring( _L, _ndx);
+}
+
+//################################################################################
+
+// raise an error unless the value at _ndx can be appended as the complete type _signature points to
+// everything is checked before anything is appended, so that an error never leaves a container open
+static void private_check_value( lua_State * const _L, int _ndx, DBusSignatureIter * const _signature)
+{
+	_ndx = utils_to_absolute_stack_index( _ndx);
+	luaL_checkstack( _L, 4, "argument is too deeply nested");
+	int const type = dbus_signature_iter_get_current_type( _signature);
+	switch( type)
+	{
+		case DBUS_TYPE_BYTE:
+		case DBUS_TYPE_INT16:
+		case DBUS_TYPE_UINT16:
+		case DBUS_TYPE_INT32:
+		case DBUS_TYPE_UINT32:
+		case DBUS_TYPE_INT64:
+		case DBUS_TYPE_UINT64:
+		case DBUS_TYPE_DOUBLE:
+		private_check_number( _L, _ndx, type);
+		break;
+
+		case DBUS_TYPE_BOOLEAN:
+		luaL_argcheck( _L, lua_isboolean( _L, _ndx), _ndx, "'b' argument expects a boolean");
+		break;
+
+		case DBUS_TYPE_STRING:
+		case DBUS_TYPE_OBJECT_PATH:
+		case DBUS_TYPE_SIGNATURE:
+		{
+			char const * const value = private_check_string( _L, _ndx, type);
+			if ( type == DBUS_TYPE_OBJECT_PATH )
+				utils_object_path_name_is_valid( _L, value);
+			else if ( type == DBUS_TYPE_SIGNATURE && !dbus_signature_validate( value, 0x0) )
+				luaL_error( _L, "'%s' is not a valid signature", value);
+		}
+		break;
+
+		case DBUS_TYPE_UNIX_FD:
+		check_dbus_unix_fd( _L, _ndx);
+		break;
+
+		case DBUS_TYPE_VARIANT:
+		{
+			DBusSignatureIter contentSignature;
+			dbus_signature_iter_init( &contentSignature, message_args_infer_signature( _L, _ndx));
+			private_check_value( _L, _ndx, &contentSignature);
+		}
+		break;
+
+		case DBUS_TYPE_STRUCT:
+		{
+			luaL_argcheck( _L, lua_istable( _L, _ndx), _ndx, "struct argument expects a table");
+			DBusSignatureIter fieldSignature;
+			dbus_signature_iter_recurse( _signature, &fieldSignature);
+			int field = 1;
+			do
+			{
+				lua_rawgeti( _L, _ndx, field ++);                         // ... field
+				private_check_value( _L, -1, &fieldSignature);
+				lua_pop( _L, 1);                                          // ...
+			} while ( dbus_signature_iter_next( &fieldSignature));
+		}
+		break;
+
+		case DBUS_TYPE_ARRAY:
+		{
+			DBusSignatureIter elementSignature;
+			dbus_signature_iter_recurse( _signature, &elementSignature);
+			int const elementType = dbus_signature_iter_get_current_type( &elementSignature);
+			if ( elementType == DBUS_TYPE_BYTE && lua_type( _L, _ndx) == LUA_TSTRING )
+			{
+				// blob
+			}
+			else if ( elementType == DBUS_TYPE_DICT_ENTRY )
+			{
+				luaL_argcheck( _L, lua_istable( _L, _ndx), _ndx, "dictionary argument expects a table");
+				lua_pushnil( _L);                                         // ... nil
+				while ( lua_next( _L, _ndx) != 0 )                        // ... key value
+				{
+					DBusSignatureIter entrySignature;
+					dbus_signature_iter_recurse( &elementSignature, &entrySignature);
+					private_check_value( _L, -2, &entrySignature);
+					dbus_signature_iter_next( &entrySignature);
+					private_check_value( _L, -1, &entrySignature);
+					lua_pop( _L, 1);                                       // ... key
+				}                                                         // ...
+			}
+			else
+			{
+				luaL_argcheck( _L, lua_istable( _L, _ndx), _ndx, "array argument expects a table");
+				int const count = (int) lua_objlen( _L, _ndx);
+				int index;
+				for ( index = 1; index <= count; ++ index)
+				{
+					lua_rawgeti( _L, _ndx, index);                         // ... value
+					private_check_value( _L, -1, &elementSignature);
+					lua_pop( _L, 1);                                       // ...
+				}
+			}
+		}
+		break;
+
+		default:
+		luaL_error( _L, "unsupported argument type '%c'", (char) type);
+	}
+}
+
+//################################################################################
+
+// append a value that passed private_check_value(): only running out of memory can fail now,
+// in which case the containers opened on the way are abandoned before returning FALSE
+static dbus_bool_t private_append_checked_value( lua_State * const _L, int _ndx, DBusSignatureIter * const _signature, DBusMessageIter * const _iter)
+{
+	_ndx = utils_to_absolute_stack_index( _ndx);
+	int const type = dbus_signature_iter_get_current_type( _signature);
+	switch( type)
+	{
+		case DBUS_TYPE_BYTE:
+		{
+			unsigned char const value = (unsigned char) lua_tonumber( _L, _ndx);
+			return dbus_message_iter_append_basic( _iter, type, &value);
+		}
+
+		case DBUS_TYPE_BOOLEAN:
+		{
+			dbus_bool_t const value = lua_toboolean( _L, _ndx) ? TRUE : FALSE;
+			return dbus_message_iter_append_basic( _iter, type, &value);
+		}
+
+		case DBUS_TYPE_INT16:
+		{
+			dbus_int16_t const value = (dbus_int16_t) lua_tonumber( _L, _ndx);
+			return dbus_message_iter_append_basic( _iter, type, &value);
+		}
+
+		case DBUS_TYPE_UINT16:
+		{
+			dbus_uint16_t const value = (dbus_uint16_t) lua_tonumber( _L, _ndx);
+			return dbus_message_iter_append_basic( _iter, type, &value);
+		}
+
+		case DBUS_TYPE_INT32:
+		{
+			dbus_int32_t const value = (dbus_int32_t) lua_tonumber( _L, _ndx);
+			return dbus_message_iter_append_basic( _iter, type, &value);
+		}
+
+		case DBUS_TYPE_UINT32:
+		{
+			dbus_uint32_t const value = (dbus_uint32_t) lua_tonumber( _L, _ndx);
+			return dbus_message_iter_append_basic( _iter, type, &value);
+		}
+
+		case DBUS_TYPE_INT64:
+		{
+			dbus_int64_t const value = (dbus_int64_t) lua_tonumber( _L, _ndx);
+			return dbus_message_iter_append_basic( _iter, type, &value);
+		}
+
+		case DBUS_TYPE_UINT64:
+		{
+			dbus_uint64_t const value = (dbus_uint64_t) lua_tonumber( _L, _ndx);
+			return dbus_message_iter_append_basic( _iter, type, &value);
+		}
+
+		case DBUS_TYPE_DOUBLE:
+		{
+			double const value = (double) lua_tonumber( _L, _ndx);
+			return dbus_message_iter_append_basic( _iter, type, &value);
+		}
+
+		case DBUS_TYPE_STRING:
+		case DBUS_TYPE_OBJECT_PATH:
+		case DBUS_TYPE_SIGNATURE:
+		{
+			char const * const value = lua_tostring( _L, _ndx);
+			return dbus_message_iter_append_basic( _iter, type, &value);
+		}
+
+		case DBUS_TYPE_UNIX_FD:
+		{
+			// the message holds a duplicate, the caller keeps its own descriptor
+			int const value = check_dbus_unix_fd( _L, _ndx);
+			return dbus_message_iter_append_basic( _iter, type, &value);
+		}
+
+		case DBUS_TYPE_VARIANT:
+		{
+			char const * const signature = message_args_infer_signature( _L, _ndx);
+			DBusSignatureIter contentSignature;
+			dbus_signature_iter_init( &contentSignature, signature);
+			DBusMessageIter sub;
+			if ( !dbus_message_iter_open_container( _iter, DBUS_TYPE_VARIANT, signature, &sub) )
+				return FALSE;
+			if ( !private_append_checked_value( _L, _ndx, &contentSignature, &sub) )
+			{
+				dbus_message_iter_abandon_container( _iter, &sub);
+				return FALSE;
+			}
+			return dbus_message_iter_close_container( _iter, &sub);
+		}
+
+		case DBUS_TYPE_STRUCT:
+		{
+			DBusSignatureIter fieldSignature;
+			dbus_signature_iter_recurse( _signature, &fieldSignature);
+			DBusMessageIter sub;
+			if ( !dbus_message_iter_open_container( _iter, DBUS_TYPE_STRUCT, 0x0, &sub) )
+				return FALSE;
+			int field = 1;
+			do
+			{
+				lua_rawgeti( _L, _ndx, field ++);                         // ... field
+				dbus_bool_t const ok = private_append_checked_value( _L, -1, &fieldSignature, &sub);
+				lua_pop( _L, 1);                                          // ...
+				if ( !ok )
+				{
+					dbus_message_iter_abandon_container( _iter, &sub);
+					return FALSE;
+				}
+			} while ( dbus_signature_iter_next( &fieldSignature));
+			return dbus_message_iter_close_container( _iter, &sub);
+		}
+
+		case DBUS_TYPE_ARRAY:
+		{
+			DBusSignatureIter elementSignature;
+			dbus_signature_iter_recurse( _signature, &elementSignature);
+			int const elementType = dbus_signature_iter_get_current_type( &elementSignature);
+			char * const signature = dbus_signature_iter_get_signature( &elementSignature);
+			if ( signature == 0x0 )
+				return FALSE;
+			DBusMessageIter sub;
+			dbus_bool_t const opened = dbus_message_iter_open_container( _iter, DBUS_TYPE_ARRAY, signature, &sub);
+			dbus_free( signature);
+			if ( !opened )
+				return FALSE;
+			dbus_bool_t ok = TRUE;
+			if ( elementType == DBUS_TYPE_BYTE && lua_type( _L, _ndx) == LUA_TSTRING )
+			{
+				// blob
+				size_t length;
+				char const * bytes = lua_tolstring( _L, _ndx, &length);
+				ok = dbus_message_iter_append_fixed_array( &sub, DBUS_TYPE_BYTE, &bytes, (int) length);
+			}
+			else if ( elementType == DBUS_TYPE_DICT_ENTRY )
+			{
+				lua_pushnil( _L);                                         // ... nil
+				while ( ok && lua_next( _L, _ndx) != 0 )                  // ... key value
+				{
+					DBusSignatureIter entrySignature;
+					dbus_signature_iter_recurse( &elementSignature, &entrySignature);
+					DBusMessageIter entry;
+					ok = dbus_message_iter_open_container( &sub, DBUS_TYPE_DICT_ENTRY, 0x0, &entry);
+					if ( ok )
+					{
+						ok = private_append_checked_value( _L, -2, &entrySignature, &entry)
+							&& dbus_signature_iter_next( &entrySignature)
+							&& private_append_checked_value( _L, -1, &entrySignature, &entry);
+						if ( ok )
+							ok = dbus_message_iter_close_container( &sub, &entry);
+						else
+							dbus_message_iter_abandon_container( &sub, &entry);
+					}
+					lua_pop( _L, ok ? 1 : 2);                              // ... key | ...
+				}                                                         // ...
+			}
+			else
+			{
+				int const count = (int) lua_objlen( _L, _ndx);
+				int index;
+				for ( index = 1; ok && index <= count; ++ index)
+				{
+					lua_rawgeti( _L, _ndx, index);                         // ... value
+					ok = private_append_checked_value( _L, -1, &elementSignature, &sub);
+					lua_pop( _L, 1);                                       // ...
+				}
+			}
+			if ( !ok )
+			{
+				dbus_message_iter_abandon_container( _iter, &sub);
+				return FALSE;
+			}
+			return dbus_message_iter_close_container( _iter, &sub);
+		}
+
+		default:
+		return FALSE;
+	}
+}
+
+//################################################################################
+
+// the whole value is checked first: an error raised here never leaves a container open in the message
+void message_args_append_value( lua_State * const _L, int _ndx, DBusSignatureIter * const _signature, DBusMessageIter * const _iter)
+{
+	private_check_value( _L, _ndx, _signature);
+	if ( !private_append_checked_value( _L, _ndx, _signature, _iter) )
+		luaL_error( _L, "not enough memory to append argument");
+}
+
+//################################################################################
+
+// what the protected loop of msg:append_array() needs
+struct ArrayAppend
+{
+	DBusSignatureIter element;
+	DBusMessageIter *array;
+	int count;
+};
+typedef struct ArrayAppend ArrayAppend;
+
+//################################################################################
+
+// lua_pcall'ed with ( state, f, s, ctl): append what f( s, ctl) returns until it returns nil,
+// the first value for plain arrays, the first two as key and value for dictionaries
+static int private_append_elements( lua_State * const _L)
+{
+	ArrayAppend * const append = (ArrayAppend *) lua_touserdata( _L, 1);
+	int const isDict = ( dbus_signature_iter_get_current_type( &append->element) == DBUS_TYPE_DICT_ENTRY );
+	for ( ;; )
+	{
+		lua_pushvalue( _L, 2);                                        // state f s ctl f
+		lua_pushvalue( _L, 3);                                        // state f s ctl f s
+		lua_pushvalue( _L, 4);                                        // state f s ctl f s ctl
+		lua_call( _L, 2, 2);                                          // state f s ctl v1 v2
+		if ( lua_isnil( _L, -2) )
+			break;
+		if ( isDict )
+		{
+			DBusSignatureIter entrySignature;
+			dbus_signature_iter_recurse( &append->element, &entrySignature);
+			// check both halves before the entry is opened, so that an error can't leave it open
+			DBusSignatureIter valueSignature = entrySignature;
+			dbus_signature_iter_next( &valueSignature);
+			private_check_value( _L, -2, &entrySignature);
+			private_check_value( _L, -1, &valueSignature);
+			DBusMessageIter entry;
+			if ( !dbus_message_iter_open_container( append->array, DBUS_TYPE_DICT_ENTRY, 0x0, &entry) )
+				return luaL_error( _L, "not enough memory to append argument");
+			if ( !private_append_checked_value( _L, -2, &entrySignature, &entry) || !private_append_checked_value( _L, -1, &valueSignature, &entry) )
+			{
+				dbus_message_iter_abandon_container( append->array, &entry);
+				return luaL_error( _L, "not enough memory to append argument");
+			}
+			if ( !dbus_message_iter_close_container( append->array, &entry) )
+				return luaL_error( _L, "not enough memory to append argument");
+		}
+		else
+		{
+			message_args_append_value( _L, -2, &append->element, append->array);
+		}
+		++ append->count;
+		lua_pop( _L, 1);                                              // state f s ctl v1
+		lua_replace( _L, 4);                                          // state f s v1
+	}
+	return 0;
+}
+
+//################################################################################
+//################################################################################
+
+int bind_dbus_message_append_args( lua_State * const _L)
+{
+	// the message, its signature, then one value per complete type in the signature
+	DBusMessage * const message = cast_to_dbus_message( _L, 1);
+	char const * const signature = luaL_checkstring( _L, 2);
+	DBusError error;
+	dbus_error_init( &error);
+	if ( !dbus_signature_validate( signature, &error) )
+	{
+		lua_pushfstring( _L, "invalid signature '%s': %s", signature, error.message);
+		dbus_error_free( &error);
+		return lua_error( _L);
+	}
+	int const nbValues = lua_gettop( _L) - 2;
+	DBusSignatureIter signatureIter;
+	dbus_signature_iter_init( &signatureIter, signature);
+	DBusMessageIter iter;
+	dbus_message_iter_init_append( message, &iter);
+	int ndx = 3;
+	if ( *signature != '\0' )
+	{
+		do
+		{
+			if ( ndx - 2 > nbValues )
+				return luaL_error( _L, "signature '%s' expects more than %d values", signature, nbValues);
+			message_args_append_value( _L, ndx ++, &signatureIter, &iter);
+		} while ( dbus_signature_iter_next( &signatureIter));
+	}
+	if ( ndx - 3 != nbValues )
+		return luaL_error( _L, "signature '%s' expects %d values, got %d", signature, ndx - 3, nbValues);
+	return 0;
+}
+
+//################################################################################
+
+// msg:append_array( sig, f [, s [, ctl]]) -> number of elements appended
+// appends an array argument of type sig ("a(ssv)", "a{sv}", ...) whose elements are produced by f( s, ctl),
+// called like a generic for would until it returns nil: no table of the whole array is ever built
+// a dictionary takes the first two values as key and value, so pairs( t) or any ( k, v) iterator works;
+// other arrays take the first value, as a generator would yield it
+// if anything raises an error, the array is abandoned, and so is the message: libdbus can't recover it
+int bind_dbus_message_append_array( lua_State * const _L)
+{
+	DBusMessage * const message = cast_to_dbus_message( _L, 1);
+	char const * const signature = luaL_checkstring( _L, 2);
+	luaL_checktype( _L, 3, LUA_TFUNCTION);
+	luaL_argcheck( _L, lua_gettop( _L) <= 5, 5, "too many arguments");
+	lua_settop( _L, 5);                                                             // msg sig f s ctl
+	DBusError error;
+	dbus_error_init( &error);
+	if ( !dbus_signature_validate_single( signature, &error) )
+	{
+		lua_pushfstring( _L, "invalid signature '%s': %s", signature, error.message);
+		dbus_error_free( &error);
+		return lua_error( _L);
+	}
+	luaL_argcheck( _L, signature[0] == DBUS_TYPE_ARRAY, 2, "expects an array signature");
+	DBusSignatureIter arraySignature;
+	dbus_signature_iter_init( &arraySignature, signature);
+	ArrayAppend append;
+	dbus_signature_iter_recurse( &arraySignature, &append.element);
+	append.count = 0;
+	DBusMessageIter iter;
+	dbus_message_iter_init_append( message, &iter);
+	DBusMessageIter sub;
+	if ( !dbus_message_iter_open_container( &iter, DBUS_TYPE_ARRAY, signature + 1, &sub) )
+		return luaL_error( _L, "not enough memory to append argument");
+	append.array = &sub;
+	// the container must be abandoned or closed whatever happens, so the loop runs protected
+	lua_pushcfunction( _L, private_append_elements);                               // msg sig f s ctl appender
+	lua_pushlightuserdata( _L, &append);                                           // msg sig f s ctl appender state
+	lua_pushvalue( _L, 3);                                                         // msg sig f s ctl appender state f
+	lua_pushvalue( _L, 4);                                                         // msg sig f s ctl appender state f s
+	lua_pushvalue( _L, 5);                                                         // msg sig f s ctl appender state f s ctl
+	if ( lua_pcall( _L, 4, 0, 0) != 0 )                                            // msg sig f s ctl [error]
+	{
+		dbus_message_iter_abandon_container( &iter, &sub);
+		return lua_error( _L);
+	}
+	if ( !dbus_message_iter_close_container( &iter, &sub) )
+		return luaL_error( _L, "not enough memory to append argument");
+	lua_pushinteger( _L, append.count);
+	return 1;
+}
+
+//################################################################################
+
+int bind_dbus_message_get_args( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	DBusMessage * const message = cast_to_dbus_message( _L, 1);
+	DBusMessageIter iter;
+	if ( !dbus_message_iter_init( message, &iter) )
+		return 0;
+	int count = 0;
+	do
+	{
+		message_args_push_iter_value( _L, &iter);
+		++ count;
+	} while ( dbus_message_iter_next( &iter));
+	return count;
+}
+
+//################################################################################
+
+// msg:args_into( tbl) -> tbl, holding the arguments like { msg:get_args() } would
+// containers are decoded into the tables already in tbl at their place, stale keys are cleared
+int bind_dbus_message_args_into( lua_State * const _L)
+{
+	utils_check_nargs( _L, 2);
+	DBusMessage * const message = cast_to_dbus_message( _L, 1);
+	luaL_checktype( _L, 2, LUA_TTABLE);
+	DBusMessageIter iter;
+	// an empty message leaves the iterator on DBUS_TYPE_INVALID, which clears the table
+	dbus_message_iter_init( message, &iter);
+	private_decode_sequence_into( _L, &iter, 2);
+	return 1;
+}
+
+//################################################################################
+
+// msg:decode_struct( argn, tbl) -> tbl, holding argument #argn, a struct, an array or a dictionary
+// as in msg:args_into(), nested containers reuse the tables already in place
+int bind_dbus_message_decode_struct( lua_State * const _L)
+{
+	utils_check_nargs( _L, 3);
+	DBusMessage * const message = cast_to_dbus_message( _L, 1);
+	int const argn = luaL_checkint( _L, 2);
+	luaL_checktype( _L, 3, LUA_TTABLE);
+	DBusMessageIter iter;
+	int i;
+	if ( argn < 1 || !dbus_message_iter_init( message, &iter) )
+		return luaL_argerror( _L, 2, "no such argument");
+	for ( i = 1; i < argn; ++ i)
+	{
+		if ( !dbus_message_iter_next( &iter) )
+			return luaL_argerror( _L, 2, "no such argument");
+	}
+	while ( dbus_message_iter_get_arg_type( &iter) == DBUS_TYPE_VARIANT )
+	{
+		DBusMessageIter sub;
+		dbus_message_iter_recurse( &iter, &sub);
+		iter = sub;
+	}
+	if ( !private_decodes_to_table( &iter) )
+		return luaL_argerror( _L, 2, "argument doesn't decode as a table");
+	private_decode_container_into( _L, &iter, 3);
+	return 1;
+}
+
+//################################################################################
+
+int bind_dbus_message_get_signature( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	DBusMessage * const message = cast_to_dbus_message( _L, 1);
+	lua_pushstring( _L, dbus_message_get_signature( message));
+	return 1;
+}
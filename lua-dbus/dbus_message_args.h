@@ -0,0 +1,18 @@
+#if ! defined ( __dbus_message_args_h__ )
+#define __dbus_message_args_h__ 1
+
+//################################################################################
+
+extern int message_args_push_iter_value( lua_State * const _L, DBusMessageIter * const _iter);
+extern void message_args_append_value( lua_State * const _L, int _ndx, DBusSignatureIter * const _signature, DBusMessageIter * const _iter);
+extern char const * message_args_infer_signature( lua_State * const _L, int _ndx);
+extern int bind_dbus_message_append_args( lua_State * const _L);
+extern int bind_dbus_message_append_array( lua_State * const _L);
+extern int bind_dbus_message_args_into( lua_State * const _L);
+extern int bind_dbus_message_decode_struct( lua_State * const _L);
+extern int bind_dbus_message_get_args( lua_State * const _L);
+extern int bind_dbus_message_get_signature( lua_State * const _L);
+
+//################################################################################
+
+#endif // __dbus_message_args_h__
@@ -0,0 +1,254 @@
+/************************************************************************
+*
+* Lua bindings for libdbus.
+* Copyright (c) 2009 - BenoitGermain <bnt.germain@gmail.com>
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+************************************************************************/
+
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <dbus/dbus.h>
+
+#include "utils.h"
+#include "dbus_message_args.h"
+#include "dbus_message_iter.h"
+
+//################################################################################
+// message iterators: a step decodes the next element of the container and nothing else, so
+// walking an array of 100k structs costs one struct worth of lua memory at a time. a container
+// element can be descended into with iter:recurse() instead, down to the basic values
+//################################################################################
+
+extern DBusMessage * cast_to_dbus_message( lua_State * const _L,  int const _ndx);
+
+char const gMessageIterMetatableKey[] = "lua-dbus message iterator";
+
+struct MessageIter
+{
+	// by convention the block starts with a non-NULL pointer, here the message we hold a reference on
+	DBusMessage *message;
+	// the element the next step yields
+	DBusMessageIter next;
+	// the element the last step yielded, valid once index > 0
+	DBusMessageIter current;
+	int index;
+	// steps yield the decoded element, or its type so that the loop can recurse into it
+	int decode;
+};
+typedef struct MessageIter MessageIter;
+
+//################################################################################
+//################################################################################
+
+void push_dbus_message_iter( lua_State * const _L, DBusMessage * const _message, DBusMessageIter const * const _iter, int const _decode)
+{
+	MessageIter * const block = (MessageIter *) lua_newuserdata( _L, sizeof( MessageIter));   // I
+	block->message = dbus_message_ref( _message);
+	block->next = *_iter;
+	block->index = 0;
+	block->decode = _decode;
+	utils_push_metatable( _L, gMessageIterMetatableKey);                                      // I meta
+	lua_setmetatable( _L, -2);                                                                // I
+}
+
+//################################################################################
+
+static MessageIter * cast_to_dbus_message_iter( lua_State * const _L, int const _ndx)
+{
+	return (MessageIter *) utils_cast_userdata( _L, _ndx, gMessageIterMetatableKey);
+}
+
+//################################################################################
+
+static DBusMessageIter * private_check_current( lua_State * const _L, MessageIter * const _iter)
+{
+	if ( _iter->index == 0 )
+		return luaL_error( _L, "the iterator has not yielded any element yet"), (DBusMessageIter *) 0x0;
+	return &_iter->current;
+}
+
+//################################################################################
+
+// a dictionary entry gives its key and its value, anything else a single value
+static int private_push_element( lua_State * const _L, DBusMessageIter * const _element)
+{
+	if ( dbus_message_iter_get_arg_type( _element) != DBUS_TYPE_DICT_ENTRY )
+		return message_args_push_iter_value( _L, _element);
+	DBusMessageIter entry;
+	dbus_message_iter_recurse( _element, &entry);
+	message_args_push_iter_value( _L, &entry);
+	dbus_message_iter_next( &entry);
+	message_args_push_iter_value( _L, &entry);
+	return 2;
+}
+
+//################################################################################
+//################################################################################
+
+// msg:iter_array( argn [, decode]) -> iterator over the elements of the array argument #argn
+// for i, v in msg:iter_array( argn) do ... end, or for k, v in ... when the array is a dictionary
+// with decode false, steps yield the index and the type of the element (a one character string),
+// and the loop decides what to do with it through the iterator: iter:get(), iter:recurse()
+int bind_dbus_message_iter_array( lua_State * const _L)
+{
+	if ( lua_gettop( _L) != 3 )
+		utils_check_nargs( _L, 2);
+	DBusMessage * const message = cast_to_dbus_message( _L, 1);
+	int const argn = luaL_checkint( _L, 2);
+	int const decode = lua_isnoneornil( _L, 3) || lua_toboolean( _L, 3);
+	DBusMessageIter iter;
+	int i;
+	if ( argn < 1 || !dbus_message_iter_init( message, &iter) )
+		return luaL_argerror( _L, 2, "no such argument");
+	for ( i = 1; i < argn; ++ i)
+	{
+		if ( !dbus_message_iter_next( &iter) )
+			return luaL_argerror( _L, 2, "no such argument");
+	}
+	if ( dbus_message_iter_get_arg_type( &iter) != DBUS_TYPE_ARRAY )
+		return luaL_argerror( _L, 2, "argument is not an array");
+	DBusMessageIter elements;
+	dbus_message_iter_recurse( &iter, &elements);
+	push_dbus_message_iter( _L, message, &elements, decode);
+	return 1;
+}
+
+//################################################################################
+
+// iter() steps to the next element: see msg:iter_array() for what it yields, nothing at the end
+// being the __call metamethod, the iterator is its own generator in a generic for
+int bind_dbus_message_iter_step( lua_State * const _L)
+{
+	MessageIter * const iter = cast_to_dbus_message_iter( _L, 1);
+	int const type = dbus_message_iter_get_arg_type( &iter->next);
+	if ( type == DBUS_TYPE_INVALID )
+		return 0;
+	iter->current = iter->next;
+	dbus_message_iter_next( &iter->next);
+	++ iter->index;
+	if ( !iter->decode )
+	{
+		char const code = (char) type;
+		lua_pushinteger( _L, iter->index);
+		lua_pushlstring( _L, &code, 1);
+		return 2;
+	}
+	if ( type == DBUS_TYPE_DICT_ENTRY )
+		return private_push_element( _L, &iter->current);
+	lua_pushinteger( _L, iter->index);
+	return 1 + message_args_push_iter_value( _L, &iter->current);
+}
+
+//################################################################################
+
+// iter:get() -> the decoded element yielded last (a dictionary entry gives its key and its value)
+int bind_dbus_message_iter_get( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	MessageIter * const iter = cast_to_dbus_message_iter( _L, 1);
+	return private_push_element( _L, private_check_current( _L, iter));
+}
+
+//################################################################################
+
+// iter:index() -> how many elements were yielded so far
+int bind_dbus_message_iter_index( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	MessageIter * const iter = cast_to_dbus_message_iter( _L, 1);
+	lua_pushinteger( _L, iter->index);
+	return 1;
+}
+
+//################################################################################
+
+// iter:recurse( [decode]) -> iterator over the contents of the container yielded last:
+// the elements of an array, the fields of a struct, the key and value of a dictionary entry, the value of a variant
+// the new iterator decodes like this one unless told otherwise, and stays valid as this one moves on
+int bind_dbus_message_iter_recurse( lua_State * const _L)
+{
+	if ( lua_gettop( _L) != 2 )
+		utils_check_nargs( _L, 1);
+	MessageIter * const iter = cast_to_dbus_message_iter( _L, 1);
+	DBusMessageIter * const current = private_check_current( _L, iter);
+	int const decode = lua_isnoneornil( _L, 2) ? iter->decode : lua_toboolean( _L, 2);
+	if ( !dbus_type_is_container( dbus_message_iter_get_arg_type( current)) )
+		return luaL_error( _L, "element #%d is not a container", iter->index);
+	DBusMessageIter sub;
+	dbus_message_iter_recurse( current, &sub);
+	push_dbus_message_iter( _L, iter->message, &sub, decode);
+	return 1;
+}
+
+//################################################################################
+
+// iter:signature() -> the signature of the element yielded last
+int bind_dbus_message_iter_signature( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	MessageIter * const iter = cast_to_dbus_message_iter( _L, 1);
+	char * const signature = dbus_message_iter_get_signature( private_check_current( _L, iter));
+	if ( signature == 0x0 )
+		return luaL_error( _L, "not enough memory to get a signature");
+	lua_pushstring( _L, signature);
+	dbus_free( signature);
+	return 1;
+}
+
+//################################################################################
+
+int finalize_dbus_message_iter( lua_State * const _L)
+{
+	MessageIter * const iter = (MessageIter *) lua_touserdata( _L, 1);
+	if ( iter->message != 0x0 )
+	{
+		dbus_message_unref( iter->message);
+		iter->message = 0x0;
+	}
+	return 0;
+}
+
+//################################################################################
+//################################################################################
+
+static luaL_Reg gMessageIterMeta[] =
+{
+	{ "get", bind_dbus_message_iter_get },
+	{ "index", bind_dbus_message_iter_index },
+	{ "recurse", bind_dbus_message_iter_recurse },
+	{ "signature", bind_dbus_message_iter_signature },
+	{ "__call", bind_dbus_message_iter_step },
+	{ "__gc", finalize_dbus_message_iter },
+	{ 0x0, 0x0 },
+};
+
+//################################################################################
+//################################################################################
+
+void register_message_iter_stuff( lua_State * const _L)
+{
+	// register the message iterator metatable in the registry
+	utils_prepare_metatable( _L, gMessageIterMetatableKey);                                 // {meta}
+	utils_register_upvalued_functions( _L, gMessageIterMeta, gMessageIterMetatableKey);     // {meta}
+	lua_pop( _L, 1);                                                                        //
+}
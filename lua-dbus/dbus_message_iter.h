@@ -0,0 +1,14 @@
+#if ! defined ( __dbus_message_iter_h__ )
+#define __dbus_message_iter_h__ 1
+
+//################################################################################
+
+// iterators walk a container argument one element at a time, without decoding it as a whole
+// they hold their own reference on the message, and a libdbus iterator that survives between steps
+extern void push_dbus_message_iter( lua_State * const _L, DBusMessage * const _message, DBusMessageIter const * const _iter, int const _decode);
+extern int bind_dbus_message_iter_array( lua_State * const _L);
+extern void register_message_iter_stuff( lua_State * const _L);
+
+//################################################################################
+
+#endif // __dbus_message_iter_h__
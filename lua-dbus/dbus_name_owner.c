@@ -0,0 +1,421 @@
+/************************************************************************
+*
+* Lua bindings for libdbus.
+* Copyright (c) 2009 - BenoitGermain <bnt.germain@gmail.com>
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+************************************************************************/
+
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <dbus/dbus.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "dbus_connection_shared.h"
+#include "dbus_name_owner.h"
+
+//################################################################################
+// name owners: a well-known name is resolved with GetNameOwner the first time it is asked
+// for, then the NameOwnerChanged signals keep the answer current. there is one match per bus
+// whatever the number of names, and the signals about untracked names cost a hash lookup
+//################################################################################
+
+#define NAME_OWNER_MATCH_RULE "type='signal',sender='" DBUS_SERVICE_DBUS "',path='" DBUS_PATH_DBUS "',interface='" DBUS_INTERFACE_DBUS "',member='NameOwnerChanged'"
+
+extern char const gBusMetatableKey[];
+
+struct NameOwnerEntry
+{
+	HashLink link;
+	// 0x0 when nobody owns the name
+	char *owner;
+	// the name lives in the same block, right after the entry
+	char *name;
+};
+typedef struct NameOwnerEntry NameOwnerEntry;
+
+// what the protected call of the change callbacks gets
+struct NameOwnerEvent
+{
+	NameOwnerCache *cache;
+	char const *name;
+	char const *oldOwner;
+	char const *newOwner;
+};
+typedef struct NameOwnerEvent NameOwnerEvent;
+
+//################################################################################
+//################################################################################
+
+static NameOwnerEntry * private_find( NameOwnerCache * const _cache, char const * const _name)
+{
+	dbus_uint64_t const hash = utils_hash_string( UTILS_FNV_OFFSET_BASIS, _name);
+	NameOwnerEntry *entry;
+	for ( entry = (NameOwnerEntry *) *utils_hash_table_bucket( &_cache->entries, hash); entry != 0x0; entry = (NameOwnerEntry *) entry->link.next )
+	{
+		if ( entry->link.hash == hash && strcmp( entry->name, _name) == 0 )
+			return entry;
+	}
+	return 0x0;
+}
+
+//################################################################################
+
+// returns 0 when out of memory, in which case the entry is left without an owner
+static int private_set_owner( NameOwnerEntry * const _entry, char const * const _owner)
+{
+	free( _entry->owner);
+	_entry->owner = 0x0;
+	if ( _owner == 0x0 || *_owner == '\0' )
+		return 1;
+	size_t const size = strlen( _owner) + 1;
+	_entry->owner = (char *) malloc( size);
+	if ( _entry->owner == 0x0 )
+		return 0;
+	memcpy( _entry->owner, _owner, size);
+	return 1;
+}
+
+//################################################################################
+
+static void private_remove( NameOwnerCache * const _cache, NameOwnerEntry * const _entry)
+{
+	utils_hash_table_remove( &_cache->entries, &_entry->link);
+	free( _entry->owner);
+	free( _entry);
+}
+
+//################################################################################
+
+static int private_store( NameOwnerCache * const _cache, char const * const _name, char const * const _owner)
+{
+	NameOwnerEntry *entry = private_find( _cache, _name);
+	if ( entry == 0x0 )
+	{
+		size_t const nameSize = strlen( _name) + 1;
+		entry = (NameOwnerEntry *) malloc( sizeof( NameOwnerEntry) + nameSize);
+		if ( entry == 0x0 )
+			return 0;
+		entry->link.hash = utils_hash_string( UTILS_FNV_OFFSET_BASIS, _name);
+		entry->owner = 0x0;
+		entry->name = (char *) (entry + 1);
+		memcpy( entry->name, _name, nameSize);
+		utils_hash_table_insert( &_cache->entries, &entry->link);
+	}
+	// an entry we couldn't fill would claim the name has no owner: better forget it
+	if ( !private_set_owner( entry, _owner) )
+	{
+		private_remove( _cache, entry);
+		return 0;
+	}
+	return 1;
+}
+
+//################################################################################
+
+// lua_cpcall'ed: call every change callback with ( bus, name, old owner, new owner)
+static int private_call_callbacks( lua_State * const _L)
+{
+	NameOwnerEvent * const event = (NameOwnerEvent *) lua_touserdata( _L, 1);
+	// the bus userdata may already be collected while libdbus still dispatches
+	if ( !utils_is_mapped_userdata( _L, event->cache->connection) )
+		return 0;
+	utils_fetch_userdata( _L, event->cache->connection);            // B
+	lua_getfenv( _L, -1);                                           // B {env}
+	lua_getfield( _L, -1, "name_owner_callbacks");                  // B {env} {callbacks}
+	int const nbCallbacks = lua_objlen( _L, -1);
+	int i;
+	for ( i = 1; i <= nbCallbacks; ++ i)
+	{
+		lua_rawgeti( _L, -1, i);                                     // B {env} {callbacks} f
+		lua_pushvalue( _L, -4);                                      // B {env} {callbacks} f B
+		lua_pushstring( _L, event->name);                            // B {env} {callbacks} f B name
+		// an empty owner means there is none
+		if ( *event->oldOwner != '\0' )
+			lua_pushstring( _L, event->oldOwner);                     // B {env} {callbacks} f B name old
+		else
+			lua_pushnil( _L);                                         // B {env} {callbacks} f B name nil
+		if ( *event->newOwner != '\0' )
+			lua_pushstring( _L, event->newOwner);                     // B {env} {callbacks} f B name old new
+		else
+			lua_pushnil( _L);                                         // B {env} {callbacks} f B name old nil
+		lua_call( _L, 4, 0);                                         // B {env} {callbacks}
+	}
+	return 0;
+}
+
+//################################################################################
+
+// keep the cache current with a NameOwnerChanged signal, anything else is ignored
+// the lua filter chain calls this before any lua filter gets a chance to swallow the signal,
+// our own filter catches the signals that don't go through the chain
+void name_owner_observe( NameOwnerCache * const _cache, DBusMessage * const _message)
+{
+	char const *name, *oldOwner, *newOwner;
+	// only the daemon knows who owns what
+	if
+	(
+		!dbus_message_is_signal( _message, DBUS_INTERFACE_DBUS, "NameOwnerChanged")
+		|| !dbus_message_has_sender( _message, DBUS_SERVICE_DBUS)
+		|| dbus_message_get_serial( _message) == _cache->lastSerial
+		|| !dbus_message_get_args( _message, 0x0, DBUS_TYPE_STRING, &name, DBUS_TYPE_STRING, &oldOwner, DBUS_TYPE_STRING, &newOwner, DBUS_TYPE_INVALID)
+	)
+		return;
+	_cache->lastSerial = dbus_message_get_serial( _message);
+	NameOwnerEntry * const entry = private_find( _cache, name);
+	// we only keep track of the names someone asked about
+	if ( entry == 0x0 )
+		return;
+	if ( !private_set_owner( entry, newOwner) )
+		private_remove( _cache, entry);
+	++ _cache->nbChanges;
+	if ( _cache->nbCallbacks > 0 )
+	{
+		lua_State * const L = _cache->L;
+		NameOwnerEvent event = { _cache, name, oldOwner, newOwner };
+		// errors can't cross libdbus: leave them where dispatch() will find and raise them
+		if ( lua_cpcall( L, private_call_callbacks, &event) != 0 )  // error
+		{
+			if ( utils_is_mapped_userdata( L, _cache->connection) )
+			{
+				utils_fetch_userdata( L, _cache->connection);           // error B
+				lua_getfenv( L, -1);                                    // error B {env}
+				lua_pushvalue( L, -3);                                  // error B {env} error
+				lua_setfield( L, -2, "filter_error");                   // error B {env}
+				lua_pop( L, 2);                                         // error
+			}
+			lua_pop( L, 1);                                            //
+		}
+	}
+}
+
+//################################################################################
+
+static DBusHandlerResult private_name_owner_filter( DBusConnection *_connection, DBusMessage *_message, void *_user_data)
+{
+	name_owner_observe( (NameOwnerCache *) _user_data, _message);
+	// the other filters may want to see it too
+	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+//################################################################################
+
+// create the cache of the bus at _ndx on first use: one match, one filter
+static NameOwnerCache * private_get_cache( lua_State * const _L, int const _ndx, ConnectionUserdata * const _ud, DBusError * const _error)
+{
+	if ( _ud->nameOwners != 0x0 )
+		return _ud->nameOwners;
+	NameOwnerCache * const cache = (NameOwnerCache *) calloc( 1, sizeof( NameOwnerCache));
+	if ( cache == 0x0 || !utils_hash_table_init( &cache->entries, 16) )
+	{
+		free( cache);
+		dbus_set_error_const( _error, DBUS_ERROR_NO_MEMORY, "not enough memory to track name owners");
+		return 0x0;
+	}
+	cache->connection = _ud->connection;
+	// subscribe before anything gets resolved, so that no change can slip in between
+	dbus_bus_add_match( _ud->connection, NAME_OWNER_MATCH_RULE, _error);
+	if ( dbus_error_is_set( _error) )
+	{
+		free( cache->entries.buckets);
+		free( cache);
+		return 0x0;
+	}
+	if ( !dbus_connection_add_filter( _ud->connection, private_name_owner_filter, cache, 0x0) )
+	{
+		dbus_bus_remove_match( _ud->connection, NAME_OWNER_MATCH_RULE, 0x0);
+		free( cache->entries.buckets);
+		free( cache);
+		dbus_set_error_const( _error, DBUS_ERROR_NO_MEMORY, "not enough memory to track name owners");
+		return 0x0;
+	}
+	// callbacks run in a thread of their own, which can't be a suspended coroutine
+	lua_getfenv( _L, _ndx);                                         // {env}
+	cache->L = lua_newthread( _L);                                  // {env} thread
+	lua_setfield( _L, -2, "name_owner_state");                      // {env}
+	lua_pop( _L, 1);                                                //
+	_ud->nameOwners = cache;
+	return cache;
+}
+
+//################################################################################
+//################################################################################
+
+// the owner of an already known name; returns 0 if the cache has never heard of it
+// the owner is 0x0 when the name is known to have none
+int name_owner_cache_lookup( NameOwnerCache * const _cache, char const * const _name, char const ** const _owner)
+{
+	NameOwnerEntry const * const entry = private_find( _cache, _name);
+	if ( entry == 0x0 )
+		return 0;
+	*_owner = entry->owner;
+	return 1;
+}
+
+//################################################################################
+
+// resolve a name for the bus at _ndx, asking the daemon only the first time
+// returns 0 and fills _error on failure, *_owner is 0x0 if the name has no owner
+// the owner string is valid until the next dispatch
+int name_owner_resolve( lua_State * const _L, int const _ndx, ConnectionUserdata * const _ud, char const * const _name, char const ** const _owner, DBusError * const _error)
+{
+	// unique names are their own owner
+	if ( _name[0] == ':' || strcmp( _name, DBUS_SERVICE_DBUS) == 0 )
+	{
+		*_owner = _name;
+		return 1;
+	}
+	NameOwnerCache * const cache = private_get_cache( _L, _ndx, _ud, _error);
+	if ( cache == 0x0 )
+		return 0;
+	if ( name_owner_cache_lookup( cache, _name, _owner) )
+	{
+		++ cache->nbHits;
+		return 1;
+	}
+	++ cache->nbMisses;
+	DBusMessage * const call = dbus_message_new_method_call( DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS, "GetNameOwner");
+	if ( call == 0x0 || !dbus_message_append_args( call, DBUS_TYPE_STRING, &_name, DBUS_TYPE_INVALID) )
+	{
+		if ( call != 0x0 )
+			dbus_message_unref( call);
+		dbus_set_error_const( _error, DBUS_ERROR_NO_MEMORY, "not enough memory to resolve a name");
+		return 0;
+	}
+	DBusMessage * const reply = dbus_connection_send_with_reply_and_block( _ud->connection, call, -1, _error);
+	dbus_message_unref( call);
+	char const *owner = 0x0;
+	if ( reply != 0x0 )
+	{
+		dbus_message_get_args( reply, _error, DBUS_TYPE_STRING, &owner, DBUS_TYPE_INVALID);
+	}
+	else if ( dbus_error_has_name( _error, DBUS_ERROR_NAME_HAS_NO_OWNER) )
+	{
+		// not an error for us: the answer is "nobody", until NameOwnerChanged says otherwise
+		dbus_error_free( _error);
+	}
+	if ( !dbus_error_is_set( _error) && !private_store( cache, _name, owner) )
+		dbus_set_error_const( _error, DBUS_ERROR_NO_MEMORY, "not enough memory to resolve a name");
+	if ( reply != 0x0 )
+		dbus_message_unref( reply);
+	if ( dbus_error_is_set( _error) )
+		return 0;
+	name_owner_cache_lookup( cache, _name, _owner);
+	return 1;
+}
+
+//################################################################################
+//################################################################################
+
+// bus:name_owner( name) -> unique name of the owner, or nil if there is none
+// or nil, error name, error message if the daemon could not be asked
+int bind_dbus_bus_name_owner( lua_State * const _L)
+{
+	utils_check_nargs( _L, 2);
+	ConnectionUserdata * const ud = (ConnectionUserdata *) utils_cast_userdata( _L, 1, gBusMetatableKey);
+	char const * const name = luaL_checkstring( _L, 2);
+	luaL_argcheck( _L, dbus_validate_bus_name( name, 0x0), 2, "invalid bus name");
+	DBusError error;
+	dbus_error_init( &error);
+	char const *owner;
+	if ( !name_owner_resolve( _L, 1, ud, name, &owner, &error) )
+	{
+		lua_pushnil( _L);
+		lua_pushstring( _L, error.name);
+		lua_pushstring( _L, error.message);
+		dbus_error_free( &error);
+		return 3;
+	}
+	if ( owner != 0x0 )
+		lua_pushstring( _L, owner);
+	else
+		lua_pushnil( _L);
+	return 1;
+}
+
+//################################################################################
+
+// bus:on_name_owner_changed( f): f( bus, name, old owner, new owner) is called as the bus is
+// dispatched, for each name resolved so far; a nil owner means the name has none
+int bind_dbus_bus_on_name_owner_changed( lua_State * const _L)
+{
+	utils_check_nargs( _L, 2);
+	ConnectionUserdata * const ud = (ConnectionUserdata *) utils_cast_userdata( _L, 1, gBusMetatableKey);
+	luaL_checktype( _L, 2, LUA_TFUNCTION);
+	DBusError error;
+	dbus_error_init( &error);
+	if ( private_get_cache( _L, 1, ud, &error) == 0x0 )
+	{
+		lua_pushnil( _L);
+		lua_pushstring( _L, error.name);
+		lua_pushstring( _L, error.message);
+		dbus_error_free( &error);
+		return 3;
+	}
+	lua_getfenv( _L, 1);                                            // B f {env}
+	lua_getfield( _L, -1, "name_owner_callbacks");                  // B f {env} {callbacks}?
+	if ( lua_isnil( _L, -1) )
+	{
+		lua_pop( _L, 1);                                             // B f {env}
+		lua_newtable( _L);                                           // B f {env} {callbacks}
+		lua_pushvalue( _L, -1);                                      // B f {env} {callbacks} {callbacks}
+		lua_setfield( _L, -3, "name_owner_callbacks");               // B f {env} {callbacks}
+	}
+	lua_pushvalue( _L, 2);                                          // B f {env} {callbacks} f
+	lua_rawseti( _L, -2, lua_objlen( _L, -2) + 1);                  // B f {env} {callbacks}
+	++ ud->nameOwners->nbCallbacks;
+	lua_pushboolean( _L, 1);
+	return 1;
+}
+
+//################################################################################
+//################################################################################
+
+// called by the bus __gc finalizer
+void finalize_name_owner_data( ConnectionUserdata * const _ud)
+{
+	NameOwnerCache * const cache = _ud->nameOwners;
+	if ( cache == 0x0 )
+		return;
+	dbus_connection_remove_filter( _ud->connection, private_name_owner_filter, cache);
+	// without an error argument, this doesn't wait for the daemon's answer
+	if ( dbus_connection_get_is_connected( _ud->connection) )
+		dbus_bus_remove_match( _ud->connection, NAME_OWNER_MATCH_RULE, 0x0);
+	int i;
+	for ( i = 0; i < cache->entries.nbBuckets; ++ i)
+	{
+		NameOwnerEntry *entry = (NameOwnerEntry *) cache->entries.buckets[i];
+		while ( entry != 0x0 )
+		{
+			NameOwnerEntry * const next = (NameOwnerEntry *) entry->link.next;
+			free( entry->owner);
+			free( entry);
+			entry = next;
+		}
+	}
+	free( cache->entries.buckets);
+	free( cache);
+	_ud->nameOwners = 0x0;
+}
@@ -0,0 +1,36 @@
+#if ! defined ( __dbus_name_owner_h__ )
+#define __dbus_name_owner_h__ 1
+
+//################################################################################
+
+// owners of well-known names, asked once with GetNameOwner and then kept current by a single
+// NameOwnerChanged match, so that resolving a name is a hash lookup instead of a round trip
+struct NameOwnerCache
+{
+	DBusConnection *connection;
+	// the names, hashed
+	HashTable entries;
+	// the state the change callbacks run in, anchored in the bus environment
+	lua_State *L;
+	unsigned long nbHits;
+	unsigned long nbMisses;
+	unsigned long nbChanges;
+	// the lua filter chain and our own filter both look at each signal, only the first one counts
+	dbus_uint32_t lastSerial;
+	// no need to enter lua on changes as long as nobody listens
+	int nbCallbacks;
+};
+typedef struct NameOwnerCache NameOwnerCache;
+
+struct ConnectionUserdata;
+
+extern int name_owner_cache_lookup( NameOwnerCache * const _cache, char const * const _name, char const ** const _owner);
+extern void name_owner_observe( NameOwnerCache * const _cache, DBusMessage * const _message);
+extern int name_owner_resolve( lua_State * const _L, int const _ndx, struct ConnectionUserdata * const _ud, char const * const _name, char const ** const _owner, DBusError * const _error);
+extern void finalize_name_owner_data( struct ConnectionUserdata * const _ud);
+extern int bind_dbus_bus_name_owner( lua_State * const _L);
+extern int bind_dbus_bus_on_name_owner_changed( lua_State * const _L);
+
+//################################################################################
+
+#endif // __dbus_name_owner_h__
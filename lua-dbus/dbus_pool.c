@@ -0,0 +1,558 @@
+/************************************************************************
+*
+* Lua bindings for libdbus.
+* Copyright (c) 2009 - BenoitGermain <bnt.germain@gmail.com>
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+************************************************************************/
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "dbus_connection_shared.h"
+#include "dbus_pool.h"
+
+//################################################################################
+// a worker pool owns a connection: a dispatcher thread reads it and hands the
+// incoming method calls to N worker threads, each running its own lua_State
+// messages travel between threads as DBusMessage pointers, never as copies
+//################################################################################
+
+extern int luaopen_dbus( lua_State * const _L);
+extern int push_dbus_connection( lua_State * const _L, DBusConnection * const _connection, int _closeOnFinalize);
+extern int push_dbus_message( lua_State * const _L, DBusMessage * const _message);
+extern DBusMessage * cast_to_dbus_message( lua_State * const _L,  int const _ndx);
+
+//################################################################################
+//################################################################################
+
+char const gPoolMetatableKey[] = "lua-dbus worker pool";
+
+//################################################################################
+//################################################################################
+
+// a ring buffer of messages: the owner pops at the front, thieves steal at the back
+struct WorkerQueue
+{
+	pthread_mutex_t lock;
+	DBusMessage **ring;
+	int capacity;
+	int head;
+	int count;
+};
+typedef struct WorkerQueue WorkerQueue;
+
+struct WorkerPool;
+
+struct Worker
+{
+	struct WorkerPool *pool;
+	pthread_t thread;
+	lua_State *L;
+	int handlerRef;
+	int connectionRef;
+	DBusMessage *current;
+	WorkerQueue queue;
+	// only written by the worker thread itself
+	unsigned long nbHandled;
+	unsigned long nbStolen;
+	unsigned long nbErrors;
+};
+typedef struct Worker Worker;
+
+struct WorkerPool
+{
+	DBusConnection *connection;
+	int pollTimeout;
+	int nbWorkers;
+	Worker *workers;
+	pthread_t dispatcher;
+	int nbStartedWorkers;
+	int dispatcherStarted;
+	// everything below is protected by the lock
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	int nbPending;
+	int stopDispatcher;
+	int stopWorkers;
+	unsigned long nbReceived;
+	unsigned long nbDropped;
+};
+typedef struct WorkerPool WorkerPool;
+
+//################################################################################
+// work queues
+//################################################################################
+
+static int private_queue_push_back( WorkerQueue * const _queue, DBusMessage * const _message)
+{
+	pthread_mutex_lock( &_queue->lock);
+	if ( _queue->count == _queue->capacity )
+	{
+		// grow the ring, unrolling it at the same time
+		int const newCapacity = (_queue->capacity > 0) ? _queue->capacity * 2 : 64;
+		DBusMessage ** const newRing = (DBusMessage **) malloc( newCapacity * sizeof( DBusMessage *));
+		if ( newRing == 0x0 )
+		{
+			pthread_mutex_unlock( &_queue->lock);
+			return 0;
+		}
+		int i;
+		for ( i = 0; i < _queue->count; ++ i)
+			newRing[i] = _queue->ring[(_queue->head + i) % _queue->capacity];
+		free( _queue->ring);
+		_queue->ring = newRing;
+		_queue->capacity = newCapacity;
+		_queue->head = 0;
+	}
+	_queue->ring[(_queue->head + _queue->count) % _queue->capacity] = _message;
+	++ _queue->count;
+	pthread_mutex_unlock( &_queue->lock);
+	return 1;
+}
+
+//################################################################################
+
+static DBusMessage * private_queue_pop_front( WorkerQueue * const _queue)
+{
+	DBusMessage * message = 0x0;
+	pthread_mutex_lock( &_queue->lock);
+	if ( _queue->count > 0 )
+	{
+		message = _queue->ring[_queue->head];
+		_queue->head = (_queue->head + 1) % _queue->capacity;
+		-- _queue->count;
+	}
+	pthread_mutex_unlock( &_queue->lock);
+	return message;
+}
+
+//################################################################################
+
+static DBusMessage * private_queue_steal_back( WorkerQueue * const _queue)
+{
+	DBusMessage * message = 0x0;
+	pthread_mutex_lock( &_queue->lock);
+	if ( _queue->count > 0 )
+	{
+		-- _queue->count;
+		message = _queue->ring[(_queue->head + _queue->count) % _queue->capacity];
+	}
+	pthread_mutex_unlock( &_queue->lock);
+	return message;
+}
+
+//################################################################################
+// threads
+//################################################################################
+
+static void * private_dispatcher_thread( void * _data)
+{
+	WorkerPool * const pool = (WorkerPool *) _data;
+	int next = 0;
+	for ( ;;)
+	{
+		pthread_mutex_lock( &pool->lock);
+		int const stop = pool->stopDispatcher;
+		pthread_mutex_unlock( &pool->lock);
+		// stop when asked to, or when the connection is gone
+		if ( stop || !dbus_connection_read_write( pool->connection, pool->pollTimeout) )
+			break;
+		DBusMessage * message;
+		while ( (message = dbus_connection_pop_message( pool->connection)) != 0x0 )
+		{
+			// only method calls are handled by the workers, the pool owns the connection so the rest is dropped
+			int const queued = (dbus_message_get_type( message) == DBUS_MESSAGE_TYPE_METHOD_CALL) && private_queue_push_back( &pool->workers[next].queue, message);
+			if ( !queued )
+				dbus_message_unref( message);
+			pthread_mutex_lock( &pool->lock);
+			++ pool->nbReceived;
+			if ( queued )
+			{
+				++ pool->nbPending;
+				pthread_cond_signal( &pool->wakeup);
+			}
+			else
+			{
+				++ pool->nbDropped;
+			}
+			pthread_mutex_unlock( &pool->lock);
+			// distribute round-robin, idle workers will steal from the busy ones anyway
+			next = (next + 1) % pool->nbWorkers;
+		}
+	}
+	return 0x0;
+}
+
+//################################################################################
+
+// runs protected in the worker state, with the worker as a light userdata argument
+static int private_worker_call_handler( lua_State * const _L)
+{
+	Worker * const worker = (Worker *) lua_touserdata( _L, 1);
+	lua_settop( _L, 0);                                             //
+	lua_rawgeti( _L, LUA_REGISTRYINDEX, worker->handlerRef);        // handler
+	lua_rawgeti( _L, LUA_REGISTRYINDEX, worker->connectionRef);     // handler U
+	// the message userdata takes over the reference we got from dbus_connection_pop_message
+	push_dbus_message( _L, worker->current);                        // handler U msg
+	lua_call( _L, 2, 1);                                            // reply?
+	if ( !lua_isnil( _L, -1) )
+	{
+		DBusMessage * const reply = cast_to_dbus_message( _L, -1);
+		dbus_connection_send( worker->pool->connection, reply, 0x0);
+	}
+	lua_pop( _L, 1);                                                //
+	return 0;
+}
+
+//################################################################################
+
+static void private_worker_handle_message( Worker * const _worker, DBusMessage * const _message)
+{
+	lua_State * const L = _worker->L;
+	// keep our own reference, the Lua side may collect the message before we are done with it
+	dbus_message_ref( _message);
+	_worker->current = _message;
+	if ( lua_cpcall( L, private_worker_call_handler, _worker) == 0 )
+	{
+		++ _worker->nbHandled;
+	}
+	else
+	{
+		++ _worker->nbErrors;
+		// don't let the caller wait for a reply that will never come
+		if ( !dbus_message_get_no_reply( _message) )
+		{
+			char const * const error = lua_tostring( L, -1);
+			DBusMessage * const reply = dbus_message_new_error( _message, DBUS_ERROR_FAILED, (error != 0x0) ? error : "handler error");
+			if ( reply != 0x0 )
+			{
+				dbus_connection_send( _worker->pool->connection, reply, 0x0);
+				dbus_message_unref( reply);
+			}
+		}
+		lua_pop( L, 1);
+	}
+	_worker->current = 0x0;
+	dbus_message_unref( _message);
+}
+
+//################################################################################
+
+static void * private_worker_thread( void * _data)
+{
+	Worker * const worker = (Worker *) _data;
+	WorkerPool * const pool = worker->pool;
+	int const self = worker - pool->workers;
+	for ( ;;)
+	{
+		pthread_mutex_lock( &pool->lock);
+		while ( pool->nbPending == 0 && !pool->stopWorkers )
+			pthread_cond_wait( &pool->wakeup, &pool->lock);
+		// when stopping, leave only once all the queued work is done
+		if ( pool->nbPending == 0 )
+		{
+			pthread_mutex_unlock( &pool->lock);
+			break;
+		}
+		// each pending count we take guarantees there is one message for us somewhere
+		-- pool->nbPending;
+		pthread_mutex_unlock( &pool->lock);
+		DBusMessage * message = 0x0;
+		while ( message == 0x0 )
+		{
+			message = private_queue_pop_front( &worker->queue);
+			int i;
+			for ( i = 1; message == 0x0 && i < pool->nbWorkers; ++ i)
+			{
+				message = private_queue_steal_back( &pool->workers[(self + i) % pool->nbWorkers].queue);
+				if ( message != 0x0 )
+					++ worker->nbStolen;
+			}
+		}
+		private_worker_handle_message( worker, message);
+	}
+	return 0x0;
+}
+
+//################################################################################
+// worker states
+//################################################################################
+
+// runs protected in the worker state, with the pool as a light userdata argument
+static int private_worker_init_state( lua_State * const _L)
+{
+	WorkerPool * const pool = (WorkerPool *) lua_touserdata( _L, 1);
+	char const * const module = lua_tostring( _L, 2);
+	luaL_openlibs( _L);
+	lua_pushcfunction( _L, luaopen_dbus);
+	lua_call( _L, 0, 0);
+	// the module must return the handler function
+	lua_getglobal( _L, "require");                                  // require
+	lua_pushstring( _L, module);                                    // require "module"
+	lua_call( _L, 1, 1);                                            // handler?
+	if ( !lua_isfunction( _L, -1) )
+		return luaL_error( _L, "module '%s' did not return a handler function", module);
+	// the handler gets a connection userdata of its own, so that it can send stuff
+	dbus_connection_ref( pool->connection);
+	push_dbus_connection( _L, pool->connection, 0);                 // handler U
+	return 2;
+}
+
+//################################################################################
+
+static int private_pool_init_worker( lua_State * const _L, WorkerPool * const _pool, Worker * const _worker, char const * const _module)
+{
+	_worker->L = luaL_newstate();
+	if ( _worker->L == 0x0 )
+	{
+		lua_pushliteral( _L, "not enough memory");
+		return 0;
+	}
+	lua_State * const L = _worker->L;
+	lua_pushcfunction( L, private_worker_init_state);                 // init
+	lua_pushlightuserdata( L, _pool);                                 // init pool
+	lua_pushstring( L, _module);                                      // init pool "module"
+	if ( lua_pcall( L, 2, 2, 0) != 0 )                                // handler U / err
+	{
+		// bring the error message back to the calling state
+		lua_pushstring( _L, lua_tostring( L, -1));
+		return 0;
+	}
+	_worker->connectionRef = luaL_ref( L, LUA_REGISTRYINDEX);         // handler
+	_worker->handlerRef = luaL_ref( L, LUA_REGISTRYINDEX);            //
+	return 1;
+}
+
+//################################################################################
+
+static void private_pool_stop( WorkerPool * const _pool)
+{
+	// first stop feeding the workers
+	if ( _pool->dispatcherStarted )
+	{
+		pthread_mutex_lock( &_pool->lock);
+		_pool->stopDispatcher = 1;
+		pthread_mutex_unlock( &_pool->lock);
+		pthread_join( _pool->dispatcher, 0x0);
+		_pool->dispatcherStarted = 0;
+	}
+	// then let them finish what they have, and leave
+	pthread_mutex_lock( &_pool->lock);
+	_pool->stopWorkers = 1;
+	pthread_cond_broadcast( &_pool->wakeup);
+	pthread_mutex_unlock( &_pool->lock);
+	int i;
+	for ( i = 0; i < _pool->nbStartedWorkers; ++ i)
+		pthread_join( _pool->workers[i].thread, 0x0);
+	_pool->nbStartedWorkers = 0;
+	// nobody is running anymore, we can close the states
+	for ( i = 0; i < _pool->nbWorkers; ++ i)
+	{
+		Worker * const worker = &_pool->workers[i];
+		if ( worker->L != 0x0 )
+		{
+			lua_close( worker->L);
+			worker->L = 0x0;
+		}
+		DBusMessage * message;
+		while ( (message = private_queue_pop_front( &worker->queue)) != 0x0 )
+			dbus_message_unref( message);
+	}
+}
+
+//################################################################################
+
+static void private_pool_delete( WorkerPool * const _pool)
+{
+	private_pool_stop( _pool);
+	int i;
+	for ( i = 0; i < _pool->nbWorkers; ++ i)
+	{
+		free( _pool->workers[i].queue.ring);
+		pthread_mutex_destroy( &_pool->workers[i].queue.lock);
+	}
+	free( _pool->workers);
+	pthread_cond_destroy( &_pool->wakeup);
+	pthread_mutex_destroy( &_pool->lock);
+	dbus_connection_unref( _pool->connection);
+	free( _pool);
+}
+
+//################################################################################
+//################################################################################
+
+static WorkerPool * cast_to_worker_pool( lua_State * const _L, int const _ndx)
+{
+	return * (WorkerPool **) utils_cast_userdata( _L, _ndx, gPoolMetatableKey);
+}
+
+//################################################################################
+
+int bind_dbus_connection_new_worker_pool( lua_State * const _L)
+{
+	// connection, number of workers, handler module name, optional poll timeout
+	if ( lua_gettop( _L) != 4 )
+		utils_check_nargs( _L, 3);
+	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, 0x0);
+	int const nbWorkers = luaL_checkint( _L, 2);
+	char const * const module = luaL_checkstring( _L, 3);
+	// the dispatcher can't write replies while it is polling, so keep it short by default
+	int const pollTimeout = luaL_optint( _L, 4, 10);
+	luaL_argcheck( _L, nbWorkers > 0, 2, "need at least one worker");
+
+	WorkerPool * const pool = (WorkerPool *) calloc( 1, sizeof( WorkerPool));
+	Worker * const workers = (Worker *) calloc( nbWorkers, sizeof( Worker));
+	if ( pool == 0x0 || workers == 0x0 )
+	{
+		free( pool);
+		free( workers);
+		return luaL_error( _L, "not enough memory to create a worker pool");
+	}
+	pool->connection = dbus_connection_ref( connection);
+	pool->pollTimeout = pollTimeout;
+	pool->nbWorkers = nbWorkers;
+	pool->workers = workers;
+	pthread_mutex_init( &pool->lock, 0x0);
+	pthread_cond_init( &pool->wakeup, 0x0);
+	int i;
+	for ( i = 0; i < nbWorkers; ++ i)
+	{
+		workers[i].pool = pool;
+		workers[i].handlerRef = LUA_NOREF;
+		workers[i].connectionRef = LUA_NOREF;
+		pthread_mutex_init( &workers[i].queue.lock, 0x0);
+	}
+
+	// create all the states before starting anything, so that load errors are reported here
+	for ( i = 0; i < nbWorkers; ++ i)
+	{
+		if ( !private_pool_init_worker( _L, pool, &workers[i], module) )                  // ... err
+		{
+			private_pool_delete( pool);
+			return luaL_error( _L, "failed to create worker #%d: %s", i + 1, lua_tostring( _L, -1));
+		}
+	}
+	for ( ; pool->nbStartedWorkers < nbWorkers; ++ pool->nbStartedWorkers)
+	{
+		if ( pthread_create( &workers[pool->nbStartedWorkers].thread, 0x0, private_worker_thread, &workers[pool->nbStartedWorkers]) != 0 )
+		{
+			private_pool_delete( pool);
+			return luaL_error( _L, "failed to start worker thread");
+		}
+	}
+	if ( pthread_create( &pool->dispatcher, 0x0, private_dispatcher_thread, pool) != 0 )
+	{
+		private_pool_delete( pool);
+		return luaL_error( _L, "failed to start dispatcher thread");
+	}
+	pool->dispatcherStarted = 1;
+
+	(void) utils_push_mapped_userdata( _L, pool, gPoolMetatableKey, sizeof( void *));  // ... P
+	// keep the connection userdata alive as long as the pool
+	lua_newtable( _L);                                                                  // ... P {env}
+	lua_pushvalue( _L, 1);                                                              // ... P {env} U
+	lua_setfield( _L, -2, "connection");                                                // ... P {env}
+	lua_setfenv( _L, -2);                                                               // ... P
+	return 1;
+}
+
+//################################################################################
+
+int bind_dbus_pool_close( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	WorkerPool * const pool = cast_to_worker_pool( _L, 1);
+	private_pool_stop( pool);
+	return 0;
+}
+
+//################################################################################
+
+int bind_dbus_pool_get_stats( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	WorkerPool * const pool = cast_to_worker_pool( _L, 1);
+	unsigned long handled = 0, stolen = 0, errors = 0;
+	int i;
+	for ( i = 0; i < pool->nbWorkers; ++ i)
+	{
+		handled += pool->workers[i].nbHandled;
+		stolen += pool->workers[i].nbStolen;
+		errors += pool->workers[i].nbErrors;
+	}
+	lua_createtable( _L, 0, 7);
+	pthread_mutex_lock( &pool->lock);
+	lua_pushnumber( _L, (lua_Number) pool->nbReceived);
+	lua_setfield( _L, -2, "received");
+	lua_pushnumber( _L, (lua_Number) pool->nbDropped);
+	lua_setfield( _L, -2, "dropped");
+	lua_pushnumber( _L, (lua_Number) pool->nbPending);
+	lua_setfield( _L, -2, "pending");
+	pthread_mutex_unlock( &pool->lock);
+	lua_pushnumber( _L, (lua_Number) handled);
+	lua_setfield( _L, -2, "handled");
+	lua_pushnumber( _L, (lua_Number) stolen);
+	lua_setfield( _L, -2, "stolen");
+	lua_pushnumber( _L, (lua_Number) errors);
+	lua_setfield( _L, -2, "errors");
+	lua_pushnumber( _L, (lua_Number) pool->nbStartedWorkers);
+	lua_setfield( _L, -2, "workers");
+	return 1;
+}
+
+//################################################################################
+
+int finalize_dbus_pool( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	WorkerPool * const pool = cast_to_worker_pool( _L, 1);
+	private_pool_delete( pool);
+	return 0;
+}
+
+//################################################################################
+//################################################################################
+
+static luaL_Reg gPoolMeta[] =
+{
+	{ "close", bind_dbus_pool_close },
+	{ "get_stats", bind_dbus_pool_get_stats },
+	{ "__gc", finalize_dbus_pool },
+	{ 0x0, 0x0 },
+};
+
+//################################################################################
+//################################################################################
+
+// should be called with the "dbus" library table on the top of the stack
+void register_pool_stuff( lua_State * const _L)
+{
+	// register the pool object metatable in the registry
+	utils_prepare_metatable( _L, gPoolMetatableKey);                        // {meta}
+	utils_register_upvalued_functions( _L, gPoolMeta, gPoolMetatableKey);   // {meta}
+	lua_pop( _L, 1);                                                        //
+}
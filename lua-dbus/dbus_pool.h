@@ -0,0 +1,11 @@
+#if ! defined ( __dbus_pool_h__ )
+#define __dbus_pool_h__ 1
+
+//################################################################################
+
+extern int bind_dbus_connection_new_worker_pool( lua_State * const _L);
+extern void register_pool_stuff( lua_State * const _L);
+
+//################################################################################
+
+#endif // __dbus_pool_h__
@@ -0,0 +1,374 @@
+/************************************************************************
+*
+* Lua bindings for libdbus.
+* Copyright (c) 2009 - BenoitGermain <bnt.germain@gmail.com>
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+************************************************************************/
+
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dbus/dbus.h>
+
+#include "utils.h"
+#include "dbus_priority.h"
+
+//################################################################################
+// priority stage: the rules are few and checked in order, the first (interface, member)
+// rule that matches wins, then the message type decides
+// coalescing: each parked message with a key points to the entry of that key, which remembers
+// the sequence number of the latest message parked with it. the queue being FIFO, a message
+// popped with an older sequence number has been superseded, and the latest one pops last
+//################################################################################
+
+struct PriorityRule
+{
+	int priority;
+	// the strings live in the same block, right after the rule; 0x0 matches anything
+	char *interface;
+	char *member;
+};
+typedef struct PriorityRule PriorityRule;
+
+struct CoalesceEntry
+{
+	HashLink link;
+	dbus_uint64_t latestSequence;
+	// the key fields, separated by their terminating zeros, right after the entry
+	size_t keySize;
+	char key[1];
+};
+typedef struct CoalesceEntry CoalesceEntry;
+
+//################################################################################
+//################################################################################
+
+PriorityStage * priority_stage_new( void)
+{
+	PriorityStage * const stage = (PriorityStage *) calloc( 1, sizeof( PriorityStage));
+	if ( stage == 0x0 )
+		return 0x0;
+	if ( !utils_hash_table_init( &stage->keys, 64) )
+	{
+		free( stage);
+		return 0x0;
+	}
+	priority_policy_init( &stage->policy);
+	return stage;
+}
+
+//################################################################################
+
+void priority_stage_delete( PriorityStage * const _stage)
+{
+	// popping releases the coalescing entries too
+	DBusMessage *message;
+	while ( (message = priority_stage_pop( _stage)) != 0x0 )
+		dbus_message_unref( message);
+	priority_policy_clear( &_stage->policy);
+	priority_stage_reset_coalescing( _stage);
+	free( _stage->keys.buckets);
+	free( _stage->queue);
+	free( _stage);
+}
+
+//################################################################################
+
+// the default policy: no rules, signals are low priority, everything else is high
+void priority_policy_init( PriorityPolicy * const _policy)
+{
+	int i;
+	_policy->rules = 0x0;
+	_policy->nbRules = 0;
+	for ( i = 0; i < DBUS_NUM_MESSAGE_TYPES; ++ i)
+		_policy->byType[i] = PRIORITY_HIGH;
+	_policy->byType[DBUS_MESSAGE_TYPE_SIGNAL] = PRIORITY_LOW;
+}
+
+//################################################################################
+
+// release the rules, and go back to the default policy
+void priority_policy_clear( PriorityPolicy * const _policy)
+{
+	int i;
+	for ( i = 0; i < _policy->nbRules; ++ i)
+		free( _policy->rules[i]);
+	free( _policy->rules);
+	priority_policy_init( _policy);
+}
+
+//################################################################################
+
+int priority_policy_add_rule( PriorityPolicy * const _policy, char const * const _interface, char const * const _member, int const _priority)
+{
+	size_t const interfaceSize = _interface ? strlen( _interface) + 1 : 0;
+	size_t const memberSize = _member ? strlen( _member) + 1 : 0;
+	PriorityRule ** const rules = (PriorityRule **) realloc( _policy->rules, (_policy->nbRules + 1) * sizeof( PriorityRule *));
+	if ( rules == 0x0 )
+		return 0;
+	_policy->rules = rules;
+	PriorityRule * const rule = (PriorityRule *) malloc( sizeof( PriorityRule) + interfaceSize + memberSize);
+	if ( rule == 0x0 )
+		return 0;
+	rule->priority = _priority;
+	rule->interface = _interface ? memcpy( (char *) (rule + 1), _interface, interfaceSize) : 0x0;
+	rule->member = _member ? memcpy( (char *) (rule + 1) + interfaceSize, _member, memberSize) : 0x0;
+	rules[_policy->nbRules ++] = rule;
+	return 1;
+}
+
+//################################################################################
+
+// the stage takes over the policy, which is left empty; the previous one is released
+void priority_stage_set_policy( PriorityStage * const _stage, PriorityPolicy * const _policy)
+{
+	priority_policy_clear( &_stage->policy);
+	_stage->policy = *_policy;
+	priority_policy_init( _policy);
+}
+
+//################################################################################
+
+// parked messages keep their keys, only new messages are no longer coalesced
+void priority_stage_reset_coalescing( PriorityStage * const _stage)
+{
+	int i;
+	for ( i = 0; i < _stage->nbCoalesceRules; ++ i)
+		free( _stage->coalesceRules[i]);
+	free( _stage->coalesceRules);
+	_stage->coalesceRules = 0x0;
+	_stage->nbCoalesceRules = 0;
+}
+
+//################################################################################
+
+int priority_stage_add_coalesce_rule( PriorityStage * const _stage, char const * const _interface, char const * const _member, char const * const _path, int const _useArg0)
+{
+	size_t const interfaceSize = _interface ? strlen( _interface) + 1 : 0;
+	size_t const memberSize = _member ? strlen( _member) + 1 : 0;
+	size_t const pathSize = _path ? strlen( _path) + 1 : 0;
+	CoalesceRule ** const rules = (CoalesceRule **) realloc( _stage->coalesceRules, (_stage->nbCoalesceRules + 1) * sizeof( CoalesceRule *));
+	if ( rules == 0x0 )
+		return 0;
+	_stage->coalesceRules = rules;
+	CoalesceRule * const rule = (CoalesceRule *) malloc( sizeof( CoalesceRule) + interfaceSize + memberSize + pathSize);
+	if ( rule == 0x0 )
+		return 0;
+	char * const strings = (char *) (rule + 1);
+	rule->useArg0 = _useArg0;
+	rule->nbDropped = 0;
+	rule->interface = _interface ? memcpy( strings, _interface, interfaceSize) : 0x0;
+	rule->member = _member ? memcpy( strings + interfaceSize, _member, memberSize) : 0x0;
+	rule->path = _path ? memcpy( strings + interfaceSize + memberSize, _path, pathSize) : 0x0;
+	rules[_stage->nbCoalesceRules ++] = rule;
+	return 1;
+}
+
+//################################################################################
+
+int priority_stage_classify( PriorityStage const * const _stage, DBusMessage * const _message)
+{
+	int i;
+	for ( i = 0; i < _stage->policy.nbRules; ++ i)
+	{
+		PriorityRule const * const rule = _stage->policy.rules[i];
+		if ( rule->interface != 0x0 && !dbus_message_has_interface( _message, rule->interface) )
+			continue;
+		if ( rule->member != 0x0 && !dbus_message_has_member( _message, rule->member) )
+			continue;
+		return rule->priority;
+	}
+	int const type = dbus_message_get_type( _message);
+	return ( type < DBUS_NUM_MESSAGE_TYPES ) ? _stage->policy.byType[type] : PRIORITY_HIGH;
+}
+
+//################################################################################
+
+static CoalesceRule * private_find_coalesce_rule( PriorityStage const * const _stage, DBusMessage * const _message)
+{
+	if ( _stage->nbCoalesceRules == 0 || dbus_message_get_type( _message) != DBUS_MESSAGE_TYPE_SIGNAL )
+		return 0x0;
+	int i;
+	for ( i = 0; i < _stage->nbCoalesceRules; ++ i)
+	{
+		CoalesceRule * const rule = _stage->coalesceRules[i];
+		if ( rule->interface != 0x0 && !dbus_message_has_interface( _message, rule->interface) )
+			continue;
+		if ( rule->member != 0x0 && !dbus_message_has_member( _message, rule->member) )
+			continue;
+		if ( rule->path != 0x0 && !dbus_message_has_path( _message, rule->path) )
+			continue;
+		return rule;
+	}
+	return 0x0;
+}
+
+//################################################################################
+
+// low priority messages wait, and so do the signals that may be superseded while waiting
+int priority_stage_should_park( PriorityStage const * const _stage, DBusMessage * const _message)
+{
+	if ( _stage->enabled && priority_stage_classify( _stage, _message) == PRIORITY_LOW )
+		return 1;
+	return private_find_coalesce_rule( _stage, _message) != 0x0;
+}
+
+//################################################################################
+
+// find or create the entry for the key of _message; 0x0 when out of memory
+static CoalesceEntry * private_get_entry( PriorityStage * const _stage, DBusMessage * const _message, int const _useArg0)
+{
+	char const *fields[5];
+	fields[0] = dbus_message_get_sender( _message);
+	fields[1] = dbus_message_get_path( _message);
+	fields[2] = dbus_message_get_interface( _message);
+	fields[3] = dbus_message_get_member( _message);
+	fields[4] = 0x0;
+	DBusMessageIter iter;
+	if ( _useArg0 && dbus_message_iter_init( _message, &iter) )
+	{
+		int const type = dbus_message_iter_get_arg_type( &iter);
+		if ( type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH )
+			dbus_message_iter_get_basic( &iter, &fields[4]);
+	}
+	// a missing field hashes like an empty one, it can only collide with itself
+	size_t sizes[5];
+	size_t keySize = 0;
+	dbus_uint64_t hash = UTILS_FNV_OFFSET_BASIS;
+	int i;
+	for ( i = 0; i < 5; ++ i)
+	{
+		char const * const field = fields[i] ? fields[i] : "";
+		sizes[i] = strlen( field) + 1;
+		keySize += sizes[i];
+		hash = utils_hash_bytes( hash, field, sizes[i]);
+	}
+	CoalesceEntry *entry;
+	for ( entry = (CoalesceEntry *) *utils_hash_table_bucket( &_stage->keys, hash); entry != 0x0; entry = (CoalesceEntry *) entry->link.next )
+	{
+		if ( entry->link.hash != hash || entry->keySize != keySize )
+			continue;
+		char const *key = entry->key;
+		for ( i = 0; i < 5; ++ i)
+		{
+			if ( memcmp( key, fields[i] ? fields[i] : "", sizes[i]) != 0 )
+				break;
+			key += sizes[i];
+		}
+		if ( i == 5 )
+			return entry;
+	}
+	entry = (CoalesceEntry *) malloc( sizeof( CoalesceEntry) + keySize);
+	if ( entry == 0x0 )
+		return 0x0;
+	entry->link.hash = hash;
+	entry->keySize = keySize;
+	entry->latestSequence = 0;
+	char *key = entry->key;
+	for ( i = 0; i < 5; ++ i)
+	{
+		memcpy( key, fields[i] ? fields[i] : "", sizes[i]);
+		key += sizes[i];
+	}
+	utils_hash_table_insert( &_stage->keys, &entry->link);
+	return entry;
+}
+
+//################################################################################
+
+static void private_release_entry( PriorityStage * const _stage, CoalesceEntry * const _entry)
+{
+	utils_hash_table_remove( &_stage->keys, &_entry->link);
+	free( _entry);
+}
+
+//################################################################################
+
+// park a message, taking a reference on it; returns 0 when out of memory
+int priority_stage_push( PriorityStage * const _stage, DBusMessage * const _message)
+{
+	if ( _stage->count == _stage->capacity )
+	{
+		int const capacity = _stage->capacity ? _stage->capacity * 2 : 64;
+		ParkedMessage * const queue = (ParkedMessage *) malloc( capacity * sizeof( ParkedMessage));
+		if ( queue == 0x0 )
+			return 0;
+		// unwrap the ring while copying
+		int i;
+		for ( i = 0; i < _stage->count; ++ i)
+			queue[i] = _stage->queue[(_stage->head + i) % _stage->capacity];
+		free( _stage->queue);
+		_stage->queue = queue;
+		_stage->capacity = capacity;
+		_stage->head = 0;
+	}
+	ParkedMessage * const parked = &_stage->queue[(_stage->head + _stage->count) % _stage->capacity];
+	parked->message = dbus_message_ref( _message);
+	parked->sequence = ++ _stage->nextSequence;
+	parked->entry = 0x0;
+	CoalesceRule * const rule = private_find_coalesce_rule( _stage, _message);
+	if ( rule != 0x0 )
+	{
+		// without an entry, the message is simply not coalesced
+		parked->entry = private_get_entry( _stage, _message, rule->useArg0);
+		if ( parked->entry != 0x0 )
+		{
+			// a parked message has this key: it is superseded, and will be dropped when popped
+			if ( parked->entry->latestSequence != 0 )
+			{
+				++ rule->nbDropped;
+				++ _stage->nbCoalesced;
+			}
+			parked->entry->latestSequence = parked->sequence;
+		}
+	}
+	++ _stage->count;
+	++ _stage->nbDeferred;
+	return 1;
+}
+
+//################################################################################
+
+// the oldest parked message that wasn't superseded, the caller gets our reference; 0x0 when there is none
+DBusMessage * priority_stage_pop( PriorityStage * const _stage)
+{
+	while ( _stage->count > 0 )
+	{
+		ParkedMessage const parked = _stage->queue[_stage->head];
+		_stage->head = (_stage->head + 1) % _stage->capacity;
+		-- _stage->count;
+		if ( parked.entry != 0x0 )
+		{
+			if ( parked.entry->latestSequence != parked.sequence )
+			{
+				dbus_message_unref( parked.message);
+				continue;
+			}
+			// the latest message of its key, nothing parked refers to the entry anymore
+			private_release_entry( _stage, parked.entry);
+		}
+		return parked.message;
+	}
+	return 0x0;
+}
@@ -0,0 +1,82 @@
+#if ! defined ( __dbus_priority_h__ )
+#define __dbus_priority_h__ 1
+
+//################################################################################
+
+// priority stage in front of the lua filters: high priority messages go through the filters
+// as libdbus dispatches them, low priority ones are parked in a FIFO and only filtered
+// once libdbus has nothing else to dispatch, so calls don't wait behind a signal storm
+// signals matching a coalescing rule are always parked: a newer one with the same
+// (sender, path, interface, member[, arg0]) key supersedes the parked one, which is dropped
+#define PRIORITY_HIGH 0
+#define PRIORITY_LOW 1
+
+struct PriorityRule;
+struct CoalesceEntry;
+
+struct CoalesceRule
+{
+	// also key on the first argument, when it is a string
+	int useArg0;
+	unsigned long nbDropped;
+	// the strings live in the same block, right after the rule; 0x0 matches anything
+	char *interface;
+	char *member;
+	char *path;
+};
+typedef struct CoalesceRule CoalesceRule;
+
+// how messages are classified: the first (interface, member) rule that matches, else the message type
+struct PriorityPolicy
+{
+	int byType[DBUS_NUM_MESSAGE_TYPES];
+	struct PriorityRule **rules;
+	int nbRules;
+};
+typedef struct PriorityPolicy PriorityPolicy;
+
+struct ParkedMessage
+{
+	DBusMessage *message;
+	dbus_uint64_t sequence;
+	// the coalescing key of the message, 0x0 if it has none
+	struct CoalesceEntry *entry;
+};
+typedef struct ParkedMessage ParkedMessage;
+
+struct PriorityStage
+{
+	// classification is only done while enabled, parked messages are drained either way
+	int enabled;
+	PriorityPolicy policy;
+	CoalesceRule **coalesceRules;
+	int nbCoalesceRules;
+	// ring buffer of parked messages, we hold a reference on each
+	ParkedMessage *queue;
+	int capacity;
+	int head;
+	int count;
+	dbus_uint64_t nextSequence;
+	// coalescing keys of the parked messages
+	HashTable keys;
+	unsigned long nbDeferred;
+	unsigned long nbCoalesced;
+};
+typedef struct PriorityStage PriorityStage;
+
+extern PriorityStage * priority_stage_new( void);
+extern void priority_stage_delete( PriorityStage * const _stage);
+extern void priority_policy_init( PriorityPolicy * const _policy);
+extern void priority_policy_clear( PriorityPolicy * const _policy);
+extern int priority_policy_add_rule( PriorityPolicy * const _policy, char const * const _interface, char const * const _member, int const _priority);
+extern void priority_stage_set_policy( PriorityStage * const _stage, PriorityPolicy * const _policy);
+extern void priority_stage_reset_coalescing( PriorityStage * const _stage);
+extern int priority_stage_add_coalesce_rule( PriorityStage * const _stage, char const * const _interface, char const * const _member, char const * const _path, int const _useArg0);
+extern int priority_stage_classify( PriorityStage const * const _stage, DBusMessage * const _message);
+extern int priority_stage_should_park( PriorityStage const * const _stage, DBusMessage * const _message);
+extern int priority_stage_push( PriorityStage * const _stage, DBusMessage * const _message);
+extern DBusMessage * priority_stage_pop( PriorityStage * const _stage);
+
+//################################################################################
+
+#endif // __dbus_priority_h__
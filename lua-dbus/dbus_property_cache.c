@@ -0,0 +1,650 @@
+/************************************************************************
+*
+* Lua bindings for libdbus.
+* Copyright (c) 2009 - BenoitGermain <bnt.germain@gmail.com>
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+************************************************************************/
+
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <dbus/dbus.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "dbus_message_args.h"
+#include "dbus_property_cache.h"
+
+//################################################################################
+// property caches: bus:property_cache( destination, path, interface) mirrors the properties
+// of one interface of a remote object. One GetAll fills it, then a C filter applies the
+// PropertiesChanged deltas as the bus is dispatched, so reads never leave the process.
+// a NameOwnerChanged match empties the mirror when the service goes away or is replaced
+//################################################################################
+
+extern char const gBusMetatableKey[];
+extern DBusConnection * extract_dbus_connection_pointer( lua_State * const _L, int const _ndx, char const * const _whichMeta);
+
+char const gPropertyCacheMetatableKey[] = "lua-dbus property cache";
+
+struct PropertyCache
+{
+	DBusConnection *connection;
+	// the state the callbacks run in, anchored in the userdata's environment
+	lua_State *L;
+	char *destination;
+	char *path;
+	char *interface;
+	// unique name of the current owner of destination, 0x0 if unknown
+	char *owner;
+	char *propertiesRule;
+	char *ownerRule;
+	// set when the mirror must be filled again before being read
+	int stale;
+	int filterInstalled;
+	unsigned long nbUpdates;
+};
+typedef struct PropertyCache PropertyCache;
+
+// the userdata only holds a pointer, so that the cache pointer can key the userdata map
+struct PropertyCacheUserdata
+{
+	PropertyCache *cache;
+};
+typedef struct PropertyCacheUserdata PropertyCacheUserdata;
+
+// what the protected calls from the filter get
+struct PropertyCacheEvent
+{
+	PropertyCache *cache;
+	DBusMessage *message;
+};
+typedef struct PropertyCacheEvent PropertyCacheEvent;
+
+//################################################################################
+//################################################################################
+
+static char * private_strdup( char const * const _string)
+{
+	size_t const size = strlen( _string) + 1;
+	char * const copy = (char *) malloc( size);
+	if ( copy != 0x0 )
+		memcpy( copy, _string, size);
+	return copy;
+}
+
+//################################################################################
+
+static void private_set_owner( PropertyCache * const _cache, char const * const _owner)
+{
+	free( _cache->owner);
+	_cache->owner = ( _owner != 0x0 && *_owner != '\0' ) ? private_strdup( _owner) : 0x0;
+}
+
+//################################################################################
+
+static PropertyCache * cast_to_property_cache( lua_State * const _L, int const _ndx)
+{
+	return *(PropertyCache **) utils_cast_userdata( _L, _ndx, gPropertyCacheMetatableKey);
+}
+
+//################################################################################
+
+// call every change callback with ( cache, name, value); expects the cache userdata at _cacheNdx
+// and the value on top of the stack, which is left in place
+static void private_notify( lua_State * const _L, int const _cacheNdx, char const * const _name)
+{
+	int const valueNdx = lua_gettop( _L);
+	lua_getfenv( _L, _cacheNdx);                                    // ... value {env}
+	lua_getfield( _L, -1, "callbacks");                             // ... value {env} {callbacks}
+	int const nbCallbacks = lua_objlen( _L, -1);
+	int i;
+	for ( i = 1; i <= nbCallbacks; ++ i)
+	{
+		lua_rawgeti( _L, -1, i);                                     // ... value {env} {callbacks} f
+		lua_pushvalue( _L, _cacheNdx);                               // ... value {env} {callbacks} f C
+		if ( _name != 0x0 )
+			lua_pushstring( _L, _name);                               // ... value {env} {callbacks} f C name
+		else
+			lua_pushnil( _L);                                         // ... value {env} {callbacks} f C nil
+		lua_pushvalue( _L, valueNdx);                                // ... value {env} {callbacks} f C name value
+		lua_call( _L, 3, 0);                                         // ... value {env} {callbacks}
+	}
+	lua_pop( _L, 2);                                                // ... value
+}
+
+//################################################################################
+
+// the userdata may already be collected while libdbus still knows our filter: don't raise in that case
+static int private_push_cache_userdata( lua_State * const _L, PropertyCache * const _cache)
+{
+	if ( !utils_is_mapped_userdata( _L, _cache) )
+		return 0;
+	utils_fetch_userdata( _L, _cache);                              // C
+	return 1;
+}
+
+//################################################################################
+
+// lua_cpcall'ed: apply a PropertiesChanged signal ( s interface, a{sv} changed, as invalidated)
+static int private_apply_properties_changed( lua_State * const _L)
+{
+	PropertyCacheEvent * const event = (PropertyCacheEvent *) lua_touserdata( _L, 1);
+	if ( !private_push_cache_userdata( _L, event->cache) )
+		return 0;                                                    // C
+	int const cacheNdx = lua_gettop( _L);
+	lua_getfenv( _L, cacheNdx);                                     // C {env}
+	lua_getfield( _L, -1, "values");                                // C {env} {values}
+	lua_getfield( _L, -2, "invalidated");                           // C {env} {values} {invalidated}
+	int const valuesNdx = cacheNdx + 2;
+	int const invalidatedNdx = cacheNdx + 3;
+	DBusMessageIter iter;
+	if ( !dbus_message_iter_init( event->message, &iter) || !dbus_message_iter_next( &iter) || dbus_message_iter_get_arg_type( &iter) != DBUS_TYPE_ARRAY )
+		return 0;
+	++ event->cache->nbUpdates;
+	DBusMessageIter dict;
+	dbus_message_iter_recurse( &iter, &dict);
+	while ( dbus_message_iter_get_arg_type( &dict) == DBUS_TYPE_DICT_ENTRY )
+	{
+		DBusMessageIter entry;
+		char const *name;
+		dbus_message_iter_recurse( &dict, &entry);
+		dbus_message_iter_get_basic( &entry, &name);
+		dbus_message_iter_next( &entry);
+		// variants come out unwrapped
+		message_args_push_iter_value( _L, &entry);                   // C {env} {values} {invalidated} value
+		lua_pushvalue( _L, -1);                                      // C {env} {values} {invalidated} value value
+		lua_setfield( _L, valuesNdx, name);                          // C {env} {values} {invalidated} value
+		lua_pushnil( _L);                                            // C {env} {values} {invalidated} value nil
+		lua_setfield( _L, invalidatedNdx, name);                     // C {env} {values} {invalidated} value
+		private_notify( _L, cacheNdx, name);
+		lua_pop( _L, 1);                                             // C {env} {values} {invalidated}
+		dbus_message_iter_next( &dict);
+	}
+	// invalidated properties are dropped, and fetched again if someone reads them
+	if ( dbus_message_iter_next( &iter) && dbus_message_iter_get_arg_type( &iter) == DBUS_TYPE_ARRAY )
+	{
+		DBusMessageIter names;
+		dbus_message_iter_recurse( &iter, &names);
+		while ( dbus_message_iter_get_arg_type( &names) == DBUS_TYPE_STRING )
+		{
+			char const *name;
+			dbus_message_iter_get_basic( &names, &name);
+			lua_pushnil( _L);                                         // C {env} {values} {invalidated} nil
+			lua_setfield( _L, valuesNdx, name);                       // C {env} {values} {invalidated}
+			lua_pushboolean( _L, 1);                                  // C {env} {values} {invalidated} true
+			lua_setfield( _L, invalidatedNdx, name);                  // C {env} {values} {invalidated}
+			lua_pushnil( _L);                                         // C {env} {values} {invalidated} nil
+			private_notify( _L, cacheNdx, name);
+			lua_pop( _L, 1);                                          // C {env} {values} {invalidated}
+			dbus_message_iter_next( &names);
+		}
+	}
+	return 0;
+}
+
+//################################################################################
+
+// lua_cpcall'ed: the owner of the destination changed, everything we know is obsolete
+static int private_apply_owner_change( lua_State * const _L)
+{
+	PropertyCacheEvent * const event = (PropertyCacheEvent *) lua_touserdata( _L, 1);
+	if ( !private_push_cache_userdata( _L, event->cache) )
+		return 0;                                                    // C
+	int const cacheNdx = lua_gettop( _L);
+	lua_getfenv( _L, cacheNdx);                                     // C {env}
+	lua_newtable( _L);                                              // C {env} {}
+	lua_setfield( _L, -2, "values");                                // C {env}
+	lua_newtable( _L);                                              // C {env} {}
+	lua_setfield( _L, -2, "invalidated");                           // C {env}
+	// a nil name tells the callbacks that all the properties are gone
+	lua_pushnil( _L);                                               // C {env} nil
+	private_notify( _L, cacheNdx, 0x0);
+	return 0;
+}
+
+//################################################################################
+
+// run one of the above in the callbacks' state; errors can't cross libdbus, so they are
+// left in the bus environment, where dispatch() raises them once libdbus is done
+static void private_run_protected( PropertyCache * const _cache, DBusMessage * const _message, lua_CFunction const _function)
+{
+	lua_State * const L = _cache->L;
+	PropertyCacheEvent event = { _cache, _message };
+	if ( lua_cpcall( L, _function, &event) == 0 )
+		return;
+	lua_getfield( L, LUA_REGISTRYINDEX, "dbus_userdata_map");       // error {udm}
+	lua_pushlightuserdata( L, _cache->connection);                  // error {udm} _lud
+	lua_rawget( L, -2);                                             // error {udm} B?
+	if ( lua_type( L, -1) == LUA_TUSERDATA )
+	{
+		lua_getfenv( L, -1);                                         // error {udm} B {env}
+		lua_pushvalue( L, -4);                                       // error {udm} B {env} error
+		lua_setfield( L, -2, "filter_error");                        // error {udm} B {env}
+		lua_pop( L, 1);                                              // error {udm} B
+	}
+	lua_pop( L, 3);                                                 //
+}
+
+//################################################################################
+
+static DBusHandlerResult private_property_cache_filter( DBusConnection *_connection, DBusMessage *_message, void *_user_data)
+{
+	PropertyCache * const cache = (PropertyCache *) _user_data;
+	if ( dbus_message_get_type( _message) != DBUS_MESSAGE_TYPE_SIGNAL )
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	if ( dbus_message_is_signal( _message, DBUS_INTERFACE_PROPERTIES, "PropertiesChanged") )
+	{
+		char const * const sender = dbus_message_get_sender( _message);
+		char const *interface = 0x0;
+		DBusMessageIter iter;
+		if ( !dbus_message_has_path( _message, cache->path)
+			|| ( cache->owner != 0x0 && sender != 0x0 && strcmp( sender, cache->owner) != 0 )
+			|| !dbus_message_iter_init( _message, &iter)
+			|| dbus_message_iter_get_arg_type( &iter) != DBUS_TYPE_STRING )
+			return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+		dbus_message_iter_get_basic( &iter, &interface);
+		if ( strcmp( interface, cache->interface) == 0 && !cache->stale )
+			private_run_protected( cache, _message, private_apply_properties_changed);
+	}
+	else if ( cache->ownerRule != 0x0 && dbus_message_is_signal( _message, DBUS_INTERFACE_DBUS, "NameOwnerChanged") )
+	{
+		char const *name, *oldOwner, *newOwner;
+		if ( !dbus_message_get_args( _message, 0x0, DBUS_TYPE_STRING, &name, DBUS_TYPE_STRING, &oldOwner, DBUS_TYPE_STRING, &newOwner, DBUS_TYPE_INVALID)
+			|| strcmp( name, cache->destination) != 0 )
+			return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+		private_set_owner( cache, newOwner);
+		// the new owner, if any, will be asked for everything on the next read
+		cache->stale = 1;
+		private_run_protected( cache, _message, private_apply_owner_change);
+	}
+	// other filters may be interested in these signals too
+	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+//################################################################################
+
+// GetAll into a fresh mirror; pushes nothing on success, or nil, error name, error message
+static int private_refresh( lua_State * const _L, int const _cacheNdx, PropertyCache * const _cache)
+{
+	DBusMessage * const call = dbus_message_new_method_call( _cache->destination, _cache->path, DBUS_INTERFACE_PROPERTIES, "GetAll");
+	char const * interface = _cache->interface;
+	if ( call == 0x0 || !dbus_message_append_args( call, DBUS_TYPE_STRING, &interface, DBUS_TYPE_INVALID) )
+	{
+		if ( call != 0x0 )
+			dbus_message_unref( call);
+		return luaL_error( _L, "not enough memory to fetch the properties");
+	}
+	DBusError error;
+	dbus_error_init( &error);
+	DBusMessage * const reply = dbus_connection_send_with_reply_and_block( _cache->connection, call, -1, &error);
+	dbus_message_unref( call);
+	DBusMessageIter iter;
+	if ( reply == 0x0 || !dbus_message_iter_init( reply, &iter) || dbus_message_iter_get_arg_type( &iter) != DBUS_TYPE_ARRAY )
+	{
+		lua_pushnil( _L);
+		lua_pushstring( _L, reply ? DBUS_ERROR_INVALID_SIGNATURE : error.name);
+		lua_pushstring( _L, reply ? "GetAll did not return a dictionary" : error.message);
+		if ( reply != 0x0 )
+			dbus_message_unref( reply);
+		dbus_error_free( &error);
+		return 3;
+	}
+	// the reply comes from the current owner, which is what PropertiesChanged senders are checked against
+	private_set_owner( _cache, dbus_message_get_sender( reply));
+	lua_getfenv( _L, _cacheNdx);                                    // {env}
+	// a{sv} comes out as a table of unwrapped values
+	message_args_push_iter_value( _L, &iter);                       // {env} {values}
+	dbus_message_unref( reply);
+	lua_setfield( _L, -2, "values");                                // {env}
+	lua_newtable( _L);                                              // {env} {}
+	lua_setfield( _L, -2, "invalidated");                           // {env}
+	lua_pop( _L, 1);                                                //
+	_cache->stale = 0;
+	return 0;
+}
+
+//################################################################################
+
+static void private_close( PropertyCache * const _cache)
+{
+	if ( _cache->filterInstalled )
+	{
+		dbus_connection_remove_filter( _cache->connection, private_property_cache_filter, _cache);
+		_cache->filterInstalled = 0;
+	}
+	// without an error argument, these don't wait for the daemon's answer
+	if ( _cache->propertiesRule != 0x0 )
+		dbus_bus_remove_match( _cache->connection, _cache->propertiesRule, 0x0);
+	if ( _cache->ownerRule != 0x0 )
+		dbus_bus_remove_match( _cache->connection, _cache->ownerRule, 0x0);
+	free( _cache->propertiesRule);
+	free( _cache->ownerRule);
+	_cache->propertiesRule = _cache->ownerRule = 0x0;
+}
+
+//################################################################################
+
+// add a match described by the rules table on top of the stack, which is popped, and keep the rule string
+static char * private_add_match( lua_State * const _L, DBusConnection * const _connection, DBusError * const _error)
+{
+	char rulesBuffer[DBUS_MAXIMUM_MATCH_RULE_LENGTH];
+	utils_fill_rule_buffer_from_table( _L, -1, rulesBuffer);
+	lua_pop( _L, 1);
+	dbus_bus_add_match( _connection, rulesBuffer, _error);
+	if ( dbus_error_is_set( _error) )
+		return 0x0;
+	char * const rule = private_strdup( rulesBuffer);
+	if ( rule == 0x0 )
+		dbus_bus_remove_match( _connection, rulesBuffer, 0x0);
+	return rule;
+}
+
+//################################################################################
+//################################################################################
+
+// bus:property_cache( destination, path, interface) -> cache, or nil, error name, error message
+int bind_dbus_bus_property_cache( lua_State * const _L)
+{
+	utils_check_nargs( _L, 4);
+	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, gBusMetatableKey);
+	char const * const destination = luaL_checkstring( _L, 2);
+	char const * const path = luaL_checkstring( _L, 3);
+	char const * const interface = luaL_checkstring( _L, 4);
+	luaL_argcheck( _L, dbus_validate_bus_name( destination, 0x0), 2, "invalid bus name");
+	luaL_argcheck( _L, dbus_validate_path( path, 0x0), 3, "invalid object path");
+	luaL_argcheck( _L, dbus_validate_interface( interface, 0x0), 4, "invalid interface name");
+
+	PropertyCache * const cache = (PropertyCache *) calloc( 1, sizeof( PropertyCache));
+	if ( cache == 0x0 )
+		return luaL_error( _L, "not enough memory to create a property cache");
+	cache->connection = dbus_connection_ref( connection);
+	cache->destination = private_strdup( destination);
+	cache->path = private_strdup( path);
+	cache->interface = private_strdup( interface);
+	cache->stale = 1;
+	// from now on, the finalizer takes care of the cleanup
+	utils_push_mapped_userdata( _L, cache, gPropertyCacheMetatableKey, sizeof( PropertyCacheUserdata));   // B d p i C
+	if ( cache->destination == 0x0 || cache->path == 0x0 || cache->interface == 0x0 )
+		return luaL_error( _L, "not enough memory to create a property cache");
+	int const cacheNdx = lua_gettop( _L);
+	lua_createtable( _L, 0, 5);                                     // B d p i C {env}
+	lua_pushvalue( _L, 1);                                          // B d p i C {env} B
+	lua_setfield( _L, -2, "bus");                                   // B d p i C {env}
+	// callbacks run in a thread of their own, which can't be a suspended coroutine
+	cache->L = lua_newthread( _L);                                  // B d p i C {env} thread
+	lua_setfield( _L, -2, "thread");                                // B d p i C {env}
+	lua_newtable( _L);                                              // B d p i C {env} {}
+	lua_setfield( _L, -2, "values");                                // B d p i C {env}
+	lua_newtable( _L);                                              // B d p i C {env} {}
+	lua_setfield( _L, -2, "invalidated");                           // B d p i C {env}
+	lua_newtable( _L);                                              // B d p i C {env} {}
+	lua_setfield( _L, -2, "callbacks");                             // B d p i C {env}
+	lua_setfenv( _L, cacheNdx);                                     // B d p i C
+
+	// subscribe before fetching, so that no change can slip between the two
+	DBusError error;
+	dbus_error_init( &error);
+	lua_createtable( _L, 0, 6);                                     // B d p i C {rules}
+	lua_pushliteral( _L, "signal");
+	lua_setfield( _L, -2, "type");
+	lua_pushvalue( _L, 2);
+	lua_setfield( _L, -2, "sender");
+	lua_pushvalue( _L, 3);
+	lua_setfield( _L, -2, "path");
+	lua_pushliteral( _L, DBUS_INTERFACE_PROPERTIES);
+	lua_setfield( _L, -2, "interface");
+	lua_pushliteral( _L, "PropertiesChanged");
+	lua_setfield( _L, -2, "member");
+	lua_createtable( _L, 1, 0);                                     // B d p i C {rules} {arg}
+	lua_pushvalue( _L, 4);
+	lua_rawseti( _L, -2, 0);
+	lua_setfield( _L, -2, "arg");                                   // B d p i C {rules}
+	cache->propertiesRule = private_add_match( _L, connection, &error);   // B d p i C
+	// unique names never change owner
+	if ( cache->propertiesRule != 0x0 && destination[0] != ':' )
+	{
+		lua_createtable( _L, 0, 6);                                  // B d p i C {rules}
+		lua_pushliteral( _L, "signal");
+		lua_setfield( _L, -2, "type");
+		lua_pushliteral( _L, DBUS_SERVICE_DBUS);
+		lua_setfield( _L, -2, "sender");
+		lua_pushliteral( _L, DBUS_PATH_DBUS);
+		lua_setfield( _L, -2, "path");
+		lua_pushliteral( _L, DBUS_INTERFACE_DBUS);
+		lua_setfield( _L, -2, "interface");
+		lua_pushliteral( _L, "NameOwnerChanged");
+		lua_setfield( _L, -2, "member");
+		lua_createtable( _L, 1, 0);                                  // B d p i C {rules} {arg}
+		lua_pushvalue( _L, 2);
+		lua_rawseti( _L, -2, 0);
+		lua_setfield( _L, -2, "arg");                                // B d p i C {rules}
+		cache->ownerRule = private_add_match( _L, connection, &error);   // B d p i C
+	}
+	if ( dbus_error_is_set( &error) )
+	{
+		lua_pushnil( _L);
+		lua_pushstring( _L, error.name);
+		lua_pushstring( _L, error.message);
+		dbus_error_free( &error);
+		return 3;
+	}
+	if ( cache->propertiesRule == 0x0 || ( destination[0] != ':' && cache->ownerRule == 0x0 ) )
+		return luaL_error( _L, "not enough memory to create a property cache");
+	if ( !dbus_connection_add_filter( connection, private_property_cache_filter, cache, 0x0) )
+		return luaL_error( _L, "not enough memory to create a property cache");
+	cache->filterInstalled = 1;
+	int const nbResults = private_refresh( _L, cacheNdx, cache);
+	if ( nbResults != 0 )
+		return nbResults;
+	lua_settop( _L, cacheNdx);                                      // B d p i C
+	return 1;
+}
+
+//################################################################################
+
+// cache:get( name) -> value; invalidated properties are fetched again, one by one
+int bind_dbus_property_cache_get( lua_State * const _L)
+{
+	utils_check_nargs( _L, 2);
+	PropertyCache * const cache = cast_to_property_cache( _L, 1);
+	char const * const name = luaL_checkstring( _L, 2);
+	if ( cache->stale )
+	{
+		int const nbResults = private_refresh( _L, 1, cache);
+		if ( nbResults != 0 )
+			return nbResults;
+	}
+	lua_getfenv( _L, 1);                                            // C name {env}
+	lua_getfield( _L, -1, "values");                                // C name {env} {values}
+	lua_getfield( _L, -1, name);                                    // C name {env} {values} value?
+	if ( !lua_isnil( _L, -1) )
+		return 1;
+	lua_getfield( _L, -3, "invalidated");                           // C name {env} {values} nil {invalidated}
+	lua_getfield( _L, -1, name);                                    // C name {env} {values} nil {invalidated} invalid?
+	if ( !lua_toboolean( _L, -1) )
+		return 1;
+	lua_pop( _L, 2);                                                // C name {env} {values} nil
+	DBusMessage * const call = dbus_message_new_method_call( cache->destination, cache->path, DBUS_INTERFACE_PROPERTIES, "Get");
+	char const *interface = cache->interface;
+	if ( call == 0x0 || !dbus_message_append_args( call, DBUS_TYPE_STRING, &interface, DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID) )
+	{
+		if ( call != 0x0 )
+			dbus_message_unref( call);
+		return luaL_error( _L, "not enough memory to fetch property %s", name);
+	}
+	DBusError error;
+	dbus_error_init( &error);
+	DBusMessage * const reply = dbus_connection_send_with_reply_and_block( cache->connection, call, -1, &error);
+	dbus_message_unref( call);
+	DBusMessageIter iter;
+	if ( reply == 0x0 || !dbus_message_iter_init( reply, &iter) )
+	{
+		lua_pushnil( _L);
+		lua_pushstring( _L, reply ? DBUS_ERROR_INVALID_SIGNATURE : error.name);
+		lua_pushstring( _L, reply ? "Get returned nothing" : error.message);
+		if ( reply != 0x0 )
+			dbus_message_unref( reply);
+		dbus_error_free( &error);
+		return 3;
+	}
+	lua_pop( _L, 1);                                                // C name {env} {values}
+	message_args_push_iter_value( _L, &iter);                       // C name {env} {values} value
+	dbus_message_unref( reply);
+	lua_pushvalue( _L, -1);                                         // C name {env} {values} value value
+	lua_setfield( _L, -3, name);                                    // C name {env} {values} value
+	lua_getfield( _L, -3, "invalidated");                           // C name {env} {values} value {invalidated}
+	lua_pushnil( _L);                                               // C name {env} {values} value {invalidated} nil
+	lua_setfield( _L, -2, name);                                    // C name {env} {values} value {invalidated}
+	lua_pop( _L, 1);                                                // C name {env} {values} value
+	return 1;
+}
+
+//################################################################################
+
+// cache:get_all() -> a copy of the mirrored properties (invalidated ones are left out)
+int bind_dbus_property_cache_get_all( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	PropertyCache * const cache = cast_to_property_cache( _L, 1);
+	if ( cache->stale )
+	{
+		int const nbResults = private_refresh( _L, 1, cache);
+		if ( nbResults != 0 )
+			return nbResults;
+	}
+	lua_getfenv( _L, 1);                                            // C {env}
+	lua_getfield( _L, -1, "values");                                // C {env} {values}
+	lua_newtable( _L);                                              // C {env} {values} {copy}
+	lua_pushnil( _L);                                               // C {env} {values} {copy} nil
+	while ( lua_next( _L, -3) != 0 )                                // C {env} {values} {copy} k v
+	{
+		lua_pushvalue( _L, -2);                                      // C {env} {values} {copy} k v k
+		lua_insert( _L, -2);                                         // C {env} {values} {copy} k k v
+		lua_rawset( _L, -4);                                         // C {env} {values} {copy} k
+	}
+	return 1;
+}
+
+//################################################################################
+
+// cache:get_stats() -> { updates, owner, stale }
+int bind_dbus_property_cache_get_stats( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	PropertyCache * const cache = cast_to_property_cache( _L, 1);
+	lua_createtable( _L, 0, 3);
+	lua_pushnumber( _L, cache->nbUpdates);
+	lua_setfield( _L, -2, "updates");
+	if ( cache->owner != 0x0 )
+	{
+		lua_pushstring( _L, cache->owner);
+		lua_setfield( _L, -2, "owner");
+	}
+	lua_pushboolean( _L, cache->stale);
+	lua_setfield( _L, -2, "stale");
+	return 1;
+}
+
+//################################################################################
+
+// cache:on_change( f): f( cache, name, value) is called for each change as the bus is dispatched
+// value is nil for invalidated properties, name is nil when the owner of the destination changed
+int bind_dbus_property_cache_on_change( lua_State * const _L)
+{
+	utils_check_nargs( _L, 2);
+	cast_to_property_cache( _L, 1);
+	luaL_checktype( _L, 2, LUA_TFUNCTION);
+	lua_getfenv( _L, 1);                                            // C f {env}
+	lua_getfield( _L, -1, "callbacks");                             // C f {env} {callbacks}
+	lua_pushvalue( _L, 2);                                          // C f {env} {callbacks} f
+	lua_rawseti( _L, -2, lua_objlen( _L, -2) + 1);                  // C f {env} {callbacks}
+	return 0;
+}
+
+//################################################################################
+
+int bind_dbus_property_cache_refresh( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	PropertyCache * const cache = cast_to_property_cache( _L, 1);
+	int const nbResults = private_refresh( _L, 1, cache);
+	if ( nbResults != 0 )
+		return nbResults;
+	lua_pushboolean( _L, 1);
+	return 1;
+}
+
+//################################################################################
+
+// stop following the remote object; the mirror keeps its last contents
+int bind_dbus_property_cache_close( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	PropertyCache * const cache = cast_to_property_cache( _L, 1);
+	private_close( cache);
+	return 0;
+}
+
+//################################################################################
+
+int finalize_dbus_property_cache( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	PropertyCache * const cache = cast_to_property_cache( _L, 1);
+	private_close( cache);
+	dbus_connection_unref( cache->connection);
+	free( cache->destination);
+	free( cache->path);
+	free( cache->interface);
+	free( cache->owner);
+	free( cache);
+	return 0;
+}
+
+//################################################################################
+//################################################################################
+
+static luaL_Reg gPropertyCacheMeta[] =
+{
+	{ "close", bind_dbus_property_cache_close },
+	{ "get", bind_dbus_property_cache_get },
+	{ "get_all", bind_dbus_property_cache_get_all },
+	{ "get_stats", bind_dbus_property_cache_get_stats },
+	{ "on_change", bind_dbus_property_cache_on_change },
+	{ "refresh", bind_dbus_property_cache_refresh },
+	{ "__gc", finalize_dbus_property_cache },
+	{ 0x0, 0x0 },
+};
+
+//################################################################################
+//################################################################################
+
+void register_property_cache_stuff( lua_State * const _L)
+{
+	// register the property cache metatable in the registry
+	utils_prepare_metatable( _L, gPropertyCacheMetatableKey);                                // {meta}
+	utils_register_upvalued_functions( _L, gPropertyCacheMeta, gPropertyCacheMetatableKey);  // {meta}
+	lua_pop( _L, 1);                                                                         //
+}
@@ -0,0 +1,11 @@
+#if ! defined ( __dbus_property_cache_h__ )
+#define __dbus_property_cache_h__ 1
+
+//################################################################################
+
+extern int bind_dbus_bus_property_cache( lua_State * const _L);
+extern void register_property_cache_stuff( lua_State * const _L);
+
+//################################################################################
+
+#endif // __dbus_property_cache_h__
@@ -0,0 +1,269 @@
+/************************************************************************
+*
+* Lua bindings for libdbus.
+* Copyright (c) 2009 - BenoitGermain <bnt.germain@gmail.com>
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+************************************************************************/
+
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "dbus_introspect.h"
+#include "dbus_message_args.h"
+#include "dbus_proxy.h"
+
+//################################################################################
+// proxies: bus:proxy( destination, path) introspects the object once, then
+// proxy.Interface.Method( ...) copies a prebuilt method call, appends the arguments
+// following the introspected signature, and returns the values of the reply
+// the introspection result is cached in the bus, per (destination, path), and shared by all proxies
+//################################################################################
+
+extern char const gBusMetatableKey[];
+extern DBusConnection * extract_dbus_connection_pointer( lua_State * const _L, int const _ndx, char const * const _whichMeta);
+extern int push_dbus_message( lua_State * const _L, DBusMessage * const _message);
+
+char const gIntrospectionMetatableKey[] = "lua-dbus introspection";
+
+//################################################################################
+//################################################################################
+
+// upvalues: the bus, the introspection userdata (it owns the method), the method as a lightuserdata
+static int private_call_proxy_method( lua_State * const _L)
+{
+	DBusConnection * const connection = *(DBusConnection **) lua_touserdata( _L, lua_upvalueindex( 1));
+	IntrospectionMethod * const method = (IntrospectionMethod *) lua_touserdata( _L, lua_upvalueindex( 3));
+	int const nbValues = lua_gettop( _L);
+	DBusMessage * const call = dbus_message_copy( method->template);
+	if ( call == 0x0 )
+		return luaL_error( _L, "not enough memory to call %s", method->name);
+	// let the userdata own the call, so that it is released if appending the arguments raises an error
+	push_dbus_message( _L, call);                                          // ... call
+	DBusMessageIter iter;
+	dbus_message_iter_init_append( call, &iter);
+	int ndx = 1;
+	if ( *method->inSignature != '\0' )
+	{
+		DBusSignatureIter signatureIter;
+		dbus_signature_iter_init( &signatureIter, method->inSignature);
+		do
+		{
+			if ( ndx > nbValues )
+				return luaL_error( _L, "%s expects arguments '%s', got %d values", method->name, method->inSignature, nbValues);
+			message_args_append_value( _L, ndx ++, &signatureIter, &iter);
+		} while ( dbus_signature_iter_next( &signatureIter));
+	}
+	if ( ndx - 1 != nbValues )
+		return luaL_error( _L, "%s expects arguments '%s', got %d values", method->name, method->inSignature, nbValues);
+	DBusError error;
+	dbus_error_init( &error);
+	DBusMessage * const reply = dbus_connection_send_with_reply_and_block( connection, call, -1, &error);
+	if ( reply == 0x0 )
+	{
+		lua_pushfstring( _L, "%s: %s", error.name, error.message);
+		dbus_error_free( &error);
+		return lua_error( _L);
+	}
+	int const base = lua_gettop( _L);
+	push_dbus_message( _L, reply);                                         // ... call reply
+	DBusMessageIter replyIter;
+	if ( !dbus_message_iter_init( reply, &replyIter) )
+		return 0;
+	do
+	{
+		message_args_push_iter_value( _L, &replyIter);                      // ... call reply values...
+	} while ( dbus_message_iter_next( &replyIter));
+	return lua_gettop( _L) - base - 1;
+}
+
+//################################################################################
+
+// push the introspection data of destination/path, or nil, error name, error message
+static int private_introspect( lua_State * const _L, DBusConnection * const _connection, char const * const _destination, char const * const _path)
+{
+	DBusMessage * const call = dbus_message_new_method_call( _destination, _path, DBUS_INTERFACE_INTROSPECTABLE, "Introspect");
+	if ( call == 0x0 )
+		return luaL_error( _L, "not enough memory to introspect %s", _path);
+	DBusError error;
+	dbus_error_init( &error);
+	DBusMessage * const reply = dbus_connection_send_with_reply_and_block( _connection, call, -1, &error);
+	dbus_message_unref( call);
+	char const *xml = 0x0;
+	if ( reply == 0x0 || !dbus_message_get_args( reply, &error, DBUS_TYPE_STRING, &xml, DBUS_TYPE_INVALID) )
+	{
+		if ( reply != 0x0 )
+			dbus_message_unref( reply);
+		lua_pushnil( _L);
+		lua_pushstring( _L, error.name);
+		lua_pushstring( _L, error.message);
+		dbus_error_free( &error);
+		return 3;
+	}
+	char const *parseError = 0x0;
+	IntrospectionData * const data = introspection_parse( xml, &parseError);
+	dbus_message_unref( reply);
+	if ( data == 0x0 )
+	{
+		lua_pushnil( _L);
+		lua_pushstring( _L, DBUS_ERROR_INVALID_ARGS);
+		lua_pushfstring( _L, "can't parse the introspection data of %s: %s", _path, parseError);
+		return 3;
+	}
+	// hand the data over to a userdata right away, so that it is collected whatever happens next
+	IntrospectionData ** const block = (IntrospectionData **) lua_newuserdata( _L, sizeof( IntrospectionData *));   // I
+	*block = data;
+	utils_push_metatable( _L, gIntrospectionMetatableKey);                                                         // I meta
+	lua_setmetatable( _L, -2);                                                                                      // I
+	// names were validated by the parser, the calls can be prepared once and for all
+	int i, j;
+	for ( i = 0; i < data->nbInterfaces; ++ i)
+	{
+		IntrospectionInterface * const interface = &data->interfaces[i];
+		for ( j = 0; j < interface->nbMethods; ++ j)
+		{
+			interface->methods[j].template = dbus_message_new_method_call( _destination, _path, interface->name, interface->methods[j].name);
+			if ( interface->methods[j].template == 0x0 )
+				return luaL_error( _L, "not enough memory to prepare %s.%s", interface->name, interface->methods[j].name);
+		}
+	}
+	return 1;
+}
+
+//################################################################################
+
+// builds the cache entry shared by the proxies: a metatable whose __index holds the interface tables
+// expects the bus at index 1 and the introspection userdata on top of the stack
+static void private_push_proxy_metatable( lua_State * const _L)
+{
+	IntrospectionData * const data = *(IntrospectionData **) lua_touserdata( _L, -1);
+	lua_createtable( _L, 0, 1);                                                  // I {meta}
+	lua_createtable( _L, 0, data->nbInterfaces * 2);                            // I {meta} {interfaces}
+	int i, j;
+	for ( i = 0; i < data->nbInterfaces; ++ i)
+	{
+		IntrospectionInterface * const interface = &data->interfaces[i];
+		lua_createtable( _L, 0, interface->nbMethods);                           // I {meta} {interfaces} {interface}
+		for ( j = 0; j < interface->nbMethods; ++ j)
+		{
+			lua_pushvalue( _L, 1);                                                // I {meta} {interfaces} {interface} B
+			lua_pushvalue( _L, -5);                                               // I {meta} {interfaces} {interface} B I
+			lua_pushlightuserdata( _L, &interface->methods[j]);                   // I {meta} {interfaces} {interface} B I method
+			lua_pushcclosure( _L, private_call_proxy_method, 3);                  // I {meta} {interfaces} {interface} f
+			lua_setfield( _L, -2, interface->methods[j].name);                    // I {meta} {interfaces} {interface}
+		}
+		// reachable by full name, and by the last component of the name when it isn't taken
+		char const * const shortName = strrchr( interface->name, '.') + 1;
+		lua_getfield( _L, -2, shortName);                                        // I {meta} {interfaces} {interface} ?
+		int const taken = !lua_isnil( _L, -1);
+		lua_pop( _L, 1);                                                         // I {meta} {interfaces} {interface}
+		if ( !taken )
+		{
+			lua_pushvalue( _L, -1);                                               // I {meta} {interfaces} {interface} {interface}
+			lua_setfield( _L, -3, shortName);                                     // I {meta} {interfaces} {interface}
+		}
+		lua_setfield( _L, -2, interface->name);                                  // I {meta} {interfaces}
+	}
+	lua_setfield( _L, -2, "__index");                                           // I {meta}
+	lua_remove( _L, -2);                                                        // {meta}
+}
+
+//################################################################################
+//################################################################################
+
+// bus:proxy( destination, path [, refresh]) -> proxy, or nil, error name, error message
+int bind_dbus_bus_proxy( lua_State * const _L)
+{
+	if ( lua_gettop( _L) != 4 )
+		utils_check_nargs( _L, 3);
+	DBusConnection * const connection = extract_dbus_connection_pointer( _L, 1, gBusMetatableKey);
+	char const * const destination = luaL_checkstring( _L, 2);
+	char const * const path = luaL_checkstring( _L, 3);
+	int const refresh = lua_toboolean( _L, 4);
+	luaL_argcheck( _L, dbus_validate_bus_name( destination, 0x0), 2, "invalid bus name");
+	luaL_argcheck( _L, dbus_validate_path( path, 0x0), 3, "invalid object path");
+	lua_settop( _L, 3);                                                         // B d p
+	lua_getfenv( _L, 1);                                                        // B d p {env}
+	lua_getfield( _L, -1, "proxy_cache");                                       // B d p {env} {cache}?
+	if ( lua_isnil( _L, -1) )
+	{
+		lua_pop( _L, 1);                                                         // B d p {env}
+		lua_newtable( _L);                                                       // B d p {env} {cache}
+		lua_pushvalue( _L, -1);                                                  // B d p {env} {cache} {cache}
+		lua_setfield( _L, -3, "proxy_cache");                                    // B d p {env} {cache}
+	}
+	// neither names nor paths can contain a newline
+	lua_pushfstring( _L, "%s\n%s", destination, path);                          // B d p {env} {cache} key
+	lua_pushvalue( _L, -1);                                                     // B d p {env} {cache} key key
+	lua_rawget( _L, -3);                                                        // B d p {env} {cache} key {meta}?
+	if ( lua_isnil( _L, -1) || refresh )
+	{
+		lua_pop( _L, 1);                                                         // B d p {env} {cache} key
+		int const nbResults = private_introspect( _L, connection, destination, path);   // B d p {env} {cache} key I
+		if ( nbResults != 1 )
+			return nbResults;
+		private_push_proxy_metatable( _L);                                       // B d p {env} {cache} key {meta}
+		lua_pushvalue( _L, -2);                                                  // B d p {env} {cache} key {meta} key
+		lua_pushvalue( _L, -2);                                                  // B d p {env} {cache} key {meta} key {meta}
+		lua_rawset( _L, -5);                                                     // B d p {env} {cache} key {meta}
+	}
+	lua_newtable( _L);                                                          // B d p {env} {cache} key {meta} {proxy}
+	lua_pushvalue( _L, -2);                                                     // B d p {env} {cache} key {meta} {proxy} {meta}
+	lua_setmetatable( _L, -2);                                                  // B d p {env} {cache} key {meta} {proxy}
+	return 1;
+}
+
+//################################################################################
+
+int finalize_dbus_introspection( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	IntrospectionData ** const block = (IntrospectionData **) lua_touserdata( _L, 1);
+	if ( *block != 0x0 )
+	{
+		introspection_delete( *block);
+		*block = 0x0;
+	}
+	return 0;
+}
+
+//################################################################################
+//################################################################################
+
+static luaL_Reg gIntrospectionMeta[] =
+{
+	{ "__gc", finalize_dbus_introspection },
+	{ 0x0, 0x0 },
+};
+
+//################################################################################
+//################################################################################
+
+void register_proxy_stuff( lua_State * const _L)
+{
+	// register the introspection data metatable in the registry
+	utils_prepare_metatable( _L, gIntrospectionMetatableKey);                             // {meta}
+	utils_register_upvalued_functions( _L, gIntrospectionMeta, gIntrospectionMetatableKey);   // {meta}
+	lua_pop( _L, 1);                                                                      //
+}
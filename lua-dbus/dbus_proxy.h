@@ -0,0 +1,11 @@
+#if ! defined ( __dbus_proxy_h__ )
+#define __dbus_proxy_h__ 1
+
+//################################################################################
+
+extern int bind_dbus_bus_proxy( lua_State * const _L);
+extern void register_proxy_stuff( lua_State * const _L);
+
+//################################################################################
+
+#endif // __dbus_proxy_h__
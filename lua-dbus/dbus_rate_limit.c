@@ -0,0 +1,237 @@
+/************************************************************************
+*
+* Lua bindings for libdbus.
+* Copyright (c) 2009 - BenoitGermain <bnt.germain@gmail.com>
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+************************************************************************/
+
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dbus/dbus.h>
+
+#include "utils.h"
+#include "dbus_rate_limit.h"
+
+//################################################################################
+// rate limiting: buckets are created full the first time a sender hits a rule, and refilled
+// lazily from the time elapsed since they were last looked at. a sender's buckets go away
+// when the bus tells us it disconnected; on a peer to peer connection there is only one
+// sender, whose buckets live as long as the connection
+//################################################################################
+
+struct RateBucket
+{
+	HashLink link;
+	int rule;
+	double tokens;
+	dbus_uint64_t lastRefill;
+	// the sender lives in the same block, right after the bucket
+	char sender[1];
+};
+typedef struct RateBucket RateBucket;
+
+//################################################################################
+//################################################################################
+
+// find the bucket of (sender, rule), creating it full if there is none yet
+static RateBucket * private_get_bucket( RateLimiter * const _limiter, char const * const _sender, int const _rule, dbus_uint64_t const _now)
+{
+	dbus_uint64_t const hash = utils_hash_string( UTILS_FNV_OFFSET_BASIS, _sender);
+	RateBucket *bucket;
+	for ( bucket = (RateBucket *) *utils_hash_table_bucket( &_limiter->buckets, hash); bucket != 0x0; bucket = (RateBucket *) bucket->link.next )
+	{
+		if ( bucket->link.hash == hash && bucket->rule == _rule && strcmp( bucket->sender, _sender) == 0 )
+			return bucket;
+	}
+	size_t const senderSize = strlen( _sender) + 1;
+	bucket = (RateBucket *) malloc( sizeof( RateBucket) + senderSize);
+	if ( bucket == 0x0 )
+		return 0x0;
+	bucket->link.hash = hash;
+	bucket->rule = _rule;
+	bucket->tokens = _limiter->rules[_rule]->burst;
+	bucket->lastRefill = _now;
+	memcpy( bucket->sender, _sender, senderSize);
+	utils_hash_table_insert( &_limiter->buckets, &bucket->link);
+	return bucket;
+}
+
+//################################################################################
+
+static void private_clear_buckets( RateLimiter * const _limiter)
+{
+	int i;
+	for ( i = 0; i < _limiter->buckets.nbBuckets; ++ i)
+	{
+		HashLink *link = _limiter->buckets.buckets[i];
+		while ( link != 0x0 )
+		{
+			HashLink * const next = link->next;
+			free( link);
+			link = next;
+		}
+		_limiter->buckets.buckets[i] = 0x0;
+	}
+	_limiter->buckets.nbEntries = 0;
+}
+
+//################################################################################
+//################################################################################
+
+RateLimiter * rate_limiter_new( void)
+{
+	RateLimiter * const limiter = (RateLimiter *) calloc( 1, sizeof( RateLimiter));
+	if ( limiter == 0x0 )
+		return 0x0;
+	if ( !utils_hash_table_init( &limiter->buckets, 16) )
+	{
+		free( limiter);
+		return 0x0;
+	}
+	return limiter;
+}
+
+//################################################################################
+
+void rate_limiter_delete( RateLimiter * const _limiter)
+{
+	if ( _limiter->lastAdmitted != 0x0 )
+		dbus_message_unref( _limiter->lastAdmitted);
+	rate_limiter_reset( _limiter);
+	free( _limiter->buckets.buckets);
+	free( _limiter);
+}
+
+//################################################################################
+
+// drop the rules, and the buckets since they are indexed by rule
+void rate_limiter_reset( RateLimiter * const _limiter)
+{
+	private_clear_buckets( _limiter);
+	int i;
+	for ( i = 0; i < _limiter->nbRules; ++ i)
+		free( _limiter->rules[i]);
+	free( _limiter->rules);
+	_limiter->rules = 0x0;
+	_limiter->nbRules = 0;
+}
+
+//################################################################################
+
+int rate_limiter_add_rule( RateLimiter * const _limiter, char const * const _interface, char const * const _member, double const _rate, double const _burst)
+{
+	size_t const interfaceSize = _interface ? strlen( _interface) + 1 : 0;
+	size_t const memberSize = _member ? strlen( _member) + 1 : 0;
+	RateLimitRule ** const rules = (RateLimitRule **) realloc( _limiter->rules, (_limiter->nbRules + 1) * sizeof( RateLimitRule *));
+	if ( rules == 0x0 )
+		return 0;
+	_limiter->rules = rules;
+	RateLimitRule * const rule = (RateLimitRule *) malloc( sizeof( RateLimitRule) + interfaceSize + memberSize);
+	if ( rule == 0x0 )
+		return 0;
+	rule->rate = _rate;
+	rule->burst = _burst;
+	rule->nbRejected = 0;
+	rule->interface = _interface ? memcpy( (char *) (rule + 1), _interface, interfaceSize) : 0x0;
+	rule->member = _member ? memcpy( (char *) (rule + 1) + interfaceSize, _member, memberSize) : 0x0;
+	rules[_limiter->nbRules ++] = rule;
+	return 1;
+}
+
+//################################################################################
+
+// returns 1 if the message may go on, 0 if it used up its sender's tokens
+// only calls and signals are limited, and never the ones coming from the bus daemon
+int rate_limiter_admit( RateLimiter * const _limiter, DBusMessage * const _message, dbus_uint64_t const _now)
+{
+	int const type = dbus_message_get_type( _message);
+	if ( _limiter->nbRules == 0 || (type != DBUS_MESSAGE_TYPE_METHOD_CALL && type != DBUS_MESSAGE_TYPE_SIGNAL) )
+		return 1;
+	if ( _message == _limiter->lastAdmitted )
+		return 1;
+	char const * sender = dbus_message_get_sender( _message);
+	if ( sender != 0x0 && strcmp( sender, DBUS_SERVICE_DBUS) == 0 )
+		return 1;
+	// a peer to peer connection has a single, anonymous, sender
+	if ( sender == 0x0 )
+		sender = "";
+	int i;
+	for ( i = 0; i < _limiter->nbRules; ++ i)
+	{
+		RateLimitRule * const rule = _limiter->rules[i];
+		if ( rule->interface != 0x0 && !dbus_message_has_interface( _message, rule->interface) )
+			continue;
+		if ( rule->member != 0x0 && !dbus_message_has_member( _message, rule->member) )
+			continue;
+		RateBucket * const bucket = private_get_bucket( _limiter, sender, i, _now);
+		// without memory to track the sender, let it through rather than refuse everyone
+		if ( bucket == 0x0 )
+			return 1;
+		bucket->tokens += (double) (_now - bucket->lastRefill) * rule->rate / 1e9;
+		if ( bucket->tokens > rule->burst )
+			bucket->tokens = rule->burst;
+		bucket->lastRefill = _now;
+		if ( bucket->tokens >= 1.0 )
+		{
+			bucket->tokens -= 1.0;
+			// holding a reference ensures the address can't be reused by another message meanwhile
+			dbus_message_ref( _message);
+			if ( _limiter->lastAdmitted != 0x0 )
+				dbus_message_unref( _limiter->lastAdmitted);
+			_limiter->lastAdmitted = _message;
+			return 1;
+		}
+		++ rule->nbRejected;
+		if ( type == DBUS_MESSAGE_TYPE_METHOD_CALL )
+			++ _limiter->nbRejectedCalls;
+		else
+			++ _limiter->nbDroppedSignals;
+		return 0;
+	}
+	return 1;
+}
+
+//################################################################################
+
+// a sender went away: remove all its buckets
+void rate_limiter_forget( RateLimiter * const _limiter, char const * const _sender)
+{
+	dbus_uint64_t const hash = utils_hash_string( UTILS_FNV_OFFSET_BASIS, _sender);
+	HashLink **link = utils_hash_table_bucket( &_limiter->buckets, hash);
+	while ( *link != 0x0 )
+	{
+		RateBucket * const bucket = (RateBucket *) *link;
+		if ( bucket->link.hash == hash && strcmp( bucket->sender, _sender) == 0 )
+		{
+			utils_hash_table_unlink( &_limiter->buckets, link);
+			free( bucket);
+			++ _limiter->nbExpired;
+		}
+		else
+		{
+			link = &bucket->link.next;
+		}
+	}
+}
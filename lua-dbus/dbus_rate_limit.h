@@ -0,0 +1,47 @@
+#if ! defined ( __dbus_rate_limit_h__ )
+#define __dbus_rate_limit_h__ 1
+
+//################################################################################
+
+// token buckets in front of the lua filters, one per (sender, rule)
+// the first rule matching the interface and member of a call or a signal decides its rate,
+// a message without a token is refused before any lua code sees it
+struct RateLimitRule
+{
+	// tokens added per second, and the most a bucket can hold
+	double rate;
+	double burst;
+	unsigned long nbRejected;
+	// the strings live in the same block, right after the rule; 0x0 matches anything
+	char *interface;
+	char *member;
+};
+typedef struct RateLimitRule RateLimitRule;
+
+struct RateLimiter
+{
+	RateLimitRule **rules;
+	int nbRules;
+	// the buckets, hashed by sender
+	HashTable buckets;
+	// set when the NameOwnerChanged match that expires the buckets was added on the bus
+	int watchesSenders;
+	// the last message that took a token, referenced: the limiter's own filter and the lua filter chain
+	// both ask about each message, and it must not pay twice
+	DBusMessage *lastAdmitted;
+	unsigned long nbRejectedCalls;
+	unsigned long nbDroppedSignals;
+	unsigned long nbExpired;
+};
+typedef struct RateLimiter RateLimiter;
+
+extern RateLimiter * rate_limiter_new( void);
+extern void rate_limiter_delete( RateLimiter * const _limiter);
+extern void rate_limiter_reset( RateLimiter * const _limiter);
+extern int rate_limiter_add_rule( RateLimiter * const _limiter, char const * const _interface, char const * const _member, double const _rate, double const _burst);
+extern int rate_limiter_admit( RateLimiter * const _limiter, DBusMessage * const _message, dbus_uint64_t const _now);
+extern void rate_limiter_forget( RateLimiter * const _limiter, char const * const _sender);
+
+//################################################################################
+
+#endif // __dbus_rate_limit_h__
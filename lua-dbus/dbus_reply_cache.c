@@ -0,0 +1,296 @@
+/************************************************************************
+*
+* Lua bindings for libdbus.
+* Copyright (c) 2009 - BenoitGermain <bnt.germain@gmail.com>
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+************************************************************************/
+
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dbus/dbus.h>
+
+#include "utils.h"
+#include "dbus_reply_cache.h"
+
+//################################################################################
+// memoized replies: the key is hashed once per incoming call (FNV-1a over the header
+// fields and the argument values), a hit costs a message copy and two header updates
+//################################################################################
+
+struct ReplyCacheEntry
+{
+	HashLink link;
+	DBusMessage *reply;
+	// the three strings live in the same block, right after the entry
+	char *path;
+	char *interface;
+	char *member;
+};
+typedef struct ReplyCacheEntry ReplyCacheEntry;
+
+//################################################################################
+//################################################################################
+
+static size_t private_fixed_type_size( int const _type)
+{
+	switch( _type)
+	{
+		case DBUS_TYPE_BYTE: return 1;
+		case DBUS_TYPE_INT16: case DBUS_TYPE_UINT16: return 2;
+		case DBUS_TYPE_BOOLEAN: case DBUS_TYPE_INT32: case DBUS_TYPE_UINT32: return 4;
+		case DBUS_TYPE_INT64: case DBUS_TYPE_UINT64: case DBUS_TYPE_DOUBLE: return 8;
+		default: return 0;
+	}
+}
+
+//################################################################################
+
+static dbus_uint64_t private_hash_arguments( dbus_uint64_t _hash, DBusMessageIter * const _iter)
+{
+	int type;
+	while ( (type = dbus_message_iter_get_arg_type( _iter)) != DBUS_TYPE_INVALID )
+	{
+		unsigned char const typeCode = (unsigned char) type;
+		_hash = utils_hash_bytes( _hash, &typeCode, 1);
+		if ( type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH || type == DBUS_TYPE_SIGNATURE )
+		{
+			char const *string;
+			dbus_message_iter_get_basic( _iter, &string);
+			_hash = utils_hash_string( _hash, string);
+		}
+		else if ( dbus_type_is_basic( type) )
+		{
+			DBusBasicValue value;
+			memset( &value, 0, sizeof( value));
+			dbus_message_iter_get_basic( _iter, &value);
+			_hash = utils_hash_bytes( _hash, &value, sizeof( value));
+		}
+		else
+		{
+			DBusMessageIter sub;
+			dbus_message_iter_recurse( _iter, &sub);
+			size_t const elementSize = ( type == DBUS_TYPE_ARRAY ) ? private_fixed_type_size( dbus_message_iter_get_element_type( _iter)) : 0;
+			if ( elementSize > 0 )
+			{
+				// arrays of fixed size elements are hashed in one go
+				void const *elements;
+				int nbElements;
+				dbus_message_iter_get_fixed_array( &sub, &elements, &nbElements);
+				_hash = utils_hash_bytes( _hash, &nbElements, sizeof( nbElements));
+				_hash = utils_hash_bytes( _hash, elements, (size_t) nbElements * elementSize);
+			}
+			else
+			{
+				if ( type == DBUS_TYPE_VARIANT )
+				{
+					char * const signature = dbus_message_iter_get_signature( &sub);
+					_hash = utils_hash_string( _hash, signature);
+					dbus_free( signature);
+				}
+				_hash = private_hash_arguments( _hash, &sub);
+			}
+			// close the container, so that nesting matters
+			unsigned char const end = 0;
+			_hash = utils_hash_bytes( _hash, &end, 1);
+		}
+		dbus_message_iter_next( _iter);
+	}
+	return _hash;
+}
+
+//################################################################################
+
+static dbus_uint64_t private_hash_call( DBusMessage * const _call)
+{
+	char const * const path = dbus_message_get_path( _call);
+	char const * const interface = dbus_message_get_interface( _call);
+	dbus_uint64_t hash = UTILS_FNV_OFFSET_BASIS;
+	hash = utils_hash_string( hash, path ? path : "");
+	hash = utils_hash_string( hash, interface ? interface : "");
+	hash = utils_hash_string( hash, dbus_message_get_member( _call));
+	DBusMessageIter iter;
+	if ( dbus_message_iter_init( _call, &iter) )
+		hash = private_hash_arguments( hash, &iter);
+	return hash;
+}
+
+//################################################################################
+
+// only plain method calls qualify: file descriptors can't be replayed
+static int private_is_cacheable_call( DBusMessage * const _call)
+{
+	return dbus_message_get_type( _call) == DBUS_MESSAGE_TYPE_METHOD_CALL
+		&& dbus_message_get_member( _call) != 0x0
+		&& !dbus_message_contains_unix_fds( _call);
+}
+
+//################################################################################
+
+static int private_entry_matches( ReplyCacheEntry const * const _entry, dbus_uint64_t const _hash, DBusMessage * const _call)
+{
+	char const * const path = dbus_message_get_path( _call);
+	char const * const interface = dbus_message_get_interface( _call);
+	return _entry->link.hash == _hash
+		&& strcmp( _entry->path, path ? path : "") == 0
+		&& strcmp( _entry->interface, interface ? interface : "") == 0
+		&& strcmp( _entry->member, dbus_message_get_member( _call)) == 0;
+}
+
+//################################################################################
+//################################################################################
+
+ReplyCache * reply_cache_new( void)
+{
+	ReplyCache * const cache = (ReplyCache *) malloc( sizeof( ReplyCache));
+	if ( cache == 0x0 )
+		return 0x0;
+	if ( !utils_hash_table_init( &cache->entries, 16) )
+	{
+		free( cache);
+		return 0x0;
+	}
+	cache->nbHits = 0;
+	cache->nbMisses = 0;
+	return cache;
+}
+
+//################################################################################
+
+void reply_cache_delete( ReplyCache * const _cache)
+{
+	reply_cache_invalidate( _cache, 0x0, 0x0, 0x0);
+	free( _cache->entries.buckets);
+	free( _cache);
+}
+
+//################################################################################
+
+// remember _reply as the answer to any call identical to _call
+// returns 0 if the call can't be cached or memory is short
+int reply_cache_put( ReplyCache * const _cache, DBusMessage * const _call, DBusMessage * const _reply)
+{
+	if ( !private_is_cacheable_call( _call) || dbus_message_contains_unix_fds( _reply) )
+		return 0;
+	// keep a private copy, so that the lua side can't change the cached reply behind our back
+	DBusMessage * const reply = dbus_message_copy( _reply);
+	if ( reply == 0x0 )
+		return 0;
+	dbus_uint64_t const hash = private_hash_call( _call);
+	ReplyCacheEntry *entry;
+	for ( entry = (ReplyCacheEntry *) *utils_hash_table_bucket( &_cache->entries, hash); entry != 0x0; entry = (ReplyCacheEntry *) entry->link.next)
+	{
+		if ( private_entry_matches( entry, hash, _call) )
+		{
+			dbus_message_unref( entry->reply);
+			entry->reply = reply;
+			return 1;
+		}
+	}
+	char const * const path = dbus_message_get_path( _call) ? dbus_message_get_path( _call) : "";
+	char const * const interface = dbus_message_get_interface( _call) ? dbus_message_get_interface( _call) : "";
+	char const * const member = dbus_message_get_member( _call);
+	size_t const pathSize = strlen( path) + 1;
+	size_t const interfaceSize = strlen( interface) + 1;
+	size_t const memberSize = strlen( member) + 1;
+	entry = (ReplyCacheEntry *) malloc( sizeof( ReplyCacheEntry) + pathSize + interfaceSize + memberSize);
+	if ( entry == 0x0 )
+	{
+		dbus_message_unref( reply);
+		return 0;
+	}
+	entry->path = (char *) (entry + 1);
+	entry->interface = entry->path + pathSize;
+	entry->member = entry->interface + interfaceSize;
+	memcpy( entry->path, path, pathSize);
+	memcpy( entry->interface, interface, interfaceSize);
+	memcpy( entry->member, member, memberSize);
+	entry->link.hash = hash;
+	entry->reply = reply;
+	utils_hash_table_insert( &_cache->entries, &entry->link);
+	return 1;
+}
+
+//################################################################################
+
+// a new reply addressed to _call if we have one, 0x0 otherwise; the caller sends it and drops it
+DBusMessage * reply_cache_answer( ReplyCache * const _cache, DBusMessage * const _call)
+{
+	if ( _cache->entries.nbEntries == 0 || !private_is_cacheable_call( _call) || dbus_message_get_no_reply( _call) )
+		return 0x0;
+	dbus_uint64_t const hash = private_hash_call( _call);
+	ReplyCacheEntry *entry;
+	for ( entry = (ReplyCacheEntry *) *utils_hash_table_bucket( &_cache->entries, hash); entry != 0x0; entry = (ReplyCacheEntry *) entry->link.next)
+	{
+		if ( private_entry_matches( entry, hash, _call) )
+		{
+			// the copy shares nothing with the cached reply but its contents, and has no serial yet
+			DBusMessage * const reply = dbus_message_copy( entry->reply);
+			if ( reply == 0x0
+				|| !dbus_message_set_reply_serial( reply, dbus_message_get_serial( _call))
+				|| !dbus_message_set_destination( reply, dbus_message_get_sender( _call)) )
+			{
+				if ( reply != 0x0 )
+					dbus_message_unref( reply);
+				break;
+			}
+			++ _cache->nbHits;
+			return reply;
+		}
+	}
+	++ _cache->nbMisses;
+	return 0x0;
+}
+
+//################################################################################
+
+// drop the entries matching the given path, interface and member; 0x0 matches anything
+// returns the number of dropped entries
+int reply_cache_invalidate( ReplyCache * const _cache, char const * const _path, char const * const _interface, char const * const _member)
+{
+	int nbDropped = 0;
+	int i;
+	for ( i = 0; i < _cache->entries.nbBuckets; ++ i)
+	{
+		HashLink **link = &_cache->entries.buckets[i];
+		while ( *link != 0x0 )
+		{
+			ReplyCacheEntry * const entry = (ReplyCacheEntry *) *link;
+			if ( ( _path == 0x0 || strcmp( entry->path, _path) == 0 )
+				&& ( _interface == 0x0 || strcmp( entry->interface, _interface) == 0 )
+				&& ( _member == 0x0 || strcmp( entry->member, _member) == 0 ) )
+			{
+				utils_hash_table_unlink( &_cache->entries, link);
+				dbus_message_unref( entry->reply);
+				free( entry);
+				++ nbDropped;
+			}
+			else
+			{
+				link = &entry->link.next;
+			}
+		}
+	}
+	return nbDropped;
+}
@@ -0,0 +1,24 @@
+#if ! defined ( __dbus_reply_cache_h__ )
+#define __dbus_reply_cache_h__ 1
+
+//################################################################################
+
+// replies to idempotent method calls, keyed by (path, interface, member, hash of the arguments)
+// a hit is answered in C by copying the stored reply, the lua handlers don't see the call at all
+struct ReplyCache
+{
+	HashTable entries;
+	unsigned long nbHits;
+	unsigned long nbMisses;
+};
+typedef struct ReplyCache ReplyCache;
+
+extern ReplyCache * reply_cache_new( void);
+extern void reply_cache_delete( ReplyCache * const _cache);
+extern int reply_cache_put( ReplyCache * const _cache, DBusMessage * const _call, DBusMessage * const _reply);
+extern DBusMessage * reply_cache_answer( ReplyCache * const _cache, DBusMessage * const _call);
+extern int reply_cache_invalidate( ReplyCache * const _cache, char const * const _path, char const * const _interface, char const * const _member);
+
+//################################################################################
+
+#endif // __dbus_reply_cache_h__
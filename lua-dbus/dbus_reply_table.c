@@ -0,0 +1,299 @@
+/************************************************************************
+*
+* Lua bindings for libdbus.
+* Copyright (c) 2009 - BenoitGermain <bnt.germain@gmail.com>
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+************************************************************************/
+
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dbus/dbus.h>
+
+#include "utils.h"
+#include "dbus_histogram.h"
+#include "dbus_reply_table.h"
+
+//################################################################################
+// reply table: serials are handed out sequentially by libdbus, so their low bits are a good hash.
+// the timer wheel has 4 levels of 64 slots, of 1 ms, 64 ms, 4 s and 4.5 min each: a deadline goes in
+// the coarsest slot that still tells it apart from the current tick, and is moved down a level each
+// time the finer level wraps around. expiring a tick is then a matter of taking a whole slot, however
+// many calls it holds. deadlines further away than the wheel spans wait in the last level
+//################################################################################
+
+#define SLOT_BITS 6
+#define SLOT_MASK (REPLY_TABLE_SLOTS - 1)
+
+//################################################################################
+//################################################################################
+
+// take a pending call out of the hash table, returns 0x0 if the serial isn't pending
+static PendingReply * private_unhash( ReplyTable * const _table, dbus_uint32_t const _serial)
+{
+	HashLink **link = utils_hash_table_bucket( &_table->pending, _serial);
+	while ( *link != 0x0 && ((PendingReply *) *link)->serial != _serial )
+		link = &(*link)->next;
+	PendingReply * const pending = (PendingReply *) *link;
+	if ( pending != 0x0 )
+		utils_hash_table_unlink( &_table->pending, link);
+	return pending;
+}
+
+//################################################################################
+
+static void private_link( PendingReply ** const _head, PendingReply * const _pending)
+{
+	_pending->timerNext = *_head;
+	_pending->timerLink = _head;
+	if ( *_head != 0x0 )
+		(*_head)->timerLink = &_pending->timerNext;
+	*_head = _pending;
+}
+
+//################################################################################
+
+static void private_unlink( PendingReply * const _pending)
+{
+	if ( _pending->timerLink == 0x0 )
+		return;
+	*_pending->timerLink = _pending->timerNext;
+	if ( _pending->timerNext != 0x0 )
+		_pending->timerNext->timerLink = _pending->timerLink;
+	_pending->timerNext = 0x0;
+	_pending->timerLink = 0x0;
+}
+
+//################################################################################
+
+// put a deadline in the slot of the finest level where it shares the current tick's turn
+// a deadline of the current tick is only scheduled while cascading, just before that slot expires
+static void private_schedule( ReplyTable * const _table, PendingReply * const _pending)
+{
+	dbus_uint64_t const expires = _pending->expires;
+	int level;
+	for ( level = 0; level < REPLY_TABLE_LEVELS - 1; ++ level)
+	{
+		if ( (expires >> (SLOT_BITS * (level + 1))) == (_table->currentTick >> (SLOT_BITS * (level + 1))) )
+			break;
+	}
+	// too far ahead for the wheel: park it in the last slot before the current one on the last level
+	// it cascades from there once per turn of that level, and gets rescheduled until it is close enough
+	dbus_uint64_t slotTick = expires;
+	if ( level == REPLY_TABLE_LEVELS - 1 && (expires - _table->currentTick) >> (SLOT_BITS * REPLY_TABLE_LEVELS) != 0 )
+		slotTick = _table->currentTick + ((dbus_uint64_t) SLOT_MASK << (SLOT_BITS * level));
+	private_link( &_table->wheel[level][(slotTick >> (SLOT_BITS * level)) & SLOT_MASK], _pending);
+}
+
+//################################################################################
+
+static void private_make_ready( ReplyTable * const _table, PendingReply * const _pending, int const _status)
+{
+	private_unlink( _pending);
+	_pending->status = _status;
+	*_table->readyTail = _pending;
+	_table->readyTail = &_pending->timerNext;
+	++ _table->nbReady;
+}
+
+//################################################################################
+//################################################################################
+
+ReplyTable * reply_table_new( dbus_uint64_t const _nowMs)
+{
+	ReplyTable * const table = (ReplyTable *) calloc( 1, sizeof( ReplyTable));
+	if ( table == 0x0 )
+		return 0x0;
+	if ( !utils_hash_table_init( &table->pending, 64) )
+	{
+		free( table);
+		return 0x0;
+	}
+	table->currentTick = _nowMs;
+	table->readyTail = &table->readyHead;
+	return table;
+}
+
+//################################################################################
+
+void reply_table_delete( ReplyTable * const _table)
+{
+	PendingReply *pending;
+	reply_table_fail_all( _table);
+	while ( (pending = reply_table_pop_ready( _table)) != 0x0 )
+		reply_table_release( pending);
+	free( _table->pending.buckets);
+	free( _table);
+}
+
+//################################################################################
+
+// a call to track, allocated before it is sent so that tracking it can't fail once it is on the wire
+// returns 0x0 when out of memory
+PendingReply * reply_table_alloc( void)
+{
+	return (PendingReply *) calloc( 1, sizeof( PendingReply));
+}
+
+//################################################################################
+
+// start waiting for the reply of the call sent with _serial
+// a timeout of 0x7fffffff (DBUS_TIMEOUT_INFINITE) never expires, a negative one means libdbus' default
+void reply_table_add( ReplyTable * const _table, PendingReply * const _pending, dbus_uint32_t const _serial, dbus_uint64_t const _nowNs, int const _timeoutMs)
+{
+	dbus_uint64_t const nowMs = _nowNs / 1000000;
+	_pending->serial = _serial;
+	_pending->status = PENDING_REPLY_ANSWERED;
+	_pending->sentNs = _nowNs;
+	if ( nowMs > _table->currentTick && _table->pending.nbEntries == 0 )
+		// nothing to expire in between, no need to walk the ticks
+		_table->currentTick = nowMs;
+	if ( _timeoutMs != DBUS_TIMEOUT_INFINITE )
+	{
+		_pending->expires = nowMs + (( _timeoutMs < 0 ) ? 25000 : _timeoutMs);
+		// the slot of the current tick was already expired
+		if ( _pending->expires <= _table->currentTick )
+			_pending->expires = _table->currentTick + 1;
+		private_schedule( _table, _pending);
+	}
+	_pending->link.hash = _serial;
+	utils_hash_table_insert( &_table->pending, &_pending->link);
+}
+
+//################################################################################
+
+// stop waiting for a call, returns it for the caller to release, or 0x0 if the serial wasn't pending
+PendingReply * reply_table_cancel( ReplyTable * const _table, dbus_uint32_t const _serial)
+{
+	PendingReply * const pending = private_unhash( _table, _serial);
+	if ( pending != 0x0 )
+		private_unlink( pending);
+	return pending;
+}
+
+//################################################################################
+
+// if _reply answers a pending call, take a reference on it and make the call ready
+PendingReply * reply_table_answer( ReplyTable * const _table, DBusMessage * const _reply, dbus_uint64_t const _nowNs)
+{
+	int const type = dbus_message_get_type( _reply);
+	if ( _table->pending.nbEntries == 0 || (type != DBUS_MESSAGE_TYPE_METHOD_RETURN && type != DBUS_MESSAGE_TYPE_ERROR) )
+		return 0x0;
+	PendingReply * const pending = private_unhash( _table, dbus_message_get_reply_serial( _reply));
+	if ( pending == 0x0 )
+		return 0x0;
+	pending->reply = dbus_message_ref( _reply);
+	private_make_ready( _table, pending, PENDING_REPLY_ANSWERED);
+	++ _table->nbAnswered;
+	if ( _table->latency != 0x0 )
+		histogram_record( _table->latency, _nowNs - pending->sentNs);
+	return pending;
+}
+
+//################################################################################
+
+// expire every deadline up to _nowMs, returns the number of calls that timed out
+int reply_table_advance( ReplyTable * const _table, dbus_uint64_t const _nowMs)
+{
+	int count = 0;
+	while ( _table->currentTick < _nowMs )
+	{
+		if ( _table->pending.nbEntries == 0 )
+		{
+			_table->currentTick = _nowMs;
+			break;
+		}
+		dbus_uint64_t const tick = ++ _table->currentTick;
+		// when a level wraps around, the next slot of the coarser level is spread over the finer ones
+		int level;
+		for ( level = 1; level < REPLY_TABLE_LEVELS && ((tick >> (SLOT_BITS * (level - 1))) & SLOT_MASK) == 0; ++ level)
+		{
+			PendingReply ** const slot = &_table->wheel[level][(tick >> (SLOT_BITS * level)) & SLOT_MASK];
+			PendingReply *pending = *slot;
+			*slot = 0x0;
+			while ( pending != 0x0 )
+			{
+				PendingReply * const next = pending->timerNext;
+				private_schedule( _table, pending);
+				pending = next;
+			}
+		}
+		PendingReply ** const slot = &_table->wheel[0][tick & SLOT_MASK];
+		while ( *slot != 0x0 )
+		{
+			PendingReply * const pending = *slot;
+			private_unhash( _table, pending->serial);
+			private_make_ready( _table, pending, PENDING_REPLY_TIMED_OUT);
+			++ _table->nbTimedOut;
+			++ count;
+		}
+	}
+	return count;
+}
+
+//################################################################################
+
+// the connection is gone: every pending call becomes ready, without a reply
+int reply_table_fail_all( ReplyTable * const _table)
+{
+	int count = 0;
+	int i;
+	for ( i = 0; i < _table->pending.nbBuckets; ++ i)
+	{
+		HashLink ** const bucket = &_table->pending.buckets[i];
+		while ( *bucket != 0x0 )
+		{
+			PendingReply * const pending = (PendingReply *) *bucket;
+			utils_hash_table_unlink( &_table->pending, bucket);
+			private_make_ready( _table, pending, PENDING_REPLY_DISCONNECTED);
+			++ _table->nbFailed;
+			++ count;
+		}
+	}
+	return count;
+}
+
+//################################################################################
+
+PendingReply * reply_table_pop_ready( ReplyTable * const _table)
+{
+	PendingReply * const pending = _table->readyHead;
+	if ( pending == 0x0 )
+		return 0x0;
+	_table->readyHead = pending->timerNext;
+	if ( _table->readyHead == 0x0 )
+		_table->readyTail = &_table->readyHead;
+	pending->timerNext = 0x0;
+	-- _table->nbReady;
+	return pending;
+}
+
+//################################################################################
+
+void reply_table_release( PendingReply * const _pending)
+{
+	if ( _pending->reply != 0x0 )
+		dbus_message_unref( _pending->reply);
+	free( _pending);
+}
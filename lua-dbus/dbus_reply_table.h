@@ -0,0 +1,70 @@
+#if ! defined ( __dbus_reply_table_h__ )
+#define __dbus_reply_table_h__ 1
+
+//################################################################################
+
+// calls waiting for their reply, keyed by serial, with their deadlines in a hierarchical timer wheel
+// answered, expired and failed calls move to a FIFO, from which they are delivered to lua in a batch
+#define REPLY_TABLE_LEVELS 4
+#define REPLY_TABLE_SLOTS 64
+
+// why a call left the table
+#define PENDING_REPLY_ANSWERED 0
+#define PENDING_REPLY_TIMED_OUT 1
+#define PENDING_REPLY_DISCONNECTED 2
+
+struct PendingReply
+{
+	// in the table while pending, hashed by serial
+	HashLink link;
+	// links in a wheel slot while pending, in the FIFO of ready calls after that
+	// timerLink is the pointer that points to this one, 0x0 for a call that never expires
+	struct PendingReply *timerNext;
+	struct PendingReply **timerLink;
+	dbus_uint32_t serial;
+	int status;
+	// in milliseconds of the monotonic clock, 0 for never
+	dbus_uint64_t expires;
+	// in nanoseconds of the monotonic clock
+	dbus_uint64_t sentNs;
+	// set once answered, the table holds a reference on it
+	DBusMessage *reply;
+	// left to the caller, to find what to do with the reply
+	int callbackRef;
+};
+typedef struct PendingReply PendingReply;
+
+struct ReplyTable
+{
+	// the pending calls, their count is pending.nbEntries
+	HashTable pending;
+	PendingReply *wheel[REPLY_TABLE_LEVELS][REPLY_TABLE_SLOTS];
+	// the wheel has expired everything up to this tick, in milliseconds
+	dbus_uint64_t currentTick;
+	PendingReply *readyHead;
+	PendingReply **readyTail;
+	int nbReady;
+	// set when the filter that catches the replies was added to the connection
+	int filterAdded;
+	// where the send-to-reply time of the answered calls is recorded, if set
+	struct Histogram *latency;
+	unsigned long nbAnswered;
+	unsigned long nbTimedOut;
+	unsigned long nbFailed;
+};
+typedef struct ReplyTable ReplyTable;
+
+extern ReplyTable * reply_table_new( dbus_uint64_t const _nowMs);
+extern void reply_table_delete( ReplyTable * const _table);
+extern PendingReply * reply_table_alloc( void);
+extern void reply_table_add( ReplyTable * const _table, PendingReply * const _pending, dbus_uint32_t const _serial, dbus_uint64_t const _nowNs, int const _timeoutMs);
+extern PendingReply * reply_table_cancel( ReplyTable * const _table, dbus_uint32_t const _serial);
+extern PendingReply * reply_table_answer( ReplyTable * const _table, DBusMessage * const _reply, dbus_uint64_t const _nowNs);
+extern int reply_table_advance( ReplyTable * const _table, dbus_uint64_t const _nowMs);
+extern int reply_table_fail_all( ReplyTable * const _table);
+extern PendingReply * reply_table_pop_ready( ReplyTable * const _table);
+extern void reply_table_release( PendingReply * const _pending);
+
+//################################################################################
+
+#endif // __dbus_reply_table_h__
@@ -0,0 +1,475 @@
+/************************************************************************
+*
+* Lua bindings for libdbus.
+* Copyright (c) 2009 - BenoitGermain <bnt.germain@gmail.com>
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+************************************************************************/
+
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <dbus/dbus.h>
+#include <string.h>
+
+#include "utils.h"
+#include "dbus_message_args.h"
+#include "dbus_schema.h"
+
+//################################################################################
+// schemas: dbus.schema( "(sxdb)", { "name", "ts", "value", "ok" }) compiles the signature into one
+// entry per field. the field names are kept as lua strings in the schema's environment, so that
+// setting a field reuses the interned key instead of hashing a new string. basic fields are read
+// and written directly, containers and variants go through the generic conversion
+//################################################################################
+
+extern DBusMessage * cast_to_dbus_message( lua_State * const _L,  int const _ndx);
+
+char const gSchemaMetatableKey[] = "lua-dbus schema";
+
+struct SchemaField
+{
+	int type;
+	// the complete type of the field, inside the schema's copy of the signature
+	char const *signature;
+};
+typedef struct SchemaField SchemaField;
+
+struct Schema
+{
+	// by convention the block starts with a non-NULL pointer, here to the struct signature, right after the fields
+	char *signature;
+	int nbFields;
+	SchemaField fields[1];
+};
+typedef struct Schema Schema;
+
+// what the protected encoding loop needs
+struct SchemaEncode
+{
+	Schema const *schema;
+	DBusMessageIter *fields;
+};
+typedef struct SchemaEncode SchemaEncode;
+
+//################################################################################
+//################################################################################
+
+static Schema * cast_to_dbus_schema( lua_State * const _L, int const _ndx)
+{
+	return (Schema *) utils_cast_userdata( _L, _ndx, gSchemaMetatableKey);
+}
+
+//################################################################################
+
+// position _iter on argument #_argn, inside the variants if there are some
+static void private_get_argument( lua_State * const _L, DBusMessage * const _message, int const _argn, DBusMessageIter * const _iter)
+{
+	int i;
+	if ( _argn < 1 || !dbus_message_iter_init( _message, _iter) )
+		luaL_argerror( _L, 3, "no such argument");
+	for ( i = 1; i < _argn; ++ i)
+	{
+		if ( !dbus_message_iter_next( _iter) )
+			luaL_argerror( _L, 3, "no such argument");
+	}
+	while ( dbus_message_iter_get_arg_type( _iter) == DBUS_TYPE_VARIANT )
+	{
+		DBusMessageIter sub;
+		dbus_message_iter_recurse( _iter, &sub);
+		*_iter = sub;
+	}
+}
+
+//################################################################################
+
+// fill the table at _ndx from the struct _iter points to, the names being at _namesNdx
+static void private_decode_record( lua_State * const _L, Schema const * const _schema, DBusMessageIter * const _iter, int const _namesNdx, int const _ndx)
+{
+	if ( dbus_message_iter_get_arg_type( _iter) != DBUS_TYPE_STRUCT )
+	{
+		luaL_error( _L, "schema %s expects a struct, got '%c'", _schema->signature, (char) dbus_message_iter_get_arg_type( _iter));
+		return;
+	}
+	DBusMessageIter fields;
+	dbus_message_iter_recurse( _iter, &fields);
+	int i;
+	for ( i = 0; i < _schema->nbFields; ++ i)
+	{
+		int const type = dbus_message_iter_get_arg_type( &fields);
+		if ( type != _schema->fields[i].type )
+		{
+			luaL_error( _L, "schema %s expects '%c' for field #%d, got '%c'", _schema->signature, (char) _schema->fields[i].type, i + 1, (char) type);
+			return;
+		}
+		lua_rawgeti( _L, _namesNdx, i + 1);                              // ... name
+		switch( type)
+		{
+			case DBUS_TYPE_BOOLEAN:
+			{
+				dbus_bool_t value;
+				dbus_message_iter_get_basic( &fields, &value);
+				lua_pushboolean( _L, value != 0);
+			}
+			break;
+
+			case DBUS_TYPE_INT32:
+			{
+				dbus_int32_t value;
+				dbus_message_iter_get_basic( &fields, &value);
+				lua_pushnumber( _L, (lua_Number) value);
+			}
+			break;
+
+			case DBUS_TYPE_UINT32:
+			{
+				dbus_uint32_t value;
+				dbus_message_iter_get_basic( &fields, &value);
+				lua_pushnumber( _L, (lua_Number) value);
+			}
+			break;
+
+			case DBUS_TYPE_INT64:
+			{
+				dbus_int64_t value;
+				dbus_message_iter_get_basic( &fields, &value);
+				lua_pushnumber( _L, (lua_Number) value);
+			}
+			break;
+
+			case DBUS_TYPE_UINT64:
+			{
+				dbus_uint64_t value;
+				dbus_message_iter_get_basic( &fields, &value);
+				lua_pushnumber( _L, (lua_Number) value);
+			}
+			break;
+
+			case DBUS_TYPE_DOUBLE:
+			{
+				double value;
+				dbus_message_iter_get_basic( &fields, &value);
+				lua_pushnumber( _L, (lua_Number) value);
+			}
+			break;
+
+			case DBUS_TYPE_STRING:
+			case DBUS_TYPE_OBJECT_PATH:
+			{
+				char const * value;
+				dbus_message_iter_get_basic( &fields, &value);
+				lua_pushstring( _L, value);
+			}
+			break;
+
+			default:
+			message_args_push_iter_value( _L, &fields);
+			break;
+		}                                                                // ... name value
+		lua_rawset( _L, _ndx);                                           // ...
+		dbus_message_iter_next( &fields);
+	}
+}
+
+//################################################################################
+
+static int private_field_error( lua_State * const _L, int const _field, char const * const _expected)
+{
+	lua_rawgeti( _L, 3, _field + 1);                                   // state record names value name
+	return luaL_error( _L, "field '%s' expects %s, got a %s", lua_tostring( _L, -1), _expected, luaL_typename( _L, -2));
+}
+
+//################################################################################
+
+// lua_pcall'ed with ( state, record, names): append the fields of the record to the open struct
+static int private_encode_fields( lua_State * const _L)
+{
+	SchemaEncode const * const encode = (SchemaEncode const *) lua_touserdata( _L, 1);
+	Schema const * const schema = encode->schema;
+	int i;
+	for ( i = 0; i < schema->nbFields; ++ i)
+	{
+		int const type = schema->fields[i].type;
+		lua_rawgeti( _L, 3, i + 1);                                      // state record names name
+		lua_rawget( _L, 2);                                              // state record names value
+		dbus_bool_t ok = TRUE;
+		if ( type == DBUS_TYPE_BOOLEAN )
+		{
+			if ( !lua_isboolean( _L, -1) )
+				return private_field_error( _L, i, "a boolean");
+			dbus_bool_t const value = lua_toboolean( _L, -1) ? TRUE : FALSE;
+			ok = dbus_message_iter_append_basic( encode->fields, type, &value);
+		}
+		else if ( type == DBUS_TYPE_INT32 || type == DBUS_TYPE_UINT32 || type == DBUS_TYPE_INT64 || type == DBUS_TYPE_UINT64 || type == DBUS_TYPE_DOUBLE )
+		{
+			if ( lua_type( _L, -1) != LUA_TNUMBER )
+				return private_field_error( _L, i, "a number");
+			lua_Number const number = lua_tonumber( _L, -1);
+			union { dbus_int32_t i32; dbus_uint32_t u32; dbus_int64_t i64; dbus_uint64_t u64; double d; } value;
+			switch( type)
+			{
+				case DBUS_TYPE_INT32: value.i32 = (dbus_int32_t) number; break;
+				case DBUS_TYPE_UINT32: value.u32 = (dbus_uint32_t) number; break;
+				case DBUS_TYPE_INT64: value.i64 = (dbus_int64_t) number; break;
+				case DBUS_TYPE_UINT64: value.u64 = (dbus_uint64_t) number; break;
+				default: value.d = (double) number; break;
+			}
+			ok = dbus_message_iter_append_basic( encode->fields, type, &value);
+		}
+		else if ( type == DBUS_TYPE_STRING )
+		{
+			if ( lua_type( _L, -1) != LUA_TSTRING )
+				return private_field_error( _L, i, "a string");
+			char const * const value = lua_tostring( _L, -1);
+			ok = dbus_message_iter_append_basic( encode->fields, type, &value);
+		}
+		else
+		{
+			// everything else needs the checks and the recursion of the generic conversion
+			DBusSignatureIter signature;
+			dbus_signature_iter_init( &signature, schema->fields[i].signature);
+			message_args_append_value( _L, -1, &signature, encode->fields);
+		}
+		if ( !ok )
+			return luaL_error( _L, "not enough memory to append argument");
+		lua_pop( _L, 1);                                                 // state record names
+	}
+	return 0;
+}
+
+//################################################################################
+//################################################################################
+
+// dbus.schema( sig, names) -> schema for the struct signature sig, whose fields are called names[1], names[2], ...
+int bind_dbus_schema( lua_State * const _L)
+{
+	utils_check_nargs( _L, 2);
+	char const * const signature = luaL_checkstring( _L, 1);
+	luaL_checktype( _L, 2, LUA_TTABLE);
+	DBusError error;
+	dbus_error_init( &error);
+	if ( !dbus_signature_validate_single( signature, &error) )
+	{
+		lua_pushfstring( _L, "invalid signature '%s': %s", signature, error.message);
+		dbus_error_free( &error);
+		return lua_error( _L);
+	}
+	luaL_argcheck( _L, signature[0] == DBUS_STRUCT_BEGIN_CHAR, 1, "expects a struct signature");
+	DBusSignatureIter structSignature, fieldSignature;
+	dbus_signature_iter_init( &structSignature, signature);
+	dbus_signature_iter_recurse( &structSignature, &fieldSignature);
+	int nbFields = 1;
+	while ( dbus_signature_iter_next( &fieldSignature) )
+		++ nbFields;
+	luaL_argcheck( _L, (int) lua_objlen( _L, 2) == nbFields, 2, "expects one name per field");
+	size_t const signatureSize = strlen( signature) + 1;
+	Schema * const schema = (Schema *) lua_newuserdata( _L, sizeof( Schema) + (nbFields - 1) * sizeof( SchemaField) + signatureSize); // sig {names} S
+	schema->signature = memcpy( (char *) &schema->fields[nbFields], signature, signatureSize);
+	schema->nbFields = nbFields;
+	// the field signatures are consecutive substrings of our copy, right after the opening parenthesis
+	// a signature iterator started on one of them reads a single complete type and stops there
+	dbus_signature_iter_recurse( &structSignature, &fieldSignature);
+	lua_createtable( _L, nbFields, 0);                                             // sig {names} S {env}
+	size_t offset = 1;
+	int i;
+	for ( i = 0; i < nbFields; ++ i)
+	{
+		schema->fields[i].type = dbus_signature_iter_get_current_type( &fieldSignature);
+		schema->fields[i].signature = schema->signature + offset;
+		char * const fieldSignatureString = dbus_signature_iter_get_signature( &fieldSignature);
+		if ( fieldSignatureString == 0x0 )
+			return luaL_error( _L, "not enough memory to compile a schema");
+		offset += strlen( fieldSignatureString);
+		dbus_free( fieldSignatureString);
+		lua_rawgeti( _L, 2, i + 1);                                                  // sig {names} S {env} name
+		if ( lua_type( _L, -1) != LUA_TSTRING )
+			return luaL_argerror( _L, 2, "field names must be strings");
+		lua_rawseti( _L, -2, i + 1);                                                 // sig {names} S {env}
+		dbus_signature_iter_next( &fieldSignature);
+	}
+	lua_setfenv( _L, -2);                                                          // sig {names} S
+	utils_push_metatable( _L, gSchemaMetatableKey);                                // sig {names} S meta
+	lua_setmetatable( _L, -2);                                                     // sig {names} S
+	return 1;
+}
+
+//################################################################################
+
+// schema:decode( msg, argn [, tbl]) -> tbl (or a new table) with the fields of the struct argument #argn set by name
+int bind_dbus_schema_decode( lua_State * const _L)
+{
+	if ( lua_gettop( _L) != 4 )
+		utils_check_nargs( _L, 3);
+	Schema * const schema = cast_to_dbus_schema( _L, 1);
+	DBusMessage * const message = cast_to_dbus_message( _L, 2);
+	int const argn = luaL_checkint( _L, 3);
+	if ( lua_isnoneornil( _L, 4) )
+	{
+		lua_settop( _L, 3);                                                         // S msg argn
+		lua_createtable( _L, 0, schema->nbFields);                                  // S msg argn {record}
+	}
+	luaL_checktype( _L, 4, LUA_TTABLE);
+	DBusMessageIter iter;
+	private_get_argument( _L, message, argn, &iter);
+	lua_getfenv( _L, 1);                                                           // S msg argn {record} {names}
+	private_decode_record( _L, schema, &iter, 5, 4);
+	lua_pop( _L, 1);                                                               // S msg argn {record}
+	return 1;
+}
+
+//################################################################################
+
+// schema:decode_array( msg, argn [, tbl]) -> tbl (or a new table) holding one record per struct of the array argument #argn
+// records already in tbl are reused, and the ones after the last struct are cleared
+int bind_dbus_schema_decode_array( lua_State * const _L)
+{
+	if ( lua_gettop( _L) != 4 )
+		utils_check_nargs( _L, 3);
+	Schema * const schema = cast_to_dbus_schema( _L, 1);
+	DBusMessage * const message = cast_to_dbus_message( _L, 2);
+	int const argn = luaL_checkint( _L, 3);
+	DBusMessageIter iter;
+	private_get_argument( _L, message, argn, &iter);
+	if ( dbus_message_iter_get_arg_type( &iter) != DBUS_TYPE_ARRAY || dbus_message_iter_get_element_type( &iter) != DBUS_TYPE_STRUCT )
+		return luaL_argerror( _L, 3, "argument is not an array of structs");
+	if ( lua_isnoneornil( _L, 4) )
+	{
+		lua_settop( _L, 3);                                                         // S msg argn
+		lua_newtable( _L);                                                          // S msg argn {records}
+	}
+	luaL_checktype( _L, 4, LUA_TTABLE);
+	lua_getfenv( _L, 1);                                                           // S msg argn {records} {names}
+	DBusMessageIter elements;
+	dbus_message_iter_recurse( &iter, &elements);
+	int index = 0;
+	while ( dbus_message_iter_get_arg_type( &elements) != DBUS_TYPE_INVALID )
+	{
+		lua_rawgeti( _L, 4, ++ index);                                              // S msg argn {records} {names} {record}?
+		if ( !lua_istable( _L, -1) )
+		{
+			lua_pop( _L, 1);                                                         // S msg argn {records} {names}
+			lua_createtable( _L, 0, schema->nbFields);                               // S msg argn {records} {names} {record}
+			lua_pushvalue( _L, -1);                                                  // S msg argn {records} {names} {record} {record}
+			lua_rawseti( _L, 4, index);                                              // S msg argn {records} {names} {record}
+		}
+		private_decode_record( _L, schema, &elements, 5, 6);
+		lua_pop( _L, 1);                                                            // S msg argn {records} {names}
+		dbus_message_iter_next( &elements);
+	}
+	lua_pop( _L, 1);                                                               // S msg argn {records}
+	// whatever follows belongs to a longer, previous, message
+	for ( ;; )
+	{
+		lua_rawgeti( _L, 4, ++ index);                                              // S msg argn {records} old
+		int const stale = !lua_isnil( _L, -1);
+		lua_pop( _L, 1);                                                            // S msg argn {records}
+		if ( !stale )
+			break;
+		lua_pushnil( _L);                                                           // S msg argn {records} nil
+		lua_rawseti( _L, 4, index);                                                 // S msg argn {records}
+	}
+	return 1;
+}
+
+//################################################################################
+
+// schema:encode( msg, record) appends one struct argument made of the record's fields, taken by name
+// if a field is missing or of the wrong type, the struct is abandoned and so is the message
+int bind_dbus_schema_encode( lua_State * const _L)
+{
+	utils_check_nargs( _L, 3);
+	Schema * const schema = cast_to_dbus_schema( _L, 1);
+	DBusMessage * const message = cast_to_dbus_message( _L, 2);
+	luaL_checktype( _L, 3, LUA_TTABLE);
+	DBusMessageIter iter;
+	dbus_message_iter_init_append( message, &iter);
+	DBusMessageIter fields;
+	if ( !dbus_message_iter_open_container( &iter, DBUS_TYPE_STRUCT, 0x0, &fields) )
+		return luaL_error( _L, "not enough memory to append argument");
+	SchemaEncode encode;
+	encode.schema = schema;
+	encode.fields = &fields;
+	// the container must be abandoned or closed whatever happens, so the fields are appended protected
+	lua_pushcfunction( _L, private_encode_fields);                                 // S msg {record} encoder
+	lua_pushlightuserdata( _L, &encode);                                           // S msg {record} encoder state
+	lua_pushvalue( _L, 3);                                                         // S msg {record} encoder state {record}
+	lua_getfenv( _L, 1);                                                           // S msg {record} encoder state {record} {names}
+	if ( lua_pcall( _L, 3, 0, 0) != 0 )                                            // S msg {record} [error]
+	{
+		dbus_message_iter_abandon_container( &iter, &fields);
+		return lua_error( _L);
+	}
+	if ( !dbus_message_iter_close_container( &iter, &fields) )
+		return luaL_error( _L, "not enough memory to append argument");
+	return 0;
+}
+
+//################################################################################
+
+// schema:names() -> { name1, name2, ...}, a copy
+int bind_dbus_schema_names( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	Schema * const schema = cast_to_dbus_schema( _L, 1);
+	lua_getfenv( _L, 1);                                                           // S {names}
+	lua_createtable( _L, schema->nbFields, 0);                                     // S {names} {copy}
+	int i;
+	for ( i = 1; i <= schema->nbFields; ++ i)
+	{
+		lua_rawgeti( _L, -2, i);                                                     // S {names} {copy} name
+		lua_rawseti( _L, -2, i);                                                     // S {names} {copy}
+	}
+	return 1;
+}
+
+//################################################################################
+
+int bind_dbus_schema_signature( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	Schema * const schema = cast_to_dbus_schema( _L, 1);
+	lua_pushstring( _L, schema->signature);
+	return 1;
+}
+
+//################################################################################
+//################################################################################
+
+static luaL_Reg gSchemaMeta[] =
+{
+	{ "decode", bind_dbus_schema_decode },
+	{ "decode_array", bind_dbus_schema_decode_array },
+	{ "encode", bind_dbus_schema_encode },
+	{ "names", bind_dbus_schema_names },
+	{ "signature", bind_dbus_schema_signature },
+	{ 0x0, 0x0 },
+};
+
+//################################################################################
+//################################################################################
+
+void register_schema_stuff( lua_State * const _L)
+{
+	// register the schema metatable in the registry
+	utils_prepare_metatable( _L, gSchemaMetatableKey);                                      // {meta}
+	utils_register_upvalued_functions( _L, gSchemaMeta, gSchemaMetatableKey);               // {meta}
+	lua_pop( _L, 1);                                                                        //
+}
@@ -0,0 +1,13 @@
+#if ! defined ( __dbus_schema_h__ )
+#define __dbus_schema_h__ 1
+
+//################################################################################
+
+// a schema names the fields of a struct signature once, and keeps a plan of their types
+// decoding and encoding follow the plan instead of walking the signature for every message
+extern int bind_dbus_schema( lua_State * const _L);
+extern void register_schema_stuff( lua_State * const _L);
+
+//################################################################################
+
+#endif // __dbus_schema_h__
@@ -26,15 +26,103 @@
 
 #include <lua.h>
 #include <lauxlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "utils.h"
 
 //################################################################################
 //################################################################################
 
-int gServerMetatableRef = LUA_NOREF;
+char const gServerMetatableKey[] = "lua-dbus server";
+
+extern int push_dbus_connection( lua_State * const _L, DBusConnection * const _connection, int _closeOnFinalize);
+
+//################################################################################
+//################################################################################
+
+// a server only accepts connections when its watches are handled, and there is no main loop to do it for us
+// so we keep track of them, and server:handle_watches() polls them
+struct ServerUserdata
+{
+	DBusServer *server;
+	// only set while handle_watches runs, new connections are pushed there
+	lua_State *L;
+	int callbackFailed;
+	int nbWatches;
+	DBusWatch **watches;
+};
+typedef struct ServerUserdata ServerUserdata;
+
+//################################################################################
+
+static dbus_bool_t private_add_watch( DBusWatch *_watch, void *_data)
+{
+	ServerUserdata * const ud = (ServerUserdata *) _data;
+	DBusWatch ** const watches = (DBusWatch **) realloc( ud->watches, (ud->nbWatches + 1) * sizeof( DBusWatch *));
+	if ( watches == 0x0 )
+		return FALSE;
+	ud->watches = watches;
+	ud->watches[ud->nbWatches ++] = _watch;
+	return TRUE;
+}
+
+//################################################################################
+
+static void private_remove_watch( DBusWatch *_watch, void *_data)
+{
+	ServerUserdata * const ud = (ServerUserdata *) _data;
+	int i;
+	for ( i = 0; i < ud->nbWatches; ++ i)
+	{
+		if ( ud->watches[i] == _watch )
+		{
+			memmove( ud->watches + i, ud->watches + i + 1, (ud->nbWatches - i - 1) * sizeof( DBusWatch *));
+			-- ud->nbWatches;
+			return;
+		}
+	}
+}
+
+//################################################################################
+
+static void private_toggle_watch( DBusWatch *_watch, void *_data)
+{
+	// nothing to do, enabled state is checked each time we poll
+}
 
 //################################################################################
+
+static void private_new_connection( DBusServer *_server, DBusConnection *_connection, void *_data)
+{
+	ServerUserdata * const ud = (ServerUserdata *) _data;
+	lua_State * const L = ud->L;
+	// if nobody takes a reference, libdbus drops the connection
+	if ( L == 0x0 || ud->callbackFailed )
+		return;
+	utils_fetch_userdata( L, _server);                    // S
+	lua_getfenv( L, -1);                                  // S {env}
+	lua_getfield( L, -1, "new_connection");               // S {env} f?
+	lua_remove( L, -2);                                   // S f?
+	if ( !lua_isfunction( L, -1) )
+	{
+		lua_pop( L, 2);                                    //
+		return;
+	}
+	lua_insert( L, -2);                                   // f S
+	// server side connections are private ones
+	dbus_connection_ref( _connection);
+	push_dbus_connection( L, _connection, 1);             // f S C
+	if ( lua_pcall( L, 2, 0, 0) != 0 )                    // err?
+	{
+		// keep the error, it is raised once we are out of libdbus
+		ud->callbackFailed = 1;
+		lua_setfield( L, LUA_REGISTRYINDEX, "dbus_server_callback_error");
+	}
+}
+
 //################################################################################
 
 int push_dbus_server( lua_State * const _L, DBusServer * const _server)
@@ -44,7 +132,22 @@ int push_dbus_server( lua_State * const _L, DBusServer * const _server)
 	else
 	{
 		// create (or find an existing) fully functional userdata for our connection
-		(void) utils_push_mapped_userdata( _L, _server, gServerMetatableRef, sizeof(void*));
+		int const existing = utils_is_mapped_userdata( _L, _server);
+		ServerUserdata * const block = (ServerUserdata *) utils_push_mapped_userdata( _L, _server, gServerMetatableKey, sizeof( ServerUserdata));
+		// an existing userdata keeps its callback and the watches libdbus handed us
+		if ( !existing )
+		{
+			block->L = 0x0;
+			block->callbackFailed = 0;
+			block->nbWatches = 0;
+			block->watches = 0x0;
+			// create a news table and set it as the userdata's environment (it will be used to store the new connection callback)
+			lua_newtable( _L);
+			lua_setfenv( _L, -2);
+			dbus_server_set_new_connection_function( _server, private_new_connection, block, 0x0);
+			if ( !dbus_server_set_watch_functions( _server, private_add_watch, private_remove_watch, private_toggle_watch, block, 0x0) )
+				return luaL_error( _L, "not enough memory to watch the server");
+		}
 		return 1;
 	}
 }
@@ -53,7 +156,14 @@ int push_dbus_server( lua_State * const _L, DBusServer * const _server)
 
 DBusServer * cast_to_dbus_server( lua_State * const _L,  int const _ndx)
 {
-	return * (DBusServer **) utils_cast_userdata( _L, _ndx, gServerMetatableRef);
+	return * (DBusServer **) utils_cast_userdata( _L, _ndx, gServerMetatableKey);
+}
+
+//################################################################################
+
+static ServerUserdata * cast_to_dbus_server_userdata( lua_State * const _L,  int const _ndx)
+{
+	return (ServerUserdata *) utils_cast_userdata( _L, _ndx, gServerMetatableKey);
 }
 
 //################################################################################
@@ -118,12 +228,102 @@ int bind_dbus_server_get_is_connected( lua_State * const _L)
 
 //################################################################################
 
+int bind_dbus_server_get_address( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	DBusServer * server = cast_to_dbus_server( _L, 1);
+	char * const address = dbus_server_get_address( server);
+	if ( address == 0x0 )
+		return 0;
+	lua_pushstring( _L, address);
+	dbus_free( address);
+	return 1;
+}
+
+//################################################################################
+
+int bind_dbus_server_handle_watches( lua_State * const _L)
+{
+	utils_check_nargs( _L, 2);
+	ServerUserdata * const ud = cast_to_dbus_server_userdata( _L, 1);
+	int const timeout = luaL_checkint( _L, 2);
+	// poll a snapshot of the enabled watches, the list changes while they are handled
+	int const nbWatches = ud->nbWatches;
+	struct pollfd * const fds = (struct pollfd *) lua_newuserdata( _L, nbWatches * (sizeof( struct pollfd) + sizeof( DBusWatch *)) + 1);
+	DBusWatch ** const watches = (DBusWatch **) (fds + nbWatches);
+	int nbFds = 0;
+	int i;
+	for ( i = 0; i < nbWatches; ++ i)
+	{
+		DBusWatch * const watch = ud->watches[i];
+		if ( !dbus_watch_get_enabled( watch) )
+			continue;
+		unsigned int const flags = dbus_watch_get_flags( watch);
+		fds[nbFds].fd = dbus_watch_get_unix_fd( watch);
+		fds[nbFds].events = ((flags & DBUS_WATCH_READABLE) ? POLLIN : 0) | ((flags & DBUS_WATCH_WRITABLE) ? POLLOUT : 0);
+		fds[nbFds].revents = 0;
+		watches[nbFds] = watch;
+		++ nbFds;
+	}
+	int const nbReady = poll( fds, nbFds, timeout);
+	if ( nbReady < 0 && errno != EINTR )
+		return luaL_error( _L, "poll failed: %s", strerror( errno));
+	ud->L = _L;
+	for ( i = 0; i < nbFds && nbReady > 0; ++ i)
+	{
+		if ( fds[i].revents == 0 )
+			continue;
+		// make sure the watch wasn't removed while we handled the previous ones
+		int j;
+		for ( j = 0; j < ud->nbWatches && ud->watches[j] != watches[i]; ++ j);
+		if ( j == ud->nbWatches )
+			continue;
+		unsigned int const flags =
+			((fds[i].revents & POLLIN) ? DBUS_WATCH_READABLE : 0)
+			| ((fds[i].revents & POLLOUT) ? DBUS_WATCH_WRITABLE : 0)
+			| ((fds[i].revents & POLLERR) ? DBUS_WATCH_ERROR : 0)
+			| ((fds[i].revents & POLLHUP) ? DBUS_WATCH_HANGUP : 0);
+		dbus_watch_handle( watches[i], flags);
+	}
+	ud->L = 0x0;
+	if ( ud->callbackFailed )
+	{
+		ud->callbackFailed = 0;
+		lua_getfield( _L, LUA_REGISTRYINDEX, "dbus_server_callback_error");
+		lua_pushnil( _L);
+		lua_setfield( _L, LUA_REGISTRYINDEX, "dbus_server_callback_error");
+		return lua_error( _L);
+	}
+	lua_pushnumber( _L, (nbReady > 0) ? nbReady : 0);
+	return 1;
+}
+
+//################################################################################
+
+int bind_dbus_server_set_new_connection_function( lua_State * const _L)
+{
+	utils_check_nargs( _L, 2);
+	(void) cast_to_dbus_server_userdata( _L, 1);
+	luaL_argcheck( _L, lua_isfunction( _L, 2) || lua_isnil( _L, 2), 2, "must provide a function or nil");
+	// the callback is stored in the server's environment
+	lua_getfenv( _L, 1);                                    // S f {env}
+	lua_pushvalue( _L, 2);                                  // S f {env} f
+	lua_setfield( _L, -2, "new_connection");                // S f {env}
+	lua_pop( _L, 1);                                        // S f
+	return 0;
+}
+
+//################################################################################
+
 int finalize_dbus_server( lua_State * const _L)
 {
 	utils_check_nargs( _L, 1);
-	DBusServer * const server = cast_to_dbus_server( _L, 1);
-	dbus_server_disconnect( server);
-	dbus_server_unref( server);
+	ServerUserdata * const ud = cast_to_dbus_server_userdata( _L, 1);
+	dbus_server_disconnect( ud->server);
+	dbus_server_unref( ud->server);
+	free( ud->watches);
+	ud->watches = 0x0;
+	ud->nbWatches = 0;
 	return 0;
 }
 
@@ -133,7 +333,10 @@ int finalize_dbus_server( lua_State * const _L)
 luaL_Reg gServerMeta[] =
 {
 	{ "disconnect", bind_dbus_server_disconnect },
+	{ "get_address", bind_dbus_server_get_address },
+	{ "handle_watches", bind_dbus_server_handle_watches },
 	{ "is_connected", bind_dbus_server_get_is_connected },
+	{ "set_new_connection_function", bind_dbus_server_set_new_connection_function },
 	{ "__gc", finalize_dbus_server },
 	{ 0x0, 0x0 },
 };
@@ -145,7 +348,7 @@ luaL_Reg gServerMeta[] =
 void register_server_stuff( lua_State * const _L)
 {
 	// register the connection object metatable in the registry
-	utils_prepare_metatable( _L, &gServerMetatableRef);                       // {meta}
-	utils_register_upvalued_functions( _L, gServerMeta, gServerMetatableRef); // {meta}
+	utils_prepare_metatable( _L, gServerMetatableKey);                        // {meta}
+	utils_register_upvalued_functions( _L, gServerMeta, gServerMetatableKey); // {meta}
 	lua_pop( _L, 1);                                                          //
 }
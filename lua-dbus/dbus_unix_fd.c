@@ -0,0 +1,427 @@
+/************************************************************************
+*
+* Lua bindings for libdbus.
+* Copyright (c) 2009 - BenoitGermain <bnt.germain@gmail.com>
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+************************************************************************/
+
+
+// memfd_create() and the file sealing constants
+#define _GNU_SOURCE
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <dbus/dbus.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "dbus_unix_fd.h"
+
+//################################################################################
+// unix fds: libdbus duplicates the descriptors it sends, and hands out a new duplicate
+// each time a received 'h' argument is read, so every fd object owns its descriptor
+// bulk payloads go through sealed memfds: once sealed nobody can change the contents,
+// so the receiver can map them and read in place without trusting the sender
+//################################################################################
+
+char const gUnixFdMetatableKey[] = "lua-dbus unix fd";
+char const gMappedBufferMetatableKey[] = "lua-dbus mapped buffer";
+
+struct UnixFd
+{
+	// -1 once closed or detached
+	int fd;
+};
+typedef struct UnixFd UnixFd;
+
+struct UnixFdUserdata
+{
+	// by convention the block starts with a non-NULL pointer, here to our own storage
+	UnixFd *unixFd;
+	UnixFd storage;
+};
+typedef struct UnixFdUserdata UnixFdUserdata;
+
+// a read-only view of a mapped fd
+struct MappedBuffer
+{
+	// the mapping, always first by convention, NULL once closed
+	char *base;
+	size_t size;
+};
+typedef struct MappedBuffer MappedBuffer;
+
+//################################################################################
+//################################################################################
+
+void push_dbus_unix_fd( lua_State * const _L, int const _fd)
+{
+	UnixFdUserdata * const block = (UnixFdUserdata *) lua_newuserdata( _L, sizeof( UnixFdUserdata));   // F
+	block->unixFd = &block->storage;
+	block->storage.fd = _fd;
+	utils_push_metatable( _L, gUnixFdMetatableKey);                                                    // F meta
+	lua_setmetatable( _L, -2);                                                                          // F
+}
+
+//################################################################################
+
+static UnixFd * cast_to_dbus_unix_fd( lua_State * const _L, int const _ndx)
+{
+	return *(UnixFd **) utils_cast_userdata( _L, _ndx, gUnixFdMetatableKey);
+}
+
+//################################################################################
+
+int is_dbus_unix_fd( lua_State * const _L, int const _ndx)
+{
+	if ( !lua_getmetatable( _L, _ndx) )
+		return 0;
+	utils_push_metatable( _L, gUnixFdMetatableKey);
+	int const equal = lua_rawequal( _L, -1, -2);
+	lua_pop( _L, 2);
+	return equal;
+}
+
+//################################################################################
+
+// an 'h' argument can be given as an fd object or a plain descriptor number
+// in both cases the caller keeps ownership, libdbus sends a duplicate
+int check_dbus_unix_fd( lua_State * const _L, int const _ndx)
+{
+	if ( lua_type( _L, _ndx) == LUA_TNUMBER )
+	{
+		// NaN fails the range test, non integer values the second one
+		lua_Number const number = lua_tonumber( _L, _ndx);
+		if ( !(number >= 0 && number <= 2147483647.0) || number != (lua_Number) (int) number )
+			return luaL_error( _L, "'h' argument expects a descriptor number, got %f", number);
+		return (int) number;
+	}
+	if ( !is_dbus_unix_fd( _L, _ndx) )
+		return luaL_error( _L, "'h' argument expects an fd or a number, got a %s", luaL_typename( _L, _ndx));
+	UnixFd * const unixFd = cast_to_dbus_unix_fd( _L, _ndx);
+	if ( unixFd->fd < 0 )
+		return luaL_error( _L, "'h' argument is a closed fd");
+	return unixFd->fd;
+}
+
+//################################################################################
+
+static MappedBuffer * cast_to_mapped_buffer( lua_State * const _L, int const _ndx)
+{
+	return (MappedBuffer *) utils_cast_userdata( _L, _ndx, gMappedBufferMetatableKey);
+}
+
+//################################################################################
+//################################################################################
+
+// dbus.memfd_new( payload [, name]) -> fd holding a sealed copy of payload, or nil, error
+// send it as an 'h' argument, the receiver calls fd:map() to read the payload in place
+int bind_dbus_memfd_new( lua_State * const _L)
+{
+	if ( lua_gettop( _L) != 2 )
+		utils_check_nargs( _L, 1);
+	size_t size;
+	char const * const payload = luaL_checklstring( _L, 1, &size);
+	char const * const name = luaL_optstring( _L, 2, "lua-dbus");
+#if defined( MFD_ALLOW_SEALING)
+	int const fd = memfd_create( name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if ( fd < 0 )
+	{
+		lua_pushnil( _L);
+		lua_pushstring( _L, strerror( errno));
+		return 2;
+	}
+	// fill the file in one go, then forbid any further change
+	char * const base = ( size > 0 && ftruncate( fd, (off_t) size) == 0 ) ? (char *) mmap( 0x0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : 0x0;
+	if ( size > 0 && ( base == 0x0 || base == MAP_FAILED ) )
+	{
+		int const error = errno;
+		close( fd);
+		lua_pushnil( _L);
+		lua_pushstring( _L, strerror( error));
+		return 2;
+	}
+	if ( size > 0 )
+	{
+		memcpy( base, payload, size);
+		munmap( base, size);
+	}
+	// the writable mapping is gone, so F_SEAL_WRITE can't fail with EBUSY
+	if ( fcntl( fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0 )
+	{
+		int const error = errno;
+		close( fd);
+		lua_pushnil( _L);
+		lua_pushstring( _L, strerror( error));
+		return 2;
+	}
+	push_dbus_unix_fd( _L, fd);
+	return 1;
+#else // MFD_ALLOW_SEALING
+	(void) payload;
+	(void) name;
+	lua_pushnil( _L);
+	lua_pushliteral( _L, "sealed memfds are not supported on this system");
+	return 2;
+#endif // MFD_ALLOW_SEALING
+}
+
+//################################################################################
+//################################################################################
+
+int bind_dbus_unix_fd_close( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	UnixFd * const unixFd = cast_to_dbus_unix_fd( _L, 1);
+	if ( unixFd->fd >= 0 )
+	{
+		close( unixFd->fd);
+		unixFd->fd = -1;
+	}
+	return 0;
+}
+
+//################################################################################
+
+// fd:detach() -> the descriptor number, which the caller now has to close
+int bind_dbus_unix_fd_detach( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	UnixFd * const unixFd = cast_to_dbus_unix_fd( _L, 1);
+	if ( unixFd->fd < 0 )
+		return luaL_error( _L, "fd is closed");
+	lua_pushinteger( _L, unixFd->fd);
+	unixFd->fd = -1;
+	return 1;
+}
+
+//################################################################################
+
+int bind_dbus_unix_fd_fileno( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	UnixFd * const unixFd = cast_to_dbus_unix_fd( _L, 1);
+	if ( unixFd->fd < 0 )
+		return luaL_error( _L, "fd is closed");
+	lua_pushinteger( _L, unixFd->fd);
+	return 1;
+}
+
+//################################################################################
+
+// fd:map( [unsealed]) -> read-only view of the whole file, or nil, error
+// the view stays valid after the fd is closed; the file must be sealed against writing and shrinking,
+// or the sender could change it under the view, or cut it short and crash us with SIGBUS.
+// pass unsealed = true to map a file you trust anyway
+int bind_dbus_unix_fd_map( lua_State * const _L)
+{
+	if ( lua_gettop( _L) != 2 )
+		utils_check_nargs( _L, 1);
+	UnixFd * const unixFd = cast_to_dbus_unix_fd( _L, 1);
+	if ( unixFd->fd < 0 )
+		return luaL_error( _L, "fd is closed");
+	if ( !lua_toboolean( _L, 2) )
+	{
+#if defined( F_GET_SEALS)
+		int const seals = fcntl( unixFd->fd, F_GET_SEALS);
+		if ( seals < 0 || ( seals & ( F_SEAL_SHRINK | F_SEAL_WRITE)) != ( F_SEAL_SHRINK | F_SEAL_WRITE) )
+		{
+			lua_pushnil( _L);
+			lua_pushliteral( _L, "fd is not sealed against writing and shrinking");
+			return 2;
+		}
+#else // F_GET_SEALS
+		lua_pushnil( _L);
+		lua_pushliteral( _L, "file sealing is not supported on this system");
+		return 2;
+#endif // F_GET_SEALS
+	}
+	struct stat info;
+	if ( fstat( unixFd->fd, &info) != 0 )
+	{
+		lua_pushnil( _L);
+		lua_pushstring( _L, strerror( errno));
+		return 2;
+	}
+	void *base = 0x0;
+	// mmap doesn't do empty mappings, an empty view needs none
+	if ( info.st_size > 0 )
+	{
+		// before linux 6.7, a shared mapping of a write-sealed file is refused even read-only;
+		// the seals already keep the contents from changing, a private one sees the same bytes
+		base = mmap( 0x0, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, unixFd->fd, 0);
+		if ( base == MAP_FAILED )
+		{
+			lua_pushnil( _L);
+			lua_pushstring( _L, strerror( errno));
+			return 2;
+		}
+	}
+	MappedBuffer * const buffer = (MappedBuffer *) lua_newuserdata( _L, sizeof( MappedBuffer));   // F V
+	// an empty view points at itself, so that it doesn't look closed
+	buffer->base = ( base != 0x0 ) ? (char *) base : (char *) buffer;
+	buffer->size = (size_t) info.st_size;
+	utils_push_metatable( _L, gMappedBufferMetatableKey);                                          // F V meta
+	lua_setmetatable( _L, -2);                                                                       // F V
+	return 1;
+}
+
+//################################################################################
+
+int finalize_dbus_unix_fd( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	UnixFdUserdata * const block = (UnixFdUserdata *) lua_touserdata( _L, 1);
+	if ( block->storage.fd >= 0 )
+	{
+		close( block->storage.fd);
+		block->storage.fd = -1;
+	}
+	return 0;
+}
+
+//################################################################################
+//################################################################################
+
+static void private_unmap( MappedBuffer * const _buffer)
+{
+	if ( _buffer->base != 0x0 && _buffer->size > 0 )
+		munmap( _buffer->base, _buffer->size);
+	_buffer->base = 0x0;
+}
+
+//################################################################################
+
+// view:byte( i) -> the value of the i-th byte, negative indices count from the end like string.byte
+int bind_dbus_mapped_buffer_byte( lua_State * const _L)
+{
+	utils_check_nargs( _L, 2);
+	MappedBuffer * const buffer = cast_to_mapped_buffer( _L, 1);
+	lua_Integer index = luaL_checkinteger( _L, 2);
+	if ( index < 0 )
+		index += (lua_Integer) buffer->size + 1;
+	if ( index < 1 || (size_t) index > buffer->size )
+		return 0;
+	lua_pushinteger( _L, (unsigned char) buffer->base[index - 1]);
+	return 1;
+}
+
+//################################################################################
+
+int bind_dbus_mapped_buffer_close( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	private_unmap( cast_to_mapped_buffer( _L, 1));
+	return 0;
+}
+
+//################################################################################
+
+// view:size(), also #view
+int bind_dbus_mapped_buffer_size( lua_State * const _L)
+{
+	// __len gets the operand twice
+	MappedBuffer * const buffer = cast_to_mapped_buffer( _L, 1);
+	lua_pushnumber( _L, (lua_Number) buffer->size);
+	return 1;
+}
+
+//################################################################################
+
+// view:sub( i [, j]) -> copy of bytes i to j, with the same index rules as string.sub
+// this is the only place where the payload gets copied, so read only what you need
+int bind_dbus_mapped_buffer_sub( lua_State * const _L)
+{
+	if ( lua_gettop( _L) != 3 )
+		utils_check_nargs( _L, 2);
+	MappedBuffer * const buffer = cast_to_mapped_buffer( _L, 1);
+	lua_Integer const size = (lua_Integer) buffer->size;
+	lua_Integer start = luaL_checkinteger( _L, 2);
+	lua_Integer end = luaL_optinteger( _L, 3, -1);
+	if ( start < 0 )
+		start += size + 1;
+	if ( end < 0 )
+		end += size + 1;
+	if ( start < 1 )
+		start = 1;
+	if ( end > size )
+		end = size;
+	if ( start > end )
+		lua_pushliteral( _L, "");
+	else
+		lua_pushlstring( _L, buffer->base + start - 1, (size_t) (end - start + 1));
+	return 1;
+}
+
+//################################################################################
+
+int finalize_dbus_mapped_buffer( lua_State * const _L)
+{
+	utils_check_nargs( _L, 1);
+	private_unmap( (MappedBuffer *) lua_touserdata( _L, 1));
+	return 0;
+}
+
+//################################################################################
+//################################################################################
+
+static luaL_Reg gUnixFdMeta[] =
+{
+	{ "close", bind_dbus_unix_fd_close },
+	{ "detach", bind_dbus_unix_fd_detach },
+	{ "fileno", bind_dbus_unix_fd_fileno },
+	{ "map", bind_dbus_unix_fd_map },
+	{ "__gc", finalize_dbus_unix_fd },
+	{ 0x0, 0x0 },
+};
+
+//################################################################################
+
+static luaL_Reg gMappedBufferMeta[] =
+{
+	{ "byte", bind_dbus_mapped_buffer_byte },
+	{ "close", bind_dbus_mapped_buffer_close },
+	{ "size", bind_dbus_mapped_buffer_size },
+	{ "sub", bind_dbus_mapped_buffer_sub },
+	{ "__gc", finalize_dbus_mapped_buffer },
+	{ "__len", bind_dbus_mapped_buffer_size },
+	{ 0x0, 0x0 },
+};
+
+//################################################################################
+//################################################################################
+
+void register_unix_fd_stuff( lua_State * const _L)
+{
+	// register the fd and mapped buffer metatables in the registry
+	utils_prepare_metatable( _L, gUnixFdMetatableKey);                                      // {meta}
+	utils_register_upvalued_functions( _L, gUnixFdMeta, gUnixFdMetatableKey);               // {meta}
+	lua_pop( _L, 1);                                                                        //
+	utils_prepare_metatable( _L, gMappedBufferMetatableKey);                                // {meta}
+	utils_register_upvalued_functions( _L, gMappedBufferMeta, gMappedBufferMetatableKey);   // {meta}
+	lua_pop( _L, 1);                                                                        //
+}
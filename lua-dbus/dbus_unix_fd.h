@@ -0,0 +1,16 @@
+#if ! defined ( __dbus_unix_fd_h__ )
+#define __dbus_unix_fd_h__ 1
+
+//################################################################################
+
+// 'h' arguments come out as fd objects that own their descriptor, and close it when collected
+// a sealed memfd carries a bulk payload: the receiver maps it read-only instead of unmarshalling a copy
+extern void push_dbus_unix_fd( lua_State * const _L, int const _fd);
+extern int check_dbus_unix_fd( lua_State * const _L, int const _ndx);
+extern int is_dbus_unix_fd( lua_State * const _L, int const _ndx);
+extern int bind_dbus_memfd_new( lua_State * const _L);
+extern void register_unix_fd_stuff( lua_State * const _L);
+
+//################################################################################
+
+#endif // __dbus_unix_fd_h__
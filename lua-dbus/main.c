@@ -26,12 +26,31 @@
 
 #include <lua.h>
 #include <lauxlib.h>
+#include <stdio.h>
 
 #include "utils.h"
 #include "dbus_bus.h"
+#include "dbus_capture.h"
 #include "dbus_connection.h"
+#include "dbus_histogram.h"
 #include "dbus_message.h"
+#include "dbus_message_iter.h"
+#include "dbus_pool.h"
+#include "dbus_property_cache.h"
+#include "dbus_proxy.h"
+#include "dbus_schema.h"
 #include "dbus_server.h"
+#include "dbus_unix_fd.h"
+
+//################################################################################
+
+// seconds elapsed on a monotonic clock, with nanosecond resolution
+static int bind_dbus_monotonic_time( lua_State * const _L)
+{
+	utils_check_nargs( _L, 0);
+	lua_pushnumber( _L, (lua_Number) utils_get_monotonic_time_ns() / 1e9);
+	return 1;
+}
 
 //################################################################################
 // centralize all the registry references here
@@ -40,10 +59,19 @@
 luaL_Reg gDBusAPI[] =
 {
 	{ "bus_get", bind_dbus_bus_get },
+	{ "capture_open", bind_dbus_capture_open },
+	{ "connection_open", bind_dbus_connection_open },
+	{ "histogram_new", bind_dbus_histogram_new },
+	{ "message_bytes_needed", bind_dbus_message_bytes_needed } ,
+	{ "message_demarshal", bind_dbus_message_demarshal } ,
+	{ "message_import", bind_dbus_message_import } ,
 	{ "message_new", bind_dbus_message_new } ,
 	{ "message_new_method_call", bind_dbus_message_new_method_call } ,
 	{ "message_new_method_return", bind_dbus_message_new_method_return } ,
 	{ "message_new_signal", bind_dbus_message_new_signal } ,
+	{ "memfd_new", bind_dbus_memfd_new },
+	{ "monotonic_time", bind_dbus_monotonic_time },
+	{ "schema", bind_dbus_schema },
 	{ "server_listen", bind_dbus_server_listen },
 	{ 0x0, 0x0 },
 };
@@ -53,6 +81,8 @@ luaL_Reg gDBusAPI[] =
 int luaopen_dbus( lua_State * const _L)
 {
 	utils_init();
+	// worker pools use connections from several threads
+	dbus_threads_init_default();
 	// add a table in the registry to hold all C pointer / userdata equivalents
 	// the table has "weak values" mode
 	lua_pushliteral( _L, "dbus_userdata_map");  // "dbus_userdata_map"
@@ -68,6 +98,14 @@ int luaopen_dbus( lua_State * const _L)
 	register_connection_stuff( _L);             //
 	register_bus_stuff( _L);                    //
 	register_message_stuff( _L);                //
+	register_message_iter_stuff( _L);           //
+	register_pool_stuff( _L);                   //
+	register_histogram_stuff( _L);              //
+	register_capture_stuff( _L);                //
+	register_proxy_stuff( _L);                  //
+	register_property_cache_stuff( _L);         //
+	register_unix_fd_stuff( _L);                //
+	register_schema_stuff( _L);                 //
 	luaL_register( _L, "dbus", gDBusAPI);       // {dbus}
 
 	return 1;
@@ -28,8 +28,10 @@
 #include <lauxlib.h>
 #include <dbus/dbus.h>
 
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "utils.h"
 
@@ -59,6 +61,114 @@ void utils_init( void)
 	private_init_valid_element_charset();
 }
 
+//################################################################################
+
+dbus_uint64_t utils_get_monotonic_time_ns( void)
+{
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now);
+	return (dbus_uint64_t) now.tv_sec * 1000000000 + (dbus_uint64_t) now.tv_nsec;
+}
+
+//################################################################################
+// hash tables
+//################################################################################
+
+#define FNV_PRIME 1099511628211ULL
+
+// FNV-1a, start from UTILS_FNV_OFFSET_BASIS and chain the calls to hash several fields
+dbus_uint64_t utils_hash_bytes( dbus_uint64_t _hash, void const * const _bytes, size_t const _length)
+{
+	unsigned char const * const bytes = (unsigned char const *) _bytes;
+	size_t i;
+	for ( i = 0; i < _length; ++ i)
+	{
+		_hash ^= bytes[i];
+		_hash *= FNV_PRIME;
+	}
+	return _hash;
+}
+
+//################################################################################
+
+// the terminating zero is hashed too, so that ("ab","c") and ("a","bc") differ
+dbus_uint64_t utils_hash_string( dbus_uint64_t const _hash, char const * const _string)
+{
+	return utils_hash_bytes( _hash, _string, strlen( _string) + 1);
+}
+
+//################################################################################
+
+// returns 0 when out of memory
+int utils_hash_table_init( HashTable * const _table, int const _nbBuckets)
+{
+	_table->nbBuckets = _nbBuckets;
+	_table->nbEntries = 0;
+	_table->buckets = (HashLink **) calloc( _nbBuckets, sizeof( HashLink *));
+	return _table->buckets != 0x0;
+}
+
+//################################################################################
+
+// double the bucket count when chains get longer than 2 on average
+static void private_hash_table_grow( HashTable * const _table)
+{
+	int const nbBuckets = _table->nbBuckets * 2;
+	HashLink ** const buckets = (HashLink **) calloc( nbBuckets, sizeof( HashLink *));
+	// not growing only makes the chains longer
+	if ( buckets == 0x0 )
+		return;
+	int i;
+	for ( i = 0; i < _table->nbBuckets; ++ i)
+	{
+		HashLink *link = _table->buckets[i];
+		while ( link != 0x0 )
+		{
+			HashLink * const next = link->next;
+			link->next = buckets[link->hash & (nbBuckets - 1)];
+			buckets[link->hash & (nbBuckets - 1)] = link;
+			link = next;
+		}
+	}
+	free( _table->buckets);
+	_table->buckets = buckets;
+	_table->nbBuckets = nbBuckets;
+}
+
+//################################################################################
+
+// _link->hash must be set
+void utils_hash_table_insert( HashTable * const _table, HashLink * const _link)
+{
+	if ( _table->nbEntries >= 2 * _table->nbBuckets )
+		private_hash_table_grow( _table);
+	HashLink ** const bucket = utils_hash_table_bucket( _table, _link->hash);
+	_link->next = *bucket;
+	*bucket = _link;
+	++ _table->nbEntries;
+}
+
+//################################################################################
+
+// take out the entry *_link points to, when walking a chain
+void utils_hash_table_unlink( HashTable * const _table, HashLink ** const _link)
+{
+	HashLink * const link = *_link;
+	*_link = link->next;
+	link->next = 0x0;
+	-- _table->nbEntries;
+}
+
+//################################################################################
+
+void utils_hash_table_remove( HashTable * const _table, HashLink * const _link)
+{
+	HashLink **link = utils_hash_table_bucket( _table, _link->hash);
+	while ( *link != _link )
+		link = &(*link)->next;
+	utils_hash_table_unlink( _table, link);
+}
+
 //################################################################################
 //################################################################################
 
@@ -71,12 +181,20 @@ int utils_check_nargs( lua_State * _L, int _nargs)
 
 //################################################################################
 
-void utils_prepare_metatable( lua_State * _L, int *_metaRef)
+void utils_prepare_metatable( lua_State * _L, char const * const _metaKey)
 {
 	// register some object's metatable in the registry
+	// the key is the address of a string of ours: it is the same in every state the module is opened in,
+	// and the bound functions carry it as an upvalue
+	utils_push_metatable( _L, _metaKey);                           // ... meta?
+	if ( lua_istable( _L, -1) )
+		// the module was already opened in this state: existing objects keep working
+		return;
+	lua_pop( _L, 1);                                               // ...
 	lua_newtable( _L);                                             // ... meta
-	lua_pushvalue( _L, -1);                                        // ... meta meta
-	*_metaRef = luaL_ref( _L, LUA_REGISTRYINDEX);                  // ... meta
+	lua_pushlightuserdata( _L, (void *) _metaKey);                 // ... meta key
+	lua_pushvalue( _L, -2);                                        // ... meta key meta
+	lua_rawset( _L, LUA_REGISTRYINDEX);                            // ... meta
 	lua_pushliteral( _L, "__index");                               // ... meta "__index"
 	lua_pushvalue( _L, -2);                                        // ... meta "__index" meta
 	lua_settable( _L, -3);                                         // ... meta
@@ -87,13 +205,21 @@ void utils_prepare_metatable( lua_State * _L, int *_metaRef)
 
 //################################################################################
 
-void utils_register_upvalued_functions( lua_State * const _L, luaL_Reg const * _reg, int const _mtRef)
+void utils_push_metatable( lua_State * const _L, char const * const _metaKey)
+{
+	lua_pushlightuserdata( _L, (void *) _metaKey);                 // ... key
+	lua_rawget( _L, LUA_REGISTRYINDEX);                            // ... meta
+}
+
+//################################################################################
+
+void utils_register_upvalued_functions( lua_State * const _L, luaL_Reg const * _reg, char const * const _metaKey)
 {
 	// do the registration ourselves because we need to provide an upvalue
 	while ( _reg->func != 0x0 )                            // meta
 	{
 		lua_pushstring( _L, _reg->name);                    // meta name
-		lua_pushlightuserdata( _L, (void*) _mtRef);         // meta name ref
+		lua_pushlightuserdata( _L, (void*) _metaKey);       // meta name key
 		lua_pushcclosure( _L, _reg->func, 1);               // meta name fn
 		lua_settable( _L, -3);                              // meta
 		++ _reg;
@@ -183,11 +309,11 @@ int utils_convert_to_message_type( lua_State * _L, int _ndx)
 		return DBUS_MESSAGE_TYPE_INVALID;
 
 	// method call?
-	lua_pushliteral( _L, "DBUS_MESSAGE_TYPE_METHOD_CALL ");
+	lua_pushliteral( _L, "DBUS_MESSAGE_TYPE_METHOD_CALL");
 	equal = lua_rawequal( _L, -1, _ndx);
 	lua_pop( _L, 1);
 	if ( equal )
-		return DBUS_MESSAGE_TYPE_METHOD_CALL ;
+		return DBUS_MESSAGE_TYPE_METHOD_CALL;
 
 	// method return?
 	lua_pushliteral( _L, "DBUS_MESSAGE_TYPE_METHOD_RETURN");
@@ -219,7 +345,7 @@ int utils_convert_to_message_type( lua_State * _L, int _ndx)
 // userdata<->pointer conversions
 //################################################################################
 
-void * utils_push_mapped_userdata( lua_State * const _L, void * const _lud, int const _metaNdx, int const _udBlockSize)
+void * utils_push_mapped_userdata( lua_State * const _L, void * const _lud, char const * const _metaKey, int const _udBlockSize)
 {
 	void * retval = 0;
 	lua_getfield( _L, LUA_REGISTRYINDEX, "dbus_userdata_map");    // {udm}
@@ -231,7 +357,7 @@ void * utils_push_mapped_userdata( lua_State * const _L, void * const _lud, int
 	{
 		puts( "found an existing userdata");
 		// we found a mapped userdata object
-		lua_rawgeti( _L, LUA_REGISTRYINDEX, _metaNdx);             // {udm} U meta1
+		utils_push_metatable( _L, _metaKey);                       // {udm} U meta1
 		lua_getmetatable( _L, -2);                                 // {udm} U meta1 meta2
 		// metatable doesn't match the expected one: error (should not happen!)
 		if ( !lua_rawequal( _L, -1, -2) )
@@ -247,7 +373,7 @@ void * utils_push_mapped_userdata( lua_State * const _L, void * const _lud, int
 	}
 	else if ( lua_type( _L, -1) == LUA_TNIL )
 	{
-		printf( "adding an entry in dbus_userdata_map (%d)\n", _metaNdx);
+		printf( "adding an entry in dbus_userdata_map (%s)\n", _metaKey);
 		// remove the nil we got when searching for an existing entry
 		lua_pop( _L, 1);                                                    // {udm}
 		// this is a new entry: create it and store the object pointer there
@@ -261,7 +387,7 @@ void * utils_push_mapped_userdata( lua_State * const _L, void * const _lud, int
 		lua_settable( _L, -4);                                              // {udm} U
 		puts( "stored the new userdata in the map");
 		// fetch the approriate metatable
-		lua_rawgeti( _L, LUA_REGISTRYINDEX, _metaNdx);                      // {udm} U meta
+		utils_push_metatable( _L, _metaKey);                                // {udm} U meta
 		// check that we actually have it
 		luaL_checktype( _L, -1, LUA_TTABLE);
 		// give it to the userdata
@@ -278,12 +404,12 @@ void * utils_push_mapped_userdata( lua_State * const _L, void * const _lud, int
 
 //################################################################################
 
-void * utils_cast_userdata( lua_State * const _L, int _ndx, int const _metaNdx)
+void * utils_cast_userdata( lua_State * const _L, int _ndx, char const * const _metaKey)
 {
 	_ndx = utils_to_absolute_stack_index( _ndx);
 	luaL_argcheck( _L, lua_isuserdata( _L, _ndx), _ndx, "parameter is not a userdata");
 	lua_getmetatable( _L, _ndx);                                // ... U ... meta1
-	lua_rawgeti( _L, LUA_REGISTRYINDEX, _metaNdx);              // ... U ... meta1 meta2
+	utils_push_metatable( _L, _metaKey);                        // ... U ... meta1 meta2
 	if ( !lua_rawequal( _L, -1, -2) )
 		return luaL_error( _L, "parameter is not of the expected type"), (void *) 0x0;
 	lua_pop( _L, 2);                                            // ... U ...
@@ -312,6 +438,20 @@ int utils_fetch_userdata( lua_State * const _L, void *_lud)
 	return 1;
 }
 
+//################################################################################
+
+// tells if a userdata is already mapped to this pointer, leaving the stack untouched
+int utils_is_mapped_userdata( lua_State * const _L, void *_lud)
+{
+	lua_getfield( _L, LUA_REGISTRYINDEX, "dbus_userdata_map");    // {udm}
+	luaL_checktype( _L, -1, LUA_TTABLE);
+	lua_pushlightuserdata( _L, _lud);                             // {udm} _lud
+	lua_rawget( _L, -2);                                          // {udm} U?
+	int const mapped = lua_type( _L, -1) == LUA_TUSERDATA;
+	lua_pop( _L, 2);                                              //
+	return mapped;
+}
+
 //################################################################################
 // generation of rules buffer from a table
 //################################################################################
@@ -527,6 +667,24 @@ void utils_fill_rule_buffer_from_table( lua_State * const _L, int _ndx, char * c
 	CHECK_RULE( arg);
 }
 
+//################################################################################
+
+// push the _i-th rule of the rules table at _ndx, with its checked interface and member
+// leaves {rule} interface? member? on the stack, missing fields are nil and match anything
+void utils_push_interface_member_rule( lua_State * const _L, int const _ndx, int const _i)
+{
+	lua_rawgeti( _L, _ndx, _i);                                    // ... {rule}
+	luaL_argcheck( _L, lua_istable( _L, -1), _ndx, "rules must be tables");
+	lua_getfield( _L, -1, "interface");                            // ... {rule} interface?
+	lua_getfield( _L, -2, "member");                               // ... {rule} interface? member?
+	char const * const interface = lua_isnil( _L, -2) ? 0x0 : luaL_checkstring( _L, -2);
+	char const * const member = lua_isnil( _L, -1) ? 0x0 : luaL_checkstring( _L, -1);
+	if ( interface != 0x0 && !dbus_validate_interface( interface, 0x0) )
+		luaL_error( _L, "'%s' is not a valid interface", interface);
+	if ( member != 0x0 && !dbus_validate_member( member, 0x0) )
+		luaL_error( _L, "'%s' is not a valid member", member);
+}
+
 //################################################################################
 // name validity (connection, bus, interface)
 //################################################################################
@@ -3,15 +3,37 @@
 
 #include <dbus/dbus.h>
 
+// chained hash table for the C side caches: entries start with a HashLink, the caller hashes
+// and compares the keys, the table chains the entries and doubles its bucket count as it fills
+struct HashLink
+{
+	struct HashLink *next;
+	dbus_uint64_t hash;
+};
+typedef struct HashLink HashLink;
+
+struct HashTable
+{
+	// a power of 2 buckets
+	HashLink **buckets;
+	int nbBuckets;
+	int nbEntries;
+};
+typedef struct HashTable HashTable;
+
+#define UTILS_FNV_OFFSET_BASIS 14695981039346656037ULL
+
 extern int utils_check_nargs( lua_State * _L, int _nargs);
-extern void utils_prepare_metatable( lua_State * _L, int *_metaRef);
-extern void utils_register_upvalued_functions( lua_State * const _L, luaL_Reg const * _reg, int const _mtRef);
+extern void utils_prepare_metatable( lua_State * _L, char const * const _metaKey);
+extern void utils_push_metatable( lua_State * const _L, char const * const _metaKey);
+extern void utils_register_upvalued_functions( lua_State * const _L, luaL_Reg const * _reg, char const * const _metaKey);
 extern DBusBusType utils_convert_to_bus_type( lua_State * _L, int _ndx);
 extern DBusHandlerResult utils_convert_to_handler_result( lua_State * _L, int _ndx);
 extern int utils_convert_to_message_type( lua_State * _L, int _ndx);
-extern void * utils_push_mapped_userdata( lua_State * const _L, void * const _lud, int const _metaNdx, int const _udBlockSize);
-extern void * utils_cast_userdata( lua_State * const _L, int _ndx, int const _metaNdx);
+extern void * utils_push_mapped_userdata( lua_State * const _L, void * const _lud, char const * const _metaKey, int const _udBlockSize);
+extern void * utils_cast_userdata( lua_State * const _L, int _ndx, char const * const _metaKey);
 extern int utils_fetch_userdata( lua_State * const _L, void *_lud);
+extern int utils_is_mapped_userdata( lua_State * const _L, void *_lud);
 extern void utils_fill_rule_buffer_from_table( lua_State * const _L, int _ndx, char * const _rules_buffer);
 extern int utils_bus_name_is_valid( lua_State * const _L, char const * const _name);
 extern int utils_unique_connection_name_is_valid( lua_State * const _L, char const * const _name);
@@ -19,6 +41,16 @@ extern int utils_interface_name_is_valid( lua_State * const _L, char const * con
 extern int utils_member_name_is_valid( lua_State * const _L, char const * const _name);
 extern int utils_object_path_name_is_valid( lua_State * const _L, char const * const _path);
 extern void utils_init( void);
+extern dbus_uint64_t utils_get_monotonic_time_ns( void);
+extern dbus_uint64_t utils_hash_bytes( dbus_uint64_t _hash, void const * const _bytes, size_t const _length);
+extern dbus_uint64_t utils_hash_string( dbus_uint64_t const _hash, char const * const _string);
+extern int utils_hash_table_init( HashTable * const _table, int const _nbBuckets);
+extern void utils_hash_table_insert( HashTable * const _table, HashLink * const _link);
+extern void utils_hash_table_unlink( HashTable * const _table, HashLink ** const _link);
+extern void utils_hash_table_remove( HashTable * const _table, HashLink * const _link);
+extern void utils_push_interface_member_rule( lua_State * const _L, int const _ndx, int const _i);
+
+#define utils_hash_table_bucket(_table,_hash) (&(_table)->buckets[(_hash) & ((_table)->nbBuckets - 1)])
 
 #define utils_to_absolute_stack_index(_ndx) (((_ndx)>0)?(_ndx):(lua_gettop(_L)+1+(_ndx)))
 